@@ -183,6 +183,9 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
     if(keepParticle == false) {
 #ifndef NO_DIAGNOSTICS
         // Count impacting particles
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseImpactCounters(p);
 #endif
         return false;
@@ -192,6 +195,9 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
     if(keepParticle == false) {
 #ifndef NO_DIAGNOSTICS
         // Count escaping particles
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseEscapeCountersBackWall(p);
 #endif
         return false;
@@ -201,6 +207,9 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
     if(keepParticle == false) {
 #ifndef NO_DIAGNOSTICS
         // Count escaping particles
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseEscapeCountersSideWall(p);
 #endif
         return false;
@@ -210,6 +219,9 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
     if(keepParticle == false) {
 #ifndef NO_DIAGNOSTICS
         // Count escaping particles
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseEscapeCountersFrontWall(p);
 #endif
         return false;
@@ -220,6 +232,9 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
     if(keepParticle == false) {
 #ifndef NO_DIAGNOSTICS
         // Count escaping particles
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseImpactCounters(p);
 #endif
         return false;
@@ -229,21 +244,33 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
     bool outside = false;
     if(Params::insideBoxTightFrontWall(&p) == false) {
 #ifndef NO_DIAGNOSTICS
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseEscapeCountersFrontWall(p);
 #endif
         outside = true;
     } else if(Params::insideBoxTightBackWall(&p) == false) {
 #ifndef NO_DIAGNOSTICS
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseEscapeCountersBackWall(p);
 #endif
         outside = true;
     } else if(Params::insideBoxTightSideWall(&p) == false) {
 #ifndef NO_DIAGNOSTICS
+#ifdef USE_OPENMP
+#pragma omp critical(particleCounters)
+#endif
         Params::diag.pCounter[p.popid]->increaseEscapeCountersSideWall(p);
 #endif
         outside = true;
     }
     if(outside == true) {
+#ifdef USE_OPENMP
+#pragma omp critical(errorlog)
+#endif
         errorlog
                 << "Boundaries returned particle that is outside the domain:  pop = " << Params::pops[p.popid]->getIdStr()
                 << ", r = [" << (int(p.x/Params::R_P*100))/100.0 << ", "
@@ -269,6 +296,9 @@ bool ParticleBoundaryConditions::checkBoundaries(TLinkedParticle& p,fastreal rAv
             rAverage[1] < Params::box_ymin_tight || rAverage[1] > Params::box_ymax_tight ||
             rAverage[2] < Params::box_zmin_tight || rAverage[2] > Params::box_zmax_tight) {
             // outside
+#ifdef USE_OPENMP
+#pragma omp critical(errorlog)
+#endif
             errorlog << "Boundaries: rAverage outside the domain (may be raveflag issue) \n"
                      << " pop = " << Params::pops[p.popid]->getIdStr()
                      << ", rA = [" << (int(rAverage[0]/Params::R_P*100))/100.0 << ", "
@@ -645,6 +675,10 @@ bool ParticleBoundaryConditions::frontWallReflectAmbient(TLinkedParticle& p,bool
 {
     if(p.x > Params::box_xmax_tight) {
         shortreal x = p.x - p.vx*Params::dt;
+        // Injection changes the particle lists of the cells, serialize it in parallel pushes
+#ifdef USE_OPENMP
+#pragma omp critical(particleInjection)
+#endif
         Params::pops[reflectPopID]->addParticle(x,p.y,p.z,p.w);
         return false;
     }
@@ -753,6 +787,9 @@ bool ParticleBoundaryConditions::extraNeutralCollisions(TLinkedParticle& p,bool&
     if (fr_limit * E <= deltaE) {
         //const real dE=E*p.w;
 #ifndef NO_DIAGNOSTICS
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
         Params::diag.pCounter[p.popid]->cutRateV += 1.0;//count subcycling rate
 #endif
         const fastreal fr = deltaE/E;
@@ -772,6 +809,9 @@ bool ParticleBoundaryConditions::extraNeutralCollisions(TLinkedParticle& p,bool&
     E-=deltaE;
     for (int i=0; i<iterate; i++) {
 #ifndef NO_DIAGNOSTICS
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
         Params::diag.pCounter[p.popid]->electronImpactIonizationRate+=deltaE*p.w; //dE=deltaE*p.w //add momentum counter?
         //g.increaseQ2H(r,deltaE); //store in field quantity for hc (U1 in avehc)
 #endif
@@ -0,0 +1,282 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef USE_MPI
+#define OMPI_SKIP_MPICXX
+#define MPICH_SKIP_MPICXX
+#include <mpi.h>
+#endif
+#include <cstdlib>
+#include <cstdio>
+#include "decomposition.h"
+
+using namespace std;
+
+int Decomposition::rank = 0;
+int Decomposition::nranks = 1;
+
+#ifdef USE_MPI
+
+//! MPI type of real
+static MPI_Datatype mpiReal()
+{
+    return (sizeof(real) == sizeof(double)) ? MPI_DOUBLE : MPI_FLOAT;
+}
+
+//! MPI reduction operator of TParticleMoments
+static void mergeMoments(void *in, void *inout, int *len, MPI_Datatype *)
+{
+    const TParticleMoments *a = static_cast<const TParticleMoments*>(in);
+    TParticleMoments *b = static_cast<TParticleMoments*>(inout);
+    for (int i = 0; i < *len; ++i) {
+        b[i].merge(a[i]);
+    }
+}
+
+#endif
+
+//! Initialize MPI, only one Decomposition object can be constructed
+Decomposition::Decomposition(int *argc, char ***argv)
+{
+    static bool onlyOneInstance = false;
+    if (onlyOneInstance == true) {
+        cerr << "ERROR [Decomposition]: only one Decomposition object can be constructed\n";
+        std::abort();
+    }
+    onlyOneInstance = true;
+#ifdef USE_MPI
+    MPI_Init(argc,argv);
+    MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+    MPI_Comm_size(MPI_COMM_WORLD,&nranks);
+#endif
+}
+
+//! Finalize MPI
+Decomposition::~Decomposition()
+{
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
+}
+
+//! Abort all ranks
+void Decomposition::abort()
+{
+#ifdef USE_MPI
+    if (nranks > 1) {
+        MPI_Abort(MPI_COMM_WORLD,1);
+    }
+#endif
+    std::abort();
+}
+
+/** \brief Sum x over the ranks
+ *
+ * The sum is formed on the root rank and broadcast, so that every rank
+ * gets the same bits and the replicated field solution stays identical.
+ */
+void Decomposition::sum(real *x, int n)
+{
+#ifdef USE_MPI
+    if (nranks <= 1 || n <= 0) {
+        return;
+    }
+    vector<real> result(n);
+    MPI_Reduce(x,&result[0],n,mpiReal(),MPI_SUM,0,MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int i = 0; i < n; ++i) {
+            x[i] = result[i];
+        }
+    }
+    MPI_Bcast(x,n,mpiReal(),0,MPI_COMM_WORLD);
+#endif
+}
+
+/** \brief Sum the rows x[width*i...width*i+width-1] over the ranks, sending only the nonzero rows
+ *
+ * Every rank gathers the indices and values of the rows that are not all
+ * zero on each rank and adds them in the order of the ranks, so that
+ * every rank gets the same bits. The communication is proportional to
+ * the rows the ranks have, not to nrows.
+ */
+void Decomposition::sumSparse(real *x, int nrows, int width)
+{
+#ifdef USE_MPI
+    if (nranks <= 1 || nrows <= 0) {
+        return;
+    }
+    vector<int> index;
+    vector<real> values;
+    for (int i = 0; i < nrows; ++i) {
+        real *row = &x[static_cast<size_t>(width)*i];
+        int k = 0;
+        while (k < width && row[k] == 0) {
+            k++;
+        }
+        if (k < width) {
+            index.push_back(i);
+            values.insert(values.end(),row,row+width);
+        }
+        // Cleared also if zero, a -0 stays on one rank only
+        for (k = 0; k < width; ++k) {
+            row[k] = 0;
+        }
+    }
+    int nlocal = index.size();
+    vector<int> counts(nranks), displ(nranks), valueCounts(nranks), valueDispl(nranks);
+    MPI_Allgather(&nlocal,1,MPI_INT,&counts[0],1,MPI_INT,MPI_COMM_WORLD);
+    int ntotal = 0;
+    for (int r = 0; r < nranks; ++r) {
+        displ[r] = ntotal;
+        valueDispl[r] = ntotal*width;
+        valueCounts[r] = counts[r]*width;
+        ntotal += counts[r];
+    }
+    vector<int> allIndex(ntotal+1);
+    vector<real> allValues(static_cast<size_t>(ntotal)*width+1);
+    // The buffers may be empty, pass valid addresses anyway
+    int dummyIndex = 0;
+    real dummyValue = 0;
+    MPI_Allgatherv(index.empty() ? &dummyIndex : &index[0],nlocal,MPI_INT,
+                   &allIndex[0],&counts[0],&displ[0],MPI_INT,MPI_COMM_WORLD);
+    MPI_Allgatherv(values.empty() ? &dummyValue : &values[0],nlocal*width,mpiReal(),
+                   &allValues[0],&valueCounts[0],&valueDispl[0],mpiReal(),MPI_COMM_WORLD);
+    for (int j = 0; j < ntotal; ++j) {
+        real *row = &x[static_cast<size_t>(width)*allIndex[j]];
+        const real *v = &allValues[static_cast<size_t>(width)*j];
+        for (int k = 0; k < width; ++k) {
+            row[k] += v[k];
+        }
+    }
+#endif
+}
+
+//! Sum x over the ranks
+void Decomposition::sum(long *x, int n)
+{
+#ifdef USE_MPI
+    if (nranks <= 1 || n <= 0) {
+        return;
+    }
+    vector<long> result(n);
+    MPI_Allreduce(x,&result[0],n,MPI_LONG,MPI_SUM,MPI_COMM_WORLD);
+    for (int i = 0; i < n; ++i) {
+        x[i] = result[i];
+    }
+#endif
+}
+
+//! True if flag is true on any rank
+bool Decomposition::any(bool flag)
+{
+#ifdef USE_MPI
+    if (nranks > 1) {
+        int local = flag ? 1 : 0, result = 0;
+        MPI_Allreduce(&local,&result,1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+        return result != 0;
+    }
+#endif
+    return flag;
+}
+
+//! Combine the particle moments m[0...n-1] of the ranks (like sum)
+void Decomposition::sumMoments(TParticleMoments *m, int n)
+{
+#ifdef USE_MPI
+    if (nranks <= 1 || n <= 0) {
+        return;
+    }
+    static MPI_Datatype momentType = MPI_DATATYPE_NULL;
+    static MPI_Op mergeOp = MPI_OP_NULL;
+    if (momentType == MPI_DATATYPE_NULL) {
+        MPI_Type_contiguous(sizeof(TParticleMoments),MPI_BYTE,&momentType);
+        MPI_Type_commit(&momentType);
+        MPI_Op_create(&mergeMoments,1,&mergeOp);
+    }
+    vector<TParticleMoments> result(n);
+    MPI_Reduce(m,&result[0],n,momentType,mergeOp,0,MPI_COMM_WORLD);
+    if (rank == 0) {
+        for (int i = 0; i < n; ++i) {
+            m[i] = result[i];
+        }
+    }
+    MPI_Bcast(m,n,momentType,0,MPI_COMM_WORLD);
+#endif
+}
+
+/** \brief Send the particles out[r] to rank r and receive the particles sent to this rank into in
+ *
+ * The particles are sent as bytes (the ranks run the same executable),
+ * the next pointers of the received particles are not valid.
+ */
+void Decomposition::exchange(vector< vector<TLinkedParticle> >& out, vector<TLinkedParticle>& in)
+{
+    in.clear();
+#ifdef USE_MPI
+    if (nranks <= 1) {
+        return;
+    }
+    const int psize = sizeof(TLinkedParticle);
+    vector<int> sendCounts(nranks), recvCounts(nranks), sendDispl(nranks), recvDispl(nranks);
+    vector<TLinkedParticle> sendBuffer;
+    for (int r = 0; r < nranks; ++r) {
+        sendCounts[r] = out[r].size()*psize;
+        sendDispl[r] = sendBuffer.size()*psize;
+        sendBuffer.insert(sendBuffer.end(),out[r].begin(),out[r].end());
+        out[r].clear();
+    }
+    MPI_Alltoall(&sendCounts[0],1,MPI_INT,&recvCounts[0],1,MPI_INT,MPI_COMM_WORLD);
+    int nrecv = 0;
+    for (int r = 0; r < nranks; ++r) {
+        recvDispl[r] = nrecv;
+        nrecv += recvCounts[r];
+    }
+    in.resize(nrecv/psize);
+    // The buffers may be empty, pass valid addresses anyway
+    TLinkedParticle dummy;
+    MPI_Alltoallv(sendBuffer.empty() ? &dummy : &sendBuffer[0],&sendCounts[0],&sendDispl[0],MPI_BYTE,
+                  in.empty() ? &dummy : &in[0],&recvCounts[0],&recvDispl[0],MPI_BYTE,MPI_COMM_WORLD);
+#endif
+}
+
+/** \brief File name of this rank: "name_rankNNN.ext" when running on more than one rank
+ *
+ * Used for the files that every rank writes of its own particles
+ * (breakpoints, particle snapshots, detectors).
+ */
+string Decomposition::rankFileName(const string& fileName)
+{
+    if (nranks <= 1) {
+        return fileName;
+    }
+    char tag[32];
+    sprintf(tag,"_rank%.3d",rank);
+    const string::size_type dot = fileName.rfind('.');
+    const string::size_type slash = fileName.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return fileName + tag;
+    }
+    return fileName.substr(0,dot) + tag + fileName.substr(dot);
+}
+
+//! File name of the files written only by the root rank, the other ranks write to /dev/null
+string Decomposition::rootFileName(const string& fileName)
+{
+    return (rank == 0) ? fileName : string("/dev/null");
+}
+
@@ -0,0 +1,69 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECOMPOSITION_H
+#define DECOMPOSITION_H
+
+#include <string>
+#include <vector>
+#include "definitions.h"
+#include "particle.h"
+
+/** \brief Distributed memory parallelization (USE_MPI)
+ *
+ * The grid and the field solution are replicated on every rank and the
+ * macroparticles are divided between the ranks by the base cell they are
+ * in (Tgrid::partition_base_cells). The ranks exchange the particles that
+ * cross into the base cells of another rank and sum the particle deposits
+ * and moments of the cells. Only the particle work is divided: a rank sends
+ * the deposits of the cells its particles reached (sumSparse), but every
+ * rank still sums them into the whole grid and there is no ghost-layer
+ * exchange of a divided grid (see README). The object is constructed at the beginning of
+ * main and the destructor finalizes MPI. Without USE_MPI there is one rank
+ * and the communication functions do nothing.
+ */
+class Decomposition
+{
+private:
+    static int rank;   //!< Rank of this process
+    static int nranks; //!< Number of ranks
+public:
+    Decomposition(int *argc, char ***argv);
+    ~Decomposition();
+    static int getRank() {
+        return rank;
+    }
+    static int getNranks() {
+        return nranks;
+    }
+    static bool isRoot() {
+        return rank == 0;
+    }
+    static void abort();
+    static void sum(real *x, int n);
+    static void sumSparse(real *x, int nrows, int width);
+    static void sum(long *x, int n);
+    static bool any(bool flag);
+    static void sumMoments(TParticleMoments *m, int n);
+    static void exchange(std::vector< std::vector<TLinkedParticle> >& out, std::vector<TLinkedParticle>& in);
+    static std::string rankFileName(const std::string& fileName);
+    static std::string rootFileName(const std::string& fileName);
+};
+
+#endif
+
@@ -18,8 +18,10 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <sys/time.h>
 #include "definitions.h"
 #include "simulation.h"
+#include "decomposition.h"
 
 using namespace std;
 
@@ -49,7 +51,7 @@ void doabort()
 {
     errorlog << "ABORT: doabort() called\n";
     cerr     << "ABORT: doabort() called\n";
-    abort();
+    Decomposition::abort();
 }
 
 //! Handle the terminate signal
@@ -129,6 +131,14 @@ real getExecutionSecs()
     return difftime(end,start);
 }
 
+//! Wall clock time [s] with microsecond resolution, for timing parts of the run
+double getWallSecs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
 //! Returns the time (in seconds) difference between the last two calls of this function.
 real getLastIntervalSecs()
 {
@@ -90,6 +90,22 @@ inline void ReadDoublesFromFile(std::istream& o, double x[], int n)
     o.read((char*)x,sizeof(double)*n);
 }
 
+//! (BREAKPOINTING) Write data
+template <class T>
+std::ostream& writeData(std::ostream& os, T& data)
+{
+    os.write(reinterpret_cast<const char*>(&data), sizeof(data));
+    return os;
+}
+
+//! (BREAKPOINTING) Read data
+template <class T>
+std::istream& readData(std::istream& is, T& data)
+{
+    is.read(reinterpret_cast<char*>(&data), sizeof(data));
+    return is;
+}
+
 //! 3D vector cross product for real
 inline void crossProduct(const real a[3], const real b[3], real result[3])
 {
@@ -141,6 +157,7 @@ void TermHandler(int);
 std::string int2string(int nn, int zeros);
 real string2double(std::string str);
 real getExecutionSecs();
+double getWallSecs();
 real getLastIntervalSecs();
 std::string secsToTimeStr(double);
 std::string cropPrecedingAndTrailingSpaces(std::string str);
@@ -26,6 +26,7 @@
 #include "simulation.h"
 #include "params.h"
 #include "magneticfield.h"
+#include "decomposition.h"
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
 #include "transformations.h"
 #endif
@@ -104,6 +105,7 @@ Detector::Detector(DetectorArgs args)
     testParts.clear();
     detectionFiles.clear();
     currentCounts.clear();
+    partDetectsClosed = false;
     if (args.detectorFUNC.given == true) {
         for (unsigned int i=0; i<args.detectorFUNC.name.size(); i++) {
             detectorFunctionNames.push_back(args.detectorFUNC.name[i]);
@@ -113,7 +115,7 @@ Detector::Detector(DetectorArgs args)
 }
 
 //! Dummy constructor
-Detector::Detector() : detectorType("Invalid") { }
+Detector::Detector() : detectorType("Invalid"), partDetectsClosed(false) { }
 
 //! Dummy virtual destructor
 Detector::~Detector() { }
@@ -342,18 +344,17 @@ PartDetect::~PartDetect()
     fs->close();
 }
 
-//! check whether to record (if r_new is InsideDetector and wasn't there before)
-inline int PartDetect::run(const TLinkedParticle* part, const gridreal r_new[3])
+//! check whether to record (if r_new is InsideDetector and wasn't there before), save() records the hit
+inline bool PartDetect::hit(const TLinkedParticle* part, const gridreal r_new[3])
 {
     if (this->InsideDetector(r_new[0],r_new[1],r_new[2]) == false) {
-        return 0;
+        return false;
     }
     if (this->InsideDetector2(part->x,part->y,part->z) == true) {
-        return 0;
+        return false;
     }
     // now we know that old point was outside while current point is inside: a hit
-    save(part, r_new);
-    return 1;
+    return true;
 }
 
 //! has the geometry of each PartDetect
@@ -448,7 +449,7 @@ FieldDetectorSet::FieldDetectorSet(DetectorArgs args)
                 nameStr << "." << detectionFile2nd;
             }
             const string fileName(nameStr.str());
-            ofstream *fs = new ofstream(fileName.c_str(),fstream::out);
+            ofstream *fs = new ofstream(Decomposition::rootFileName(fileName).c_str(),fstream::out);
             if (!fs->good()) {
                 ERRORMSG2 ("unable to open detectionFile",fileName);
                 continue; //continue nonetheless!
@@ -477,7 +478,7 @@ FieldDetectorSet::FieldDetectorSet(DetectorArgs args)
                 nameStr << "." << detectionFile2nd;
             }
             const string fileName(nameStr.str());
-            ofstream *fs = new ofstream(fileName.c_str(),fstream::out);
+            ofstream *fs = new ofstream(Decomposition::rootFileName(fileName).c_str(),fstream::out);
             if (!fs->good()) {
                 ERRORMSG2 ("unable to open detectionFile",fileName);
                 pointCoordinates.erase(i_vect);
@@ -799,7 +800,7 @@ ParticleDetectorSet::ParticleDetectorSet(DetectorArgs args)
             nameStr << "." << detectionFile2nd;
         }
         const string fileName(nameStr.str());
-        ofstream *fs = new ofstream(fileName.c_str(),fstream::out);
+        ofstream *fs = new ofstream(Decomposition::rankFileName(fileName).c_str(),fstream::out);
         if (!fs->good()) {
             ERRORMSG2 ("unable to open detectionFile", fileName);
             continue; //continue nonetheless by ignoring this index i
@@ -896,7 +897,7 @@ TestParticleSet::TestParticleSet(DetectorArgs args)
         errorlog << "\n" << flush;
     }
     //open testparticle save file (detectionFile)
-    files = new ofstream(detectionFile.c_str(),fstream::out);
+    files = new ofstream(Decomposition::rootFileName(detectionFile).c_str(),fstream::out);
     if (!files->good()) {
         ERRORMSG2 ("unable to open detectionFile",detectionFile);
         doabort();
@@ -947,17 +948,27 @@ void Detector::runPartDetects(const TLinkedParticle* part, const gridreal r_new[
             if (popIdStr.compare("-")==0 ||
                 popIdStr.compare(Params::pops[part->popid]->getIdStr())==0) { //right pop
                 for (unsigned int i=0; i<partDetects.size(); i++) {
-                    if (currentCounts[i]<maxCounts) { //is the maxCounts already reached
-                        currentCounts[i] += partDetects[i]->run(part,r_new);
+                    // Hits are rare, test the geometry without locking
+                    if (currentCounts[i]<maxCounts && partDetects[i]->hit(part,r_new)) {
+#ifdef USE_OPENMP
+#pragma omp critical(particleDetectors)
+#endif
+                        if (currentCounts[i]<maxCounts) { //is the maxCounts already reached
+                            partDetects[i]->save(part,r_new);
+                            currentCounts[i] += 1;
+                        }
                     }
                 }
             }
-        } else { // when detection time over
-            static bool closed=false;
-            if (closed==false) {
+        } else if (partDetectsClosed == false) { // when detection time over
+#ifdef USE_OPENMP
+#pragma omp critical(particleDetectors)
+#endif
+            if (partDetectsClosed == false) {
                 for (unsigned int i=0; i<partDetects.size(); i++) {
                     partDetects[i]->~PartDetect(); //destructors
                 }
+                partDetectsClosed = true;
             }
         }
     }
@@ -990,6 +1001,57 @@ void Detector::runTestParticles(void)
     }
 }
 
+//! (BREAKPOINTING) Write detector counts and test particle states
+void Detector::saveState(std::ostream& os) const
+{
+    const int32_t ncounts = currentCounts.size();
+    writeData(os, ncounts);
+    for (int i=0; i<ncounts; i++) {
+        writeData(os, currentCounts[i]);
+    }
+    writeData(os, stillPropagating);
+    const int32_t ntest = testParts.size();
+    writeData(os, ntest);
+    for (int i=0; i<ntest; i++) {
+        const TestParticle& tp = *testParts[i];
+        const gridreal rv[6] = {tp.x, tp.y, tp.z, tp.vx, tp.vy, tp.vz};
+        writeData(os, rv);
+        writeData(os, tp.propagate);
+    }
+}
+
+//! (BREAKPOINTING) Read detector state written by saveState
+void Detector::loadState(std::istream& is)
+{
+    int32_t ncounts = 0, ntest = 0;
+    readData(is, ncounts);
+    for (int i=0; i<ncounts; i++) {
+        real count;
+        readData(is, count);
+        if (i < static_cast<int>(currentCounts.size())) {
+            currentCounts[i] = count;
+        }
+    }
+    readData(is, stillPropagating);
+    readData(is, ntest);
+    for (int i=0; i<ntest; i++) {
+        gridreal rv[6];
+        bool propagate;
+        readData(is, rv);
+        readData(is, propagate);
+        if (i < static_cast<int>(testParts.size())) {
+            TestParticle& tp = *testParts[i];
+            tp.x = rv[0];
+            tp.y = rv[1];
+            tp.z = rv[2];
+            tp.vx = rv[3];
+            tp.vy = rv[4];
+            tp.vz = rv[5];
+            tp.propagate = propagate;
+        }
+    }
+}
+
 //! Sphere detect constructor: inputs are Radius and point of origin r[3] (Upper class)
 PartDetect_Sphere::PartDetect_Sphere(ofstream *fs1, vector <real> partDetectArgs)
     : PartDetect(fs1, partDetectArgs)
@@ -1442,12 +1504,12 @@ void TestParticle::PropagateV(void)
     g.faceintpol(r, Tgrid::FACEDATA_B, B);
     addConstantMagneticField(r, B);
     // Velocity field of the electron fluid from cells
-    // Do not pass r => uses saved_cellptr and avoids findcell call
+    // Do not pass r => uses the cell of faceintpol and avoids findcell call
     g.cellintpol(Tgrid::CELLDATA_UE,Ue);
     if(Params::electronPressure==true) {
         real Efield[3],tx,ty,tz,sx,sy,sz,dvx,dvy,dvz,vmx,vmy,vmz,v0x,v0y,v0z,vpx,vpy,vpz,qmideltT2,t2,b2;
         // get the NGP electric field
-        // Do not pass r => uses saved_cellptr and avoids findcell call
+        // Do not pass r => uses the cell of faceintpol and avoids findcell call
         g.cellintpol(Tgrid::CELLDATA_TEMP2,Efield);
         Efield[0] += B[1]*Ue[2] - B[2]*Ue[1];
         Efield[1] += B[2]*Ue[0] - B[0]*Ue[2];
@@ -1557,12 +1619,12 @@ void TestParticle::PropagateV(void)
     g.sph_faceintpol(r, Tgrid::FACEDATA_B, B);
     addConstantMagneticField(r, B);
     // Velocity field of the electron fluid from cells
-    // Do not pass r => uses saved_cellptr and avoids findcell call
+    // Do not pass r => uses the cell of faceintpol and avoids findcell call
     g.cellintpol(Tgrid::CELLDATA_UE,Ue);
     if(Params::electronPressure==true) {
         real Efield[3],tx,ty,tz,sx,sy,sz,dvx,dvy,dvz,vmx,vmy,vmz,v0x,v0y,v0z,vpx,vpy,vpz,qmideltT2,t2,b2;
         // get the NGP electric field
-        // Do not pass r => uses saved_cellptr and avoids findcell call
+        // Do not pass r => uses the cell of faceintpol and avoids findcell call
         g.cellintpol(Tgrid::CELLDATA_TEMP2,Efield);
         Efield[0] += B[1]*Ue[2] - B[2]*Ue[1];
         Efield[1] += B[2]*Ue[0] - B[0]*Ue[2];
@@ -69,7 +69,7 @@ public:
     PartDetect();
     PartDetect(std::ofstream *fs1, std::vector<real> partDetectArgs);
     virtual void firstline(void);
-    inline int run(const TLinkedParticle* part, const gridreal r_new[3]);
+    inline bool hit(const TLinkedParticle* part, const gridreal r_new[3]);
     inline void save(const TLinkedParticle* part, const gridreal r_new[3]);
     virtual bool InsideDetector(const gridreal x, const gridreal y, const gridreal z);
     virtual bool InsideDetector2(const gridreal x, const gridreal y, const gridreal z);
@@ -108,6 +108,8 @@ public:
     unsigned int getNumberOfDetects();
     unsigned int getNumberOfFieldDetects();
     unsigned int getNumberOfPartDetects();
+    void saveState(std::ostream& os) const;
+    void loadState(std::istream& is);
     std::string detectionFile;
 protected:
     std::string coordinateFile, testParticleFile;
@@ -115,6 +117,7 @@ protected:
     real detectionTime[2];
     real mass, charge;
     bool stillPropagating;
+    bool partDetectsClosed; //!< Particle detector files closed after the detection time
     std::ofstream *files;
     std::vector<FieldDetect*> fieldDetects;
     std::vector<PartDetect*> partDetects;
@@ -18,6 +18,7 @@
 
 #include "diagnostics.h"
 #include "simulation.h"
+#include "decomposition.h"
 
 using namespace std;
 
@@ -61,7 +62,7 @@ void Diagnostics::init()
         // log file
         stringstream fn;
         fn << "pop" << int2string(i+1,3) << "_" << Params::pops[i]->getIdStr() << ".log";
-        plog.push_back(new ofstream(fn.str().c_str()));
+        plog.push_back(new ofstream(Decomposition::rootFileName(fn.str()).c_str()));
         (*plog[i]) << scientific << showpos;
         (*plog[i]).precision(10);
     }
@@ -105,7 +106,7 @@ void Diagnostics::logParticles()
                     << "% " << Params::pops[i]->getIdStr() << "\n"
                     << "% m [kg] = " << Params::pops[i]->m << "\n"
                     << "% q [C]  = " << Params::pops[i]->q << "\n"
-                    << "% columns = 43\n"
+                    << "% columns = 46\n"
                     << "% 01. Time [s]\n"
                     << "% 02. Particles [#]\n"
                     << "% 03. Macroparticles [#]\n"
@@ -149,12 +150,31 @@ void Diagnostics::logParticles()
                     << "% 41. Inject y-momentum rate [kgm/s^2]\n"
                     << "% 42. Inject z-momentum rate [kgm/s^2]\n"
                     << "% 43. Inject kinetic energy rate [J/s]\n"
+                    << "% 44. Particle arena live macroparticles [#]\n"
+                    << "% 45. Particle arena free macroparticles [#]\n"
+                    << "% 46. Particle arena peak macroparticles [#]\n"
                     << flush;
         }
         initDone = true;
     }
     // Go through all particles and do analysis stuff
     g.particle_pass(&particleAnalyzeFunction);
+    // Particle arena counts of this rank
+    vector<long> arena(3*pCounter.size());
+    for (unsigned int i = 0; i < pCounter.size(); i++) {
+        arena[3*i] = particleArena.getLive(pCounter[i]->popid);
+        arena[3*i+1] = particleArena.getFree(pCounter[i]->popid);
+        arena[3*i+2] = particleArena.getPeak(pCounter[i]->popid);
+    }
+    // Sum the counters of the MPI ranks
+    if (Decomposition::getNranks() > 1) {
+        for (unsigned int i = 0; i < pCounter.size(); i++) {
+            pCounter[i]->sumRanks();
+        }
+        if (arena.empty() == false) {
+            Decomposition::sum(&arena[0],arena.size());
+        }
+    }
     // Finalize counters
     for (unsigned int i = 0; i < pCounter.size(); i++) {
         pCounter[i]->finalizeCounters();
@@ -205,6 +225,9 @@ void Diagnostics::logParticles()
                 << pCounter[i]->injectRateMomentum[1] << "\t"
                 << pCounter[i]->injectRateMomentum[2] << "\t"
                 << pCounter[i]->injectRateKineticEnergy << "\t"
+                << arena[3*i] << "\t"
+                << arena[3*i+1] << "\t"
+                << arena[3*i+2] << "\t"
                 << "\n" << flush;
     }
     // Reset counters
@@ -218,12 +241,12 @@ void Diagnostics::logFields()
 {
     static bool initDone = false;
     if(initDone == false) {
-        flog.open("field.log");
+        flog.open(Decomposition::rootFileName("field.log").c_str());
         flog << scientific << showpos;
         flog.precision(10);
         flog
                 << "% field\n"
-                << "% columns = 13\n"
+                << "% columns = 15\n"
                 << "% 01. Time [s]\n"
                 << "% 02. avg(Bx) [T]\n"
                 << "% 03. avg(By) [T]\n"
@@ -237,11 +260,14 @@ void Diagnostics::logFields()
                 << "% 11. cutE rate [#/dt]\n"
                 << "% 12. cutRhoQ rate [#/dt]\n"
                 << "% 13. cutUe rate [#/dt]\n"
+                << "% 14. uniform stencil PIC deposit rate [#/dt]\n"
+                << "% 15. general PIC deposit rate [#/dt]\n"
                 << flush;
         initDone = true;
     }
-    // Finalize results
+    // Finalize results, the deposits are counted by the ranks of the particles
     Tgrid::fieldCounter.finalize();
+    Decomposition::sum(&Tgrid::fieldCounter.fastDepositRate,2);
     // Calculate instantenous field values
     MagneticLog magLog;
 #ifndef USE_SPHERICAL_COORDINATE_SYSTEM
@@ -262,6 +288,8 @@ void Diagnostics::logFields()
     flog << Tgrid::fieldCounter.cutRateE << "\t";
     flog << Tgrid::fieldCounter.cutRateRhoQ << "\t";
     flog << Tgrid::fieldCounter.cutRateUe << "\t";
+    flog << Tgrid::fieldCounter.fastDepositRate << "\t";
+    flog << Tgrid::fieldCounter.slowDepositRate << "\t";
     flog << "\n" << flush;
     // Maximum B field reached => set program termination flag and save hc-files
     if (magLog.maxB >= Params::B_limit) {
@@ -317,6 +345,28 @@ void ParticleCounter::reset()
     resetTimestep = Params::cnt_dt;
 }
 
+//! (MPI) Sum the counters over the ranks, all members from totalWeight to electronImpactIonizationRate
+void ParticleCounter::sumRanks()
+{
+    Decomposition::sum(&totalWeight, &electronImpactIonizationRate + 1 - &totalWeight);
+}
+
+//! (BREAKPOINTING) Write counters, all members from totalWeight to resetTimestep
+void ParticleCounter::saveState(std::ostream& os) const
+{
+    const char *first = reinterpret_cast<const char*>(&totalWeight);
+    const char *last = reinterpret_cast<const char*>(&resetTimestep + 1);
+    os.write(first, last - first);
+}
+
+//! (BREAKPOINTING) Read counters written by saveState
+void ParticleCounter::loadState(std::istream& is)
+{
+    char *first = reinterpret_cast<char*>(&totalWeight);
+    char *last = reinterpret_cast<char*>(&resetTimestep + 1);
+    is.read(first, last - first);
+}
+
 //! Increase escape counter (front wall)
 void ParticleCounter::increaseEscapeCountersFrontWall(TLinkedParticle& p)
 {
@@ -88,6 +88,9 @@ struct ParticleCounter {
     void increaseImpactCounters(TLinkedParticle& p);
     void increaseInjectCounters(shortreal vx,shortreal vy,shortreal vz,shortreal w);
     void finalizeCounters();
+    void sumRanks();
+    void saveState(std::ostream& os) const;
+    void loadState(std::istream& is);
 };
 
 #endif
@@ -20,11 +20,19 @@
 #include <fstream>
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
+#include <set>
+#include <unistd.h>
 #include "grid.h"
 #include "magneticfield.h"
 #include "random.h"
 #include "simulation.h"
 #include "templates.h"
+#include "output.h"
+#include "decomposition.h"
+#ifdef USE_COMPRESSED_HC
+#include <zlib.h>
+#endif
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
 #include "transformations.h"
 #endif
@@ -36,6 +44,21 @@ using namespace std;
 
 const char *Tgrid::celldata_names[Tgrid::NCELLDATA] = {"u","ue","j","B"};
 int Tgrid::cell_running_index = 0;
+bool Tgrid::moment_table_valid = false;
+int Tgrid::ave_ncols = 0;
+int Tgrid::ave_spectra_col = 0;
+const datareal *Tgrid::ave_view = 0;
+real Tgrid::ave_view_scale = 0;
+
+//! Index of the push block of this thread in Tgrid::particle_push, -1 outside it
+static int push_block_index = -1;
+//! Timestep of the latest Tgrid::particle_push and the number of earlier pushes in it (random stream seeds)
+static int push_step = -1, push_pass = 0;
+//! Deposits of this thread by the uniform-level and the general path of accumulate_PIC not yet added to Tgrid::fieldCounter
+static real fast_deposits = 0.0, slow_deposits = 0.0;
+#ifdef USE_OPENMP
+#pragma omp threadprivate(push_block_index,fast_deposits,slow_deposits)
+#endif
 Tgrid::TPtrHash *Tgrid::hp = 0;
 FieldCounter Tgrid::fieldCounter;
 
@@ -75,11 +98,11 @@ void Tgrid::init(int nx1, int ny1, int nz1, gridreal x1, gridreal y1, gridreal z
     ny = ny1 + 2;
     nz = nz1 + 2;
     bgdx = bgdx1;
-    saved_cellptr = 0;
+    cursor.reset();
     n_particles = 0;
+    owned_injection = false;
     n_pdftables = 0;
-    ave_ntimes = 0;
-    previous_found_cell = 0;
+    ave_deposit = 0;
     invbgdx = 1.0/bgdx;
     x_1 = x1 - bgdx;
     y_1 = y1 - bgdx;
@@ -124,26 +147,8 @@ void Tgrid::init(int nx1, int ny1, int nz1, gridreal x1, gridreal y1, gridreal z
         cells[c]->nc = 0.0;
         cells[c]->rho_q = 0.0;
         cells[c]->rho_q_bg = 0.0;
-        cells[c]->ave_nc = 0.0;
 #ifdef SAVE_PARTICLES_ALONG_ORBIT
         cells[c]->save_particles = false;
-#endif
-#ifdef SAVE_POPULATION_AVERAGES
-        for (int l = 0; l < Params::POPULATIONS; ++l) {
-            cells[c]->pop_ave_n.push_back(0.0);
-            cells[c]->pop_ave_vx.push_back(0.0);
-            cells[c]->pop_ave_vy.push_back(0.0);
-            cells[c]->pop_ave_vz.push_back(0.0);
-        }
-#endif
-#ifdef SAVE_PARTICLE_CELL_SPECTRA
-        for (int l = 0; l < Params::POPULATIONS; ++l) {
-            vector<datareal> temp;
-            cells[c]->spectra.push_back(temp);
-            for (int m = 0; m < Params::spectraNbins; ++m) {
-                cells[c]->spectra[l].push_back(0.0);
-            }
-        }
 #endif
         memset(&cells[c]->celldata[0][0],0,sizeof(datareal)*NCELLDATA*3);
         cells[c]->centroid[0] = x_1 + (i+0.5)*bgdx;
@@ -206,14 +211,16 @@ void Tgrid::init(int nx1, int ny1, int nz1, gridreal x1, gridreal y1, gridreal z
                 if (i > 0         ) cells[c]->face[2][1]->node[3] = nodes[flatindex(i-1,j,  k)];
             }
     delete [] nodes;
+    build_morton_order();
     MSGFUNCTIONEND("Tgrid::init");
 }
 
 #ifndef USE_SPHERICAL_COORDINATE_SYSTEM
 
 //! Find a cell at r and return a pointer to the cell or 0 (NULL) if no cell found
-Tgrid::TCellPtr Tgrid::findcell(const shortreal r[3], gridreal* lowercorner)
+Tgrid::TCellPtr Tgrid::findcell(const shortreal r[3], CellCursor& cur, gridreal* lowercorner)
 {
+    const TCellPtr previous_found_cell = cur.hint;
     if (previous_found_cell) {
         bool isinside = true;
         int d;
@@ -258,15 +265,16 @@ Tgrid::TCellPtr Tgrid::findcell(const shortreal r[3], gridreal* lowercorner)
         }
         c = c->child[chx][chy][chz];
     }
-    previous_found_cell = c;
+    cur.hint = c;
     return c;
 }
 
 #else
 
 //! (SPHERICAL) Spherical version findcell
-Tgrid::TCellPtr Tgrid::findcell(const shortreal r[3], gridreal* lowercorner)
+Tgrid::TCellPtr Tgrid::findcell(const shortreal r[3], CellCursor& cur, gridreal* lowercorner)
 {
+    const TCellPtr previous_found_cell = cur.hint;
     if (previous_found_cell) {
         bool isinside = true;
         int d;
@@ -311,7 +319,7 @@ Tgrid::TCellPtr Tgrid::findcell(const shortreal r[3], gridreal* lowercorner)
     	}
     c = c->child[chx][chy][chz];
     }*/
-    previous_found_cell = c;
+    cur.hint = c;
     return c;
 }
 
@@ -396,6 +404,14 @@ real Tgrid::Tcell::childave_nc() const
     return result;
 }
 
+//! face2cell interpolation
+void Tgrid::Tcell::FC1(TFaceDataSelect fs, TCellDataSelect cs)
+{
+    int d;
+    for (d=0; d<3; d++)
+        celldata[cs][d] = 0.5*(faceave(d,0,fs) + faceave(d,1,fs));
+}
+
 //! face2cell interpolation (recursive)
 void Tgrid::Tcell::FC_recursive(TFaceDataSelect fs, TCellDataSelect cs)
 {
@@ -403,94 +419,82 @@ void Tgrid::Tcell::FC_recursive(TFaceDataSelect fs, TCellDataSelect cs)
         int ch;
         for (ch=0; ch<8; ch++) child[0][0][ch]->FC_recursive(fs,cs);
     } else {
-        int d;
-        for (d=0; d<3; d++)
-            celldata[cs][d] = 0.5*(faceave(d,0,fs) + faceave(d,1,fs));
+        FC1(fs,cs);
     }
 }
 
-//! node2cell interpolation (recursive)
-void Tgrid::Tcell::NC_recursive(TNodeDataSelect ns,TCellDataSelect cs)
+//! node2cell interpolation
+void Tgrid::Tcell::NC1(TNodeDataSelect ns,TCellDataSelect cs)
 {
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->NC_recursive(ns,cs);
-    } else {
-        int dir,d,f,f2;
-        datareal tempx,tempy,tempz;
-        celldata[cs][0]=0.;
-        celldata[cs][1]=0.;
-        celldata[cs][2]=0.;
-        for(dir=0; dir<3; dir++)for(d=0; d<2; d++) {
-                tempx=tempy=tempz=0.;
-                if (isrefined_face(dir,d)) {
-                    for (f=0; f<4; f++) for (f2=0; f2<4; f2++) {
-                            tempx+=refintf[dir][d]->face[f]->node[f2]->nodedata[ns][0];
-                            tempy+=refintf[dir][d]->face[f]->node[f2]->nodedata[ns][1];
-                            tempz+=refintf[dir][d]->face[f]->node[f2]->nodedata[ns][2];
-                        }
-                    tempx*=0.25;
-                    tempy*=0.25;
-                    tempz*=0.25;
-                } else {
-                    for(f=0; f<4; f++) {
-                        tempx+=face[dir][d]->node[f]->nodedata[ns][0];
-                        tempy+=face[dir][d]->node[f]->nodedata[ns][1];
-                        tempz+=face[dir][d]->node[f]->nodedata[ns][2];
+    int dir,d,f,f2;
+    datareal tempx,tempy,tempz;
+    celldata[cs][0]=0.;
+    celldata[cs][1]=0.;
+    celldata[cs][2]=0.;
+    for(dir=0; dir<3; dir++)for(d=0; d<2; d++) {
+            tempx=tempy=tempz=0.;
+            if (isrefined_face(dir,d)) {
+                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) {
+                        tempx+=refintf[dir][d]->face[f]->node[f2]->nodedata[ns][0];
+                        tempy+=refintf[dir][d]->face[f]->node[f2]->nodedata[ns][1];
+                        tempz+=refintf[dir][d]->face[f]->node[f2]->nodedata[ns][2];
                     }
+                tempx*=0.25;
+                tempy*=0.25;
+                tempz*=0.25;
+            } else {
+                for(f=0; f<4; f++) {
+                    tempx+=face[dir][d]->node[f]->nodedata[ns][0];
+                    tempy+=face[dir][d]->node[f]->nodedata[ns][1];
+                    tempz+=face[dir][d]->node[f]->nodedata[ns][2];
                 }
-                celldata[cs][0]+=tempx/24.;
-                celldata[cs][1]+=tempy/24.;
-                celldata[cs][2]+=tempz/24.;
             }
-    }
+            celldata[cs][0]+=tempx/24.;
+            celldata[cs][1]+=tempy/24.;
+            celldata[cs][2]+=tempz/24.;
+        }
 }
 
-//! node2cell interpolation for smoothing (recursive)
-void Tgrid::Tcell::NC_smoothing_recursive()
+//! node2cell interpolation for smoothing
+void Tgrid::Tcell::NC1_smoothing()
 {
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->NC_smoothing_recursive();
-    } else {
-        int dir,d,f,f2;
-        datareal tempnc,temprhoq,tempvx,tempvy,tempvz;
-        nc=0.;
-        rho_q=0.;
-        celldata[CELLDATA_Ji][0]=0.;
-        celldata[CELLDATA_Ji][1]=0.;
-        celldata[CELLDATA_Ji][2]=0.;
-        for(dir=0; dir<3; dir++)for(d=0; d<2; d++) {
-                tempnc=temprhoq=tempvx=tempvy=tempvz=0.;
-                if (isrefined_face(dir,d)) {
-                    for (f=0; f<4; f++) for (f2=0; f2<4; f2++) {
-                            tempnc+=refintf[dir][d]->face[f]->node[f2]->nn;
-                            temprhoq+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_UE][0];
-                            tempvx+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_J][0];
-                            tempvy+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_J][1];
-                            tempvz+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_J][2];
-                        }
-                    tempnc*=0.25;
-                    temprhoq*=0.25;
-                    tempvx*=0.25;
-                    tempvy*=0.25;
-                    tempvz*=0.25;
-                } else {
-                    for(f=0; f<4; f++) {
-                        tempnc+=face[dir][d]->node[f]->nn;
-                        temprhoq+=face[dir][d]->node[f]->nodedata[NODEDATA_UE][0];
-                        tempvx+=face[dir][d]->node[f]->nodedata[NODEDATA_J][0];
-                        tempvy+=face[dir][d]->node[f]->nodedata[NODEDATA_J][1];
-                        tempvz+=face[dir][d]->node[f]->nodedata[NODEDATA_J][2];
+    int dir,d,f,f2;
+    datareal tempnc,temprhoq,tempvx,tempvy,tempvz;
+    nc=0.;
+    rho_q=0.;
+    celldata[CELLDATA_Ji][0]=0.;
+    celldata[CELLDATA_Ji][1]=0.;
+    celldata[CELLDATA_Ji][2]=0.;
+    for(dir=0; dir<3; dir++)for(d=0; d<2; d++) {
+            tempnc=temprhoq=tempvx=tempvy=tempvz=0.;
+            if (isrefined_face(dir,d)) {
+                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) {
+                        tempnc+=refintf[dir][d]->face[f]->node[f2]->nn;
+                        temprhoq+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_UE][0];
+                        tempvx+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_J][0];
+                        tempvy+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_J][1];
+                        tempvz+=refintf[dir][d]->face[f]->node[f2]->nodedata[NODEDATA_J][2];
                     }
+                tempnc*=0.25;
+                temprhoq*=0.25;
+                tempvx*=0.25;
+                tempvy*=0.25;
+                tempvz*=0.25;
+            } else {
+                for(f=0; f<4; f++) {
+                    tempnc+=face[dir][d]->node[f]->nn;
+                    temprhoq+=face[dir][d]->node[f]->nodedata[NODEDATA_UE][0];
+                    tempvx+=face[dir][d]->node[f]->nodedata[NODEDATA_J][0];
+                    tempvy+=face[dir][d]->node[f]->nodedata[NODEDATA_J][1];
+                    tempvz+=face[dir][d]->node[f]->nodedata[NODEDATA_J][2];
                 }
-                nc+=tempnc/24.;
-                rho_q+=temprhoq/24.;
-                celldata[CELLDATA_Ji][0]+=tempvx/24.;
-                celldata[CELLDATA_Ji][1]+=tempvy/24.;
-                celldata[CELLDATA_Ji][2]+=tempvz/24.;
             }
-    }
+            nc+=tempnc/24.;
+            rho_q+=temprhoq/24.;
+            celldata[CELLDATA_Ji][0]+=tempvx/24.;
+            celldata[CELLDATA_Ji][1]+=tempvy/24.;
+            celldata[CELLDATA_Ji][2]+=tempvz/24.;
+        }
 }
 
 //! cell2node interpolation
@@ -618,6 +622,9 @@ void Tgrid::Tnode::CN_donor1(TCellDataSelect cs, TNodeDataSelect ns, TNodeDataSe
     for (ch=0; ch<8; ch++) {
         c = cell[0][0][ch];
         if (!c) {
+#ifdef USE_OPENMP
+#pragma omp critical(errorlog)
+#endif
             errorlog << "Tnode::CN_donor1: nonexistent cell at " << Tr3v(centroid).toString() << ", upwind_x=" << upwind_x/3e6 << "\n";
             continue;
         }
@@ -677,143 +684,27 @@ void Tgrid::Tnode::calc_E1(void)
             nodedata[NODEDATA_E][2] *= scaling;
 #ifndef NO_DIAGNOSTICS
             // Increase counter
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
             Tgrid::fieldCounter.cutRateE += 1.0;
 #endif
         }
     }
 }
 
-//! cell2node interpolation (recursive)
-void Tgrid::Tcell::CN_recursive(TCellDataSelect cs, TNodeDataSelect ns)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->CN_recursive(cs,ns);
-    } else {
-        // NODE LOOP
-        // Idea: To pass through all nodes, pass through all right-pointing faces,
-        // and all upper-right corner points thereof
-        // IF YOU MODIFY THIS, MODIFY ALSO Tcell::calc_node_E_recursive below!!
-        int d = 0; // choose to pass in X-direction
-        if (isrefined_face(d,1)) {
-            int f,f2;
-            for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN1(cs,ns);
-        } else {
-            face[d][1]->node[2]->CN1(cs,ns);    // assume nodes are numbered 0=(x,y), 1=(x+dx,y), 2=(x+dx,y+dy), 3=(x,y+dy)
-        }
-        for (d=1; d<3; d++) if (isrefined_face(d,1)) {
-                int f,f2;
-                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN1(cs,ns);
-            }
-    }
-}
-
-//! cell2node interpolation for smoothing (recursive)
-void Tgrid::Tcell::CN_smoothing_recursive()
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->CN_smoothing_recursive();
-    } else {
-        // NODE LOOP
-        int d = 0;          // choose to pass in X-direction
-        if (isrefined_face(d,1)) {
-            int f,f2;
-            for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN1_smoothing();
-        } else {
-            face[d][1]->node[2]->CN1_smoothing(); // assume nodes are numbered 0=(x,y), 1=(x+dx,y), 2=(x+dx,y+dy), 3=(x,y+dy)
-        }
-        for (d=1; d<3; d++) if (isrefined_face(d,1)) {
-                int f,f2;
-                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN1_smoothing();
-            }
-    }
-}
-
-//! cell2node interpolation of rho_q (recursive)
-void Tgrid::Tcell::CN_rhoq_recursive()
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->CN_rhoq_recursive();
-    } else {
-        // NODE LOOP
-        int d = 0;          // choose to pass in X-direction
-        if (isrefined_face(d,1)) {
-            int f,f2;
-            for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN1_rhoq();
-        } else {
-            face[d][1]->node[2]->CN1_rhoq(); // assume nodes are numbered 0=(x,y), 1=(x+dx,y), 2=(x+dx,y+dy), 3=(x,y+dy)
-        }
-        for (d=1; d<3; d++) if (isrefined_face(d,1)) {
-                int f,f2;
-                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN1_rhoq();
-            }
-    }
-}
-
-//! Upwind nodedata by using cell2node interpolation (recursive)
-void Tgrid::Tcell::CN_donor_recursive(TCellDataSelect cs, TNodeDataSelect ns, TNodeDataSelect uns, real dt)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->CN_donor_recursive(cs,ns,uns,dt);
-    } else {
-        // NODE LOOP
-        int d = 0;          // choose to pass in X-direction
-        if (isrefined_face(d,1)) {
-            int f,f2;
-            for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN_donor1(cs,ns,uns,dt);
-        } else {
-            face[d][1]->node[2]->CN_donor1(cs,ns,uns,dt);
-            //assume nodes are numbered 0=(x,y), 1=(x+dx,y), 2=(x+dx,y+dy), 3=(x,y+dy)
-        }
-        for (d=1; d<3; d++) if (isrefined_face(d,1)) {
-                int f,f2;
-                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->CN_donor1(cs,ns,uns,dt);
-            }
-    }
-}
-
-//! Calculate the electric field at a node (recursive)
-void Tgrid::Tcell::calc_node_E_recursive(void)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->calc_node_E_recursive();
-    } else {
-        // NODE LOOP
-        int d = 0;          // choose to pass in X-direction
-        if (isrefined_face(d,1)) {
-            int f,f2;
-            for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->calc_E1();
-        } else {
-            face[d][1]->node[2]->calc_E1();
-        }
-        for (d=1; d<3; d++) if (isrefined_face(d,1)) {
-                int f,f2;
-                for (f=0; f<4; f++) for (f2=0; f2<4; f2++) refintf[d][1]->face[f]->node[f2]->calc_E1();
-            }
-    }
-}
-
-//! Calculate the polarization electric field in a cell and store in CELLDATA_TEMP2 (recursive)
-void Tgrid::Tcell::calc_cell_E_recursive(void)
+//! Calculate the polarization electric field in a cell and store in CELLDATA_TEMP2
+void Tgrid::Tcell::calc_cell_E1(void)
 {
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->calc_cell_E_recursive();
-    } else {
-        celldata[CELLDATA_TEMP2][0] = 0.;
-        celldata[CELLDATA_TEMP2][1] = 0.;
-        celldata[CELLDATA_TEMP2][2] = 0.;
-        //electron pressure contribution
-        if(r2>sqr(Params::R_zeroPolarizationField)) { //if the cell is outside of the background ionosphere density peak, include the polarization electric field.
-            const real pressure_coef=Params::k_B*Params::Te/Params::e;//KTe/e for isothermal plasma.
-            celldata[CELLDATA_TEMP2][0] -= pressure_coef*celldata[CELLDATA_TEMP1][0]/rho_q;
-            celldata[CELLDATA_TEMP2][1] -= pressure_coef*celldata[CELLDATA_TEMP1][1]/rho_q;
-            celldata[CELLDATA_TEMP2][2] -= pressure_coef*celldata[CELLDATA_TEMP1][2]/rho_q;
-        }
+    celldata[CELLDATA_TEMP2][0] = 0.;
+    celldata[CELLDATA_TEMP2][1] = 0.;
+    celldata[CELLDATA_TEMP2][2] = 0.;
+    //electron pressure contribution
+    if(r2>sqr(Params::R_zeroPolarizationField)) { //if the cell is outside of the background ionosphere density peak, include the polarization electric field.
+        const real pressure_coef=Params::k_B*Params::Te/Params::e;//KTe/e for isothermal plasma.
+        celldata[CELLDATA_TEMP2][0] -= pressure_coef*celldata[CELLDATA_TEMP1][0]/rho_q;
+        celldata[CELLDATA_TEMP2][1] -= pressure_coef*celldata[CELLDATA_TEMP1][1]/rho_q;
+        celldata[CELLDATA_TEMP2][2] -= pressure_coef*celldata[CELLDATA_TEMP1][2]/rho_q;
     }
 }
 
@@ -830,112 +721,42 @@ void Tgrid::Tcell::zero_rhoq_nc_Vq_recursive()
     }
 }
 
-//! Calculate Ue in a cell (recursive)
-void Tgrid::Tcell::calc_ue_recursive(void)
+//! Calculate Ue in a cell
+void Tgrid::Tcell::calc_ue1(void)
 {
-    if (haschildren) {
-        for (int ch=0; ch<8; ch++) child[0][0][ch]->calc_ue_recursive();
-    } else {
-        // Check zero field radius
-        if (r2 < Params::R_zeroFields2) {
-            for (int d=0; d<3; d++) {
-                celldata[CELLDATA_UE][d] = 0;
-            }
-            return;
-        }
-        // Charge density in thel cell
-        real chargedensity = rho_q;
-        const real invrho_q = 1.0/chargedensity;
-        real ue[3];
-        real ue2 = 0.0;
+    // Check zero field radius
+    if (r2 < Params::R_zeroFields2) {
         for (int d=0; d<3; d++) {
+            celldata[CELLDATA_UE][d] = 0;
+        }
+        return;
+    }
+    // Charge density in thel cell
+    real chargedensity = rho_q;
+    const real invrho_q = 1.0/chargedensity;
+    real ue[3];
+    real ue2 = 0.0;
+    for (int d=0; d<3; d++) {
 #ifndef IGNORE_ELECTRIC_FIELD_HALL_TERM
-            ue[d] = (celldata[CELLDATA_Ji][d] - celldata[CELLDATA_J][d])*invrho_q;
+        ue[d] = (celldata[CELLDATA_Ji][d] - celldata[CELLDATA_J][d])*invrho_q;
 #else
-            ue[d] = (celldata[CELLDATA_Ji][d])*invrho_q;
+        ue[d] = (celldata[CELLDATA_Ji][d])*invrho_q;
 #endif
-            ue2+= sqr(ue[d]);
-        }
-        // Check maximum electron fluid velocity (CONSTRAINT)
-        if (Params::Ue_max > 0 && ue2 > Params::Ue_max2) {
-            const real norm = Params::Ue_max/sqrt(ue2);
-            for (int d=0; d<3; d++) ue[d]*= norm;
+        ue2+= sqr(ue[d]);
+    }
+    // Check maximum electron fluid velocity (CONSTRAINT)
+    if (Params::Ue_max > 0 && ue2 > Params::Ue_max2) {
+        const real norm = Params::Ue_max/sqrt(ue2);
+        for (int d=0; d<3; d++) ue[d]*= norm;
 #ifndef NO_DIAGNOSTICS
-            // Increase counter
-            Tgrid::fieldCounter.cutRateUe += 1.0;
+        // Increase counter
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+        Tgrid::fieldCounter.cutRateUe += 1.0;
 #endif
-        }
-        for (int d=0; d<3; d++) celldata[CELLDATA_UE][d] = ue[d];
-    }
-}
-
-//! Calculate curl at cell faces (recursive)
-void Tgrid::Tcell::FaceCurl_recursive(TNodeDataSelect nsB, TFaceDataSelect fsj, int d, real factor)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->FaceCurl_recursive(nsB,fsj,d,factor);
-    } else {
-        const int dir = 1;
-        if (isrefined_face(d,dir)) {
-            int f;
-            for (f=0; f<4; f++) refintf[d][dir]->face[f]->Curl1(nsB,fsj,d,0.5*size,factor);
-        } else {
-            face[d][dir]->Curl1(nsB,fsj,d,size,factor);
-        }
-    }
-}
-
-//! node2face interpolation (recursive)
-void Tgrid::Tcell::NF_recursive(TNodeDataSelect ns, TFaceDataSelect fs, int d)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->NF_recursive(ns,fs,d);
-    } else {
-        const int dir = 1;
-        if (isrefined_face(d,dir)) {
-            int f;
-            for (f=0; f<4; f++) refintf[d][dir]->face[f]->NF1(ns,fs,d);
-        } else {
-            face[d][dir]->NF1(ns,fs,d);
-        }
-    }
-}
-
-//! node2face interpolation of rho_q (recursive)
-void Tgrid::Tcell::NF_rhoq_recursive(int d)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->NF_rhoq_recursive(d);
-    } else {
-        const int dir = 1;
-        if (isrefined_face(d,dir)) {
-            int f;
-            for (f=0; f<4; f++) refintf[d][dir]->face[f]->NF_rhoq1();
-        } else {
-            face[d][dir]->NF_rhoq1();
-        }
-    }
-}
-
-//! Face propagate (recursive)
-void Tgrid::Tcell::FacePropagate_recursive(TFaceDataSelect Bold, TFaceDataSelect Bnew, real dt)
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->FacePropagate_recursive(Bold,Bnew,dt);
-    } else {
-        int d;
-        for (d=0; d<3; d++)
-            if (isrefined_face(d,1)) {
-                int f;
-                for (f=0; f<4; f++) refintf[d][1]->face[f]->Propagate1(Bold,Bnew,dt);
-            } else {
-                face[d][1]->Propagate1(Bold,Bnew,dt);
-            }
     }
+    for (int d=0; d<3; d++) celldata[CELLDATA_UE][d] = ue[d];
 }
 
 //! Set resistivity at a node (recursive)
@@ -1125,14 +946,10 @@ void Tgrid::Tcell::calc_facediv_recursive(TFaceDataSelect fs, MagneticLog& resul
     }
 }
 
-//! Calculate gradient of rho_q (recursive)
-void Tgrid::Tcell::CalcGradient_rhoq_recursive(void)
+//! Calculate gradient of rho_q
+void Tgrid::Tcell::CalcGradient_rhoq1(void)
 {
-    if (haschildren) {
-        for (int ch=0; ch<8; ch++) child[0][0][ch]->CalcGradient_rhoq_recursive();
-    } else {
-        for (int d=0; d<3; d++)celldata[CELLDATA_TEMP1][d]= (faceave(d,1,Tgrid::FACEDATA_MINUSDB) - faceave(d,0,Tgrid::FACEDATA_MINUSDB))/size;
-    }
+    for (int d=0; d<3; d++)celldata[CELLDATA_TEMP1][d]= (faceave(d,1,Tgrid::FACEDATA_MINUSDB) - faceave(d,0,Tgrid::FACEDATA_MINUSDB))/size;
 }
 
 //! Return the number of refined faces in a cell
@@ -1233,11 +1050,11 @@ void Tgrid::Tface::NF_rhoq1(void)
 }
 
 //! face2r interpolation
-void Tgrid::faceintpol(const shortreal r[3], TFaceDataSelect s, real result[3])
+void Tgrid::faceintpol(const shortreal r[3], TFaceDataSelect s, real result[3], CellCursor& cur)
 {
     int d;
     gridreal t,lowercorner[3];
-    Tcell *const c = findcell(r,lowercorner);
+    Tcell *const c = findcell(r,cur,lowercorner);
     if (!c) {
         errorlog << "ERROR [Tgrid::faceintpol]: findcell returned null for r=" << Tr3v(r).toString() << "\n";
         doabort();
@@ -1256,67 +1073,85 @@ void Tgrid::faceintpol(const shortreal r[3], TFaceDataSelect s, real result[3])
         t = (r[2] - lowercorner[2])*c->invsize;
         result[2] = (1-t)*c->face[2][0]->facedata[s] + t*c->face[2][1]->facedata[s];
     }
-    saved_cellptr = c;
+    cur.cell = c;
 }
 
 //! face2cell interpolation
 void Tgrid::FC(TFaceDataSelect fs, TCellDataSelect cs)
 {
-    int i,j,k,c;
-    ForInterior(i,j,k) {
-        c = flatindex(i,j,k);
-        cells[c]->FC_recursive(fs,cs);
+    const int n = sweep_cells.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int m=0; m<n; m++) {
+        sweep_cells[m]->FC1(fs,cs);
     }
 }
 
 //! node2cell interpolation for smoothing
 void Tgrid::NC_smoothing()
 {
-    int i,j,k,c;
-    ForInterior(i,j,k) {
-        c = flatindex(i,j,k);
-        cells[c]->NC_smoothing_recursive();
+    const int n = sweep_cells.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int m=0; m<n; m++) {
+        sweep_cells[m]->NC1_smoothing();
     }
 }
 
 //! node2cell interpolation
 void Tgrid::NC(TNodeDataSelect ns,TCellDataSelect cs)
 {
-    int i,j,k,c;
-    ForInterior(i,j,k) {
-        c = flatindex(i,j,k);
-        cells[c]->NC_recursive(ns,cs);
+    const int n = sweep_cells.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int m=0; m<n; m++) {
+        sweep_cells[m]->NC1(ns,cs);
     }
 }
 
 //! cell2node interpolation
 void Tgrid::CN(TCellDataSelect cs, TNodeDataSelect ns)
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                cells[c]->CN_recursive(cs,ns);
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_nodes[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            sweep_nodes[colour][m]->CN1(cs,ns);
+        }
+    }
 }
 
 //! cell2node interpolation for smoothing
 void Tgrid::CN_smoothing()
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                cells[c]->CN_smoothing_recursive();
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_nodes[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            sweep_nodes[colour][m]->CN1_smoothing();
+        }
+    }
 }
 
 //! cell2node interpolation of rho_q
 void Tgrid::CN_rhoq()
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                cells[c]->CN_rhoq_recursive();
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_nodes[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            sweep_nodes[colour][m]->CN1_rhoq();
+        }
+    }
 }
 
 //! Set resistivity at a node
@@ -1335,11 +1170,15 @@ void Tgrid::set_resistivity(ResistivityProfile res)
 //! Upwind nodedata by using cell2node interpolation
 void Tgrid::CN_donor(TCellDataSelect cs, TNodeDataSelect ns, TNodeDataSelect uns, real dt)
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                cells[c]->CN_donor_recursive(cs,ns,uns,dt);
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_nodes[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            sweep_nodes[colour][m]->CN_donor1(cs,ns,uns,dt);
+        }
+    }
 }
 
 //! Reset nc, rho_q and CELLDATA_Ji in a cell
@@ -1352,14 +1191,85 @@ void Tgrid::zero_rhoq_nc_Vq()
     }
 }
 
+/** \brief Add the contribution of a macroparticle to a cell
+ *
+ * accum_w is the particle number contribution (weight times the fraction of
+ * the particle cloud in the cell). Returns false if the population is not
+ * accumulated. sb is the spectra bin of the particle (spectra_bin).
+ */
+inline bool Tgrid::deposit_PIC(Tcell *c, real accum_w, const shortreal v[3], int popid, const TSpectraBin& sb)
+{
+    bool accumulated = false;
+    if(Params::pops[popid]->getAccumulate() == true) {
+        // Charge contribution from a macroparticle to this cell
+        const datareal charge = accum_w*Params::pops[popid]->q;
+        // Add particle number contribution to the cell
+        c->nc += accum_w;
+        // Add charge contribution to the cell
+        c->rho_q += charge;
+        // Add ion current contribution to the cell
+        for (int d=0; d<3; d++) {
+            c->celldata[CELLDATA_Ji][d] += charge*v[d];
+        }
+        accumulated = true;
+    }
+    if (Params::averaging == true) {
+        average_PIC(c,accum_w,v,popid,sb);
+    }
+    return accumulated;
+}
+
+//! Add the contribution of a macroparticle to the averaged population quantities of a cell, see deposit_PIC
+inline void Tgrid::average_PIC(Tcell *c, real accum_w, const shortreal v[3], int popid, const TSpectraBin& sb)
+{
+#ifdef SAVE_POPULATION_AVERAGES
+    average_population(c,accum_w,v,popid);
+#endif
+#ifdef SAVE_PARTICLE_CELL_SPECTRA
+    if (sb.bin >= 0) {
+        ave_deposit[static_cast<size_t>(c->ave_row)*ave_ncols + ave_spectra_col + popid*Params::spectraNbins + sb.bin] += sb.speed*accum_w;
+    }
+#endif
+}
+
+/** \brief Spectra bin of a macroparticle, found once for all cells of its stencil
+ *
+ * The energies below and above the bins are binned to the first and last
+ * bin in the regular case and otherwise if spectraEminAll/spectraEmaxAll.
+ */
+inline TSpectraBin Tgrid::spectra_bin(const shortreal v[3], int popid, bool regular) const
+{
+    TSpectraBin sb;
+    sb.bin = -1;
+    sb.speed = 0;
+#ifdef SAVE_PARTICLE_CELL_SPECTRA
+    if (Params::averaging == true) {
+        const real v2 = vecsqr(v);
+        sb.speed = sqrt(v2);
+        sb.bin = spectra_bins[popid].find(v2, regular || Params::spectraEminAll == true, regular || Params::spectraEmaxAll == true);
+    }
+#endif
+    return sb;
+}
+
+//! Add the particle number and flux of a macroparticle to the population averages of a cell
+inline void Tgrid::average_population(Tcell *c, real accum_w, const shortreal v[3], int popid)
+{
+    datareal *pop = ave_deposit + static_cast<size_t>(c->ave_row)*ave_ncols + 1 + 4*popid;
+    pop[0] += accum_w;
+    pop[1] += accum_w*v[0];
+    pop[2] += accum_w*v[1];
+    pop[3] += accum_w*v[2];
+}
+
 //! Accumulate Particle-In-Cell quantities in the grid (recursive)
-inline gridreal Tgrid::accumulate_PIC_recursive(const TBoxDef& cloudbox, Tcell *c, gridreal invvol, const shortreal v[3], real w, int popid)
+inline gridreal Tgrid::accumulate_PIC_recursive(const TBoxDef& cloudbox, Tcell *c, gridreal invvol, const shortreal v[3], real w, int popid, const TSpectraBin& sb)
 {
     // This function is recursive, but a good compiler will inline the first-level calls in accumulate_PIC anyway.
     gridreal accum = 0.0;
     if (c->haschildren) {
         int ch;
-        for (ch=0; ch<8; ch++) accum+= accumulate_PIC_recursive(cloudbox,c->child[0][0][ch],invvol,v,w,popid);
+        for (ch=0; ch<8; ch++) accum+= accumulate_PIC_recursive(cloudbox,c->child[0][0][ch],invvol,v,w,popid,sb);
     } else {
         TBoxDef cellbox;
         const gridreal halfdx = 0.5*size(c);
@@ -1368,61 +1278,46 @@ inline gridreal Tgrid::accumulate_PIC_recursive(const TBoxDef& cloudbox, Tcell *
         cellbox.lowz = c->centroid[2] - halfdx;
         cellbox.size = size(c);
         accum = intersection_volume(cloudbox,cellbox)*invvol;
-        // Particle number contribution from a macroparticle to this cell
-        register const real accum_w = w*accum;
-        // Charge contribution from a macroparticle to this cell
-        datareal charge = accum_w*Params::pops[popid]->q;
-        if(Params::pops[popid]->getAccumulate() == true) {
-            // Add particle number contribution to the cell
-            c->nc += accum_w;
-
-            // Add charge contribution to the cell
-            c->rho_q += charge;
-
-            // Add ion current contribution to the cell
-            for (int d=0; d<3; d++) {
-                c->celldata[CELLDATA_Ji][d] += charge*v[d];
-            }
-        } else {
+        if (!deposit_PIC(c,w*accum,v,popid,sb)) {
             accum = 0.0;
         }
-
-        if (Params::averaging == true) {
-#ifdef SAVE_POPULATION_AVERAGES
-            c->pop_ave_n[popid] += accum_w;
-            c->pop_ave_vx[popid] += accum_w*v[0];
-            c->pop_ave_vy[popid] += accum_w*v[1];
-            c->pop_ave_vz[popid] += accum_w*v[2];
-#endif
-#ifdef SAVE_PARTICLE_CELL_SPECTRA
-            const real v2 = vecsqr(v);
-            const real spectraAccum = sqrt(v2)*accum_w;
-            const unsigned int Nbins = Params::spectraV2BinsPerPop[popid].size() - 1;
-            if(v2 < Params::spectraV2BinsPerPop[popid][0] && Params::spectraEminAll == true) {
-                c->spectra[popid][0] += spectraAccum;
-            } else if(v2 > Params::spectraV2BinsPerPop[popid][Nbins] && Params::spectraEmaxAll == true) {
-                c->spectra[popid][Nbins] += spectraAccum;
-            } else {
-                for(unsigned int i=0; i<Nbins; ++i) {
-                    if(v2 >= Params::spectraV2BinsPerPop[popid][i] && v2 < Params::spectraV2BinsPerPop[popid][i+1]) {
-                        c->spectra[popid][i] += spectraAccum;
-                        break;
-                    }
-                }
-            }
-#endif
-        }
     }
     return accum;
 }
 
+/** \brief Check if the accumulate_PIC stencil of cell c is a uniform neighbourhood
+ *
+ * True if none of the neighbours C[1..7] is refined and, for a basegrid cell, none of
+ * them is a ghost cell. Assumes that all cells of the stencil are of the same level.
+ */
+inline bool Tgrid::uniform_stencil(const Tcell *c, Tcell *const C[8], const bool movetoright[3]) const
+{
+    for (int a=1; a<8; a++) if (C[a]->haschildren) return false;
+    // Refinement does not touch the box boundary, so only basegrid stencils can contain ghost cells
+    if (c->level == 0) {
+        int i,j,k;
+        decompose(c->flatind,i,j,k);
+        if (!movetoright[0]) i--;
+        if (!movetoright[1]) j--;
+        if (!movetoright[2]) k--;
+        if (i <= 0 || i+1 >= nx-1 || j <= 0 || j+1 >= ny-1 || k <= 0 || k+1 >= nz-1) return false;
+    }
+    return true;
+}
+
 //! Accumulate Particle-In-Cell quantities in the grid
-void Tgrid::accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, int popid)
+void Tgrid::accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, int popid, CellCursor& cur)
 {
+    if (push_block_index >= 0 && defer_push_deposit(r,v,w,popid)) {
+        return;
+    }
     gridreal centroid[3];
-    Tcell *const c = findcell(r,centroid);
+    Tcell *const c = findcell(r,cur,centroid);
     if (!c) {
         // Do not abort if no cell is found. Particle removed in pass_with_relocate afterwards.
+#ifdef USE_OPENMP
+#pragma omp critical(errorlog)
+#endif
         errorlog << "ERROR [Tgrid::accumulate_PIC]: findcell returned null for r="
                  << Tr3v(r).toString() << "\n"
                  << "   v=" << Tr3v(v).toString()
@@ -1453,6 +1348,42 @@ void Tgrid::accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, i
             all_same_level = false;
             break;
         }
+    if (all_same_level && uniform_stencil(c,C,movetoright)) {
+        // Fast path: plain trilinear weights over eight distinct leaf cells of the same size.
+        // Same as the 'regular grid' branch below, with the weights of the eight cells factored
+        // per dimension. Cell a of the stencil is on the far side along dimension d if bit d of a is set.
+        gridreal wd[3][2];
+        for (int d=0; d<3; d++) {
+            wd[d][1] = fabs(r[d]-c->centroid[d])*c->invsize;
+            wd[d][0] = 1.0 - wd[d][1];
+        }
+        if (Params::pops[popid]->getAccumulate() == true) {
+            const datareal q = Params::pops[popid]->q;
+            for (a=0; a<8; a++) {
+                Tcell *const c1 = C[a];
+                const real accum_w = w*(wd[0][a&1]*wd[1][(a>>1)&1]*wd[2][a>>2]);
+                const datareal charge = accum_w*q;
+                c1->nc += accum_w;
+                c1->rho_q += charge;
+                c1->celldata[CELLDATA_Ji][0] += charge*v[0];
+                c1->celldata[CELLDATA_Ji][1] += charge*v[1];
+                c1->celldata[CELLDATA_Ji][2] += charge*v[2];
+            }
+        }
+        if (Params::averaging == true) {
+            const TSpectraBin sb = spectra_bin(v,popid,true);
+            for (a=0; a<8; a++) {
+                average_PIC(C[a],w*(wd[0][a&1]*wd[1][(a>>1)&1]*wd[2][a>>2]),v,popid,sb);
+            }
+        }
+#ifndef NO_DIAGNOSTICS
+        fast_deposits += 1.0;
+#endif
+        return;
+    }
+#ifndef NO_DIAGNOSTICS
+    slow_deposits += 1.0;
+#endif
     // Replace duplicate cells by null pointers. Duplicates can occur if the neighbour is coarser.
     // Cells 0,1,2,4 cannot be duplicates anyway so exclude them from the search.
     int b;
@@ -1511,6 +1442,7 @@ void Tgrid::accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, i
     gridreal accum = 0.0;
     // Pass through the eight cells. Exclude nulls (those duplicates we removed above).
     if (!any_refined && all_same_level) {
+        const TSpectraBin sb = spectra_bin(v,popid,true);
         // Omit the halfdx shift in intersection box definitions, can be done since intersection volume is translation invariant
         // the essential thing is that cloudsize and cellboxsize are the same in the regular case
         TCellPtr c1;
@@ -1556,47 +1488,9 @@ void Tgrid::accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, i
                     c1 = cells[flatindex(i,j,k)];	// compute back the cell from the basegrid
                 }
             }
-            // Particle number contribution from a macroparticle to this cell
-            register const real accum_w = w*accum1;
-            // Charge contribution from a macroparticle to this cell
-            datareal charge = accum_w*Params::pops[popid]->q;
-            if(Params::pops[popid]->getAccumulate() == true) {
-                // Add particle number contribution to the cell
-                c1->nc += accum_w;
-                // Add charge contribution to the cell
-                c1->rho_q += charge;
-                // Add charge times velocity contribution to the cell
-                for (int d=0; d<3; d++) {
-                    c1->celldata[CELLDATA_Ji][d] += charge*v[d];
-                }
-            } else {
+            if (!deposit_PIC(c1,w*accum1,v,popid,sb)) {
                 accum1 = 0.0;
             }
-            if(Params::averaging == true) {
-#ifdef SAVE_POPULATION_AVERAGES
-                c1->pop_ave_n[popid] += accum_w;
-                c1->pop_ave_vx[popid] += accum_w*v[0];
-                c1->pop_ave_vy[popid] += accum_w*v[1];
-                c1->pop_ave_vz[popid] += accum_w*v[2];
-#endif
-#ifdef SAVE_PARTICLE_CELL_SPECTRA
-                const real v2 = vecsqr(v);
-                const real spectraAccum = sqrt(v2)*accum_w;
-                const unsigned int Nbins = Params::spectraV2BinsPerPop[popid].size()-1;
-                if(v2 < Params::spectraV2BinsPerPop[popid][0]) {
-                    c1->spectra[popid][0] += spectraAccum;
-                } else if(v2 > Params::spectraV2BinsPerPop[popid][Nbins]) {
-                    c1->spectra[popid][Nbins] += spectraAccum;
-                } else {
-                    for(unsigned int i=0; i<Nbins; ++i) {
-                        if(v2 >= Params::spectraV2BinsPerPop[popid][i] && v2 < Params::spectraV2BinsPerPop[popid][i+1]) {
-                            c1->spectra[popid][i] += spectraAccum;
-                            break;
-                        }
-                    }
-                }
-#endif
-            }
             accum += accum1;
         }
     } else {
@@ -1605,8 +1499,9 @@ void Tgrid::accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, i
         cloudbox.lowy = r[1] - halfcloudsize;
         cloudbox.lowz = r[2] - halfcloudsize;
         cloudbox.size = cloudsize;
+        const TSpectraBin sb = spectra_bin(v,popid,false);
         for (a=0; a<8; a++) if (C[a]) {
-                accum+= accumulate_PIC_recursive(cloudbox,C[a],invvol,v,w,popid);
+                accum+= accumulate_PIC_recursive(cloudbox,C[a],invvol,v,w,popid,sb);
             }
     }
 }
@@ -1637,28 +1532,15 @@ void Tgrid::finalize_accum_recursive(Tcell *c)
             Tgrid::fieldCounter.cutRateRhoQ += 1.0;
 #endif
         }
-        // Averaging
-        if (Params::averaging == true) {
-            c->ave_nc+= c->nc;
-            for (int d=0; d<3; d++) {
-                if (c->neighbour[d][1] == 0) {
-                    continue;
-                }
-                if (c->isrefined_face(d,1)) {
-                    for (int f=0; f<4; f++) {
-                        c->refintf[d][1]->face[f]->facedata[FACEDATA_AVEB] += c->refintf[d][1]->face[f]->facedata[FACEDATA_B];
-                    }
-                } else {
-                    c->face[d][1]->facedata[FACEDATA_AVEB] += c->face[d][1]->facedata[FACEDATA_B];
-                }
-            }
-        }
     }
 }
 
 //! Finalize accumulate Particle-In-Cell quantities in the grid
 void Tgrid::finalize_accum()
 {
+    if (Decomposition::getNranks() > 1) {
+        sum_deposits();
+    }
     Neumann_rhoq();
     int i,j,k,c;
     ForAll(i,j,k) {
@@ -1666,7 +1548,7 @@ void Tgrid::finalize_accum()
         finalize_accum_recursive(cells[c]);
     }
     if (Params::averaging == true) {
-        ave_ntimes++;
+        accumulate_average();
     }
 }
 
@@ -1716,30 +1598,138 @@ void Tgrid::copy_smoothing(int cTo, int cFrom)
 void Tgrid::calc_ue(void)
 {
     //! Ue = (Ji - j)/rho_q
-    int i,j,k,c;
-    ForInterior(i,j,k) {
-        c = flatindex(i,j,k);
-        cells[c]->calc_ue_recursive();
+    const int n = sweep_cells.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int m=0; m<n; m++) {
+        sweep_cells[m]->calc_ue1();
+    }
+}
+
+/** \brief (Field subcycling) Store the ion moments of the timestep before the field substeps
+ *
+ * Saves rho_q and CELLDATA_Ji of all leaf cells (ghost cells included).
+ * The moments of the previous timestep are used if havePrevious is true
+ * and the grid has not been adapted since, otherwise the moments are
+ * taken constant over the timestep.
+ */
+void Tgrid::begin_moment_subcycling(bool havePrevious)
+{
+    collect_leaves(subcycle_leaves);
+    const int nleaves = subcycle_leaves.size();
+    subcycle_moments.resize(4*nleaves);
+    for (int l=0; l<nleaves; l++) {
+        const Tcell *c = subcycle_leaves[l];
+        datareal *m = &subcycle_moments[4*l];
+        m[0] = c->rho_q;
+        for (int d=0; d<3; d++) {
+            m[1+d] = c->celldata[CELLDATA_Ji][d];
+        }
+    }
+    if (havePrevious == false || subcycle_prev.size() != subcycle_moments.size()) {
+        subcycle_prev = subcycle_moments;
+    }
+}
+
+/** \brief (Field subcycling) Set the ion moments of a field substep
+ *
+ * The moments of the timestep are taken to be at the middle of the field
+ * advance and the change from the previous timestep is applied linearly:
+ * moments = moments + f*(moments - previous moments), where f is the
+ * time of the substep from the middle of the timestep in timesteps.
+ * f < 0 interpolates and f > 0 extrapolates.
+ */
+void Tgrid::set_subcycle_moments(real f)
+{
+    const int nleaves = subcycle_leaves.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int l=0; l<nleaves; l++) {
+        Tcell *c = subcycle_leaves[l];
+        const datareal *m = &subcycle_moments[4*l];
+        const datareal *mprev = &subcycle_prev[4*l];
+        c->rho_q = max(real(m[0] + f*(m[0] - mprev[0])), real(Params::rho_q_min));
+        for (int d=0; d<3; d++) {
+            c->celldata[CELLDATA_Ji][d] = m[1+d] + f*(m[1+d] - mprev[1+d]);
+        }
+    }
+}
+
+//! (Field subcycling) Restore the ion moments of the timestep after the field substeps
+void Tgrid::end_moment_subcycling()
+{
+    const int nleaves = subcycle_leaves.size();
+    for (int l=0; l<nleaves; l++) {
+        Tcell *c = subcycle_leaves[l];
+        const datareal *m = &subcycle_moments[4*l];
+        c->rho_q = m[0];
+        for (int d=0; d<3; d++) {
+            c->celldata[CELLDATA_Ji][d] = m[1+d];
+        }
+    }
+    subcycle_prev.swap(subcycle_moments);
+}
+
+/** \brief Smallest whistler stability limit of the explicit field propagation [s]
+ *
+ * dt_w = mu_0*rho_q*dx^2/(pi*|B|), where B includes the constant field,
+ * taken over the interior leaf cells outside R_zeroFields. Uses
+ * CELLDATA_B of the latest field propagation. Returns 0 if there are
+ * no such cells.
+ */
+real Tgrid::whistler_timestep() const
+{
+    real dtMin = 0.0;
+    bool found = false;
+    const int n = sweep_cells.size();
+    for (int m=0; m<n; m++) {
+        const Tcell *c = sweep_cells[m];
+        if (c->r2 < Params::R_zeroFields2) {
+            continue;
+        }
+        real B0[3] = {0.0, 0.0, 0.0};
+        addConstantMagneticField(c->centroid,B0);
+        real B2 = 0.0;
+        for (int d=0; d<3; d++) {
+            B2 += sqr(c->celldata[CELLDATA_B][d] + B0[d]);
+        }
+        if (B2 <= 0.0) {
+            continue;
+        }
+        const real dtw = Params::mu_0*c->rho_q*sqr(c->size)/(pi*sqrt(B2));
+        if (found == false || dtw < dtMin) {
+            dtMin = dtw;
+            found = true;
+        }
     }
+    return dtMin;
 }
 
 //! Calculate electric field at nodes
 void Tgrid::calc_node_E(void)
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                cells[c]->calc_node_E_recursive();
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_nodes[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            sweep_nodes[colour][m]->calc_E1();
+        }
+    }
 }
 
 //! Calculate electric field in cells
 void Tgrid::calc_cell_E(void)
 {
-    int i,j,k,c;
-    ForInterior(i,j,k) {
-        c = flatindex(i,j,k);
-        cells[c]->calc_cell_E_recursive();
+    const int n = sweep_cells.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int m=0; m<n; m++) {
+        sweep_cells[m]->calc_cell_E1();
     }
 }
 
@@ -1748,37 +1738,46 @@ void Tgrid::FaceCurl(TNodeDataSelect nsB, TFaceDataSelect fsj, real factor)
 {
     //1. Ampere's law j=curl(B)/mu0  2. Faraday's induction dB/dt=-curl(E)
     // Factor is for case 1: 1/Params::mu_0  and for case 2: 1
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                if (j > 0 && k > 0) cells[c]->FaceCurl_recursive(nsB,fsj,0, factor);
-                if (i > 0 && k > 0) cells[c]->FaceCurl_recursive(nsB,fsj,1, factor);
-                if (i > 0 && j > 0) cells[c]->FaceCurl_recursive(nsB,fsj,2, factor);
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_faces[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            const TSweepFace& f = sweep_faces[colour][m];
+            if (f.inner) f.face->Curl1(nsB,fsj,f.d,f.dx,factor);
+        }
+    }
 }
 
 //! node2face interpolation
 void Tgrid::NF(TNodeDataSelect ns, TFaceDataSelect fs)
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                if (j > 0 && k > 0) cells[c]->NF_recursive(ns,fs,0);
-                if (i > 0 && k > 0) cells[c]->NF_recursive(ns,fs,1);
-                if (i > 0 && j > 0) cells[c]->NF_recursive(ns,fs,2);
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_faces[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            const TSweepFace& f = sweep_faces[colour][m];
+            if (f.inner) f.face->NF1(ns,fs,f.d);
+        }
+    }
 }
 
 // node2face interpolation of rho_q
 void Tgrid::NF_rhoq()
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                if (j > 0 && k > 0) cells[c]->NF_rhoq_recursive(0);
-                if (i > 0 && k > 0) cells[c]->NF_rhoq_recursive(1);
-                if (i > 0 && j > 0) cells[c]->NF_rhoq_recursive(2);
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_faces[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            const TSweepFace& f = sweep_faces[colour][m];
+            if (f.inner) f.face->NF_rhoq1();
+        }
+    }
 }
 
 //! Set magnetic field in cells and faces
@@ -1812,18 +1811,25 @@ void Tgrid::set_bgRhoQ(BackgroundChargeDensityProfile func)
 //! Face propagate
 void Tgrid::FacePropagate(TFaceDataSelect Bold, TFaceDataSelect Bnew, real dt)
 {
-    int i,j,k,c;
-    for (i=0; i<nx-1; i++) for (j=0; j<ny-1; j++) for (k=0; k<nz-1; k++) {
-                c = flatindex(i,j,k);
-                cells[c]->FacePropagate_recursive(Bold,Bnew,dt);
-            }
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_faces[colour].size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int m=0; m<n; m++) {
+            sweep_faces[colour][m].face->Propagate1(Bold,Bnew,dt);
+        }
+    }
 }
 //! Calculate the gradient of rho_q
 void Tgrid::CalcGradient_rhoq(void)
 {
-    int i,j,k;
-    ForInterior(i,j,k) {
-        cells[flatindex(i,j,k)]->CalcGradient_rhoq_recursive();
+    const int n = sweep_cells.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int m=0; m<n; m++) {
+        sweep_cells[m]->CalcGradient_rhoq1();
     }
 }
 
@@ -1849,17 +1855,27 @@ int Tgrid::Ncells_without_ghosts() const
 //! Neumann boundary conditions
 void Tgrid::Neumann(TCellDataSelect cs)
 {
+    // With USE_OPENMP the cells of each boundary plane are copied in parallel
     int i,j,k;
     // -X boundary
     i = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for private(k)
+#endif
     for (j=1; j<ny-1; j++) for (k=1; k<nz-1; k++)
             copy_celldata(flatindex(i,j,k),flatindex(i+1,j,k),cs);
     // +X boundary
     i = nx-1;
+#ifdef USE_OPENMP
+#pragma omp parallel for private(k)
+#endif
     for (j=1; j<ny-1; j++) for (k=1; k<nz-1; k++)
             copy_celldata(flatindex(i,j,k),flatindex(i-1,j,k),cs);
     // -Y boundary. From now on, i extends over all points.
     j = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for private(k)
+#endif
     for (i=0; i<nx; i++) for (k=1; k<nz-1; k++)
 #ifdef PERIODIC_FIELDS_Y
             copy_celldata(flatindex(i,j,k),flatindex(i,ny-2,k),cs);
@@ -1868,6 +1884,9 @@ void Tgrid::Neumann(TCellDataSelect cs)
 #endif
     // +Y boundary
     j = ny-1;
+#ifdef USE_OPENMP
+#pragma omp parallel for private(k)
+#endif
     for (i=0; i<nx; i++) for (k=1; k<nz-1; k++)
 #ifdef PERIODIC_FIELDS_Y
             copy_celldata(flatindex(i,j,k),flatindex(i,1,k),cs);
@@ -1876,10 +1895,16 @@ void Tgrid::Neumann(TCellDataSelect cs)
 #endif
     // -Z boundary. Fron now on, both i and j extend over all points.
     k = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for private(j)
+#endif
     for (i=0; i<nx; i++) for (j=0; j<ny; j++)
             copy_celldata(flatindex(i,j,k),flatindex(i,j,k+1),cs);
     // +Z boundary
     k = nz-1;
+#ifdef USE_OPENMP
+#pragma omp parallel for private(j)
+#endif
     for (i=0; i<nx; i++) for (j=0; j<ny; j++)
             copy_celldata(flatindex(i,j,k),flatindex(i,j,k-1),cs);
 }
@@ -2021,35 +2046,92 @@ void Tgrid::boundarypass(int dim, bool toRight, void (*funcB)(datareal cdata[NCE
 // ================================ GRID REFINEMENT ================================
 // =================================================================================
 
-//! (GRID REFINEMENT)
-int Tgrid::TPtrHash::HashFunction(const gridreal r[3], int iq[3]) const
+//! (GRID REFINEMENT) Empty table in the slots of the object
+Tgrid::TPtrHash::TPtrHash(Tgrid& g)
+    : gptr(&g), slots(initial_slots), mask(PTR_HASHTABLE_INITIAL_SIZE-1), shift(PTR_HASHTABLE_INITIAL_SHIFT), count(0)
+{
+    memset(initial_slots,0,sizeof(initial_slots));
+}
+
+//! (GRID REFINEMENT) Fibonacci hash of the integer coordinates packed in 64 bits
+unsigned int Tgrid::TPtrHash::HashFunction(const int iq[3]) const
+{
+    // 21 bits per coordinate, larger coordinates overlap the next field
+    const uint64_t x = (uint64_t(uint32_t(iq[0])) << 42) ^ (uint64_t(uint32_t(iq[1])) << 21) ^ uint64_t(uint32_t(iq[2]));
+    // The high bits of the product depend on all bits of x
+    return (unsigned int)((x*((uint64_t(0x9E3779B9) << 32) | uint64_t(0x7F4A7C15))) >> shift);
+}
+
+//! (GRID REFINEMENT) Slot of the key r, or the empty slot where it would be added
+unsigned int Tgrid::TPtrHash::find(const gridreal r[3], int iq[3]) const
 {
     gptr->intcoords(r,iq);
-    unsigned long x = (iq[0] << 7);
-    x+= iq[1];
-    x+= (iq[2] >> 7);
-    return int(x % (unsigned long)(PTR_HASHTABLE_SIZE));
+    unsigned int i = HashFunction(iq);
+    while (slots[i].data) {
+        if (iq[0] == slots[i].iq[0] && iq[1] == slots[i].iq[1] && iq[2] == slots[i].iq[2]) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+//! (GRID REFINEMENT) Add a new entry in the empty slot i returned by find
+void Tgrid::TPtrHash::insert(unsigned int i, const int iq[3], void *value)
+{
+    if (value == 0) {
+        // Null marks an empty slot, so adding it is the same as not adding
+        return;
+    }
+    if (2*(count + 1) > mask + 1) {
+        grow();
+        i = HashFunction(iq);
+        while (slots[i].data) {
+            i = (i + 1) & mask;
+        }
+    }
+    slots[i].data = value;
+    slots[i].iq[0] = iq[0];
+    slots[i].iq[1] = iq[1];
+    slots[i].iq[2] = iq[2];
+    count++;
+}
+
+//! (GRID REFINEMENT) Double the number of slots and rehash the entries
+void Tgrid::TPtrHash::grow()
+{
+    Thashslot *const old = slots;
+    const unsigned int oldsize = mask + 1;
+    mask = 2*oldsize - 1;
+    shift--;
+    slots = new Thashslot [mask + 1];
+    memset(slots,0,sizeof(Thashslot)*(mask + 1));
+    for (unsigned int j=0; j<oldsize; j++) {
+        if (old[j].data == 0) {
+            continue;
+        }
+        unsigned int i = HashFunction(old[j].iq);
+        while (slots[i].data) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = old[j];
+    }
+    if (old != initial_slots) {
+        delete [] old;
+    }
 }
 
 //! (GRID REFINEMENT) Return old entry or null, and add
 void *Tgrid::TPtrHash::add(const gridreal r[3], void *value)
 {
     int iq[3];
-    const int key = HashFunction(r,iq);
-    Thashnode *p;
-    for (p=pool[key]; p; p=p->next)
-        if (iq[0] == p->iq[0] && iq[1] == p->iq[1] && iq[2] == p->iq[2]) {
-            void *const result = p->data;
-            p->data = value;
-            return result;
-        }
-    p = new Thashnode;
-    p->next = pool[key];
-    p->iq[0] = iq[0];
-    p->iq[1] = iq[1];
-    p->iq[2] = iq[2];
-    p->data = value;
-    pool[key] = p;
+    const unsigned int i = find(r,iq);
+    if (slots[i].data) {
+        void *const result = slots[i].data;
+        slots[i].data = value;
+        return result;
+    }
+    insert(i,iq,value);
     return 0;
 }
 
@@ -2057,23 +2139,15 @@ void *Tgrid::TPtrHash::add(const gridreal r[3], void *value)
 void *Tgrid::TPtrHash::add_unique(const gridreal r[3], void *value)
 {
     int iq[3];
-    const int key = HashFunction(r,iq);
-    Thashnode *p;
-    for (p=pool[key]; p; p=p->next)
-        if (iq[0] == p->iq[0] && iq[1] == p->iq[1] && iq[2] == p->iq[2]) {
-            if (p->data != value) {
-                errorlog << "ERROR [Tgrid::TPtrHash::add_unique]: Data is not unique\n";
-                doabort();
-            }
-            return p->data;
+    const unsigned int i = find(r,iq);
+    if (slots[i].data) {
+        if (slots[i].data != value) {
+            errorlog << "ERROR [Tgrid::TPtrHash::add_unique]: Data is not unique\n";
+            doabort();
         }
-    p = new Thashnode;
-    p->next = pool[key];
-    p->iq[0] = iq[0];
-    p->iq[1] = iq[1];
-    p->iq[2] = iq[2];
-    p->data = value;
-    pool[key] = p;
+        return slots[i].data;
+    }
+    insert(i,iq,value);
     return 0;
 }
 
@@ -2081,62 +2155,52 @@ void *Tgrid::TPtrHash::add_unique(const gridreal r[3], void *value)
 void *Tgrid::TPtrHash::read(const gridreal r[3]) const
 {
     int iq[3];
-    const int key = HashFunction(r,iq);
-    Thashnode *p;
-    for (p=pool[key]; p; p=p->next)
-        if (iq[0] == p->iq[0] && iq[1] == p->iq[1] && iq[2] == p->iq[2])
-            return p->data;
-    return 0;
+    return slots[find(r,iq)].data;
 }
 
-//! (GRID REFINEMENT)
+//! (GRID REFINEMENT) Remove an entry and shift the following entries of its probe sequence back
 void Tgrid::TPtrHash::remove(const gridreal r[3])
 {
     int iq[3];
-    const int key = HashFunction(r,iq);
-    Thashnode *p,*q;
-    bool found = false;
-    for (p=pool[key]; p; p=p->next)
-        if (iq[0] == p->iq[0] && iq[1] == p->iq[1] && iq[2] == p->iq[2]) {
-            found = true;
-            if (p == pool[key]) {
-                // first entry in synonym chain
-                pool[key] = p->next;
-            } else {
-                // not first entry
-                q = pool[key];
-                while (q->next != p) q = q->next;
-                q->next = p->next;
-            }
-            delete p;
+    unsigned int i = find(r,iq);
+    if (slots[i].data == 0) {
+        errorlog << "*** Tgrid::TPtrHash::remove" << Tr3v(r).toString() << " failed\n";
+        return;
+    }
+    slots[i].data = 0;
+    count--;
+    unsigned int j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (slots[j].data == 0) {
             break;
         }
-    if (!found) {
-        errorlog << "*** Tgrid::TPtrHash::remove" << Tr3v(r).toString() << " failed\n";
+        // Move the entry at j to the hole at i if its home slot is not cyclically in (i,j]
+        const unsigned int home = HashFunction(slots[j].iq);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            slots[i] = slots[j];
+            slots[j].data = 0;
+            i = j;
+        }
     }
 }
 
 //! (GRID REFINEMENT)
 void Tgrid::TPtrHash::delete_all_as_nodeptr()
 {
-    int i;
-    Thashnode *p;
-    for (i=0; i<PTR_HASHTABLE_SIZE; i++)
-        for (p=pool[i]; p; p=p->next)
-            delete (Tgrid::Tnode *)p->data;
+    for (unsigned int i=0; i<=mask; i++) {
+        if (slots[i].data) {
+            delete (Tgrid::Tnode *)slots[i].data;
+        }
+    }
 }
 
 //! (GRID REFINEMENT)
 Tgrid::TPtrHash::~TPtrHash()
 {
-    int i;
-    Thashnode *p;
-    for (i=0; i<PTR_HASHTABLE_SIZE; i++)
-        while (pool[i]) {
-            p = pool[i];
-            pool[i] = p->next;
-            delete p;
-        }
+    if (slots != initial_slots) {
+        delete [] slots;
+    }
 }
 
 //! (GRID REFINEMENT)
@@ -2220,13 +2284,62 @@ void Tgrid::Tnode::update_cell_pointers(gridreal size, Tgrid& g)
             }
 }
 
-//! (GRID REFINEMENT) Refine a cell. Fails if any neighbour is larger.
-bool Tgrid::Tcell::refine(Tgrid& g)
+//! (GRID REFINEMENT) Walsh function (-1)^popcount(s&a) of the child index a
+static inline int walsh(int s, int a)
 {
-    int d,dir,a,s,ch,f1,f2,f,dirx,diry,dirz,chdir[3];
-    TCellPtr c,celltab[3][3][3];        // [x][y][z]
-    Tgrid::TNodePtr n,nodetab[3][3][3];
-    Tgrid::TFacePtr facetab[3][2][2][3];    // [dim][+-y][+-z][left,middle,right]
+    const int b = s & a;
+    return (((b ^ (b >> 1) ^ (b >> 2)) & 1) != 0) ? -1 : +1;
+}
+
+/** \brief (GRID REFINEMENT) Divergence-free face data of the 12 intra-faces of a refined cell
+ *
+ * The outer faces of the children have the face data of the coarse faces
+ * or of the finer neighbours. An intra-face is first set to the mean of
+ * the two outer faces on the same line, then the minimum-norm correction
+ * delta = phi(upper child) - phi(lower child) with L phi = div is added,
+ * which makes the divergence of each child equal (zero if the coarse cell
+ * was divergence-free). L is the graph Laplacian of the 2x2x2 children,
+ * its eigenvectors are the Walsh functions (-1)^popcount(s&a) with the
+ * eigenvalues 2*popcount(s).
+ */
+void Tgrid::Tcell::prolong_intra_faces(TFacePtr facetab[3][2][2][3])
+{
+    int s,d,diry,dirz,a,w,chdir[3];
+    for (s=0; s<NFACEDATA; s++) {
+        for (d=0; d<3; d++) for (diry=0; diry<2; diry++) for (dirz=0; dirz<2; dirz++) {
+                    facetab[d][diry][dirz][1]->facedata[s] = 0.5*(facetab[d][diry][dirz][0]->facedata[s] + facetab[d][diry][dirz][2]->facedata[s]);
+                }
+        real div[8],phi[8];
+        for (a=0; a<8; a++) {
+            div[a] = 0;
+            for (d=0; d<3; d++) div[a]+= child[0][0][a]->face[d][1]->facedata[s] - child[0][0][a]->face[d][0]->facedata[s];
+            phi[a] = 0;
+        }
+        for (w=1; w<8; w++) {
+            const int nbits = (w & 1) + ((w >> 1) & 1) + ((w >> 2) & 1);
+            real proj = 0;
+            for (a=0; a<8; a++) proj+= walsh(w,a)*div[a];
+            proj/= 8*2*nbits;
+            for (a=0; a<8; a++) phi[a]+= walsh(w,a)*proj;
+        }
+        for (d=0; d<3; d++) for (diry=0; diry<2; diry++) for (dirz=0; dirz<2; dirz++) {
+                    chdir[d] = 0;
+                    chdir[(d+1)%3] = diry;
+                    chdir[(d+2)%3] = dirz;
+                    const int lower = 4*chdir[0] + 2*chdir[1] + chdir[2];
+                    const int upper = lower + (1 << (2-d));
+                    facetab[d][diry][dirz][1]->facedata[s]+= phi[upper] - phi[lower];
+                }
+    }
+}
+
+//! (GRID REFINEMENT) Refine a cell. Fails if any neighbour is larger.
+bool Tgrid::Tcell::refine(Tgrid& g)
+{
+    int d,dir,a,s,ch,f1,f2,f,dirx,diry,dirz,chdir[3];
+    TCellPtr c,celltab[3][3][3];        // [x][y][z]
+    Tgrid::TNodePtr n,nodetab[3][3][3];
+    Tgrid::TFacePtr facetab[3][2][2][3];    // [dim][+-y][+-z][left,middle,right]
     Tgrid::TPtrHash nodehash(g);
     // Check if any neighbour is larger, if yes, do nothing and return false
     const int ourlevel = level;     // avoid using bit operations but once
@@ -2310,9 +2423,10 @@ bool Tgrid::Tcell::refine(Tgrid& g)
                         facetab[d][diry][dirz][2*dir] = neighbour[d][dir]->child[chdir[0]][chdir[1]][chdir[2]]->face[d][!dir];
                     }
             } else {
-                // create 4 new faces
+                // create 4 new faces, each with the face data of the coarse face
                 for (diry=0; diry<2; diry++) for (dirz=0; dirz<2; dirz++) {
-                        facetab[d][diry][dirz][2*dir] = new Tface;
+                        Tgrid::TFacePtr subface = facetab[d][diry][dirz][2*dir] = new Tface;
+                        for (s=0; s<NFACEDATA; s++) subface->facedata[s] = face[d][dir]->facedata[s];
                     }
             }
         }
@@ -2333,35 +2447,23 @@ bool Tgrid::Tcell::refine(Tgrid& g)
         c = new Tcell;
         child[0][0][a] = c;
         c->plist.init();
-        c->haschildren = c->refine_it = c->recoarsen_it = c->forbid_psplit = false;
+        c->haschildren = c->refine_it = c->recoarsen_it = false;
         c->refstatus = 0;       // no child can have a refined neighbour at this stage, this we know for sure
         c->level = ourlevel + 1;
         c->parent = this;
         c->flatind = a;
         c->running_index = -1234;       // arbitrary illegal value to ease debugging (not important though)
-        c->rho_q_bg = 0.0;
+        c->rho_q = rho_q;
+        c->rho_q_bg = rho_q_bg;
+        c->forbid_psplit = forbid_psplit;
+#ifdef SAVE_PARTICLES_ALONG_ORBIT
+        c->save_particles = save_particles;
+#endif
         for (d=0; d<3; d++) c->centroid[d] = centroid[d] + size*(chdir[d] ? +0.25 : -0.25);
         c->r2 = vecsqr(c->centroid);
         c->size = 0.5*size;
         c->invsize = 1.0/c->size;
         c->nc = nc;
-        // Averaging
-        if (Params::averaging == true) {
-            c->ave_nc = ave_nc;
-#ifdef SAVE_POPULATION_AVERAGES
-            for (int i = 0; i < Params::POPULATIONS; ++i) {
-                c->pop_ave_n.push_back(pop_ave_n[i]);
-                c->pop_ave_vx.push_back(pop_ave_vx[i]);
-                c->pop_ave_vy.push_back(pop_ave_vy[i]);
-                c->pop_ave_vz.push_back(pop_ave_vz[i]);
-            }
-#endif
-#ifdef SAVE_PARTICLE_CELL_SPECTRA
-            for (int i = 0; i < Params::POPULATIONS; ++i) {
-                c->spectra.push_back(spectra[i]);
-            }
-#endif
-        }
         for (s=0; s<NCELLDATA; s++) for (d=0; d<3; d++) c->celldata[s][d] = celldata[s][d];
         // set c->face pointers
         for (d=0; d<3; d++) {
@@ -2372,8 +2474,15 @@ bool Tgrid::Tcell::refine(Tgrid& g)
         }
         // c->neighbour must be filled later
     }
+    prolong_intra_faces(facetab);
+    // Move the particles to the children
+    TParticleList *octants[8];
+    for (a=0; a<8; a++) octants[a] = &child[0][0][a]->plist;
+    plist.move_to_octants(centroid,octants);
     // Mark it that we now have children
     haschildren = true;
+    // The lookup hint may be this cell, which is no longer a leaf
+    g.cursor.reset();
     // Set pointers from faces to nodes
     for (d=0; d<3; d++) for (diry=0; diry<2; diry++) for (dirz=0; dirz<2; dirz++) for (a=0; a<3; a++) {
                     gridreal rfacec[3],rnode[3];    // face center, node position
@@ -2468,10 +2577,45 @@ bool Tgrid::Tcell::refine(Tgrid& g)
 }
 
 //! (GRID REFINEMENT) Recoarsen a cell. Fails if the cell has no children, has grandchildren, or any neighbour of the cell's children has children.
+/** \brief (recoarsen) Keep the nodes of the recoarsened cell coarse that the leaves under this cell use
+ *
+ * The nodes of the leaf cell faces found in nodehash_remove are moved to
+ * nodehash_retain and their cell pointers are updated. The faces of a
+ * leaf are read through the refinement interface on its refined sides
+ * (face[][] is not valid there).
+ */
+void Tgrid::Tcell::retain_nodes_recursive(const Tcell *coarse, Tgrid& g, TPtrHash& nodehash_remove, TPtrHash& nodehash_retain)
+{
+    if (haschildren) {
+        for (int ch=0; ch<8; ch++) child[0][0][ch]->retain_nodes_recursive(coarse,g,nodehash_remove,nodehash_retain);
+        return;
+    }
+    // Leaves that do not touch the recoarsened cell have no such nodes
+    for (int d=0; d<3; d++) {
+        if (fabs(centroid[d] - coarse->centroid[d]) > 0.5*(coarse->size + size)*(1 + 1e-3)) {
+            return;
+        }
+    }
+    for (int d=0; d<3; d++) for (int dir=0; dir<2; dir++) {
+            const int nfaces = isrefined_face(d,dir) ? 4 : 1;
+            for (int q=0; q<nfaces; q++) {
+                const Tgrid::TFacePtr face1 = isrefined_face(d,dir) ? refintf[d][dir]->face[q] : face[d][dir];
+                for (int f=0; f<4; f++) {
+                    const Tgrid::TNodePtr nod = face1->node[f];
+                    if (nodehash_remove.read(nod->centroid)) {
+                        nod->update_cell_pointers(coarse->size,g);
+                        nodehash_remove.remove(nod->centroid);
+                        nodehash_retain.add_unique(nod);
+                    }
+                }
+            }
+        }
+}
+
 bool Tgrid::Tcell::recoarsen(Tgrid& g)
 {
     if (!haschildren) return false;
-    int ch,d,dir,n,diry,dirz,chdir[3],s,f;
+    int a,ch,d,dir,n,diry,dirz,chdir[3],s,f;
     for (ch=0; ch<8; ch++) {
         if (child[0][0][ch]->haschildren) return false;
         for (d=0; d<3; d++) for (dir=0; dir<2; dir++)
@@ -2538,36 +2682,24 @@ bool Tgrid::Tcell::recoarsen(Tgrid& g)
                 }
             }
         }
+    // Take the particles and the static cell flags from children
+    for (ch=0; ch<8; ch++) child[0][0][ch]->plist.move_to(plist);
+    rho_q_bg = 0;
+    forbid_psplit = false;
+#ifdef SAVE_PARTICLES_ALONG_ORBIT
+    save_particles = false;
+#endif
+    for (ch=0; ch<8; ch++) {
+        rho_q_bg+= 0.125*child[0][0][ch]->rho_q_bg;
+        forbid_psplit = forbid_psplit || child[0][0][ch]->forbid_psplit;
+#ifdef SAVE_PARTICLES_ALONG_ORBIT
+        save_particles = save_particles || child[0][0][ch]->save_particles;
+#endif
+    }
     // Take nc and celldata as averages from children
     nc = 0;
     for (ch=0; ch<8; ch++) nc+= child[0][0][ch]->nc;
     nc*= 0.125;
-    // Averaging
-    if (Params::averaging == true) {
-        ave_nc = 0;
-        for (ch=0; ch<8; ch++) {
-            ave_nc+= child[0][0][ch]->ave_nc;
-        }
-        ave_nc*= 0.125;
-#ifdef SAVE_POPULATION_AVERAGES
-        for (int i = 0; i < Params::POPULATIONS; ++i) {
-            pop_ave_n[i] = 0.0;
-            pop_ave_vx[i] = 0.0;
-            pop_ave_vy[i] = 0.0;
-            pop_ave_vz[i] = 0.0;
-            for (ch=0; ch<8; ch++) {
-                pop_ave_n[i] += child[0][0][ch]->pop_ave_n[i];
-                pop_ave_vx[i] += child[0][0][ch]->pop_ave_vx[i];
-                pop_ave_vy[i] += child[0][0][ch]->pop_ave_vy[i];
-                pop_ave_vz[i] += child[0][0][ch]->pop_ave_vz[i];
-            }
-            pop_ave_n[i] *= 0.125;
-            pop_ave_vx[i] *= 0.125;
-            pop_ave_vy[i] *= 0.125;
-            pop_ave_vz[i] *= 0.125;
-        }
-#endif
-    }
     for (s=0; s<NCELLDATA; s++) for (d=0; d<3; d++) celldata[s][d] = 0;
     for (ch=0; ch<8; ch++) for (s=0; s<NCELLDATA; s++) for (d=0; d<3; d++) celldata[s][d]+= child[0][0][ch]->celldata[s][d];
     for (s=0; s<NCELLDATA; s++) for (d=0; d<3; d++) celldata[s][d]*= 0.125;
@@ -2581,31 +2713,19 @@ bool Tgrid::Tcell::recoarsen(Tgrid& g)
         delete child[0][0][ch];
     }
     haschildren = false;
-    // Go through the 6 neighbours, excluding their outer faces.
-    // Also exclude leaf cells. Remove all accessible nodes from nodehash_remove,
+    // The lookup hint may be a deleted child (update_cell_pointers below uses findcell)
+    g.cursor.reset();
+    // Go through the 26 neighbours, also those sharing only an edge or a corner
+    // with us, because their children may use the nodes on our edges.
+    // Exclude leaf cells. Remove all accessible nodes from nodehash_remove,
     // but before it update their cell pointers (update_cell_pointers()).
-    for (d=0; d<3; d++) for (dir=0; dir<2; dir++) {
-            chdir[0] = chdir[1] = chdir[2] = 1;
-            chdir[d] = 2*dir;
-            c = celltab[chdir[0]][chdir[1]][chdir[2]];
-            if (!c->haschildren) continue;  // exclude leaf cells
-            for (ch=0; ch<8; ch++) {
-                if (GetBit(ch,2-d) == dir) continue;    // exclude outer row of cells
-                int d1,dir1;
-                for (d1=0; d1<3; d1++) for (dir1=0; dir1<2; dir1++) {
-                        if (d1==d && dir1==dir) continue;   // exclude outer faces
-                        Tgrid::TFacePtr face1 = c->child[0][0][ch]->face[d1][dir1];
-                        for (f=0; f<4; f++) {
-                            const Tgrid::TNodePtr nod = face1->node[f];
-                            if (nodehash_remove.read(nod->centroid)) {
-                                nod->update_cell_pointers(size,g);
-                                nodehash_remove.remove(nod->centroid);
-                                nodehash_retain.add_unique(nod);
-                            }
-                        }
-                    }
-            }
+    for (a=0; a<27; a++) {
+        c = celltab[0][0][a];
+        if (c == this || !c->haschildren) continue;  // exclude leaf cells
+        for (ch=0; ch<8; ch++) {
+            c->child[0][0][ch]->retain_nodes_recursive(this,g,nodehash_remove,nodehash_retain);
         }
+    }
     // Similarly, pass through the faces of *this (only non-refined faces)
     // to get hand to the 8 corner nodes (for refined faces, the nodes have already
     // been processed by the previous loop).
@@ -2758,6 +2878,7 @@ void Tgrid::Refine(GridRefinementProfile refFunc)
     vector<int> levelNRefinedCells;
     for (int level=0; level<Params::maxGridRefinementLevel; level++) {
         mainlog << " level " << level << ": ";
+        const double t0 = getWallSecs();
         int nmarked = 0;
         int i,j,k;
         ForInterior(i,j,k) {
@@ -2770,6 +2891,7 @@ void Tgrid::Refine(GridRefinementProfile refFunc)
         ForInterior(i,j,k) {
             cells[flatindex(i,j,k)]->refine_recursive(*this);
         }
+        mainlog << "  refined in " << getWallSecs()-t0 << " s\n";
         levelNRefinedCells.push_back(nmarked);
         ++Params::currentGridRefinementLevel;
     }
@@ -2799,8 +2921,13 @@ void Tgrid::Refine(GridRefinementProfile refFunc)
     mainlog << "| Total cells in all levels (no parents/ghosts) : " << totalCellsWithoutGhosts << "\n";
     mainlog << "| Total macroparticles in the box (average)     : " << totalCellsWithoutGhosts*Params::macroParticlesPerCell << "\n";
     mainlog << "|-----------------------------------------------------------------|\n";
-    // reset the cached cell pointer since it may have been invalidated
-    previous_found_cell = 0;
+    build_sweep_arrays();
+    // reset the cached cell pointers since they may have been invalidated
+    cursor.reset();
+    // The leaf cells changed, restart the temporal averages
+    if (ave_windows.empty() == false) {
+        build_average_table();
+    }
     MSGFUNCTIONEND("Tgrid::Refine");
 }
 
@@ -2818,7 +2945,210 @@ void Tgrid::recoarsen(gridreal (*mindx)(const gridreal[]))
         ForInterior(i,j,k)
         cells[flatindex(i,j,k)]->recoarsen_recursive(*this);
     }
-    previous_found_cell = 0;        // reset the cached cell pointer since it may have been invalidated
+    build_sweep_arrays();
+    cursor.reset();        // reset the cached cell pointers since they may have been invalidated
+    // The leaf cells changed, restart the temporal averages
+    if (ave_windows.empty() == false) {
+        build_average_table();
+    }
+}
+
+//! (GRID REFINEMENT) Whether the cell is inside an interior base cell
+bool Tgrid::is_interior(const Tcell *c) const
+{
+    while (c->parent) c = c->parent;
+    int i,j,k;
+    decompose(c->flatind,i,j,k);
+    return i > 0 && i < nx-1 && j > 0 && j < ny-1 && k > 0 && k < nz-1;
+}
+
+//! (GRID REFINEMENT) Whether the cell and its face neighbours are interior cells (the faces of ghost cells have no nodes)
+bool Tgrid::is_refinable(const Tcell *c) const
+{
+    if (!is_interior(c)) {
+        return false;
+    }
+    for (int d=0; d<3; d++) for (int dir=0; dir<2; dir++) {
+            if (!is_interior(c->neighbour[d][dir])) {
+                return false;
+            }
+        }
+    return true;
+}
+
+/** \brief (GRID REFINEMENT) Adaptive refinement criterion of a leaf cell
+ *
+ * The largest of the enabled criteria divided by its threshold: the
+ * relative jump of B (B1+B0) and of the density to the face neighbours
+ * (the jump over one cell is |grad B|*dx/B) and the current density.
+ * Values above 1 call for refinement.
+ */
+real Tgrid::refinement_indicator(const Tcell *c, CellCursor& cur)
+{
+    real q = 0;
+    if (Params::adaptiveRefineJ > 0) {
+        q = max2(q, normvec(c->celldata[CELLDATA_J])/Params::adaptiveRefineJ);
+    }
+    if (Params::adaptiveRefineGradB <= 0 && Params::adaptiveRefineDensityJump <= 0) {
+        return q;
+    }
+    datareal B[3],Bn[3];
+    for (int d=0; d<3; d++) B[d] = c->celldata[CELLDATA_B][d];
+    addConstantMagneticField(c->centroid,B);
+    const real absB = normvec(B);
+    for (int d=0; d<3; d++) for (int dir=0; dir<2; dir++) {
+            gridreal r[3] = {c->centroid[0], c->centroid[1], c->centroid[2]};
+            r[d]+= (2*dir-1)*c->size;
+            const TCellPtr n = findcell(r,cur);
+            if (n == 0 || !is_interior(n)) {
+                continue;
+            }
+            if (Params::adaptiveRefineGradB > 0) {
+                for (int e=0; e<3; e++) Bn[e] = n->celldata[CELLDATA_B][e];
+                addConstantMagneticField(n->centroid,Bn);
+                const real mean = 0.5*(absB + normvec(Bn));
+                if (mean > 0) {
+                    const real dB = sqrt(sqr(B[0]-Bn[0]) + sqr(B[1]-Bn[1]) + sqr(B[2]-Bn[2]));
+                    q = max2(q, dB/mean/Params::adaptiveRefineGradB);
+                }
+            }
+            if (Params::adaptiveRefineDensityJump > 0) {
+                const real mean = 0.5*(c->nc + n->nc);
+                if (mean > 0) {
+                    q = max2(q, fabs(c->nc - n->nc)/mean/Params::adaptiveRefineDensityJump);
+                }
+            }
+        }
+    return q;
+}
+
+/** \brief (GRID REFINEMENT) Refine and recoarsen the grid by the solution
+ *
+ * Leaf cells whose refinement_indicator exceeds 1 are refined (up to
+ * maxGridRefinementLevel) and the children of a cell are recoarsened if
+ * the indicators of all of them are below adaptiveRecoarsenFraction and
+ * gridRefinementFUNC does not require the cell to be refined. Coarser
+ * face neighbours of the cells to be refined are refined too, so that
+ * neighbour levels differ at most by one. Cells are refined or
+ * recoarsened by at most one level per call. Refinement keeps the face
+ * magnetic field divergence-free and moves the particles to the
+ * children, recoarsening moves them to the parent. Afterwards the sweep
+ * arrays and the PDF tables are rebuilt and the temporal averages are
+ * remapped to the new leaf cells.
+ */
+void Tgrid::adapt_refinement(int& nrefined, int& nrecoarsened)
+{
+    nrefined = nrecoarsened = 0;
+    const bool averages = ave_windows.empty() == false;
+    TPtrHash avecells(*this), avefaces0(*this), avefaces1(*this), avefaces2(*this);
+    TPtrHash *avefaces[3] = {&avefaces0, &avefaces1, &avefaces2};
+    if (averages) {
+        hash_average_table(avecells,avefaces);
+    }
+    vector<TCellPtr> leaves, flagged;
+    collect_leaves(leaves);
+    CellCursor cur;
+    const int nleaves = leaves.size();
+    int l;
+    for (l=0; l<nleaves; l++) {
+        const TCellPtr c = leaves[l];
+        if (!is_interior(c)) {
+            continue;
+        }
+        const real q = refinement_indicator(c,cur);
+        if (q > 1 && c->level < Params::maxGridRefinementLevel && is_refinable(c)) {
+            c->refine_it = true;
+            flagged.push_back(c);
+        } else if (q < Params::adaptiveRecoarsenFraction && c->parent != 0) {
+            c->recoarsen_it = true;
+        }
+    }
+    // Refine coarser face neighbours too (the list grows while it is scanned)
+    for (unsigned int f=0; f<flagged.size(); f++) {
+        const TCellPtr c = flagged[f];
+        for (int d=0; d<3 && c->refine_it; d++) for (int dir=0; dir<2; dir++) {
+                const TCellPtr n = c->neighbour[d][dir];
+                if (n->level >= c->level || n->refine_it) {
+                    continue;
+                }
+                if (!is_refinable(n)) {
+                    c->refine_it = false;
+                    break;
+                }
+                n->refine_it = true;
+                n->recoarsen_it = false;
+                flagged.push_back(n);
+            }
+    }
+    // Refine the coarsest cells first
+    stable_sort(flagged.begin(),flagged.end(),SweepCoarser());
+    int maxlevel = Params::currentGridRefinementLevel;
+    for (unsigned int f=0; f<flagged.size(); f++) {
+        const TCellPtr c = flagged[f];
+        if (c->refine_it && c->refine(*this)) {
+            nrefined++;
+            maxlevel = max2(maxlevel, c->level+1);
+        }
+        c->refine_it = false;
+    }
+    // Parents whose children are all unrefined leaves to be recoarsened
+    vector<TCellPtr> parents;
+    for (l=0; l<nleaves; l++) {
+        const TCellPtr c = leaves[l];
+        if (!c->recoarsen_it || c->parent == 0 || c->flatind != 0) {
+            continue;
+        }
+        const TCellPtr p = c->parent;
+        bool all = true;
+        for (int ch=0; ch<8 && all; ch++) {
+            all = p->child[0][0][ch]->recoarsen_it && !p->child[0][0][ch]->haschildren;
+        }
+        if (all && is_refinable(p) && !(Params::gridRefinementFunction.isDefined() && p->size > Params::gridRefinementFunction.getValue(p->centroid))) {
+            parents.push_back(p);
+        }
+    }
+    for (l=0; l<nleaves; l++) {
+        leaves[l]->recoarsen_it = false;
+    }
+    // recoarsen() fails if a neighbour would become two levels finer
+    for (unsigned int p=0; p<parents.size(); p++) {
+        if (parents[p]->recoarsen(*this)) {
+            nrecoarsened++;
+        }
+    }
+    if (nrefined + nrecoarsened == 0) {
+        return;
+    }
+    Params::currentGridRefinementLevel = maxlevel;
+    build_sweep_arrays();
+    cursor.reset();
+    // The nodes next to the adapted cells may still point to replaced cells
+    // (also those of finer cells across an edge), update all of them. The
+    // nodes on the ghost cell boundary are skipped, findcell() does not find
+    // ghost cells and refinable cells never touch them.
+    const gridreal finest = 1.0/(invbgdx*(1 << maxlevel));
+    const gridreal margin = bgdx + 0.5*finest;
+    const gridreal lo[3] = {x_1 + margin, y_1 + margin, z_1 + margin};
+    const gridreal hi[3] = {x_1 + nx*bgdx - margin, y_1 + ny*bgdx - margin, z_1 + nz*bgdx - margin};
+    for (int colour=0; colour<8; colour++) {
+        const int n = sweep_nodes[colour].size();
+        for (int m=0; m<n; m++) {
+            const TNodePtr nod = sweep_nodes[colour][m];
+            bool inside = true;
+            for (int d=0; d<3; d++) {
+                inside = inside && nod->centroid[d] > lo[d] && nod->centroid[d] < hi[d];
+            }
+            if (inside) {
+                nod->update_cell_pointers(finest,*this);
+            }
+        }
+    }
+    moment_table_valid = false;
+    subcycle_prev.clear();
+    rebuild_PDF();
+    if (averages) {
+        remap_average_table(avecells,avefaces);
+    }
 }
 
 // =================================================================================
@@ -2847,18 +3177,198 @@ void Tgrid::Tcell::enum_children_recursive()
     }
 }
 
+//! Collect child cells in the order they are written by writeMHD_children_recursive
+void Tgrid::Tcell::hc_order_children_recursive(vector<const Tcell*>& order) const
+{
+    if (haschildren) {
+        int dirx,diry,dirz;
+        for (dirz=0; dirz<2; dirz++) for (diry=0; diry<2; diry++) for (dirx=0; dirx<2; dirx++)
+                    order.push_back(child[dirx][diry][dirz]);
+        for (dirz=0; dirz<2; dirz++) for (diry=0; diry<2; diry++) for (dirx=0; dirx<2; dirx++)
+                    child[dirx][diry][dirz]->hc_order_children_recursive(order);
+    }
+}
+
 //! Calculate fluid parameters in a cell
 void Tgrid::Tcell::cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, vector<int> popId)
 {
-    n = plist.calc_mass(popId)/(Params::pops[popId[0]]->m*size*size*size);
+    n = moment_mass(popId)/(Params::pops[popId[0]]->m*size*size*size);
     vx = vy = vz = 0;
-    plist.calc_avev(vx, vy, vz, popId);
-    const real T = 0.5*plist.calc_avemv2(vx, vy, vz, popId);
+    moment_avev(vx, vy, vz, popId);
+    const real T = 0.5*moment_avemv2(vx, vy, vz, popId);
     P = n*T;
 }
 
+/** \brief Compute the particle moments of all populations in all leaf cells
+ *
+ * One pass over the particles of each leaf cell fills moment_table. The
+ * HC and VTK writers and the detectors then combine the moments of any set
+ * of populations from the table (Tcell::moment_*) instead of passing the
+ * particles again for every file and quantity. The table must be freed
+ * with free_moments() before the particles move.
+ */
+void Tgrid::compute_moments()
+{
+    const int npops = Params::pops.size();
+    if (npops <= 0) {
+        return;
+    }
+    vector<TCellPtr> leaves;
+    collect_leaves(leaves);
+    const int nleaves = leaves.size();
+    moment_table.resize(static_cast<size_t>(nleaves)*npops);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+    for (int l=0; l<nleaves; l++) {
+        leaves[l]->moments = &moment_table[static_cast<size_t>(l)*npops];
+        leaves[l]->plist.calc_moments(leaves[l]->moments, npops);
+    }
+    // Combine the moments of the particles of all MPI ranks
+    Decomposition::sumMoments(&moment_table[0], moment_table.size());
+    moment_table_valid = true;
+}
+
+//! Release the moment table, Tcell::moment_* go back to passing the particles
+void Tgrid::free_moments()
+{
+    moment_table_valid = false;
+    vector<TParticleMoments>().swap(moment_table);
+}
+
+//! Number of populations selected by popId (all if popId is empty)
+static inline int selectedPops(const vector<int>& popId)
+{
+    return popId.empty() ? static_cast<int>(Params::pops.size()) : static_cast<int>(popId.size());
+}
+
+//! Population ID of the i'th population selected by popId
+static inline int selectedPop(const vector<int>& popId, int i)
+{
+    return popId.empty() ? i : popId[i];
+}
+
+//! Sum(w) over pops listed in popId (all if empty), like TParticleList::calc_weight
+real Tgrid::Tcell::moment_weight(const vector<int>& popId) const
+{
+    if (moment_table_valid == false || haschildren) {
+        return plist.calc_weight(popId);
+    }
+    real result = 0;
+    const int n = selectedPops(popId);
+    for (int i=0; i<n; i++) {
+        result += moments[selectedPop(popId,i)].w;
+    }
+    return result;
+}
+
+//! Sum(w*m) over pops listed in popId (all if empty), like TParticleList::calc_mass
+real Tgrid::Tcell::moment_mass(const vector<int>& popId) const
+{
+    if (moment_table_valid == false || haschildren) {
+        return plist.calc_mass(popId);
+    }
+    real result = 0;
+    const int n = selectedPops(popId);
+    for (int i=0; i<n; i++) {
+        const int p = selectedPop(popId,i);
+        result += moments[p].w*real(Params::pops[p]->m);
+    }
+    return result;
+}
+
+//! Sum(w*q) over pops listed in popId (all if empty), like TParticleList::calc_charge
+real Tgrid::Tcell::moment_charge(const vector<int>& popId) const
+{
+    if (moment_table_valid == false || haschildren) {
+        return plist.calc_charge(popId);
+    }
+    real result = 0;
+    const int n = selectedPops(popId);
+    for (int i=0; i<n; i++) {
+        const int p = selectedPop(popId,i);
+        result += moments[p].w*real(Params::pops[p]->q);
+    }
+    return result;
+}
+
+//! Sum(w*v)/sum(w) over pops listed in popId (all if empty), like TParticleList::calc_avev
+void Tgrid::Tcell::moment_avev(real& vx0, real& vy0, real& vz0, const vector<int>& popId) const
+{
+    if (moment_table_valid == false || haschildren) {
+        plist.calc_avev(vx0,vy0,vz0,popId);
+        return;
+    }
+    vx0 = vy0 = vz0 = 0;
+    real wsum = 0;
+    const int n = selectedPops(popId);
+    for (int i=0; i<n; i++) {
+        const TParticleMoments& m = moments[selectedPop(popId,i)];
+        vx0 += m.w*m.v[0];
+        vy0 += m.w*m.v[1];
+        vz0 += m.w*m.v[2];
+        wsum += m.w;
+    }
+    if (wsum == 0) {
+        return;
+    }
+    const real invwsum = 1.0/wsum;
+    vx0 *= invwsum;
+    vy0 *= invwsum;
+    vz0 *= invwsum;
+}
+
+//! U = sum(m*w*v)/sum(m*w) over pops listed in popId (all if empty), like TParticleList::calc_U
+void Tgrid::Tcell::moment_U(real& Ux0, real& Uy0, real& Uz0, const vector<int>& popId) const
+{
+    if (moment_table_valid == false || haschildren) {
+        plist.calc_U(Ux0,Uy0,Uz0,popId);
+        return;
+    }
+    Ux0 = Uy0 = Uz0 = 0;
+    real wsum = 0;
+    const int n = selectedPops(popId);
+    for (int i=0; i<n; i++) {
+        const int p = selectedPop(popId,i);
+        const TParticleMoments& m = moments[p];
+        const real wfac = m.w*real(Params::pops[p]->m);
+        Ux0 += wfac*m.v[0];
+        Uy0 += wfac*m.v[1];
+        Uz0 += wfac*m.v[2];
+        wsum += wfac;
+    }
+    if (wsum == 0) {
+        return;
+    }
+    const real invwsum = 1.0/wsum;
+    Ux0 *= invwsum;
+    Uy0 *= invwsum;
+    Uz0 *= invwsum;
+}
+
+//! Sum(w*m*(v-v0)^2)/sum(w) over pops listed in popId (all if empty), like TParticleList::calc_avemv2
+real Tgrid::Tcell::moment_avemv2(real vx0, real vy0, real vz0, const vector<int>& popId) const
+{
+    if (moment_table_valid == false || haschildren) {
+        return plist.calc_avemv2(vx0,vy0,vz0,popId);
+    }
+    real mv2 = 0, denom = 0;
+    const int n = selectedPops(popId);
+    for (int i=0; i<n; i++) {
+        const int p = selectedPop(popId,i);
+        const TParticleMoments& m = moments[p];
+        // Central moment of the population plus its drift relative to v0
+        mv2 += real(Params::pops[p]->m)*(m.trace() + m.w*(sqr(m.v[0]-vx0) + sqr(m.v[1]-vy0) + sqr(m.v[2]-vz0)));
+        denom += m.w;
+    }
+    if (denom == 0) {
+        return 0;
+    }
+    return mv2/denom;
+}
+
 //! Write population and plasma quantities (recursive)
-void Tgrid::Tcell::writeMHD_children_recursive(ostream& o,const int filetype,vector<int> popId) const
+void Tgrid::Tcell::writeMHD_children_recursive(ostream& o,const int filetype,const vector<int>& popId) const
 {
     if (haschildren) {
         int dirx,diry,dirz;
@@ -2870,11 +3380,8 @@ void Tgrid::Tcell::writeMHD_children_recursive(ostream& o,const int filetype,vec
 }
 
 //! Write population and plasma quantities
-void Tgrid::Tcell::writeMHD(ostream& o,const int filetype,vector<int> popId) const
+void Tgrid::Tcell::writeMHD(ostream& o,const int filetype,const vector<int>& popId) const
 {
-    if (filetype == 1 || filetype == 2) {
-        popId.clear();
-    }
     if (haschildren) {
         if (hcFileAsciiFormat == false) {
             o.put('N');
@@ -2890,168 +3397,157 @@ void Tgrid::Tcell::writeMHD(ostream& o,const int filetype,vector<int> popId) con
         } else {
             o << "L " << (parent ? parent->running_index : -1) << ' ';
         }
-        real rho = 0;
-        real rhovx = 0;
-        real rhovy = 0;
-        real rhovz = 0;
-        real U1 = 0;
-        real B1x = 0;
-        real B1y = 0;
-        real B1z = 0;
-        real B0x = 0;
-        real B0y = 0;
-        real B0z = 0;
-        real n=0,vx=0,vy=0,vz=0;
+        real x[N_MHD_VALUES];
+        MHD_values(filetype,popId,x);
+        if (hcFileAsciiFormat == false) {
+            float xf[N_MHD_VALUES];
+            for (int i=0; i<N_MHD_VALUES; i++) {
+                xf[i] = x[i];
+            }
+            ByteConversion(sizeof(float),(unsigned char*)xf,N_MHD_VALUES);
+            WriteFloatsToFile(o,xf,N_MHD_VALUES);
+        } else {
+            for (int i=0; i<N_MHD_VALUES; i++) {
+                o << x[i] << ' ';
+            }
+            o << '\n';
+        }
+    }
+}
+
+//! Population and plasma quantities of a leaf cell in the order of the MHD hc-file
+void Tgrid::Tcell::MHD_values(const int filetype,const vector<int>& popIdArg,real x[N_MHD_VALUES]) const
+{
+    // Average and plasma files are calculated over all populations
+    static const vector<int> allPops;
+    const vector<int>& popId = (filetype == 1 || filetype == 2) ? allPops : popIdArg;
+    real rho = 0;
+    real rhovx = 0;
+    real rhovy = 0;
+    real rhovz = 0;
+    real U1 = 0;
+    real B1x = 0;
+    real B1y = 0;
+    real B1z = 0;
+    real B0x = 0;
+    real B0y = 0;
+    real B0z = 0;
+    real n=0,vx=0,vy=0,vz=0;
 #ifndef USE_SPHERICAL_COORDINATE_SYSTEM
-        gridreal dV = size*size*size;
+    gridreal dV = size*size*size;
 #else
-        gridreal dV = sph_dV;
-        if (dV<0.0) dV = -dV;  // This because r = x and x can be (and usually is!) negative
+    gridreal dV = sph_dV;
+    if (dV<0.0) dV = -dV;  // This because r = x and x can be (and usually is!) negative
 #endif
-        if(filetype == 0) { // Population(s)
-            // This gives correct mass density, but hcvis may assume that
-            // m = mp and then, e.g., for O+ populations n comes out wrong
-            // in hcvis. The volume weighting (accumulation) is not used!
-            rho = plist.calc_mass(popId)/dV;
-            // This gives correct number density if all the populations
-            // to be saved in this hc-file have the same particle mass
-            // (as should be usually the case)!
-            n = rho/Params::pops[popId[0]]->m;
+    if(filetype == 0) { // Population(s)
+        // This gives correct mass density, but hcvis may assume that
+        // m = mp and then, e.g., for O+ populations n comes out wrong
+        // in hcvis. The volume weighting (accumulation) is not used!
+        rho = moment_mass(popId)/dV;
+        // This gives correct number density if all the populations
+        // to be saved in this hc-file have the same particle mass
+        // (as should be usually the case)!
+        n = rho/Params::pops[popId[0]]->m;
 #ifndef USE_SPHERICAL_COORDINATE_SYSTEM
-            // This is B after the propagations in this timestep
-            B1x = 0.5*(faceave(0,0,FACEDATA_B) + faceave(0,1,FACEDATA_B));
-            B1y = 0.5*(faceave(1,0,FACEDATA_B) + faceave(1,1,FACEDATA_B));
-            B1z = 0.5*(faceave(2,0,FACEDATA_B) + faceave(2,1,FACEDATA_B));
+        // This is B after the propagations in this timestep
+        B1x = 0.5*(faceave(0,0,FACEDATA_B) + faceave(0,1,FACEDATA_B));
+        B1y = 0.5*(faceave(1,0,FACEDATA_B) + faceave(1,1,FACEDATA_B));
+        B1z = 0.5*(faceave(2,0,FACEDATA_B) + faceave(2,1,FACEDATA_B));
 #else
-            B1x = celldata[CELLDATA_B][0];
-            B1y = celldata[CELLDATA_B][1];
-            B1z = celldata[CELLDATA_B][2];
+        B1x = celldata[CELLDATA_B][0];
+        B1y = celldata[CELLDATA_B][1];
+        B1z = celldata[CELLDATA_B][2];
 #endif
-            // Average velocity among the selected populations in the cell.
-            // The volume weighting (accumulation) is not used!
-            plist.calc_avev(vx,vy,vz,popId);
-        } else if(filetype == 1) { // Average
-            // Use proton mass here => rho is generally incorrect, but
-            // hcvis can display correct number density for temporal
-            // average files. Accumulated value!
-            if (Params::bg_in_avehcfile==false) {
-                rho = Params::m_p * ave_nc;
-            } else {
-                rho = Params::m_p * (ave_nc + rho_q_bg/Params::e);
-            }
-            // This is correct temporal average number density. It has little
-            // use, since temporal average files cannot have correct U. To get
-            // correct U, something like CELLDATA_AVE_VQ, CELLDATA_AVE_T etc.
-            // would be needed. Accumulated value!
-            n = ave_nc;
-            // B is correct in temporal average hc-file
-            B1x = 0.5*(faceave(0,0,FACEDATA_AVEB) + faceave(0,1,FACEDATA_AVEB));
-            B1y = 0.5*(faceave(1,0,FACEDATA_AVEB) + faceave(1,1,FACEDATA_AVEB));
-            B1z = 0.5*(faceave(2,0,FACEDATA_AVEB) + faceave(2,1,FACEDATA_AVEB));
-            // At least n (remember to use proton mass for mp in hcvis)
-            // and B come out correct in hcvis when displaying temporal
-            // average hc-files.
-            vx = celldata[CELLDATA_Ji][0]/rho_q;
-            vy = celldata[CELLDATA_Ji][1]/rho_q;
-            vz = celldata[CELLDATA_Ji][2]/rho_q;
-        } else if(filetype == 2) { // Plasma
-            // Total mass density in the cell.
-            // The volume weighting (accumulation) is not used!
-            rho = plist.calc_mass()/dV;
-            // Total particle number density in the cell.
-            // The volume weighting (accumulation) is not used!
-            // Accumulated nc could be used but then rho would
-            // not consistent with this value.
-            n = plist.calc_weight()/dV;
+        // Average velocity among the selected populations in the cell.
+        // The volume weighting (accumulation) is not used!
+        moment_avev(vx,vy,vz,popId);
+    } else if(filetype == 1) { // Average
+        // Use proton mass here => rho is generally incorrect, but
+        // hcvis can display correct number density for temporal
+        // average files. Accumulated value!
+        if (Params::bg_in_avehcfile==false) {
+            rho = Params::m_p * ave_n();
+        } else {
+            rho = Params::m_p * (ave_n() + rho_q_bg/Params::e);
+        }
+        // This is correct temporal average number density. It has little
+        // use, since temporal average files cannot have correct U. To get
+        // correct U, something like CELLDATA_AVE_VQ, CELLDATA_AVE_T etc.
+        // would be needed. Accumulated value!
+        n = ave_n();
+        // B is correct in temporal average hc-file
+        B1x = 0.5*(faceave(0,0,FACEDATA_AVEB) + faceave(0,1,FACEDATA_AVEB));
+        B1y = 0.5*(faceave(1,0,FACEDATA_AVEB) + faceave(1,1,FACEDATA_AVEB));
+        B1z = 0.5*(faceave(2,0,FACEDATA_AVEB) + faceave(2,1,FACEDATA_AVEB));
+        // At least n (remember to use proton mass for mp in hcvis)
+        // and B come out correct in hcvis when displaying temporal
+        // average hc-files.
+        vx = celldata[CELLDATA_Ji][0]/rho_q;
+        vy = celldata[CELLDATA_Ji][1]/rho_q;
+        vz = celldata[CELLDATA_Ji][2]/rho_q;
+    } else if(filetype == 2) { // Plasma
+        // Total mass density in the cell.
+        // The volume weighting (accumulation) is not used!
+        rho = moment_mass(popId)/dV;
+        // Total particle number density in the cell.
+        // The volume weighting (accumulation) is not used!
+        // Accumulated nc could be used but then rho would
+        // not consistent with this value.
+        n = moment_weight(popId)/dV;
 #ifndef USE_SPHERICAL_COORDINATE_SYSTEM
-            B1x = 0.5*(faceave(0,0,FACEDATA_B) + faceave(0,1,FACEDATA_B));
-            B1y = 0.5*(faceave(1,0,FACEDATA_B) + faceave(1,1,FACEDATA_B));
-            B1z = 0.5*(faceave(2,0,FACEDATA_B) + faceave(2,1,FACEDATA_B));
+        B1x = 0.5*(faceave(0,0,FACEDATA_B) + faceave(0,1,FACEDATA_B));
+        B1y = 0.5*(faceave(1,0,FACEDATA_B) + faceave(1,1,FACEDATA_B));
+        B1z = 0.5*(faceave(2,0,FACEDATA_B) + faceave(2,1,FACEDATA_B));
 #else
-            gridreal dS0[3] = {sph_dS[0], sph_dS[1], sph_dS[2]};
-            gridreal dS1[3] = {sph_dS_next[0], sph_dS_next[1], sph_dS_next[2]};
-            gridreal dSc[3] = {sph_dS_centroid[0], sph_dS_centroid[1], sph_dS_centroid[2]};
-            B1x = 0.5*(faceave(0,0,FACEDATA_B)*dS0[0] + faceave(0,1,FACEDATA_B)*dS1[0])/dSc[0];
-            B1y = 0.5*(faceave(1,0,FACEDATA_B)*dS0[1] + faceave(1,1,FACEDATA_B)*dS1[1])/dSc[1];
-            B1z = 0.5*(faceave(2,0,FACEDATA_B)*dS0[2] + faceave(2,1,FACEDATA_B)*dS1[2])/dSc[2];
+        gridreal dS0[3] = {sph_dS[0], sph_dS[1], sph_dS[2]};
+        gridreal dS1[3] = {sph_dS_next[0], sph_dS_next[1], sph_dS_next[2]};
+        gridreal dSc[3] = {sph_dS_centroid[0], sph_dS_centroid[1], sph_dS_centroid[2]};
+        B1x = 0.5*(faceave(0,0,FACEDATA_B)*dS0[0] + faceave(0,1,FACEDATA_B)*dS1[0])/dSc[0];
+        B1y = 0.5*(faceave(1,0,FACEDATA_B)*dS0[1] + faceave(1,1,FACEDATA_B)*dS1[1])/dSc[1];
+        B1z = 0.5*(faceave(2,0,FACEDATA_B)*dS0[2] + faceave(2,1,FACEDATA_B)*dS1[2])/dSc[2];
 #endif
-            // Average (MHD single fluid) velocity in the cell.
-            // The volume weighting (accumulation) is not used!
-            plist.calc_U(vx,vy,vz);
-        }
+        // Average (MHD single fluid) velocity in the cell.
+        // The volume weighting (accumulation) is not used!
+        moment_U(vx,vy,vz,popId);
+    }
 #ifdef SAVE_POPULATION_AVERAGES
-        else if(filetype == 3) { // Average population(s)
-            for(unsigned int i=0; i< popId.size(); i++) {
-                int j = popId[i];
-                n += pop_ave_n[j];
-                vx += pop_ave_n[j]*pop_ave_vx[j];
-                vy += pop_ave_n[j]*pop_ave_vy[j];
-                vz += pop_ave_n[j]*pop_ave_vz[j];
-            }
-            real inv_n=0;
-            if(n>0) {
-                inv_n = 1.0/n;
-            }
-            vx *= inv_n;
-            vy *= inv_n;
-            vz *= inv_n;
-            rho = n*Params::pops[popId[0]]->m;
-            B1x = 0.5*(faceave(0,0,FACEDATA_AVEB) + faceave(0,1,FACEDATA_AVEB));
-            B1y = 0.5*(faceave(1,0,FACEDATA_AVEB) + faceave(1,1,FACEDATA_AVEB));
-            B1z = 0.5*(faceave(2,0,FACEDATA_AVEB) + faceave(2,1,FACEDATA_AVEB));
-        }
+    else if(filetype == 3) { // Average population(s)
+        ave_population(popId,n,vx,vy,vz);
+        rho = n*Params::pops[popId[0]]->m;
+        B1x = 0.5*(faceave(0,0,FACEDATA_AVEB) + faceave(0,1,FACEDATA_AVEB));
+        B1y = 0.5*(faceave(1,0,FACEDATA_AVEB) + faceave(1,1,FACEDATA_AVEB));
+        B1z = 0.5*(faceave(2,0,FACEDATA_AVEB) + faceave(2,1,FACEDATA_AVEB));
+    }
 #endif
-        else {
-            ERRORMSG("internal error");
-        }
-        // Particle momentum density
-        rhovx = rho*vx;
-        rhovy = rho*vy;
-        rhovz = rho*vz;
-        const real T = 0.5*plist.calc_avemv2(vx,vy,vz,popId);
-        const real P = n*T;
-        // Total energy without constant magnetic field
-        U1 = P/(Params::gamma-1) + 0.5*rho*( sqr(vx) + sqr(vy) + sqr(vz) ) + ( sqr(B1x) + sqr(B1y) + sqr(B1z) )/(2*Params::mu_0);
-        // Constant magnetic field
-        real B0[3] = {0.0, 0.0, 0.0};
-        fastreal r[3] = {centroid[0], centroid[1], centroid[2]};
-        addConstantMagneticField(r, B0);
-        B0x = B0[0];
-        B0y = B0[1];
-        B0z = B0[2];
-        if (hcFileAsciiFormat == false) {
-            const int n = 11;
-            float xf[n];
-            xf[0] = rho;
-            xf[1] = rhovx;
-            xf[2] = rhovy;
-            xf[3] = rhovz;
-            xf[4] = U1;
-            xf[5] = B1x;
-            xf[6] = B1y;
-            xf[7] = B1z;
-            xf[8] = B0x;
-            xf[9] = B0y;
-            xf[10] = B0z;
-            ByteConversion(sizeof(float),(unsigned char*)xf,n);
-            WriteFloatsToFile(o,xf,n);
-        } else {
-            o << rho << ' '
-              << rho*vx << ' '
-              << rho*vy << ' '
-              << rho*vz << ' '
-              << U1 << ' '
-              << B1x << ' '
-              << B1y << ' '
-              << B1z << ' '
-              << B0x << ' '
-              << B0y << ' '
-              << B0z << ' ';
-        }
-        if (hcFileAsciiFormat == true) {
-            o << '\n';
-        }
+    else {
+        ERRORMSG("internal error");
     }
+    // Particle momentum density
+    rhovx = rho*vx;
+    rhovy = rho*vy;
+    rhovz = rho*vz;
+    const real T = 0.5*moment_avemv2(vx,vy,vz,popId);
+    const real P = n*T;
+    // Total energy without constant magnetic field
+    U1 = P/(Params::gamma-1) + 0.5*rho*( sqr(vx) + sqr(vy) + sqr(vz) ) + ( sqr(B1x) + sqr(B1y) + sqr(B1z) )/(2*Params::mu_0);
+    // Constant magnetic field
+    real B0[3] = {0.0, 0.0, 0.0};
+    fastreal r[3] = {centroid[0], centroid[1], centroid[2]};
+    addConstantMagneticField(r, B0);
+    B0x = B0[0];
+    B0y = B0[1];
+    B0z = B0[2];
+x[0] = rho;
+    x[1] = rhovx;
+    x[2] = rhovy;
+    x[3] = rhovz;
+    x[4] = U1;
+    x[5] = B1x;
+    x[6] = B1y;
+    x[7] = B1z;
+    x[8] = B0x;
+    x[9] = B0y;
+    x[10] = B0z;
 }
 
 //! Write debug quantities (recursive)
@@ -3224,21 +3720,14 @@ void Tgrid::Tcell::writeSPECTRA(ostream& o,vector<int> popId) const
             const int n = Params::spectraNbins;
             float xf[n];
             for(int i=0; i<n; i++) {
-                xf[i] = 0.0;
-                for(unsigned int j=0; j<popId.size(); ++j) {
-                    xf[i] += spectra[popId[j]][i];
-                }
+                xf[i] = ave_spectrum(popId,i);
             }
             ByteConversion(sizeof(float),(unsigned char*)xf,n);
             WriteFloatsToFile(o,xf,n);
         } else {
             const int n = Params::spectraNbins;
             for(int i=0; i<n; i++) {
-                real sum = 0.0;
-                for(unsigned int j=0; j<popId.size(); ++j) {
-                    sum += spectra[popId[j]][i];
-                }
-                o << sum << ' ';
+                o << ave_spectrum(popId,i) << ' ';
             }
         }
         if (hcFileAsciiFormat == true) {
@@ -3356,22 +3845,205 @@ void Tgrid::Tcell::particles_write_recursive()
 
 #endif
 
-//! Write population and plasma hc-file
-bool Tgrid::hcwrite_MHD(const char *fn,string ascbin,string hctype,vector<int> popId)
+//! Write the cells of a binary or ascii population and plasma hc-file
+void Tgrid::write_MHD_cells(ostream& o,const int filetype,const vector<int>& popId)
 {
-    if(ascbin.compare("binary") == 0) {
-        hcFileAsciiFormat = false;
-    } else if(ascbin.compare("ascii") == 0) {
-        hcFileAsciiFormat = true;
-    }
-    // File types: 0 = populations, 1 = average, 2 = plasma
-    int filetype;
-    if(hctype.compare("populations") == 0) {
-        filetype = 0;
-    } else if(hctype.compare("average") == 0) {
-        filetype = 1;
-    } else if(hctype.compare("plasma") == 0) {
-        filetype = 2;
+    int c;
+    const int Nbase = nx*ny*nz;
+    for (c=0; c<Nbase; c++) {
+        if (cells[c]->haschildren) {
+            if (hcFileAsciiFormat == false) {
+                o.put('N');
+                WriteInt(o,-1);
+                WriteInt(o,cells[c]->child[0][0][0]->running_index);
+            } else {
+                o << "N -1 " << cells[c]->child[0][0][0]->running_index << "\n";
+            }
+        } else {
+            cells[c]->writeMHD(o,filetype,popId);
+        }
+    }
+    for (c=0; c<Nbase; c++) {
+        if (cells[c]->haschildren) cells[c]->writeMHD_children_recursive(o,filetype,popId);
+    }
+    int i,j,k;
+    ForAll(i,j,k) {
+        // celltype=0: interior, 1: ghost, 2:dead
+        int celltype = (i==0 || i==nx-1) + (j==0 || j==ny-1) + (k==0 || k==nz-1);
+        if (celltype > 2) celltype = 2;
+        c = flatindex(i,j,k);
+        if (hcFileAsciiFormat == false) {
+            o.put(EncodeCellInfo(celltype));
+            o.put((unsigned char)'\0');
+        } else {
+            o << celltype << " 1 1 0\n";
+        }
+    }
+    ForAll(i,j,k) {
+        c = flatindex(i,j,k);
+        if (cells[c]->haschildren) {
+            const int n = cells[c]->Ncells_recursive() - 1;
+            int cnt;
+            if (hcFileAsciiFormat == false) {
+                const unsigned char ch = EncodeCellInfo(0);
+                for (cnt=0; cnt<n; cnt++) {
+                    o.put(ch);
+                    o.put((unsigned char)'\0');
+                }
+            } else {
+                for (cnt=0; cnt<n; cnt++) o << "0 1 1 0\n";
+            }
+        }
+    }
+}
+
+#ifdef USE_COMPRESSED_HC
+
+static const int HC_CHUNK_CELLS = 65536; //!< Cells per compressed block in compressed hc-files
+static const int HC_COMPRESSED_STREAMS = 4 + Tgrid::N_MHD_VALUES; //!< Flags, parents, first children, cell infos and values
+
+//! Store a 32-bit integer in the byte order of WriteInt
+inline void PutInt32(unsigned char *p, int x)
+{
+    int i;
+    for (i=0; i<4; i++) p[i] = (unsigned char)((x >> 8*i) & 0xFF);
+}
+
+//! Write a big-endian 64-bit unsigned integer
+inline void WriteUint64(ostream& o, uint64_t x)
+{
+    int i;
+    for (i=7; i>=0; i--) o.put((unsigned char)((x >> 8*i) & 0xFF));
+}
+
+/** \brief Shuffle and compress one block of n items of itemsize bytes
+ *
+ * The k'th bytes of all items are stored together before deflating, which
+ * puts the slowly varying sign and exponent bytes of the floats next to
+ * each other. Returns false if zlib fails.
+ */
+static bool compressBlock(const unsigned char *src, int n, int itemsize, vector<unsigned char>& out)
+{
+    vector<unsigned char> shuffled(size_t(n)*itemsize);
+    int i,b;
+    for (i=0; i<n; i++) for (b=0; b<itemsize; b++) shuffled[size_t(b)*n + i] = src[size_t(i)*itemsize + b];
+    uLongf len = compressBound(shuffled.size());
+    out.resize(len);
+    if (compress2(&out[0], &len, &shuffled[0], shuffled.size(), Z_BEST_SPEED) != Z_OK) {
+        out.clear();
+        return false;
+    }
+    out.resize(len);
+    return true;
+}
+
+/** \brief Write the cells of a compressed population and plasma hc-file
+ *
+ * The cells are in the same order as in a binary hc-file, but each cell
+ * field is stored as a separate stream: flag bytes ('L' or 'N'), parent
+ * indices, first child indices (4-byte integers, -1 = none), cell info
+ * bytes (2 per cell) and the N_MHD_VALUES big-endian floats (0 in non-leaf
+ * cells). The streams are split into blocks of chunkcells cells, which are
+ * compressed independently. After the header follows an index of
+ * nstreams*nchunks big-endian 64-bit (offset, size) pairs, entry
+ * s*nchunks+k for block k of stream s, and the offsets count from the end
+ * of the index. A reader can thus seek to and inflate any block alone.
+ */
+bool Tgrid::write_MHD_cells_compressed(ostream& o,const int filetype,const vector<int>& popId)
+{
+    int c,s,a;
+    const int Nbase = nx*ny*nz;
+    vector<const Tcell*> order(cells,cells+Nbase);
+    for (c=0; c<Nbase; c++) {
+        if (cells[c]->haschildren) cells[c]->hc_order_children_recursive(order);
+    }
+    const int ncells = order.size();
+    const int nchunks = (ncells + HC_CHUNK_CELLS - 1)/HC_CHUNK_CELLS;
+    int itemsize[HC_COMPRESSED_STREAMS];
+    itemsize[0] = 1;
+    itemsize[1] = itemsize[2] = 4;
+    itemsize[3] = 2;
+    for (s=4; s<HC_COMPRESSED_STREAMS; s++) itemsize[s] = sizeof(float);
+    vector< vector<unsigned char> > streams(HC_COMPRESSED_STREAMS);
+    for (s=0; s<HC_COMPRESSED_STREAMS; s++) streams[s].resize(size_t(ncells)*itemsize[s]);
+    for (c=0; c<ncells; c++) {
+        const Tcell *cell = order[c];
+        streams[0][c] = cell->haschildren ? 'N' : 'L';
+        PutInt32(&streams[1][4*size_t(c)], cell->parent ? cell->parent->running_index : -1);
+        PutInt32(&streams[2][4*size_t(c)], cell->haschildren ? cell->child[0][0][0]->running_index : -1);
+        // celltype=0: interior, 1: ghost, 2:dead (children are interior)
+        int celltype = 0;
+        if (c < Nbase) {
+            int i,j,k;
+            decompose(c,i,j,k);
+            celltype = (i==0 || i==nx-1) + (j==0 || j==ny-1) + (k==0 || k==nz-1);
+            if (celltype > 2) celltype = 2;
+        }
+        streams[3][2*size_t(c)] = EncodeCellInfo(celltype);
+        streams[3][2*size_t(c)+1] = '\0';
+        float xf[N_MHD_VALUES];
+        if (cell->haschildren) {
+            for (a=0; a<N_MHD_VALUES; a++) xf[a] = 0.0;
+        } else {
+            real x[N_MHD_VALUES];
+            cell->MHD_values(filetype,popId,x);
+            for (a=0; a<N_MHD_VALUES; a++) xf[a] = x[a];
+            ByteConversion(sizeof(float),(unsigned char*)xf,N_MHD_VALUES);
+        }
+        for (a=0; a<N_MHD_VALUES; a++) memcpy(&streams[4+a][sizeof(float)*size_t(c)],&xf[a],sizeof(float));
+    }
+    const int nblocks = HC_COMPRESSED_STREAMS*nchunks;
+    vector< vector<unsigned char> > blocks(nblocks);
+    int nfailed = 0;
+    int b;
+#ifdef USE_OPENMP
+    #pragma omp parallel for schedule(dynamic) reduction(+:nfailed)
+#endif
+    for (b=0; b<nblocks; b++) {
+        const int sb = b/nchunks;
+        const int first = (b % nchunks)*HC_CHUNK_CELLS;
+        const int n = min(HC_CHUNK_CELLS, ncells - first);
+        if (compressBlock(&streams[sb][size_t(first)*itemsize[sb]], n, itemsize[sb], blocks[b]) == false) nfailed++;
+    }
+    if (nfailed > 0) {
+        ERRORMSG("zlib compression failed");
+        return false;
+    }
+    uint64_t offset = 0;
+    for (b=0; b<nblocks; b++) {
+        WriteUint64(o,offset);
+        WriteUint64(o,blocks[b].size());
+        offset += blocks[b].size();
+    }
+    for (b=0; b<nblocks; b++) o.write((const char*)&blocks[b][0],blocks[b].size());
+    return true;
+}
+
+#endif
+
+//! Write population and plasma hc-file
+bool Tgrid::hcwrite_MHD(const char *fn,const string& ascbin,const string& hctype,const vector<int>& popId)
+{
+    bool compressed = false;
+    if(ascbin.compare("binary") == 0) {
+        hcFileAsciiFormat = false;
+    } else if(ascbin.compare("ascii") == 0) {
+        hcFileAsciiFormat = true;
+    }
+#ifdef USE_COMPRESSED_HC
+    else if(ascbin.compare("compressed") == 0) {
+        hcFileAsciiFormat = false;
+        compressed = true;
+    }
+#endif
+    // File types: 0 = populations, 1 = average, 2 = plasma
+    int filetype;
+    if(hctype.compare("populations") == 0) {
+        filetype = 0;
+    } else if(hctype.compare("average") == 0) {
+        filetype = 1;
+    } else if(hctype.compare("plasma") == 0) {
+        filetype = 2;
     }
 #ifdef SAVE_POPULATION_AVERAGES
     else if(hctype.compare("populations_ave") == 0) {
@@ -3391,9 +4063,6 @@ bool Tgrid::hcwrite_MHD(const char *fn,string ascbin,string hctype,vector<int> p
         ERRORMSG("averaging turned off");
         return false;
     }
-    if(filetype == 1 || filetype == 2) {
-        popId.clear();
-    }
 #ifdef SAVE_POPULATION_AVERAGES
     if(filetype == 3 && Params::averaging == 0) {
         ERRORMSG("no averaging used");
@@ -3401,7 +4070,7 @@ bool Tgrid::hcwrite_MHD(const char *fn,string ascbin,string hctype,vector<int> p
     }
 #endif
     const int ncells = Ncells_with_ghosts();
-    ofstream o(fn);
+    OutputFile o(fn);
     if (!o.good()) {
         return false;
     }
@@ -3552,56 +4221,31 @@ bool Tgrid::hcwrite_MHD(const char *fn,string ascbin,string hctype,vector<int> p
     o << "type = hc\n";
     o << "ncells = " << ncells << "\n";
     o << "nablocks = 0\n";
-    o << "bytes_per_int = " << n_int_bytes << "\n";     // no meaning if ascii
+    o << "bytes_per_int = " << (compressed ? 4 : n_int_bytes) << "\n";     // no meaning if ascii
     o << "freelist1 = -1234567\n";
     o << "freelist2 = -1234567\n";
+#ifdef USE_COMPRESSED_HC
+    if (compressed == true) {
+        o << "compression = zlib\n";
+        o << "chunkcells = " << HC_CHUNK_CELLS << "\n";
+        o << "nchunks = " << (ncells + HC_CHUNK_CELLS - 1)/HC_CHUNK_CELLS << "\n";
+        o << "nstreams = " << HC_COMPRESSED_STREAMS << "\n";
+    }
+#endif
     o << "eoh\n";
     o.precision(oldprec);
-    for (c=0; c<Nbase; c++) {
-        if (cells[c]->haschildren) {
-            if (hcFileAsciiFormat == false) {
-                o.put('N');
-                WriteInt(o,-1);
-                WriteInt(o,cells[c]->child[0][0][0]->running_index);
-            } else {
-                o << "N -1 " << cells[c]->child[0][0][0]->running_index << "\n";
-            }
-        } else {
-            cells[c]->writeMHD(o,filetype,popId);
-        }
-    }
-    for (c=0; c<Nbase; c++) {
-        if (cells[c]->haschildren) cells[c]->writeMHD_children_recursive(o,filetype,popId);
-    }
-    int i,j,k;
-    ForAll(i,j,k) {
-        // celltype=0: interior, 1: ghost, 2:dead
-        int celltype = (i==0 || i==nx-1) + (j==0 || j==ny-1) + (k==0 || k==nz-1);
-        if (celltype > 2) celltype = 2;
-        c = flatindex(i,j,k);
-        if (hcFileAsciiFormat == false) {
-            o.put(EncodeCellInfo(celltype));
-            o.put((unsigned char)'\0');
-        } else {
-            o << celltype << " 1 1 0\n";
-        }
-    }
-    ForAll(i,j,k) {
-        c = flatindex(i,j,k);
-        if (cells[c]->haschildren) {
-            const int n = cells[c]->Ncells_recursive() - 1;
-            int cnt;
-            if (hcFileAsciiFormat == false) {
-                const unsigned char ch = EncodeCellInfo(0);
-                for (cnt=0; cnt<n; cnt++) {
-                    o.put(ch);
-                    o.put((unsigned char)'\0');
-                }
-            } else {
-                for (cnt=0; cnt<n; cnt++) o << "0 1 1 0\n";
-            }
+#ifdef USE_COMPRESSED_HC
+    if (compressed == true) {
+        if (write_MHD_cells_compressed(o,filetype,popId) == false) {
+            o.setstate(ios::failbit);
         }
+    } else {
+        write_MHD_cells(o,filetype,popId);
     }
+#else
+    write_MHD_cells(o,filetype,popId);
+#endif
+    o.close();
     if (o.good()) {
         mainlog << "Tgrid::hcwrite_MHD: Wrote \"" << fn << "\"\n";
     } else {
@@ -3614,7 +4258,7 @@ bool Tgrid::hcwrite_MHD(const char *fn,string ascbin,string hctype,vector<int> p
 bool Tgrid::hcwrite_DBUG(const char *fn)
 {
     const int ncells = Ncells_with_ghosts();
-    ofstream o(fn);
+    OutputFile o(fn);
     if (!o.good()) {
         return false;
     }
@@ -3727,6 +4371,7 @@ bool Tgrid::hcwrite_DBUG(const char *fn)
             }
         }
     }
+    o.close();
     if (o.good()) {
         mainlog << "Tgrid::hcwrite_DBUG: Wrote \"" << fn << "\"\n";
     } else {
@@ -3740,7 +4385,7 @@ bool Tgrid::hcwrite_EXTRA(string fileName, ScalarField* s, string hcHeaderStr)
 {
     const char* fn = fileName.c_str();
     const int ncells = Ncells_with_ghosts();
-    ofstream o(fn);
+    OutputFile o(fn);
     if (!o.good()) {
         return false;
     }
@@ -3833,6 +4478,7 @@ bool Tgrid::hcwrite_EXTRA(string fileName, ScalarField* s, string hcHeaderStr)
             }
         }
     }
+    o.close();
     if (o.good()) {
         mainlog << "Tgrid::hcwrite_EXTRA: Wrote \"" << fn << "\"\n";
     } else {
@@ -3846,13 +4492,14 @@ bool Tgrid::hcwrite_EXTRA(string fileName, ScalarField* s, string hcHeaderStr)
 //! Write spectra hc-file
 bool Tgrid::hcwrite_SPECTRA(const char *fn,string ascbin,vector<int> popId)
 {
-    if(ascbin.compare("binary") == 0) {
+    // Spectra files are not compressed
+    if(ascbin.compare("binary") == 0 || ascbin.compare("compressed") == 0) {
         hcFileAsciiFormat = false;
     } else if(ascbin.compare("ascii") == 0) {
         hcFileAsciiFormat = true;
     }
     const int ncells = Ncells_with_ghosts();
-    ofstream o(fn);
+    OutputFile o(fn);
     if (!o.good()) {
         return false;
     }
@@ -3976,6 +4623,7 @@ bool Tgrid::hcwrite_SPECTRA(const char *fn,string ascbin,vector<int> popId)
             }
         }
     }
+    o.close();
     if (o.good()) {
         mainlog << "Tgrid::hcwrite_SPECTRA: Wrote \"" << fn << "\"\n";
     } else {
@@ -3991,65 +4639,232 @@ bool Tgrid::hcwrite_SPECTRA(const char *fn,string ascbin,vector<int> popId)
 // =================================================================================
 
 
-//! (BREAKPOINTING) Write data
+/** \brief (BREAKPOINTING) Breakpoint file format
+ *
+ * A breakpoint file starts with the identifier BREAKPOINT_MAGIC followed by
+ * the format version, an endianness marker (0x01020304 as written by the
+ * writing machine), the breakpoint flags of the build, the sizes of the
+ * floating point types and the base grid and population counts. After the
+ * header come, in this order:
+ * (1) time and time step counter, random number generator state
+ *     (including the gaussrnd cache),
+ * (2) population identifiers,
+ * (3) refinement tree as the levels and centroids of the refined cells,
+ * (4) face magnetic field as one column block,
+ * (5) particle counts of the leaf cells in Morton order and the particles
+ *     as chunks of column blocks (x,y,z,vx,vy,vz,w,popid),
+ * (6) population and field counters and (7) detector states, each as a
+ *     byte count and a record.
+ * A column block is the number of elements followed by the elements.
+ */
+#define BREAKPOINT_MAGIC "HYBBRKPT"
+#define BREAKPOINT_VERSION 1
+
+//! (BREAKPOINTING) Compile options recorded in the breakpoint header
+enum TBreakpointFlag {BREAKPOINT_SPHERICAL=1, BREAKPOINT_PARTICLE_SUBCYCLING=2, BREAKPOINT_DIAGNOSTICS=4};
+
+//! (BREAKPOINTING) Maximum number of particles in one chunk of particle column blocks
+static const int64_t breakpointChunkParticles = 1 << 22;
+
+//! (BREAKPOINTING) Breakpoint flags of this build
+static uint32_t breakpoint_flags()
+{
+    uint32_t flags = 0;
+#ifdef USE_SPHERICAL_COORDINATE_SYSTEM
+    flags |= BREAKPOINT_SPHERICAL;
+#endif
+#ifdef USE_PARTICLE_SUBCYCLING
+    flags |= BREAKPOINT_PARTICLE_SUBCYCLING;
+#endif
+#ifndef NO_DIAGNOSTICS
+    flags |= BREAKPOINT_DIAGNOSTICS;
+#endif
+    return flags;
+}
+
+//! (BREAKPOINTING) Write column block
 template <class T>
-ostream& writeData(ostream& os, T& data)
+void writeBlock(ostream& os, const vector<T>& v)
 {
-    os.write(reinterpret_cast<const char*>(&data), sizeof(data));
-    return os;
+    const int64_t n = v.size();
+    writeData(os, n);
+    if (n > 0) {
+        os.write(reinterpret_cast<const char*>(&v[0]), n*sizeof(T));
+    }
 }
 
-//! (BREAKPOINTING) Read data
+//! (BREAKPOINTING) Read column block
 template <class T>
-istream& readData(istream& is, T& data)
+void readBlock(istream& is, vector<T>& v)
 {
-    is.read(reinterpret_cast<char*>(&data), sizeof(data));
-    return is;
+    int64_t n = 0;
+    readData(is, n);
+    if (!is || n < 0) {
+        ERRORMSG("breakpoint file is truncated");
+        doabort();
+    }
+    v.resize(n);
+    if (n > 0) {
+        is.read(reinterpret_cast<char*>(&v[0]), n*sizeof(T));
+    }
 }
 
-//! (BREAKPOINTING) Write particle
-struct Tgrid::writeParticle {
+//! (BREAKPOINTING) Read column block of n values at offset pos of file fd, false if it does not fit
+template <class T>
+static bool preadBlock(int fd, int64_t pos, int64_t n, vector<T>& v)
+{
+    int64_t m = -1;
+    if (pread(fd, &m, sizeof(m), pos) != static_cast<ssize_t>(sizeof(m)) || m != n) {
+        return false;
+    }
+    v.resize(n);
+    if (n == 0) {
+        return true;
+    }
+    char *buf = reinterpret_cast<char*>(&v[0]);
+    int64_t left = n*sizeof(T);
+    pos+= sizeof(m);
+    while (left > 0) {
+        const ssize_t r = pread(fd, buf, left, pos);
+        if (r <= 0) {
+            return false;
+        }
+        buf+= r;
+        left-= r;
+        pos+= r;
+    }
+    return true;
+}
+
+//! (BREAKPOINTING) Write byte count and record
+static void writeRecord(ostream& os, const string& s)
+{
+    vector<char> v(s.begin(), s.end());
+    writeBlock(os, v);
+}
+
+//! (BREAKPOINTING) Read byte count and record
+static string readRecord(istream& is)
+{
+    vector<char> v;
+    readBlock(is, v);
+    return string(v.begin(), v.end());
+}
+
+//! (BREAKPOINTING) Particle column blocks of one chunk
+struct TParticleColumns {
+    vector<shortreal> x,y,z,vx,vy,vz,w;
+    vector<int32_t> popid;
+    void resize(int64_t n) {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        vx.resize(n);
+        vy.resize(n);
+        vz.resize(n);
+        w.resize(n);
+        popid.resize(n);
+    }
+    void write(ostream& os) const {
+        writeBlock(os, x);
+        writeBlock(os, y);
+        writeBlock(os, z);
+        writeBlock(os, vx);
+        writeBlock(os, vy);
+        writeBlock(os, vz);
+        writeBlock(os, w);
+        writeBlock(os, popid);
+    }
+    void read(istream& is) {
+        readBlock(is, x);
+        readBlock(is, y);
+        readBlock(is, z);
+        readBlock(is, vx);
+        readBlock(is, vy);
+        readBlock(is, vz);
+        readBlock(is, w);
+        readBlock(is, popid);
+    }
+    //! Bytes of the column blocks of n particles
+    static int64_t bytes(int64_t n) {
+        return 8*sizeof(int64_t) + n*(7*sizeof(shortreal) + sizeof(int32_t));
+    }
+    /** \brief Read the column blocks of n particles at offset pos of file fd
+     *
+     * Each block is read with its own pread, the blocks in parallel with
+     * USE_OPENMP. Returns false if the blocks do not fit.
+     */
+    bool read(int fd, int64_t pos, int64_t n) {
+        vector<shortreal> *const cols[7] = {&x, &y, &z, &vx, &vy, &vz, &w};
+        const int64_t colBytes = sizeof(int64_t) + n*sizeof(shortreal);
+        int nfailed = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static,1) reduction(+:nfailed)
+#endif
+        for (int k=0; k<8; k++) {
+            const bool ok = (k < 7) ? preadBlock(fd, pos + k*colBytes, n, *cols[k]) : preadBlock(fd, pos + 7*colBytes, n, popid);
+            if (!ok) {
+                nfailed++;
+            }
+        }
+        return nfailed == 0;
+    }
+};
 
-    writeParticle(ostream& o) : os_(o) { }
-    bool operator() (TLinkedParticle& p) const {
-        writeData(os_, p.x);
-        writeData(os_, p.y);
-        writeData(os_, p.z);
-        writeData(os_, p.vx);
-        writeData(os_, p.vy);
-        writeData(os_, p.vz);
-        writeData(os_, p.w);
-        writeData(os_, p.popid);
+//! (BREAKPOINTING) Copy particles of a leaf cell into column blocks
+struct Tgrid::writeParticle {
+    writeParticle(TParticleColumns& c, int64_t first) : col(c), n(first) { }
+    bool operator() (TLinkedParticle& p) {
+        col.x[n] = p.x;
+        col.y[n] = p.y;
+        col.z[n] = p.z;
+        col.vx[n] = p.vx;
+        col.vy[n] = p.vy;
+        col.vz[n] = p.vz;
+        col.w[n] = p.w;
+        col.popid[n] = p.popid;
+        n++;
         return true;
     }
 private:
-    ostream& os_;
+    TParticleColumns& col;
+    int64_t n;
+};
+
+//! (BREAKPOINTING) Collect leaf cells
+struct Tgrid::collectLeaves {
+    collectLeaves(vector<TCellPtr>& l) : leaves(l) { }
+    void operator() (Tcell& cell) {
+        leaves.push_back(&cell);
+    }
+private:
+    vector<TCellPtr>& leaves;
 };
 
-//! (BREAKPOINTING) Write magnetic field
+//! (BREAKPOINTING) Collect faces of the breakpoint magnetic field
 struct Tgrid::writeMagneticField {
-    writeMagneticField(ostream& o) : os_(o) { }
-    void operator() (Tcell& cell) const {
+    writeMagneticField(vector<TFacePtr>& f) : faces(f) { }
+    void operator() (Tcell& cell) {
         const int dims = 3;
         for (int dim = 0; dim < dims; ++dim)
             if (!cell.isrefined_face(dim, 1)) {
                 TFacePtr face = cell.face[dim][1];
                 if (face != 0)
-                    writeData(os_, face->facedata[FACEDATA_B]);
+                    faces.push_back(face);
             } else {
-                const int faces = 4;
-                for (int f = 0; f < faces; ++f) {
+                const int faces4 = 4;
+                for (int f = 0; f < faces4; ++f) {
                     Trefintf* ref = cell.refintf[dim][1];
                     if (ref != 0)
-                        writeData(os_, ref->face[f]->facedata[FACEDATA_B]);
+                        faces.push_back(ref->face[f]);
                 }
             }
     }
 private:
-    ostream& os_;
+    vector<TFacePtr>& faces;
 };
 
-//! (BREAKPOINTING) Read magnetic field
+//! (BREAKPOINTING) Read magnetic field (old breakpoint format)
 struct Tgrid::readMagneticField {
     readMagneticField(istream& i) : is_(i) { }
     void operator() (Tcell& cell) {
@@ -4072,27 +4887,446 @@ private:
     istream& is_;
 };
 
-//! (BREAKPOINTING) Write breakpoint
+//! (BREAKPOINTING) Leaf cells in Morton order of the base cells, the order of particle_pass
+void Tgrid::collect_leaves(vector<TCellPtr>& leaves)
+{
+    leaves.clear();
+    collectLeaves op(leaves);
+    const int ncells = morton_order.size();
+    for (int m=0; m<ncells; m++) {
+        cells[morton_order[m]]->cellPassRecursive(op);
+    }
+}
+
+//! (BREAKPOINTING) Levels and centroids of the refined cells, depth-first from the interior base cells
+void Tgrid::collect_refinement(vector<int32_t>& levels, vector<gridreal>& centroids)
+{
+    levels.clear();
+    centroids.clear();
+    vector<TCellPtr> stack;
+    int i,j,k;
+    ForInterior(i,j,k) {
+        stack.push_back(cells[flatindex(i,j,k)]);
+        while (!stack.empty()) {
+            const TCellPtr c = stack.back();
+            stack.pop_back();
+            if (!c->haschildren) {
+                continue;
+            }
+            levels.push_back(c->level);
+            for (int d=0; d<3; d++) {
+                centroids.push_back(c->centroid[d]);
+            }
+            for (int ch=7; ch>=0; ch--) stack.push_back(c->child[0][0][ch]);
+        }
+    }
+}
+
+/** \brief (BREAKPOINTING) Refine the grid as in the breakpoint
+ *
+ * Nothing is done if the current grid has the same refinement (the usual
+ * case, when it was set up from the same configuration). Otherwise the
+ * breakpoint cells not yet refined are refined level by level. A grid
+ * refined beyond the breakpoint is not recoarsened but rejected.
+ */
+void Tgrid::restore_refinement(const vector<int32_t>& levels, const vector<gridreal>& centroids)
+{
+    vector<int32_t> curLevels;
+    vector<gridreal> curCentroids;
+    collect_refinement(curLevels, curCentroids);
+    if (curLevels == levels && curCentroids == centroids) {
+        return;
+    }
+    mainlog << "Restoring the grid refinement of the breakpoint: " << levels.size() << " refined cells\n";
+    const int nref = levels.size();
+    int level;
+    for (level=0; ; level++) {
+        int nlevel = 0, nmarked = 0;
+        for (int n=0; n<nref; n++) {
+            if (levels[n] != level) {
+                continue;
+            }
+            nlevel++;
+            const shortreal r[3] = {centroids[3*n], centroids[3*n+1], centroids[3*n+2]};
+            const TCellPtr c = findcell(r);
+            if (!c || c->level < level) {
+                ERRORMSG2("breakpoint refinement does not fit the grid at", Tr3v(r).toString());
+                doabort();
+            }
+            // Cells refined already by the configuration have leaves of a higher level
+            if (c->level == level) {
+                c->refine_it = true;
+                nmarked++;
+            }
+        }
+        if (nlevel == 0) {
+            break;
+        }
+        if (nmarked > 0) {
+            int i,j,k;
+            ForInterior(i,j,k) {
+                cells[flatindex(i,j,k)]->refine_recursive(*this);
+            }
+            cursor.reset();
+        }
+    }
+    collect_refinement(curLevels, curCentroids);
+    if (curLevels != levels || curCentroids != centroids) {
+        ERRORMSG("grid is refined beyond the breakpoint, use the grid refinement of the breakpoint run or none");
+        doabort();
+    }
+    Params::currentGridRefinementLevel = max2(Params::currentGridRefinementLevel, level);
+    build_sweep_arrays();
+    cursor.reset();
+}
+
+/** \brief (BREAKPOINTING) Write breakpoint
+ *
+ * See BREAKPOINT_MAGIC for the format. Face magnetic field and particles
+ * are gathered into column blocks in parallel with USE_OPENMP.
+ */
 void Tgrid::dumpState(ostream& os)
 {
-    portrand.save(os); // write random number generator state
+    // Header
+    os.write(BREAKPOINT_MAGIC, 8);
+    const uint32_t version = BREAKPOINT_VERSION;
+    const uint32_t endian = 0x01020304;
+    const uint32_t flags = breakpoint_flags();
+    const uint32_t sizes[4] = {sizeof(shortreal), sizeof(gridreal), sizeof(real), sizeof(datareal)};
+    const int32_t dims[4] = {nx, ny, nz, static_cast<int32_t>(Params::pops.size())};
+    writeData(os, version);
+    writeData(os, endian);
+    writeData(os, flags);
+    writeData(os, sizes);
+    writeData(os, dims);
+    // Time and random number generator state
     writeData(os, Params::t);
     writeData(os, Params::cnt_dt);
-    writeData(os, n_particles);
-    // write particles
-    particle_pass(writeParticle(os));
-    // write magnetic field
-    cellPass(writeMagneticField(os));
+    ostringstream rng;
+    portrand.save(rng);
+    writeRecord(os, rng.str());
+    writeData(os, gausscache);
+    // Populations
+    for (unsigned int i = 0; i < Params::pops.size(); ++i) {
+        writeRecord(os, Params::pops[i]->getIdStr());
+    }
+    // Refinement tree
+    vector<int32_t> levels;
+    vector<gridreal> centroids;
+    collect_refinement(levels, centroids);
+    writeBlock(os, levels);
+    writeBlock(os, centroids);
+    // Magnetic field
+    vector<TFacePtr> faces;
+    cellPass(writeMagneticField(faces));
+    const int nfaces = faces.size();
+    vector<datareal> B(nfaces);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int f=0; f<nfaces; f++) {
+        B[f] = faces[f]->facedata[FACEDATA_B];
+    }
+    writeBlock(os, B);
+    // Particles
+    vector<TCellPtr> leaves;
+    collect_leaves(leaves);
+    const int nleaves = leaves.size();
+    vector<int32_t> counts(nleaves);
+    for (int l=0; l<nleaves; l++) {
+        counts[l] = leaves[l]->plist.Nparticles();
+    }
+    writeBlock(os, counts);
+    TParticleColumns col;
+    vector<int64_t> offset;
+    int l0 = 0;
+    while (l0 < nleaves) {
+        // Chunk of whole leaves with at most breakpointChunkParticles particles (unless a leaf has more)
+        int l1 = l0;
+        int64_t n = 0;
+        offset.clear();
+        while (l1 < nleaves && (l1 == l0 || n + counts[l1] <= breakpointChunkParticles)) {
+            offset.push_back(n);
+            n+= counts[l1++];
+        }
+        col.resize(n);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+        for (int l=l0; l<l1; l++) {
+            writeParticle op(col, offset[l-l0]);
+            leaves[l]->plist.pass(op);
+        }
+        const int32_t last = l1;
+        writeData(os, last);
+        col.write(os);
+        l0 = l1;
+    }
+    // Counters
+    ostringstream counters;
 #ifndef NO_DIAGNOSTICS
     for (unsigned int i = 0; i < Params::pops.size(); ++i) {
-        writeData(os, Params::diag.pCounter[i]);
+        Params::diag.pCounter[i]->saveState(counters);
+    }
+    // Include the deposits not yet added to fieldCounter
+    FieldCounter fc = fieldCounter;
+    fc.fastDepositRate += fast_deposits;
+    fc.slowDepositRate += slow_deposits;
+    writeData(counters, fc);
+#endif
+    writeRecord(os, counters.str());
+    // Detectors
+    ostringstream detectors;
+    const int32_t ndetectors = Params::detectors.size();
+    writeData(detectors, ndetectors);
+    for (int i = 0; i < ndetectors; ++i) {
+        Params::detectors[i]->saveState(detectors);
+    }
+    writeRecord(os, detectors.str());
+    if (!os) {
+        ERRORMSG("writing the breakpoint failed");
+    }
+}
+
+//! (BREAKPOINTING) Read and check breakpoint header, false (and stream rewound) for the old format
+bool Tgrid::read_breakpoint_header(istream& is, uint32_t& flags)
+{
+    char magic[8];
+    is.read(magic, 8);
+    if (!is || strncmp(magic, BREAKPOINT_MAGIC, 8) != 0) {
+        is.clear();
+        is.seekg(0);
+        return false;
+    }
+    uint32_t version, endian, sizes[4];
+    int32_t dims[4];
+    readData(is, version);
+    readData(is, endian);
+    readData(is, flags);
+    readData(is, sizes);
+    readData(is, dims);
+    if (version > BREAKPOINT_VERSION) {
+        ERRORMSG2("breakpoint format version is newer than this program", static_cast<int>(version));
+        doabort();
+    }
+    if (endian != 0x01020304) {
+        ERRORMSG("breakpoint written on a machine of different byte order");
+        doabort();
+    }
+    if ((flags & BREAKPOINT_SPHERICAL) != (breakpoint_flags() & BREAKPOINT_SPHERICAL)) {
+        ERRORMSG("breakpoint written with a different USE_SPHERICAL_COORDINATE_SYSTEM");
+        doabort();
+    }
+    if (sizes[0] != sizeof(shortreal) || sizes[1] != sizeof(gridreal) || sizes[2] != sizeof(real) || sizes[3] != sizeof(datareal)) {
+        ERRORMSG("breakpoint written with different floating point types");
+        doabort();
+    }
+    if (dims[0] != nx || dims[1] != ny || dims[2] != nz || dims[3] != static_cast<int32_t>(Params::pops.size())) {
+        ERRORMSG("breakpoint base grid or number of populations differs from the configuration");
+        doabort();
+    }
+    return true;
+}
+
+/** \brief (BREAKPOINTING) Restore the grid refinement of a breakpoint
+ *
+ * Called before the cell quantities (resistivity, background charge,
+ * magnetic field) are initialized, so that they are set also in cells
+ * refined differently from the configuration. Nothing is done for the
+ * old breakpoint format.
+ */
+void Tgrid::readStateRefinement(istream& is)
+{
+    uint32_t flags;
+    if (!read_breakpoint_header(is, flags)) {
+        return;
+    }
+    real t;
+    int cnt_dt;
+    TGaussCache gauss;
+    readData(is, t);
+    readData(is, cnt_dt);
+    readRecord(is);
+    readData(is, gauss);
+    for (unsigned int i = 0; i < Params::pops.size(); ++i) {
+        readRecord(is);
+    }
+    vector<int32_t> levels;
+    vector<gridreal> centroids;
+    readBlock(is, levels);
+    readBlock(is, centroids);
+    restore_refinement(levels, centroids);
+}
+
+/** \brief (BREAKPOINTING) Read breakpoint
+ *
+ * Reads also the old breakpoint format without a header. If fd is a file
+ * descriptor of the same file, the particle column blocks are read with
+ * pread in parallel (see TParticleColumns::read), otherwise from is.
+ * Particles are added to their leaf cells in parallel with USE_OPENMP,
+ * each leaf with one TParticleList::insert.
+ */
+void Tgrid::readState(istream& is, int fd)
+{
+    uint32_t flags;
+    if (!read_breakpoint_header(is, flags)) {
+        readStateOldFormat(is);
+        return;
+    }
+    // Time and random number generator state
+    readData(is, Params::t);
+    readData(is, Params::cnt_dt);
+    istringstream rng(readRecord(is));
+    portrand.load(rng);
+    readData(is, gausscache);
+    // Populations
+    for (unsigned int i = 0; i < Params::pops.size(); ++i) {
+        const string idStr = readRecord(is);
+        if (idStr != Params::pops[i]->getIdStr()) {
+            ERRORMSG2("breakpoint population differs from the configuration", idStr);
+            doabort();
+        }
+    }
+    // Refinement tree
+    vector<int32_t> levels;
+    vector<gridreal> centroids;
+    readBlock(is, levels);
+    readBlock(is, centroids);
+    restore_refinement(levels, centroids);
+    // Magnetic field
+    vector<TFacePtr> faces;
+    cellPass(writeMagneticField(faces));
+    vector<datareal> B;
+    readBlock(is, B);
+    if (B.size() != faces.size()) {
+        ERRORMSG2("breakpoint magnetic field does not fit the grid", static_cast<int>(B.size()));
+        doabort();
+    }
+    const int nfaces = faces.size();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int f=0; f<nfaces; f++) {
+        faces[f]->facedata[FACEDATA_B] = B[f];
+    }
+    // Particles
+    vector<TCellPtr> leaves;
+    collect_leaves(leaves);
+    const int nleaves = leaves.size();
+    vector<int32_t> counts;
+    readBlock(is, counts);
+    if (static_cast<int>(counts.size()) != nleaves) {
+        ERRORMSG2("breakpoint particles do not fit the grid", static_cast<int>(counts.size()));
+        doabort();
+    }
+    const int npops = Params::pops.size();
+    TParticleColumns col;
+    vector<int64_t> offset;
+    int l0 = 0, nbad = 0;
+    while (l0 < nleaves) {
+        int32_t l1;
+        readData(is, l1);
+        if (!is || l1 <= l0 || l1 > nleaves) {
+            ERRORMSG("breakpoint file is truncated");
+            doabort();
+        }
+        offset.clear();
+        int64_t n = 0;
+        for (int l=l0; l<l1; l++) {
+            offset.push_back(n);
+            n+= counts[l];
+        }
+        offset.push_back(n);
+        if (fd >= 0) {
+            const int64_t pos = is.tellg();
+            if (!col.read(fd, pos, n)) {
+                ERRORMSG("breakpoint file is truncated");
+                doabort();
+            }
+            is.seekg(pos + TParticleColumns::bytes(n));
+        } else {
+            col.read(is);
+        }
+        if (!is) {
+            ERRORMSG("breakpoint file is truncated");
+            doabort();
+        }
+        if (static_cast<int64_t>(col.popid.size()) != n) {
+            ERRORMSG("breakpoint particle counts do not match");
+            doabort();
+        }
+#ifdef USE_OPENMP
+#pragma omp parallel reduction(+:nbad)
+#endif
+        {
+            vector<TLinkedParticle> buf;
+#ifdef USE_OPENMP
+#pragma omp for schedule(dynamic,64)
+#endif
+            for (int l=l0; l<l1; l++) {
+                buf.clear();
+                for (int64_t p=offset[l-l0]; p<offset[l-l0+1]; p++) {
+                    TLinkedParticle q;
+                    q.popid = col.popid[p];
+                    if (q.popid < 0 || q.popid >= npops) {
+                        nbad++;
+                        continue;
+                    }
+                    q.x = col.x[p];
+                    q.y = col.y[p];
+                    q.z = col.z[p];
+                    q.vx = col.vx[p];
+                    q.vy = col.vy[p];
+                    q.vz = col.vz[p];
+                    q.w = col.w[p];
+                    q.next = 0;
+#ifdef USE_PARTICLE_SUBCYCLING
+                    q.dtlevel = 0;
+                    q.accumed = 1;
+#endif
+                    buf.push_back(q);
+                }
+                if (!buf.empty()) {
+                    leaves[l]->plist.insert(&buf[0], buf.size());
+                }
+            }
+        }
+        n_particles+= n;
+        l0 = l1;
+    }
+    if (nbad > 0) {
+        WARNINGMSG2("readState: particles with a bad popid, ignoring", nbad);
+        n_particles-= nbad;
+    }
+    // Counters
+    istringstream counters(readRecord(is));
+#ifndef NO_DIAGNOSTICS
+    if (flags & BREAKPOINT_DIAGNOSTICS) {
+        for (unsigned int i = 0; i < Params::pops.size(); ++i) {
+            Params::diag.pCounter[i]->loadState(counters);
+        }
+        readData(counters, fieldCounter);
     }
-    writeData(os, fieldCounter);
 #endif
+    // Detectors
+    istringstream detectors(readRecord(is));
+    int32_t ndetectors = 0;
+    readData(detectors, ndetectors);
+    if (ndetectors == static_cast<int32_t>(Params::detectors.size())) {
+        for (int i = 0; i < ndetectors; ++i) {
+            Params::detectors[i]->loadState(detectors);
+        }
+    } else {
+        WARNINGMSG2("breakpoint detectors differ from the configuration, detector states not restored", ndetectors);
+    }
+    if (!is) {
+        ERRORMSG("breakpoint file is truncated");
+        doabort();
+    }
 }
 
-//! (BREAKPOINTING) Read breakpoint
-void Tgrid::readState(istream& is)
+//! (BREAKPOINTING) Read breakpoint of the old format (no header, particles one by one)
+void Tgrid::readStateOldFormat(istream& is)
 {
     portrand.load(is); // restore random number generator state
     readData(is, Params::t);
@@ -4111,22 +5345,15 @@ void Tgrid::readState(istream& is)
         readData(is, vz);
         readData(is, w);
         readData(is, popid);
-        if(popid < 0 || popid > static_cast<int>(Params::pops.size())) {
+        if(popid < 0 || popid >= static_cast<int>(Params::pops.size())) {
             WARNINGMSG2("readState: particle with a bad popid, ignoring",popid);
             continue;
         }
-        addparticle(x, y, z, vx, vy, vz, w, popid);
+        addparticle(x, y, z, vx, vy, vz, w, popid, false);
     }
     // read magnetic field
     readMagneticField mReader(is);
     cellPass(mReader);
-#ifndef NO_DIAGNOSTICS
-    // This may not work as planned
-    /*for (unsigned int i = 0; i < Params::pops.size(); ++i) {
-        readData(is, Params::diag.pCounter[i]);
-    }
-    readData(is, fieldCounter);*/
-#endif
 }
 
 // =================================================================================
@@ -4146,78 +5373,618 @@ void Tgrid::addparticle(shortreal x, shortreal y, shortreal z,
                  << " out of box (not created)\n";
         return;
     }
-    c->plist.add(x,y,z,vx,vy,vz,w,popid);
-#ifndef NO_DIAGNOSTICS
-    if(inject==true) {
-        Params::diag.pCounter[popid]->increaseInjectCounters(vx,vy,vz,w);
+    if (owned_injection == true && base_owner[base_index(r)] != Decomposition::getRank()) {
+        return;
+    }
+    c->plist.add(x,y,z,vx,vy,vz,w,popid);
+#ifndef NO_DIAGNOSTICS
+    if(inject==true) {
+        Params::diag.pCounter[popid]->increaseInjectCounters(vx,vy,vz,w);
+    }
+#endif
+    n_particles++;
+}
+
+//! Find the particle's list
+TParticleList *Tgrid::find_plist(const TLinkedParticle& p)
+{
+    const shortreal r[3] = {p.x,p.y,p.z};
+    TCellPtr c = findcell(r);
+    if (!c) {
+        errorlog << "WARNING: Tgrid::find_plist" << Tr3v(r).toString() << " out of box\n";
+        return 0;
+    }
+    return &(c->plist);
+}
+
+//! Returns the number of particles deleted
+int Tgrid::Tcell::particle_pass_recursive(bool (*op)(TLinkedParticle& p, ParticlePassArgs a), bool relocate)
+{
+    int ndel = 0;
+    if (haschildren) {
+        int ch;
+        for (ch=0; ch<8; ch++) ndel+= child[0][0][ch]->particle_pass_recursive(op,relocate);
+    } else {
+        // Set arguments for the particle pass function
+        ParticlePassArgs a;
+        a.rho_q = this->rho_q;
+        a.size = this->size;
+        if (relocate) {
+            ndel = plist.pass_with_relocate(op,a);
+        } else {
+            ndel = plist.pass(op,a);
+        }
+    }
+    return ndel;
+}
+
+//! Pass all particles in the list to the function op
+int Tgrid::particle_pass(bool (*op)(TLinkedParticle& p, ParticlePassArgs a), bool relocate)
+{
+    int ndel=0;
+    const int ncells = morton_order.size();
+    for (int m=0; m<ncells; m++) {
+        ndel+= cells[morton_order[m]]->particle_pass_recursive(op,relocate);
+    }
+    n_particles-= ndel;
+    return ndel;
+}
+
+//! Return the number of macro particles (recursive)
+int Tgrid::Tcell::Nparticles_recursive() const
+{
+    int result = 0;
+    if (haschildren) {
+        int ch;
+        for (ch=0; ch<8; ch++) result+= child[0][0][ch]->Nparticles_recursive();
+    } else {
+        result = plist.Nparticles();
+    }
+    return result;
+}
+
+//! Return the number of macro particles
+int Tgrid::Nparticles() const
+{
+    return n_particles;
+}
+
+//! Z-order comparison of integer triples: the coordinate whose differing bits are most significant decides
+struct MortonLess {
+    const std::vector<int>& key;
+    MortonLess(const std::vector<int>& k) : key(k) { }
+    static bool lessMSB(unsigned int a, unsigned int b) {
+        return a < b && a < (a ^ b);
+    }
+    bool operator()(int a, int b) const {
+        int dim = 0;
+        unsigned int x = key[3*a] ^ key[3*b];
+        for (int d=1; d<3; d++) {
+            const unsigned int y = key[3*a+d] ^ key[3*b+d];
+            if (lessMSB(x,y)) {
+                dim = d;
+                x = y;
+            }
+        }
+        return key[3*a+dim] < key[3*b+dim];
+    }
+};
+
+//! Order the base cells along a Morton (Z-order) curve, used by particle_pass and sort_particles
+void Tgrid::build_morton_order()
+{
+    const int ncells = nx*ny*nz;
+    std::vector<int> ijk(3*ncells);
+    morton_order.resize(ncells);
+    for (int c=0; c<ncells; c++) {
+        decompose(c,ijk[3*c],ijk[3*c+1],ijk[3*c+2]);
+        morton_order[c] = c;
+    }
+    std::sort(morton_order.begin(),morton_order.end(),MortonLess(ijk));
+    build_push_blocks();
+    build_sweep_arrays();
+}
+
+//! Divide morton_order into push blocks of PUSH_BLOCK_SIZE^3 base cells and colour them
+void Tgrid::build_push_blocks()
+{
+    push_blocks.clear();
+    for (int colour=0; colour<8; colour++) {
+        push_phases[colour].clear();
+    }
+    const int ncells = morton_order.size();
+    int m = 0;
+    while (m < ncells) {
+        // Aligned blocks are contiguous in Morton order
+        TPushBlock b;
+        int blk[3];
+        decompose(morton_order[m],b.lo[0],b.lo[1],b.lo[2]);
+        for (int d=0; d<3; d++) {
+            blk[d] = b.lo[d]/PUSH_BLOCK_SIZE;
+            b.lo[d] = blk[d]*PUSH_BLOCK_SIZE;
+        }
+        b.first = m;
+        int i,j,k;
+        do {
+            m++;
+            if (m < ncells) {
+                decompose(morton_order[m],i,j,k);
+            }
+        } while (m < ncells && i/PUSH_BLOCK_SIZE == blk[0] && j/PUSH_BLOCK_SIZE == blk[1] && k/PUSH_BLOCK_SIZE == blk[2]);
+        b.last = m;
+        push_phases[(blk[0]%2) + 2*(blk[1]%2) + 4*(blk[2]%2)].push_back(push_blocks.size());
+        push_blocks.push_back(b);
+    }
+    push_overflow.resize(push_blocks.size());
+}
+
+/** \brief Collect the leaf cells, nodes and faces of the field sweeps
+ *
+ * Flattens the cell tree into straight arrays so that the sweeps do not
+ * recurse. Must be called again whenever the grid is refined or recoarsened.
+ * A leaf cell writes only the nodes and faces on its upper faces, which lie
+ * on the closed box of its base cell. Base cells of the same parity colour
+ * are at least two cells apart along some dimension, so their boxes are
+ * disjoint and a node or face sweep can process one colour in parallel.
+ * A node on a refinement interface can be reached from several cells, it is
+ * kept only in the colour that reaches it first.
+ */
+void Tgrid::build_sweep_arrays()
+{
+    sweep_cells.clear();
+    for (int colour=0; colour<8; colour++) {
+        sweep_nodes[colour].clear();
+        sweep_faces[colour].clear();
+    }
+    const int ncells = morton_order.size();
+    std::vector<TCellPtr> stack;
+    std::set<TNodePtr> visited;
+    for (int colour=0; colour<8; colour++) {
+        for (int m=0; m<ncells; m++) {
+            const int c0 = morton_order[m];
+            int i,j,k;
+            decompose(c0,i,j,k);
+            if (i >= nx-1 || j >= ny-1 || k >= nz-1 || (i%2) + 2*(j%2) + 4*(k%2) != colour) {
+                continue;
+            }
+            const bool interior = (i > 0 && j > 0 && k > 0);
+            const bool inner[3] = {j > 0 && k > 0, i > 0 && k > 0, i > 0 && j > 0};
+            // Depth-first pass of the leaves in child order
+            stack.push_back(cells[c0]);
+            while (!stack.empty()) {
+                const TCellPtr c = stack.back();
+                stack.pop_back();
+                if (c->haschildren) {
+                    for (int ch=7; ch>=0; ch--) stack.push_back(c->child[0][0][ch]);
+                    continue;
+                }
+                if (interior) {
+                    sweep_cells.push_back(c);
+                }
+                // NODE LOOP
+                // Idea: To pass through all nodes, pass through all right-pointing faces,
+                // and all upper-right corner points thereof
+                for (int d=0; d<3; d++) {
+                    if (c->isrefined_face(d,1)) {
+                        for (int f=0; f<4; f++) for (int f2=0; f2<4; f2++) {
+                                const TNodePtr n = c->refintf[d][1]->face[f]->node[f2];
+                                if (visited.insert(n).second) sweep_nodes[colour].push_back(n);
+                            }
+                    } else if (d == 0) {
+                        // assume nodes are numbered 0=(x,y), 1=(x+dx,y), 2=(x+dx,y+dy), 3=(x,y+dy)
+                        const TNodePtr n = c->face[d][1]->node[2];
+                        if (visited.insert(n).second) sweep_nodes[colour].push_back(n);
+                    }
+                }
+                // FACE LOOP: all right-pointing faces
+                for (int d=0; d<3; d++) {
+                    TSweepFace sf;
+                    sf.d = d;
+                    sf.inner = inner[d];
+                    if (c->isrefined_face(d,1)) {
+                        sf.dx = 0.5*c->size;
+                        for (int f=0; f<4; f++) {
+                            sf.face = c->refintf[d][1]->face[f];
+                            sweep_faces[colour].push_back(sf);
+                        }
+                    } else {
+                        sf.dx = c->size;
+                        sf.face = c->face[d][1];
+                        sweep_faces[colour].push_back(sf);
+                    }
+                }
+            }
+        }
+        std::stable_sort(sweep_faces[colour].begin(),sweep_faces[colour].end(),SweepCoarser());
+    }
+    std::stable_sort(sweep_cells.begin(),sweep_cells.end(),SweepCoarser());
+}
+
+//! Count the particle pushes of the timestep (call before the push blocks)
+void Tgrid::begin_push_pass()
+{
+    if (push_step != Params::cnt_dt) {
+        push_step = Params::cnt_dt;
+        push_pass = 0;
+    } else {
+        push_pass++;
+    }
+}
+
+/** \brief Start pushing the particles of push block b in this thread
+ *
+ * The random numbers of the block (e.g. the ambient boundary conditions)
+ * come from a stream seeded by the timestep, the push of the timestep, the
+ * block and the MPI rank, so they do not depend on the thread schedule.
+ */
+void Tgrid::begin_push_block(int b)
+{
+    push_block_index = b;
+    push_overflow[b].clear();
+    unsigned long int seed = static_cast<unsigned long int>(push_step)*8 + push_pass;
+    seed = seed*push_blocks.size() + b;
+    seed = seed*Decomposition::getNranks() + Decomposition::getRank();
+    begin_rnd_stream(1 + seed % 2147483562UL);
+}
+
+//! Stop pushing a push block in this thread
+void Tgrid::end_push_block()
+{
+    push_block_index = -1;
+    end_rnd_stream();
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+    fieldCounter.fastDepositRate += fast_deposits;
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+    fieldCounter.slowDepositRate += slow_deposits;
+    fast_deposits = slow_deposits = 0.0;
+}
+
+/** \brief Defer the deposit if its stencil can reach beyond the current push block
+ *
+ * The stencil of a deposit at r covers at most one base cell around r, so
+ * deposits within one base cell from the block are safe. Blocks of the same
+ * colour are PUSH_BLOCK_SIZE base cells apart.
+ */
+bool Tgrid::defer_push_deposit(const shortreal r[3], const shortreal v[3], real w, int popid)
+{
+    const TPushBlock& b = push_blocks[push_block_index];
+    const gridreal corner[3] = {x_1, y_1, z_1};
+    bool inside = true;
+    for (int d=0; d<3; d++) {
+        const gridreal q = (r[d] - corner[d])*invbgdx;
+        if (q < b.lo[d] - 1 || q >= b.lo[d] + PUSH_BLOCK_SIZE + 1) {
+            inside = false;
+            break;
+        }
+    }
+    if (inside) {
+        return false;
+    }
+    TPushDeposit dep;
+    for (int d=0; d<3; d++) {
+        dep.r[d] = r[d];
+        dep.v[d] = v[d];
+    }
+    dep.w = w;
+    dep.popid = popid;
+    push_overflow[push_block_index].push_back(dep);
+    return true;
+}
+
+//! Apply the deferred deposits of all push blocks in block order
+void Tgrid::flush_push_deposits()
+{
+    for (unsigned int b=0; b<push_overflow.size(); b++) {
+        for (unsigned int n=0; n<push_overflow[b].size(); n++) {
+            const TPushDeposit& dep = push_overflow[b][n];
+            accumulate_PIC(dep.r,dep.v,dep.w,dep.popid);
+        }
+        push_overflow[b].clear();
+    }
+}
+
+#ifndef USE_PARTICLE_ARRAYS
+
+//! (PARTICLE SORTING) Move the particles of each leaf cell into a buffer
+struct Tgrid::sortExtract {
+    sortExtract(std::vector<TLinkedParticle>& b, std::vector<int>& n) : buffer(b), counts(n) { }
+    void operator()(Tcell& cell) {
+        counts.push_back(cell.plist.extract(buffer));
+    }
+private:
+    std::vector<TLinkedParticle>& buffer;
+    std::vector<int>& counts;
+};
+
+//! (PARTICLE SORTING) Refill the leaf cells from the buffer in the same order
+struct Tgrid::sortInsert {
+    sortInsert(const std::vector<TLinkedParticle>& b, const std::vector<int>& n) : buffer(b), counts(n), cellIndex(0), pos(0) { }
+    void operator()(Tcell& cell) {
+        const int n = counts[cellIndex++];
+        if (n > 0) {
+            cell.plist.insert(&buffer[pos],n);
+        }
+        pos+= n;
+    }
+private:
+    const std::vector<TLinkedParticle>& buffer;
+    const std::vector<int>& counts;
+    int cellIndex;
+    int pos;
+};
+
+#else
+
+//! (PARTICLE SORTING) Reallocate the streams of each leaf cell
+struct Tgrid::sortInsert {
+    void operator()(Tcell& cell) {
+        cell.plist.shrink();
+    }
+};
+
+#endif
+
+/** \brief Re-sort particles in memory to follow the cells in Morton order
+ *
+ * Particle lists become scattered in memory as particles move between cells.
+ * With linked lists, all particles are copied to a buffer and the particle
+ * arena is reset so that the particles of consecutive cells are allocated
+ * from consecutive addresses. With particle arrays, the streams of each cell
+ * are reallocated in the same order. The order of particles within a cell is
+ * preserved.
+ */
+void Tgrid::sort_particles()
+{
+    MSGFUNCTIONCALL("Tgrid::sort_particles");
+    const int ncells = morton_order.size();
+#ifndef USE_PARTICLE_ARRAYS
+    std::vector<TLinkedParticle> buffer;
+    std::vector<int> counts;
+    buffer.reserve(n_particles);
+    sortExtract ex(buffer,counts);
+    for (int m=0; m<ncells; m++) {
+        cells[morton_order[m]]->cellPassRecursive(ex);
+    }
+    particleArena.reset();
+    sortInsert ins(buffer,counts);
+    for (int m=0; m<ncells; m++) {
+        cells[morton_order[m]]->cellPassRecursive(ins);
+    }
+#else
+    sortInsert ins;
+    for (int m=0; m<ncells; m++) {
+        cells[morton_order[m]]->cellPassRecursive(ins);
     }
 #endif
-    n_particles++;
+    MSGFUNCTIONEND("Tgrid::sort_particles");
 }
 
-//! Find the particle's list
-TParticleList *Tgrid::find_plist(const TLinkedParticle& p)
+//! (MPI) True if flat index c is an interior (non-ghost) base cell
+inline bool Tgrid::is_interior_base(int c) const
 {
-    const shortreal r[3] = {p.x,p.y,p.z};
-    TCellPtr c = findcell(r);
-    if (!c) {
-        errorlog << "WARNING: Tgrid::find_plist" << Tr3v(r).toString() << " out of box\n";
-        return 0;
+    int i,j,k;
+    decompose(c,i,j,k);
+    return i >= 1 && i <= nx-2 && j >= 1 && j <= ny-2 && k >= 1 && k <= nz-2;
+}
+
+/** \brief (MPI) Divide the base cells between the ranks
+ *
+ * Each rank gets a contiguous run of morton_order with an equal number of
+ * interior base cells (the ghost cells have no particles). The runs are
+ * compact regions, so that the particles migrate only across the
+ * surfaces of the regions.
+ */
+void Tgrid::partition_base_cells()
+{
+    const int nranks = Decomposition::getNranks();
+    const int ncells = morton_order.size();
+    base_owner.assign(ncells,0);
+    if (nranks <= 1) {
+        return;
     }
-    return &(c->plist);
+    vector<real> cost(ncells,0.0);
+    for (int c=0; c<ncells; c++) {
+        if (is_interior_base(c) == true) {
+            cost[c] = 1.0;
+        }
+    }
+    assign_base_owners(cost);
+    vector<int> owned(nranks,0);
+    for (int c=0; c<ncells; c++) {
+        if (is_interior_base(c) == true) {
+            owned[base_owner[c]]++;
+        }
+    }
+    mainlog << "|---------------- MPI DECOMPOSITION ----------------|\n"
+            << "| Ranks = " << nranks << "\n"
+            << "| Interior base cells per rank = " << *min_element(owned.begin(),owned.end())
+            << "..." << *max_element(owned.begin(),owned.end()) << "\n"
+            << "|---------------------------------------------------|\n";
 }
 
-//! Returns the number of particles deleted
-int Tgrid::Tcell::particle_pass_recursive(bool (*op)(TLinkedParticle& p, ParticlePassArgs a), bool relocate)
+/** \brief (MPI) Load balancing: divide the base cells between the ranks by their cost
+ *
+ * The cost of an interior base cell is the number of its macroparticles
+ * plus cellWeight times the number of its cells, i.e. the work of the
+ * rank owning it in macroparticle pushes. The costs are summed over the
+ * ranks, so that every rank computes the same new partition, and
+ * morton_order is cut into runs of equal cost. Only the particles of the
+ * base cells that change owner are sent (migrate_particles). Returns the
+ * number of base cells that changed owner, imbalance = (largest rank
+ * cost)/(average rank cost) before and after and the number of sent
+ * particles (sum over the ranks).
+ */
+int Tgrid::balance_load(real cellWeight, real& imbalanceBefore, real& imbalanceAfter, real& nmovedParticles)
 {
-    int ndel = 0;
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) ndel+= child[0][0][ch]->particle_pass_recursive(op,relocate);
-    } else {
-        // Set arguments for the particle pass function
-        ParticlePassArgs a;
-        a.rho_q = this->rho_q;
-        a.size = this->size;
-        if (relocate) {
-            ndel = plist.pass_with_relocate(op,a);
-        } else {
-            ndel = plist.pass(op,a);
+    imbalanceBefore = imbalanceAfter = 1.0;
+    nmovedParticles = 0;
+    const int nranks = Decomposition::getNranks();
+    if (nranks <= 1) {
+        return 0;
+    }
+    const int rank = Decomposition::getRank();
+    const int ncells = morton_order.size();
+    vector<real> cost(ncells,0.0);
+    for (int c=0; c<ncells; c++) {
+        if (base_owner[c] == rank && is_interior_base(c) == true) {
+            cost[c] = cells[c]->Nparticles_recursive() + cellWeight*cells[c]->Ncells_recursive();
         }
     }
-    return ndel;
+    Decomposition::sum(&cost[0],ncells);
+    real total = 0.0;
+    for (int c=0; c<ncells; c++) {
+        total += cost[c];
+    }
+    if (total <= 0.0) {
+        return 0;
+    }
+    imbalanceBefore = rank_imbalance(cost);
+    const vector<int> oldOwner = base_owner;
+    assign_base_owners(cost);
+    imbalanceAfter = rank_imbalance(cost);
+    int nmoved = 0;
+    for (int c=0; c<ncells; c++) {
+        if (base_owner[c] != oldOwner[c]) {
+            nmoved++;
+            if (oldOwner[c] == rank) {
+                nmovedParticles += cells[c]->Nparticles_recursive();
+            }
+        }
+    }
+    Decomposition::sum(&nmovedParticles,1);
+    if (nmoved > 0) {
+        migrate_particles();
+    }
+    return nmoved;
 }
 
-//! Pass all particles in the list to the function op
-int Tgrid::particle_pass(bool (*op)(TLinkedParticle& p, ParticlePassArgs a), bool relocate)
+/** \brief (MPI) Set base_owner by cutting morton_order into nranks runs of equal cost
+ *
+ * A base cell goes to the rank in which the cost of the preceding cells
+ * of morton_order falls, the cost must have a positive sum.
+ */
+void Tgrid::assign_base_owners(const vector<real>& cost)
 {
-    int i,j,k,ndel=0;
-    TCellPtr c;
-    ForAll(i,j,k) {
-        c = cells[flatindex(i,j,k)];
-        ndel+= c->particle_pass_recursive(op,relocate);
+    const int nranks = Decomposition::getNranks();
+    const int ncells = morton_order.size();
+    real total = 0.0;
+    for (int c=0; c<ncells; c++) {
+        total += cost[c];
+    }
+    real prefix = 0.0;
+    for (int m=0; m<ncells; m++) {
+        const int c = morton_order[m];
+        base_owner[c] = min(nranks-1, int(prefix*nranks/total));
+        prefix += cost[c];
     }
-    n_particles-= ndel;
-    return ndel;
 }
 
-//! Return the number of macro particles (recursive)
-int Tgrid::Tcell::Nparticles_recursive() const
+//! (MPI) Largest cost of a rank divided by the average cost of the ranks
+real Tgrid::rank_imbalance(const vector<real>& cost) const
 {
-    int result = 0;
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) result+= child[0][0][ch]->Nparticles_recursive();
-    } else {
-        result = plist.Nparticles();
+    const int nranks = Decomposition::getNranks();
+    vector<real> load(nranks,0.0);
+    real total = 0.0;
+    for (unsigned int c=0; c<cost.size(); c++) {
+        load[base_owner[c]] += cost[c];
+        total += cost[c];
     }
-    return result;
+    if (total <= 0.0) {
+        return 1.0;
+    }
+    return *max_element(load.begin(),load.end())*nranks/total;
 }
 
-//! Return the number of macro particles
-int Tgrid::Nparticles() const
+//! (MPI) Flat index of the base cell containing r (r inside the box)
+inline int Tgrid::base_index(const shortreal r[3]) const
 {
-    return n_particles;
+    return flatindex(int((r[0]-x_1)*invbgdx), int((r[1]-y_1)*invbgdx), int((r[2]-z_1)*invbgdx));
+}
+
+//! (MPI) Move the particles of the leaf cells into a buffer
+struct Tgrid::migrateExtract {
+    migrateExtract(std::vector<TLinkedParticle>& b) : buffer(b), n(0) { }
+    void operator()(Tcell& cell) {
+        n += cell.plist.extract(buffer);
+    }
+    std::vector<TLinkedParticle>& buffer;
+    int n;
+};
+
+/** \brief (MPI) Send the particles in the base cells of other ranks to their owners
+ *
+ * Called after the particles have been relocated, the particles that
+ * moved out of the base cells of this rank are sent in one bulk exchange
+ * and the received particles are added to their cells.
+ */
+void Tgrid::migrate_particles()
+{
+    const int nranks = Decomposition::getNranks();
+    if (nranks <= 1) {
+        return;
+    }
+    const int rank = Decomposition::getRank();
+    vector< vector<TLinkedParticle> > out(nranks);
+    int nout = 0;
+    const int ncells = morton_order.size();
+    for (int m=0; m<ncells; m++) {
+        const int c = morton_order[m];
+        if (base_owner[c] == rank) {
+            continue;
+        }
+        migrateExtract ex(out[base_owner[c]]);
+        cells[c]->cellPassRecursive(ex);
+        nout += ex.n;
+    }
+    vector<TLinkedParticle> in;
+    Decomposition::exchange(out,in);
+    n_particles -= nout;
+    for (unsigned int p=0; p<in.size(); p++) {
+        const shortreal r[3] = {in[p].x,in[p].y,in[p].z};
+        TCellPtr c = findcell(r);
+        if (!c) {
+            errorlog << "WARNING: Tgrid::migrate_particles" << Tr3v(r).toString() << " out of box (not added)\n";
+            continue;
+        }
+        c->plist.insert(&in[p],1);
+        n_particles++;
+    }
+}
+
+/** \brief (MPI) Sum the particle deposits of the leaf cells over the ranks
+ *
+ * The particles of a rank deposit nc, rho_q and CELLDATA_Ji also to the
+ * cells of the other ranks near the boundaries of its region, the sums
+ * are the deposits of all particles on every rank. Only the leaves with
+ * deposits on a rank are sent (Decomposition::sumSparse).
+ */
+void Tgrid::sum_deposits()
+{
+    vector<TCellPtr> leaves;
+    collect_leaves(leaves);
+    const int nleaves = leaves.size();
+    vector<real> buffer(5*nleaves);
+    for (int l=0; l<nleaves; l++) {
+        real *b = &buffer[5*l];
+        b[0] = leaves[l]->nc;
+        b[1] = leaves[l]->rho_q;
+        b[2] = leaves[l]->celldata[CELLDATA_Ji][0];
+        b[3] = leaves[l]->celldata[CELLDATA_Ji][1];
+        b[4] = leaves[l]->celldata[CELLDATA_Ji][2];
+    }
+    Decomposition::sumSparse(&buffer[0],nleaves,5);
+    for (int l=0; l<nleaves; l++) {
+        const real *b = &buffer[5*l];
+        leaves[l]->nc = b[0];
+        leaves[l]->rho_q = b[1];
+        leaves[l]->celldata[CELLDATA_Ji][0] = b[2];
+        leaves[l]->celldata[CELLDATA_Ji][1] = b[3];
+        leaves[l]->celldata[CELLDATA_Ji][2] = b[4];
+    }
 }
 
 /** \brief Split&Join probability function
@@ -4388,113 +6155,424 @@ int Tgrid::forbid_split_and_join(ForbidSplitAndJoinProfile forb)
     return result;
 }
 
-//! Start temporal average (recursive)
-void Tgrid::Tcell::begin_average_recursive()
-{
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->begin_average_recursive();
-    } else {
-        ave_nc = 0.0;
-        int d;
-        for (d=0; d<3; d++) {
-            if (neighbour[d][1] == 0) continue;
-            if (isrefined_face(d,1)) {
-                int f;
-                for (f=0; f<4; f++) refintf[d][1]->face[f]->facedata[FACEDATA_AVEB] = 0;
+/** \brief Allocate the temporal averaging table
+ *
+ * The averages of all leaf cells are kept in one densely packed table
+ * instead of the cells: one row of ave_ncols accumulators per leaf cell
+ * (n, the particle number and flux sums of each population and the
+ * spectra of each population) and one FACEDATA_B accumulator per upper
+ * face of the leaf cells. Each averaging window has its own copy of the
+ * table. Window 0 is the interval average of the average hc-files, the
+ * other windows are running (exponential) averages with the time
+ * constants of Params::averageTimeConstants. The table is rebuilt (and
+ * the averages restart) if the grid is refined or recoarsened.
+ */
+void Tgrid::build_average_table()
+{
+    collect_leaves(ave_leaves);
+    ave_faces.clear();
+    const int nleaves = ave_leaves.size();
+    for (int l=0; l<nleaves; l++) {
+        Tcell *c = ave_leaves[l];
+        c->ave_row = l;
+        for (int d=0; d<3; d++) {
+            if (c->neighbour[d][1] == 0) {
+                continue;
+            }
+            if (c->isrefined_face(d,1)) {
+                for (int f=0; f<4; f++) {
+                    ave_faces.push_back(c->refintf[d][1]->face[f]);
+                }
             } else {
-                face[d][1]->facedata[FACEDATA_AVEB] = 0;
+                ave_faces.push_back(c->face[d][1]);
             }
         }
+    }
+    ave_ncols = 1;
 #ifdef SAVE_POPULATION_AVERAGES
-        for(int i = 0; i < Params::POPULATIONS; i++) {
-            pop_ave_n[i] = 0.0;
-            pop_ave_vx[i] = 0.0;
-            pop_ave_vy[i] = 0.0;
-            pop_ave_vz[i] = 0.0;
-        }
+    ave_ncols += 4*Params::pops.size();
 #endif
+    ave_spectra_col = ave_ncols;
 #ifdef SAVE_PARTICLE_CELL_SPECTRA
-        for(unsigned int i=0; i<spectra.size(); ++i) {
-            for(unsigned int j=0; j<spectra[i].size(); ++j) {
-                spectra[i][j] = 0.0;
+    ave_ncols += Params::pops.size()*Params::spectraNbins;
+    spectra_bins.resize(Params::pops.size());
+    for (unsigned int i=0; i<spectra_bins.size(); i++) {
+        spectra_bins[i].initialize(Params::spectraV2BinsPerPop[i]);
+    }
+#endif
+    const size_t ncells = static_cast<size_t>(nleaves)*ave_ncols;
+    ave_windows.clear();
+    TAverageWindow w;
+    w.tau = 0;
+    w.decay = w.gain = 1;
+    w.weight = 0;
+    ave_windows.push_back(w);
+    const int ntau = sizeof(Params::averageTimeConstants)/sizeof(Params::averageTimeConstants[0]);
+    for (int i=0; i<ntau; i++) {
+        if (Params::averageTimeConstants[i] <= 0) {
+            continue;
+        }
+        w.tau = Params::averageTimeConstants[i];
+        w.decay = exp(-Params::dt/w.tau);
+        w.gain = 1 - w.decay;
+        ave_windows.push_back(w);
+    }
+    for (unsigned int i=0; i<ave_windows.size(); i++) {
+        ave_windows[i].cells.assign(ncells,0.0);
+        ave_windows[i].faceB.assign(ave_faces.size(),0.0);
+    }
+    // Without running averages the timestep values go directly to the interval average
+    if (ave_windows.size() > 1) {
+        ave_step_cells.assign(ncells,0.0);
+        ave_step_faceB.assign(ave_faces.size(),0.0);
+        ave_deposit = &ave_step_cells[0];
+    } else {
+        vector<datareal>().swap(ave_step_cells);
+        vector<datareal>().swap(ave_step_faceB);
+        ave_deposit = &ave_windows[0].cells[0];
+    }
+    ave_view = 0;
+}
+
+//! Hash value of a row or face index of the averaging table (never null)
+static inline void *average_key(int i)
+{
+    return reinterpret_cast<void*>(static_cast<size_t>(i) + 1);
+}
+
+//! Row or face index of the averaging table at r in a hash of hash_average_table, -1 if none
+int Tgrid::average_index(const TPtrHash& h, const gridreal r[3])
+{
+    const void *p = h.read(r);
+    return p ? static_cast<int>(reinterpret_cast<size_t>(p)) - 1 : -1;
+}
+
+//! Centre point of the upper face of a leaf cell in direction d, or of its subface f (0..3) if the face is refined
+void Tgrid::upper_face_centre(const Tcell *c, int d, int f, gridreal r[3])
+{
+    for (int e=0; e<3; e++) r[e] = c->centroid[e];
+    r[d]+= 0.5*c->size;
+    if (c->isrefined_face(d,1)) {
+        r[(d+1)%3]+= ((f & 1) ? 0.25 : -0.25)*c->size;
+        r[(d+2)%3]+= ((f & 2) ? 0.25 : -0.25)*c->size;
+    }
+}
+
+/** \brief Index the averaging table by position before the grid is adapted
+ *
+ * Rows are keyed by the centroids of ave_leaves and faces by the centres
+ * of ave_faces, one hash per normal direction (see remap_average_table).
+ */
+void Tgrid::hash_average_table(TPtrHash& cellhash, TPtrHash *facehash[3]) const
+{
+    const int nleaves = ave_leaves.size();
+    int nf = 0;
+    gridreal r[3];
+    for (int l=0; l<nleaves; l++) {
+        const Tcell *c = ave_leaves[l];
+        cellhash.add(c->centroid,average_key(l));
+        for (int d=0; d<3; d++) {
+            if (c->neighbour[d][1] == 0) {
+                continue;
+            }
+            const int nsub = c->isrefined_face(d,1) ? 4 : 1;
+            for (int f=0; f<nsub; f++, nf++) {
+                upper_face_centre(c,d,f,r);
+                facehash[d]->add(r,average_key(nf));
             }
         }
-#endif
     }
 }
 
-//! End temporal average (recursive)
-void Tgrid::Tcell::end_average_recursive(real inv_ave_ntimes)
+/** \brief Old faces of the averaging table covering a face (remap_average_table)
+ *
+ * The face is centred at r, normal to d and has side h. Returns the
+ * number of old faces (index, weight): the same face, the coarser face
+ * containing it or the four subfaces of it. Returns 0 for a new face.
+ */
+int Tgrid::average_face_sources(TPtrHash *facehash[3], const gridreal r[3], int d, gridreal h, int index[4], real weight[4])
 {
-    if (haschildren) {
-        int ch;
-        for (ch=0; ch<8; ch++) child[0][0][ch]->end_average_recursive(inv_ave_ntimes);
-    } else {
-        ave_nc*= inv_ave_ntimes;
-        int d;
-        for (d=0; d<3; d++) {
-            if (neighbour[d][1] == 0) continue;
-            if (isrefined_face(d,1)) {
-                int f;
-                for (f=0; f<4; f++) refintf[d][1]->face[f]->facedata[FACEDATA_AVEB]*= inv_ave_ntimes;
-            } else {
-                face[d][1]->facedata[FACEDATA_AVEB]*= inv_ave_ntimes;
+    const int d1 = (d+1)%3, d2 = (d+2)%3;
+    int i = average_index(*facehash[d],r);
+    if (i >= 0) {
+        index[0] = i;
+        weight[0] = 1;
+        return 1;
+    }
+    gridreal q[3];
+    int a;
+    for (a=0; a<4; a++) {
+        q[d] = r[d];
+        q[d1] = r[d1] + ((a & 1) ? 0.5 : -0.5)*h;
+        q[d2] = r[d2] + ((a & 2) ? 0.5 : -0.5)*h;
+        i = average_index(*facehash[d],q);
+        if (i >= 0) {
+            index[0] = i;
+            weight[0] = 1;
+            return 1;
+        }
+    }
+    for (a=0; a<4; a++) {
+        q[d] = r[d];
+        q[d1] = r[d1] + ((a & 1) ? 0.25 : -0.25)*h;
+        q[d2] = r[d2] + ((a & 2) ? 0.25 : -0.25)*h;
+        index[a] = average_index(*facehash[d],q);
+        weight[a] = 0.25;
+        if (index[a] < 0) {
+            return 0;
+        }
+    }
+    return 4;
+}
+
+/** \brief Carry the temporal averages over to the adapted grid
+ *
+ * The table is rebuilt for the new leaf cells and filled from the old
+ * table indexed by hash_average_table. A refined cell gives its n average
+ * to its children and 1/8 of its particle sums to each, the children of a
+ * recoarsened cell give the mean of their n and the sum of their particle
+ * sums. Faces take the value of the same face, the coarser face containing
+ * them or the mean of their old subfaces, and the faces inside a refined
+ * cell the mean of the two faces on the same line. The window weights are
+ * kept, so the averages continue.
+ */
+void Tgrid::remap_average_table(const TPtrHash& cellhash, TPtrHash *facehash[3])
+{
+    vector<TAverageWindow> old;
+    old.swap(ave_windows);
+    build_average_table();
+    const int nwindows = ave_windows.size();
+    int w;
+    for (w=0; w<nwindows; w++) {
+        ave_windows[w].weight = old[w].weight;
+    }
+    const int nleaves = ave_leaves.size();
+    int nf = 0;
+    int index[8];
+    real wn[8], wsum[8];
+    gridreal r[3];
+    for (int l=0; l<nleaves; l++) {
+        const Tcell *c = ave_leaves[l];
+        int n = 0;
+        int i = average_index(cellhash,c->centroid);
+        if (i >= 0) {
+            index[0] = i;
+            wn[0] = wsum[0] = 1;
+            n = 1;
+        } else if (c->parent != 0 && (i = average_index(cellhash,c->parent->centroid)) >= 0) {
+            index[0] = i;
+            wn[0] = 1;
+            wsum[0] = 0.125;
+            n = 1;
+        } else {
+            for (int ch=0; ch<8; ch++) {
+                r[0] = c->centroid[0] + ((ch & 4) ? 0.25 : -0.25)*c->size;
+                r[1] = c->centroid[1] + ((ch & 2) ? 0.25 : -0.25)*c->size;
+                r[2] = c->centroid[2] + ((ch & 1) ? 0.25 : -0.25)*c->size;
+                index[ch] = average_index(cellhash,r);
+                wn[ch] = 0.125;
+                wsum[ch] = 1;
             }
+            n = 8;
+            for (int ch=0; ch<8; ch++) if (index[ch] < 0) n = 0;
         }
-#if defined(SAVE_POPULATION_AVERAGES) || defined(SAVE_PARTICLE_CELL_SPECTRA)
-#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
-        gridreal invvol = 1.0/(size*size*size);
-#else
-        gridreal invvol = 1.0/abs(sph_dV);
-#endif
-#endif
-#ifdef SAVE_POPULATION_AVERAGES
-        for (int i = 0; i < Params::POPULATIONS; ++i) {
-            gridreal inv_sum_w = 0;
-            if(pop_ave_n[i] > 0) {
-                inv_sum_w = 1.0/pop_ave_n[i];
+        for (w=0; w<nwindows; w++) {
+            datareal *row = &ave_windows[w].cells[static_cast<size_t>(l)*ave_ncols];
+            for (int k=0; k<n; k++) {
+                const datareal *oldrow = &old[w].cells[static_cast<size_t>(index[k])*ave_ncols];
+                row[0]+= wn[k]*oldrow[0];
+                for (int col=1; col<ave_ncols; col++) row[col]+= wsum[k]*oldrow[col];
             }
-            pop_ave_n[i] *= invvol;
-            pop_ave_vx[i] *= inv_sum_w;
-            pop_ave_vy[i] *= inv_sum_w;
-            pop_ave_vz[i] *= inv_sum_w;
-            pop_ave_n[i] *= inv_ave_ntimes;
         }
-#endif
-#ifdef SAVE_PARTICLE_CELL_SPECTRA
-        for(unsigned int i=0; i<spectra.size(); ++i) {
-            const real norm = invvol*inv_ave_ntimes/(Params::spectra_dE_eV[i]*4*pi);
-            for(unsigned int j=0; j<spectra[i].size(); ++j) {
-                spectra[i][j] *= norm;
+        for (int d=0; d<3; d++) {
+            if (c->neighbour[d][1] == 0) {
+                continue;
+            }
+            const bool refined = c->isrefined_face(d,1);
+            const int nsub = refined ? 4 : 1;
+            const gridreal h = refined ? 0.5*c->size : c->size;
+            for (int f=0; f<nsub; f++, nf++) {
+                upper_face_centre(c,d,f,r);
+                n = average_face_sources(facehash,r,d,h,index,wn);
+                if (n == 0) {
+                    // Face inside a refined cell: mean of the faces at the cell surface
+                    for (int dir=0; dir<2; dir++) {
+                        gridreal q[3] = {r[0], r[1], r[2]};
+                        q[d]+= (2*dir-1)*h;
+                        const int m = average_face_sources(facehash,q,d,h,&index[n],&wn[n]);
+                        for (int k=n; k<n+m; k++) wn[k]*= 0.5;
+                        n+= m;
+                    }
+                }
+                for (w=0; w<nwindows; w++) {
+                    datareal sum = 0;
+                    for (int k=0; k<n; k++) sum+= wn[k]*old[w].faceB[index[k]];
+                    ave_windows[w].faceB[nf] = sum;
+                }
             }
         }
-#endif
     }
 }
 
-//! Start temporal average
+/** \brief Add the timestep to the temporal averages (after finalize_accum)
+ *
+ * The particles were deposited by average_PIC during the timestep, here n
+ * and FACEDATA_B are added. With running averages the timestep is then
+ * flushed to every window by flat loops over the table and zeroed.
+ */
+void Tgrid::accumulate_average()
+{
+    const int nleaves = ave_leaves.size();
+    const int nfaces = ave_faces.size();
+    const bool stepBuffer = ave_windows.size() > 1;
+    datareal *faceB = stepBuffer ? &ave_step_faceB[0] : &ave_windows[0].faceB[0];
+    for (int l=0; l<nleaves; l++) {
+        ave_deposit[static_cast<size_t>(l)*ave_ncols] += ave_leaves[l]->nc;
+    }
+    for (int f=0; f<nfaces; f++) {
+        faceB[f] += ave_faces[f]->facedata[FACEDATA_B];
+    }
+    if (stepBuffer == false) {
+        ave_windows[0].weight += 1;
+        return;
+    }
+    const size_t ncells = ave_step_cells.size();
+    const datareal *stepCells = &ave_step_cells[0];
+    for (unsigned int i=0; i<ave_windows.size(); i++) {
+        TAverageWindow& w = ave_windows[i];
+        const datareal decay = w.decay;
+        const datareal gain = w.gain;
+        datareal *a = &w.cells[0];
+        for (size_t j=0; j<ncells; j++) {
+            a[j] = decay*a[j] + gain*stepCells[j];
+        }
+        a = &w.faceB[0];
+        for (int f=0; f<nfaces; f++) {
+            a[f] = decay*a[f] + gain*faceB[f];
+        }
+        w.weight = decay*w.weight + gain;
+    }
+    memset(&ave_step_cells[0],0,ncells*sizeof(datareal));
+    memset(faceB,0,nfaces*sizeof(datareal));
+}
+
+//! Start temporal average (interval average, running averages continue)
 void Tgrid::begin_average()
 {
-    int i,j,k;
-    ForAll(i,j,k) cells[flatindex(i,j,k)]->begin_average_recursive();
-    ave_ntimes = 0;
+    if (ave_windows.empty()) {
+        build_average_table();
+    }
+    TAverageWindow& w = ave_windows[0];
+    memset(&w.cells[0],0,w.cells.size()*sizeof(datareal));
+    if (w.faceB.size() > 0) {
+        memset(&w.faceB[0],0,w.faceB.size()*sizeof(datareal));
+    }
+    w.weight = 0;
+    ave_view = 0;
 }
 
-//! End temporal average
+/** \brief End temporal average
+ *
+ * The table keeps the sums, they are normalized when read (Tcell::ave_n
+ * etc.) so there is nothing to do here but check that the interval had
+ * timesteps.
+ */
 bool Tgrid::end_average()
 {
-    if (ave_ntimes <= 0) {
-        errorlog << "*** Tgrid::end_average: ave_ntimes=" << ave_ntimes << "\n";
+    if (ave_windows.empty() || ave_windows[0].weight <= 0) {
+        errorlog << "*** Tgrid::end_average: no timesteps averaged\n";
         return false;
     }
-    const real inv_ave_ntimes = 1.0/ave_ntimes;
-    int i,j,k;
-    ForAll(i,j,k) cells[flatindex(i,j,k)]->end_average_recursive(inv_ave_ntimes);
-    ave_ntimes = 0;
     return true;
 }
 
+/** \brief Select the averaging window read by Tcell::ave_* and FACEDATA_AVEB
+ *
+ * Copies the normalized face averages of the window to FACEDATA_AVEB.
+ * Returns false if the window has no timesteps.
+ */
+bool Tgrid::select_average(int w)
+{
+    ave_view = 0;
+    if (w < 0 || w >= average_windows() || ave_windows[w].weight <= 0) {
+        return false;
+    }
+    const TAverageWindow& win = ave_windows[w];
+    ave_view = &win.cells[0];
+    ave_view_scale = 1.0/win.weight;
+    const datareal scale = ave_view_scale;
+    const int nfaces = ave_faces.size();
+    for (int f=0; f<nfaces; f++) {
+        ave_faces[f]->facedata[FACEDATA_AVEB] = scale*win.faceB[f];
+    }
+    return true;
+}
+
+//! Time constant of an averaging window [s], 0 = interval average
+real Tgrid::average_time_constant(int w) const
+{
+    return ave_windows[w].tau;
+}
+
+//! Temporally averaged density of the selected averaging window [#/m^3]
+real Tgrid::Tcell::ave_n() const
+{
+    if (ave_view == 0 || haschildren) {
+        return 0;
+    }
+    return ave_view_scale*ave_view[static_cast<size_t>(ave_row)*ave_ncols];
+}
+
+#ifdef SAVE_POPULATION_AVERAGES
+//! Temporally averaged density and velocity of the populations in popId of the selected averaging window
+void Tgrid::Tcell::ave_population(const vector<int>& popId, real& n, real& vx, real& vy, real& vz) const
+{
+    n = vx = vy = vz = 0;
+    if (ave_view == 0 || haschildren) {
+        return;
+    }
+    const datareal *row = ave_view + static_cast<size_t>(ave_row)*ave_ncols;
+    for (unsigned int i=0; i<popId.size(); i++) {
+        const datareal *pop = row + 1 + 4*popId[i];
+        n += pop[0];
+        vx += pop[1];
+        vy += pop[2];
+        vz += pop[3];
+    }
+    if (n > 0) {
+        vx /= n;
+        vy /= n;
+        vz /= n;
+    }
+#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
+    n *= ave_view_scale/(size*size*size);
+#else
+    n *= ave_view_scale/abs(sph_dV);
+#endif
+}
+#endif
+
+#ifdef SAVE_PARTICLE_CELL_SPECTRA
+//! Temporally averaged energy spectrum bin of the populations in popId of the selected averaging window
+real Tgrid::Tcell::ave_spectrum(const vector<int>& popId, int bin) const
+{
+    if (ave_view == 0 || haschildren) {
+        return 0;
+    }
+    const datareal *row = ave_view + static_cast<size_t>(ave_row)*ave_ncols + ave_spectra_col;
+    real sum = 0;
+    for (unsigned int i=0; i<popId.size(); i++) {
+        sum += row[popId[i]*Params::spectraNbins + bin];
+    }
+#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
+    const real invvol = 1.0/(size*size*size);
+#else
+    const real invvol = 1.0/abs(sph_dV);
+#endif
+    return sum*ave_view_scale*invvol/(Params::spectra_dE_eV[bin]*4*pi);
+}
+#endif
+
 //! Prepare Probability Density Functions in the grid (recursive)
 void Tgrid::Tcell::prepare_PDF_recursive(ScalarField* pdffunc, Tgrid* g)
 {
@@ -4516,8 +6594,10 @@ void Tgrid::prepare_PDF(ScalarField* pdffunc, TPDF_ID& pdfid, real& cumsumvalue)
         doabort();
     }
     pdfid = n_pdftables;
+    pdftables[n_pdftables].func = pdffunc;
     if (n_pdftables == 0) {
-        const int n = Ncells_without_ghosts();
+        // plus 1 for the first element of the cumsum table
+        const int n = Ncells_without_ghosts() + 1;
         pdftables[n_pdftables].n = n;
         pdftables[n_pdftables].cellptrs = new TCellPtr [n];
     } else {
@@ -4557,6 +6637,29 @@ void Tgrid::prepare_PDF(ScalarField* pdffunc, TPDF_ID& pdfid, real& cumsumvalue)
     n_pdftables++;
 }
 
+/** \brief Prepare the PDF tables again for the leaf cells of the adapted grid
+ *
+ * The tables keep their IDs. The total rates computed by prepare_PDF at
+ * initialization are not changed.
+ */
+void Tgrid::rebuild_PDF()
+{
+    const int ntables = n_pdftables;
+    ScalarField *funcs[MAX_PDFTABLES];
+    int i;
+    for (i=0; i<ntables; i++) {
+        funcs[i] = pdftables[i].func;
+        delete [] pdftables[i].cpdf;
+        delete [] pdftables[i].cellptrs;
+    }
+    n_pdftables = 0;
+    for (i=0; i<ntables; i++) {
+        TPDF_ID pdfid;
+        real cumsumvalue;
+        prepare_PDF(funcs[i],pdfid,cumsumvalue);
+    }
+}
+
 /** \brief Locate
  *
  * Given array xx[1..n] and given value x, returns value j such that x is between
@@ -4615,41 +6718,48 @@ void Tgrid::generate_random_point(const TPDF_ID& pdfid, gridreal r[3])
 }
 
 //! NGP interpolation
-void Tgrid::cellintpol(const shortreal r[3], TCellDataSelect s, real result[3])
+void Tgrid::cellintpol(const shortreal r[3], TCellDataSelect s, real result[3], CellCursor& cur)
 {
     int d;
-    Tcell *const c = findcell(r);
+    Tcell *const c = findcell(r,cur);
     if(!c) {
         ERRORMSG("NULL cell pointer");
         doabort();
     }
     for (d=0; d<3; d++) result[d] = c->celldata[s][d];
-    saved_cellptr = c;
+    cur.cell = c;
 }
 
-//! NGP interpolation (use saved cellptr)
-void Tgrid::cellintpol(TCellDataSelect s, real result[3]) const
+//! NGP interpolation (use the cell of the previous interpolation)
+void Tgrid::cellintpol(TCellDataSelect s, real result[3], const CellCursor& cur) const
 {
     int d;
-    for (d=0; d<3; d++) result[d] = saved_cellptr->celldata[s][d];
+    for (d=0; d<3; d++) result[d] = cur.cell->celldata[s][d];
 }
 
-//! Interpolation of fluid parameters in a cell (use saved cellptr)
-void Tgrid::cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, vector<int> popId)
+//! Number density and charge density of all particles (use the cell of the previous interpolation)
+void Tgrid::cellintpol_density(real& n, real& rho_q, const CellCursor& cur) const
 {
-    saved_cellptr->cellintpol_fluid(n, vx, vy, vz, P, popId);
+    n = cur.cell->nc;
+    rho_q = cur.cell->rho_q;
+}
+
+//! Interpolation of fluid parameters in a cell (use the cell of the previous interpolation)
+void Tgrid::cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, vector<int> popId, const CellCursor& cur)
+{
+    cur.cell->cellintpol_fluid(n, vx, vy, vz, P, popId);
 }
 
 //! Interpolation of fluid parameters in a cell
-void Tgrid::cellintpol_fluid(const shortreal r[3], real& n, real& vx, real& vy, real& vz, real& P, vector<int> popId)
+void Tgrid::cellintpol_fluid(const shortreal r[3], real& n, real& vx, real& vy, real& vz, real& P, vector<int> popId, CellCursor& cur)
 {
-    Tcell *const c = findcell(r);
+    Tcell *const c = findcell(r,cur);
     if(!c) {
         ERRORMSG("NULL cell pointer");
         doabort();
     }
-    saved_cellptr = c;
-    cellintpol_fluid(n, vx, vy, vz, P, popId);
+    cur.cell = c;
+    cellintpol_fluid(n, vx, vy, vz, P, popId, cur);
 }
 
 //! Constructor
@@ -4664,21 +6774,31 @@ void FieldCounter::reset()
     cutRateE = 0.0;
     cutRateRhoQ = 0.0;
     cutRateUe = 0.0;
+    fastDepositRate = 0.0;
+    slowDepositRate = 0.0;
     resetTimestep = Params::cnt_dt;
 }
 
 //! Finalize results
 void FieldCounter::finalize()
 {
+    // Deposits made outside particle push blocks
+    fastDepositRate += fast_deposits;
+    slowDepositRate += slow_deposits;
+    fast_deposits = slow_deposits = 0.0;
     real timeSteps = static_cast<real>(1+Params::cnt_dt - Tgrid::fieldCounter.resetTimestep);
     if(timeSteps > 0) {
         cutRateE /= timeSteps;
         cutRateRhoQ /= timeSteps;
         cutRateUe /= timeSteps;
+        fastDepositRate /= timeSteps;
+        slowDepositRate /= timeSteps;
     } else {
         cutRateE = 0;
         cutRateRhoQ = 0;
         cutRateUe = 0;
+        fastDepositRate = 0;
+        slowDepositRate = 0;
     }
 }
 
@@ -5018,11 +7138,11 @@ void Tgrid::sph_init(int nx1, int ny1, int nz1, gridreal x1, gridreal y1, gridre
     } else {
         onlyOneTgridObject = true;
     }
-    saved_cellptr = 0;
+    cursor.reset();
     n_particles = 0;
+    owned_injection = false;
     n_pdftables = 0;
-    ave_ntimes = 0;
-    previous_found_cell = 0;
+    ave_deposit = 0;
     nx = nx1 + 2;
     ny = ny1 + 2;
     nz = nz1 + 2;
@@ -5123,15 +7243,6 @@ void Tgrid::sph_init(int nx1, int ny1, int nz1, gridreal x1, gridreal y1, gridre
         cells[c]->nc = 0.0;
         cells[c]->rho_q = 0.0;
         cells[c]->rho_q_bg = 0.0;
-        cells[c]->ave_nc = 0.0;
-#ifdef SAVE_POPULATION_AVERAGES
-        for (int l = 0; l < Params::POPULATIONS; ++l) {
-            cells[c]->pop_ave_n.push_back(0.0);
-            cells[c]->pop_ave_vx.push_back(0.0);
-            cells[c]->pop_ave_vy.push_back(0.0);
-            cells[c]->pop_ave_vz.push_back(0.0);
-        }
-#endif
         memset(&cells[c]->celldata[0][0],0,sizeof(datareal)*NCELLDATA*3);
         cells[c]->centroid[0] = x_1 + (i+0.5)*bgdx;
         cells[c]->centroid[1] = y_1 + (j+0.5)*sph_bgdy;
@@ -5270,6 +7381,7 @@ void Tgrid::sph_init(int nx1, int ny1, int nz1, gridreal x1, gridreal y1, gridre
                 if (i > 0         ) cells[c]->face[2][1]->node[3] = nodes[flatindex(i-1,j,  k)];
             }
     delete [] nodes;
+    build_morton_order();
     MSGFUNCTIONEND("Tgrid::sph_init");
 }
 
@@ -7337,7 +9449,7 @@ void Tgrid::sph_faceintpol(shortreal r[3], TFaceDataSelect s, real result[3])
         //dSt[2] = rc*dr*dtheta;
         //result[2] = ((1-t)*c->face[2][0]->facedata[s]/dS1[2] + t*c->face[2][1]->facedata[s]/dS2[2])*dSt[2];
     }
-    saved_cellptr = c;
+    cursor.cell = c;
 }
 
 
@@ -8636,10 +10748,7 @@ inline gridreal Tgrid::sph_accumulate_PIC_recursive(const TBoxDef& cloudbox, Tce
     }
 #ifdef SAVE_POPULATION_AVERAGES
     if (Params::averaging == true) {
-        c->pop_ave_n[popid] += accum_w;
-        c->pop_ave_vx[popid] += accum_w*v[0];
-        c->pop_ave_vy[popid] += accum_w*v[1];
-        c->pop_ave_vz[popid] += accum_w*v[2];
+        average_population(c,accum_w,v,popid);
     }
 #endif
     return accum;
@@ -8803,22 +10912,6 @@ void Tgrid::sph_finalize_accum_recursive(Tcell *c)
             Tgrid::fieldCounter.cutRateRhoQ += 1.0;
 #endif
         }
-        // Averaging
-        if (Params::averaging == true) {
-            c->ave_nc+= c->nc;
-            for (int d=0; d<3; d++) {
-                if (c->neighbour[d][1] == 0) {
-                    continue;
-                }
-                if (c->isrefined_face(d,1)) {
-                    for (int f=0; f<4; f++) {
-                        c->refintf[d][1]->face[f]->facedata[FACEDATA_AVEB] += c->refintf[d][1]->face[f]->facedata[FACEDATA_B];
-                    }
-                } else {
-                    c->face[d][1]->facedata[FACEDATA_AVEB] += c->face[d][1]->facedata[FACEDATA_B];
-                }
-            }
-        }
     }
 }
 
@@ -8832,9 +10925,9 @@ void Tgrid::sph_finalize_accum()
         c = flatindex(i,j,k);
         sph_finalize_accum_recursive(cells[c]);
     }
-// Averaging
+    // Averaging
     if (Params::averaging == true) {
-        ave_ntimes++;
+        accumulate_average();
     }
 }
 
@@ -9379,10 +11472,10 @@ void Tgrid::sph_boundarypass(int dim, bool toRight, void (*funcB)(datareal cdata
 //! (SPHERICAL) Spherical version of "cellintpol_fluid". Calculate fluid parameters in the cell: n, avg(v) and P=nT (use particle mass of the population popID[0])
 void Tgrid::Tcell::sph_cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, vector<int> popId)
 {
-    n = plist.calc_mass(popId)/(Params::pops[popId[0]]->m*sph_dV);
+    n = moment_mass(popId)/(Params::pops[popId[0]]->m*sph_dV);
     vx = vy = vz = 0;
-    plist.calc_avev(vx, vy, vz, popId);
-    const real T = 0.5*plist.calc_avemv2(vx, vy, vz, popId);
+    moment_avev(vx, vy, vz, popId);
+    const real T = 0.5*moment_avemv2(vx, vy, vz, popId);
     P = n*T;
 }
 
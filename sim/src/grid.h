@@ -29,6 +29,7 @@
 #include "forbidsplitjoin.h"
 #include "backgroundcharge.h"
 #include "magneticfield.h"
+#include "spectrabins.h"
 
 //! Magnetic field log
 struct MagneticLog {
@@ -50,6 +51,8 @@ struct FieldCounter {
     real cutRateE;
     real cutRateRhoQ;
     real cutRateUe;
+    real fastDepositRate; //!< accumulate_PIC deposits through the uniform stencil path
+    real slowDepositRate; //!< accumulate_PIC deposits through the general path
     int resetTimestep;
     FieldCounter();
     void reset();
@@ -81,6 +84,7 @@ public:
     enum {NNODEDATA=7};
     enum {NCELLDATA=10};
 #endif
+    enum {N_MHD_VALUES=11}; //!< Values per leaf cell in MHD hc-files (rho, rhov, U1, B1, B0)
     //! Get nth bit of word (n=0 is leftmost)
     static bool GetBit(int word, int n) {
         return (word & (1 << n)) != 0;
@@ -100,6 +104,7 @@ private:
     struct Trefintf; //!< Grid cell refinement interface
     struct Tface; //!< Grid cell face
     struct Tnode; //!< Grid cell node
+    class TPtrHash; //!< Hash of pointers by coordinates
     typedef Tnode *TNodePtr; //! Grid node pointer
     typedef Tface *TFacePtr; //! Grid face pointer
     typedef Tcell *TCellPtr; //! Grid cell pointer
@@ -136,54 +141,53 @@ private:
         datareal nc; //!< Number density of the physical particles inside the cell [#/m^3]
         datareal rho_q; //!< Charge density inside the cell [C/m^3]
         datareal rho_q_bg; //!< Background charge density inside the cell [C/m^3]
-        datareal ave_nc; //!< Temporally averaged density inside the cell [#/m^3]
-#ifdef SAVE_POPULATION_AVERAGES
-        std::vector<datareal> pop_ave_n; //!< Temporal population average: density
-        std::vector<datareal> pop_ave_vx; //!< Temporal population average: vx
-        std::vector<datareal> pop_ave_vy; //!< Temporal population average: vy
-        std::vector<datareal> pop_ave_vz; //!< Temporal population average: vz
-#endif
-#ifdef SAVE_PARTICLE_CELL_SPECTRA
-        std::vector< std::vector<datareal> > spectra; //!< Particle cell energy spectra
-#endif
+        int ave_row; //!< Leaf cell: row of the temporal averaging table (Tgrid::ave_windows), valid while the table is allocated
         datareal celldata[NCELLDATA][3]; //!< Cell data
         gridreal centroid[3]; //!< Centroid coordinates of the cell
         gridreal r2; //!< Square of the distance to the box origin [m^2]
         gridreal size; //!< Side length of the cell [m]
         gridreal invsize; //!< 1.0/size [1/m]
         TParticleList plist; //!< List of macroparticles residing in this cell
+        TParticleMoments *moments; //!< Leaf cell: row of Tgrid::moment_table, valid only while Tgrid::moment_table_valid
         real faceave(int dim, int dir, TFaceDataSelect s) const;
         void childave(TCellDataSelect cs, real result[3]) const;
         real childave_rhoq() const;
         real childave_nc() const;
+        real ave_n() const;
+#ifdef SAVE_POPULATION_AVERAGES
+        void ave_population(const std::vector<int>& popId, real& n, real& vx, real& vy, real& vz) const;
+#endif
+#ifdef SAVE_PARTICLE_CELL_SPECTRA
+        real ave_spectrum(const std::vector<int>& popId, int bin) const;
+#endif
+        void FC1(TFaceDataSelect fs, TCellDataSelect cs);
         void FC_recursive(TFaceDataSelect fs, TCellDataSelect cs);
-        void NC_smoothing_recursive();
-        void NC_recursive(TNodeDataSelect ns,TCellDataSelect cs);
-        void CN_recursive(TCellDataSelect cs, TNodeDataSelect ns);
-        void CN_smoothing_recursive();
-        void CN_rhoq_recursive();
-        void CN_donor_recursive(TCellDataSelect cs, TNodeDataSelect ns, TNodeDataSelect uns, real dt);
+        void NC1_smoothing();
+        void NC1(TNodeDataSelect ns,TCellDataSelect cs);
         void zero_rhoq_nc_Vq_recursive();
-        void calc_ue_recursive(void);
-        void calc_node_E_recursive(void);
-        void calc_cell_E_recursive(void);
+        void calc_ue1(void);
+        void calc_cell_E1(void);
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
         void sph_calc_cell_E_recursive(void);
 #endif
-        void FaceCurl_recursive(TNodeDataSelect nsB, TFaceDataSelect fsj, int d, real factor);
-        void NF_recursive(TNodeDataSelect ns, TFaceDataSelect fs, int d);
-        void NF_rhoq_recursive(int d);
-        void FacePropagate_recursive(TFaceDataSelect Bold, TFaceDataSelect Bnew, real dt);
         void set_B_recursive(void (*)(const gridreal[3], datareal[3]));
         void set_bgRhoQ_recursive(BackgroundChargeDensityProfile func);
         void calc_facediv_recursive(TFaceDataSelect fs, MagneticLog& result) const;
-        void CalcGradient_rhoq_recursive();
+        void CalcGradient_rhoq1();
         int Ncells_recursive() const;
         int Nfaces() const;
         int Nparticles_recursive() const;
         void enum_children_recursive();
-        void writeMHD_children_recursive(std::ostream& o,const int filetype,std::vector<int> popId) const;
-        void writeMHD(std::ostream& o,const int filetype,std::vector<int> popId) const;
+        void writeMHD_children_recursive(std::ostream& o,const int filetype,const std::vector<int>& popId) const;
+        void writeMHD(std::ostream& o,const int filetype,const std::vector<int>& popId) const;
+        void MHD_values(const int filetype,const std::vector<int>& popId,real x[N_MHD_VALUES]) const;
+        void hc_order_children_recursive(std::vector<const Tcell*>& order) const;
+        real moment_weight(const std::vector<int>& popId) const;
+        real moment_mass(const std::vector<int>& popId) const;
+        real moment_charge(const std::vector<int>& popId) const;
+        void moment_avev(real& vx0, real& vy0, real& vz0, const std::vector<int>& popId) const;
+        void moment_U(real& Ux0, real& Uy0, real& Uz0, const std::vector<int>& popId) const;
+        real moment_avemv2(real vx0, real vy0, real vz0, const std::vector<int>& popId) const;
         void writeDBUG_children_recursive(std::ostream& o) const;
         void writeDBUG(std::ostream& o) const;
         void writeEXTRA_children_recursive(std::ostream& o,ScalarField* s) const;
@@ -196,15 +200,16 @@ private:
         int mark_recoarsening_recursive(gridreal (*mindx)(const gridreal[]));
         void refine_recursive(Tgrid& g);
         void recoarsen_recursive(Tgrid& g);
+        void prolong_intra_faces(TFacePtr facetab[3][2][2][3]);
         bool refine(Tgrid& g);
         bool recoarsen(Tgrid& g);
+        void retain_nodes_recursive(const Tcell *coarse, Tgrid& g, TPtrHash& nodehash_remove, TPtrHash& nodehash_retain);
         template <class Func> int particle_pass_recursive(Func& op, bool relocate);
+        template <class Func> void particle_batch_recursive(Func& op);
         int particle_pass_recursive(bool (*op)(TLinkedParticle& p, ParticlePassArgs a), bool relocate);
         template <class Func> void cellPassRecursive(Func& op);
         void split_and_join_recursive(int& nsplit, int& njoined);
         int forbid_split_and_join_recursive(ForbidSplitAndJoinProfile forb);
-        void begin_average_recursive();
-        void end_average_recursive(real inv_ave_ntimes);
         void set_resistivity_recursive(ResistivityProfile res);
         void prepare_PDF_recursive(ScalarField* pdffunc, Tgrid*);
         void generate_random_point(gridreal r[3]);
@@ -355,25 +360,36 @@ private:
         void sph_calc_ue1();
 #endif
     }; // Grid cell node
-    //! TPtrHash indexes void* pointers using gridreal triples.
+    /** \brief TPtrHash indexes void* pointers using gridreal triples.
+     *
+     * Open addressing with linear probing on the integer coordinates
+     * (Tgrid::intcoords) of the key. The slots are kept in one array whose
+     * size is a power of two and which is doubled when half full, so that
+     * the lookups stay O(1) however many nodes a refinement creates. Small
+     * tables live in the object itself and need no allocation.
+     */
     class TPtrHash
     {
     private:
-        enum {PTR_HASHTABLE_SIZE = 39};
-        struct Thashnode {
-            void *data;
+        enum {PTR_HASHTABLE_INITIAL_SIZE = 128, PTR_HASHTABLE_INITIAL_SHIFT = 57};
+        struct Thashslot {
+            void *data; //!< Null for an empty slot
             int iq[3];
-            Thashnode *next;
         };
-        typedef Thashnode *Thashnodeptr;
         Tgrid *gptr; //!< Needed to access Tgrid::intcoords
-        Thashnode **pool;
-        int HashFunction(const gridreal[3], int iq[3]) const;
+        Thashslot initial_slots[PTR_HASHTABLE_INITIAL_SIZE];
+        Thashslot *slots;
+        unsigned int mask; //!< Number of slots minus one
+        int shift; //!< 64 minus log2 of the number of slots
+        unsigned int count; //!< Number of entries
+        unsigned int HashFunction(const int iq[3]) const;
+        unsigned int find(const gridreal r[3], int iq[3]) const;
+        void insert(unsigned int i, const int iq[3], void *value);
+        void grow();
+        TPtrHash(const TPtrHash&);
+        TPtrHash& operator=(const TPtrHash&);
     public:
-        TPtrHash(Tgrid& g) : gptr(&g) {
-            pool = new Thashnodeptr [PTR_HASHTABLE_SIZE];
-            memset(pool,0,sizeof(Thashnodeptr)*PTR_HASHTABLE_SIZE);
-        }
+        TPtrHash(Tgrid& g);
         void *add(const gridreal r[3], void *value);
         void *add_unique(const gridreal r[3], void *value);
         //! Convenient abbreviation call
@@ -398,6 +414,7 @@ private:
         int n; //!< Number of interior cells, length of tables
         shortreal *cpdf; //!< Cumulative PDF, monotonically increasing from 0 to 1, vector of length n
         TCellPtr *cellptrs; //!< Pointer to interior cell for each CPDF entry, vector of length n (computed only for the FIRST PDF allocated (pdftables[0]) because it is the same for subsequent ones)
+        ScalarField *func; //!< Function of the PDF, for rebuild_PDF
     };
 
     // ---------------- Private data of Tgrid: ------------------
@@ -407,13 +424,73 @@ private:
     gridreal bgdx,invbgdx; //!< Grid spacing (isotropic) and its inverse (invbgdx=1/bgdx)
     real inv_unit; //!< 1/(smallest representable unit wrt. gridreal "epsilon")
     TCellPtr *cells;
-    TCellPtr saved_cellptr; //!< Routines which get r[3] as input saves the found cell here (avoids unnecessary findcell() call)
     const static char *celldata_names[NCELLDATA];
     static int cell_running_index; //!< Running cell index
+    std::vector<TParticleMoments> moment_table; //!< Particle moments of all populations in all leaf cells (output time only)
+    static bool moment_table_valid; //!< Tcell::moments point to up-to-date rows of moment_table
     static TPtrHash *hp;
     int n_particles; //!< Number of macro particles
-    int ave_ntimes; //!< Temporal averaging counter
-    TCellPtr previous_found_cell;
+    //! Temporal averaging window: the interval average of the hc-files or a running (exponential) average
+    struct TAverageWindow {
+        real tau; //!< Time constant of a running average [s], 0 = interval average
+        real decay, gain; //!< Update of each timestep: ave = decay*ave + gain*(value of the timestep)
+        real weight; //!< Sum of the timestep weights, the averages are ave/weight
+        std::vector<datareal> cells; //!< Accumulators of the leaf cells (ave_ncols per ave_leaves row)
+        std::vector<datareal> faceB; //!< FACEDATA_B accumulators of ave_faces
+    };
+    std::vector<TCellPtr> ave_leaves; //!< Leaf cells in the row order of the averaging table
+    std::vector<TFacePtr> ave_faces; //!< Upper faces of the leaf cells, the faces averaged by FACEDATA_AVEB
+    std::vector<TAverageWindow> ave_windows; //!< Window 0 = interval average, others = running averages
+    std::vector<datareal> ave_step_cells; //!< Particle deposits of the timestep (only with running averages)
+    std::vector<datareal> ave_step_faceB; //!< FACEDATA_B of the timestep (only with running averages)
+    datareal *ave_deposit; //!< Particle deposits go here: ave_step_cells or window 0
+    static int ave_ncols; //!< Accumulators per leaf cell: n, population n and v sums, spectra
+    static int ave_spectra_col; //!< First spectra column
+    static const datareal *ave_view; //!< Cells of the window selected by select_average, 0 = none
+    static real ave_view_scale; //!< 1/weight of the selected window
+#ifdef SAVE_PARTICLE_CELL_SPECTRA
+    std::vector<SpectraBins> spectra_bins; //!< Energy bins of the cell spectra of each population
+#endif
+    std::vector<TCellPtr> subcycle_leaves; //!< (Field subcycling) Leaf cells of subcycle_moments
+    std::vector<datareal> subcycle_moments; //!< (Field subcycling) rho_q and CELLDATA_Ji of the timestep (4 per leaf)
+    std::vector<datareal> subcycle_prev; //!< (Field subcycling) Moments of the previous timestep, empty = none
+    std::vector<int> morton_order; //!< Flat indices of the base cells in Morton (Z-order) order
+    std::vector<int> base_owner; //!< (MPI) Rank of the particles of each base cell (flat index)
+    bool owned_injection; //!< (MPI) addparticle keeps only the particles in the base cells of this rank
+    enum {PUSH_BLOCK_SIZE = 4}; //!< Edge length of a particle push block [base cells]
+    //! Block of base cells pushed by one thread in particle_push (a run of morton_order)
+    struct TPushBlock {
+        int first, last; //!< Range [first,last) in morton_order
+        int lo[3];       //!< Lowest base cell indices of the block
+    };
+    //! Deferred accumulate_PIC call whose stencil may reach beyond the block
+    struct TPushDeposit {
+        shortreal r[3], v[3];
+        real w;
+        int popid;
+    };
+    std::vector<TPushBlock> push_blocks;
+    std::vector<int> push_phases[8]; //!< Push blocks of each colour, blocks of the same colour do not share stencil cells
+    std::vector< std::vector<TPushDeposit> > push_overflow; //!< Deferred deposits of each push block
+    //! Face visited by the face sweeps
+    struct TSweepFace {
+        TFacePtr face;
+        gridreal dx; //!< Side length of the face
+        int d;       //!< Normal direction of the face
+        bool inner;  //!< False on the lower boundary planes, which FaceCurl and NF skip
+    };
+    //! Orders sweep cells and faces by level, the coarsest first
+    struct SweepCoarser {
+        bool operator()(TCellPtr a, TCellPtr b) const {
+            return a->level < b->level;
+        }
+        bool operator()(const TSweepFace& a, const TSweepFace& b) const {
+            return a.dx > b.dx;
+        }
+    };
+    std::vector<TCellPtr> sweep_cells; //!< Leaf cells of the interior base cells, sorted by level (cell sweeps)
+    std::vector<TNodePtr> sweep_nodes[8]; //!< Unique nodes written by the base cells of each parity colour (node sweeps)
+    std::vector<TSweepFace> sweep_faces[8]; //!< Faces written by the base cells of each parity colour, sorted by level (face sweeps)
     enum {MAX_PDFTABLES = 100};
     TPDFTable pdftables[MAX_PDFTABLES];
     int n_pdftables; //!< Length of entries in pdftables, initially 0
@@ -461,7 +538,7 @@ private:
     TCellPtr moveto(TCellPtr c, int dim, bool movetoright) const {
         return c->neighbour[dim][movetoright];
     }
-    gridreal accumulate_PIC_recursive(const TBoxDef& cloudbox, Tcell *c, gridreal invvol, const shortreal v[3], real w, int popid);
+    gridreal accumulate_PIC_recursive(const TBoxDef& cloudbox, Tcell *c, gridreal invvol, const shortreal v[3], real w, int popid, const TSpectraBin& sb);
     static gridreal intersection_volume(const TBoxDef& boxA, const TBoxDef& boxB);
     static gridreal intersection_volume_samesize_nochecks(const shortreal rA[3], const gridreal rB[3], gridreal size);
     void copy_celldata(int cTo, int cFrom, TCellDataSelect cs);
@@ -469,8 +546,49 @@ private:
     void copy_smoothing(int cTo, int cFrom);
     void finalize_accum_recursive(Tcell *c);
     struct writeParticle;
+    struct collectLeaves;
     struct writeMagneticField;
     struct readMagneticField;
+    void collect_leaves(std::vector<TCellPtr>& leaves);
+    void write_MHD_cells(std::ostream& o,const int filetype,const std::vector<int>& popId);
+#ifdef USE_COMPRESSED_HC
+    bool write_MHD_cells_compressed(std::ostream& o,const int filetype,const std::vector<int>& popId);
+#endif
+    void collect_refinement(std::vector<int32_t>& levels, std::vector<gridreal>& centroids);
+    void restore_refinement(const std::vector<int32_t>& levels, const std::vector<gridreal>& centroids);
+    bool read_breakpoint_header(std::istream& is, uint32_t& flags);
+    void readStateOldFormat(std::istream& is);
+    struct sortExtract;
+    struct sortInsert;
+    struct migrateExtract;
+    int base_index(const shortreal r[3]) const;
+    void sum_deposits();
+    bool is_interior_base(int c) const;
+    void assign_base_owners(const std::vector<real>& cost);
+    real rank_imbalance(const std::vector<real>& cost) const;
+    void hash_average_table(TPtrHash& cellhash, TPtrHash *facehash[3]) const;
+    void remap_average_table(const TPtrHash& cellhash, TPtrHash *facehash[3]);
+    static int average_index(const TPtrHash& h, const gridreal r[3]);
+    static void upper_face_centre(const Tcell *c, int d, int f, gridreal r[3]);
+    static int average_face_sources(TPtrHash *facehash[3], const gridreal r[3], int d, gridreal h, int index[4], real weight[4]);
+    bool is_interior(const Tcell *c) const;
+    bool is_refinable(const Tcell *c) const;
+    void rebuild_PDF();
+    void build_morton_order();
+    void build_push_blocks();
+    void build_sweep_arrays();
+    void begin_push_pass();
+    void begin_push_block(int b);
+    void end_push_block();
+    bool defer_push_deposit(const shortreal r[3], const shortreal v[3], real w, int popid);
+    void flush_push_deposits();
+    bool uniform_stencil(const Tcell *c, Tcell *const C[8], const bool movetoright[3]) const;
+    bool deposit_PIC(Tcell *c, real accum_w, const shortreal v[3], int popid, const TSpectraBin& sb);
+    void average_PIC(Tcell *c, real accum_w, const shortreal v[3], int popid, const TSpectraBin& sb);
+    TSpectraBin spectra_bin(const shortreal v[3], int popid, bool regular) const;
+    void average_population(Tcell *c, real accum_w, const shortreal v[3], int popid);
+    void build_average_table();
+    void accumulate_average();
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
     gridreal sph_theta_1, sph_phi_1; //!< (SPHERICAL)
     gridreal sph_bgdy, sph_bgdz, sph_bgdtheta, sph_bgdphi, sph_invbgdy, sph_invbgdz; //!< (SPHERICAL)
@@ -504,7 +622,30 @@ private:
 #endif
     // Tgrid
 public:
-    TCellPtr findcell(const shortreal r[3], gridreal* lowercorner=0);
+    /** \brief Caller-owned cell lookup state
+     *
+     * findcell starts from the cell it found previously with the same
+     * cursor, and the interpolation functions without r[3] use the cell
+     * of the previous interpolation with the same cursor. Threads must not
+     * share cursors. Cursors are invalidated by Refine and recoarsen.
+     */
+    struct CellCursor {
+        TCellPtr hint; //!< Cell found by the previous findcell call
+        TCellPtr cell; //!< Cell of the previous interpolation
+        CellCursor() : hint(0), cell(0) { }
+        void reset() {
+            hint = 0;
+            cell = 0;
+        }
+    };
+private:
+    CellCursor cursor; //!< Lookup state of the functions called without a cursor
+    real refinement_indicator(const Tcell *c, CellCursor& cur);
+public:
+    TCellPtr findcell(const shortreal r[3], gridreal* lowercorner=0) {
+        return findcell(r,cursor,lowercorner);
+    }
+    TCellPtr findcell(const shortreal r[3], CellCursor& cur, gridreal* lowercorner=0);
     TCellPtr findcell_to_maxlevel(const shortreal r[3], int maxlevel) const;
     TParticleList *find_plist(const TLinkedParticle& p);
     Tgrid();
@@ -541,11 +682,27 @@ public:
     real BasegridSpacing() const {
         return bgdx;
     }
-    void faceintpol(const shortreal r[3], TFaceDataSelect s, real result[3]);
-    void cellintpol(const shortreal r[3], TCellDataSelect s, real result[3]);
-    void cellintpol(TCellDataSelect s, real result[3]) const;
-    void cellintpol_fluid(const shortreal r[3], real& n, real& vx, real& vy, real& vz, real& P, std::vector<int> popId);
-    void cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, std::vector<int> popId);
+    void faceintpol(const shortreal r[3], TFaceDataSelect s, real result[3]) {
+        faceintpol(r,s,result,cursor);
+    }
+    void faceintpol(const shortreal r[3], TFaceDataSelect s, real result[3], CellCursor& cur);
+    void cellintpol(const shortreal r[3], TCellDataSelect s, real result[3]) {
+        cellintpol(r,s,result,cursor);
+    }
+    void cellintpol(const shortreal r[3], TCellDataSelect s, real result[3], CellCursor& cur);
+    void cellintpol(TCellDataSelect s, real result[3]) const {
+        cellintpol(s,result,cursor);
+    }
+    void cellintpol(TCellDataSelect s, real result[3], const CellCursor& cur) const;
+    void cellintpol_density(real& n, real& rho_q, const CellCursor& cur) const;
+    void cellintpol_fluid(const shortreal r[3], real& n, real& vx, real& vy, real& vz, real& P, std::vector<int> popId) {
+        cellintpol_fluid(r,n,vx,vy,vz,P,popId,cursor);
+    }
+    void cellintpol_fluid(const shortreal r[3], real& n, real& vx, real& vy, real& vz, real& P, std::vector<int> popId, CellCursor& cur);
+    void cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, std::vector<int> popId) {
+        cellintpol_fluid(n,vx,vy,vz,P,popId,cursor);
+    }
+    void cellintpol_fluid(real& n, real& vx, real& vy, real& vz, real& P, std::vector<int> popId, const CellCursor& cur);
     void FC(TFaceDataSelect fs, TCellDataSelect cs);
     void NC_smoothing();
     void NC(TNodeDataSelect ns, TCellDataSelect cs);
@@ -558,9 +715,16 @@ public:
     void NF(TNodeDataSelect ns, TFaceDataSelect fs);
     void NF_rhoq();
     void zero_rhoq_nc_Vq();
-    void accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, int popid);
+    void accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, int popid) {
+        accumulate_PIC(r,v,w,popid,cursor);
+    }
+    void accumulate_PIC(const shortreal r[3], const shortreal v[3], real w, int popid, CellCursor& cur);
     void finalize_accum();
     void calc_ue(void);
+    void begin_moment_subcycling(bool havePrevious);
+    void set_subcycle_moments(real f);
+    void end_moment_subcycling();
+    real whistler_timestep() const;
     void Neumann(TCellDataSelect cs);
     void Neumann_rhoq();
     void Neumann_smoothing();
@@ -576,16 +740,20 @@ public:
     void set_save_particles_orbit(const char *fn);
     void particles_write();
 #endif
-    bool hcwrite_MHD(const char *fn,std::string ascbin,std::string hctype,std::vector<int> popId);
+    void compute_moments();
+    void free_moments();
+    bool hcwrite_MHD(const char *fn,const std::string& ascbin,const std::string& hctype,const std::vector<int>& popId);
     bool hcwrite_DBUG(const char *fn);
     bool hcwrite_EXTRA(std::string fileName,ScalarField* s,std::string);
 #ifdef SAVE_PARTICLE_CELL_SPECTRA
     bool hcwrite_SPECTRA(const char *fn,std::string ascbin,std::vector<int> popId);
 #endif
     void dumpState(std::ostream& os);
-    void readState(std::istream& is);
+    void readState(std::istream& is, int fd=-1);
+    void readStateRefinement(std::istream& is);
     void Refine(GridRefinementProfile refFunc);
     void recoarsen(gridreal (*mindx)(const gridreal[3]));
+    void adapt_refinement(int& nrefined, int& nrecoarsened);
     void calc_facediv(TFaceDataSelect fs, MagneticLog& result) const;
     void CalcGradient_rhoq();
     int approx_bytes_per_cell() {
@@ -598,8 +766,18 @@ public:
                      shortreal vx,shortreal vy,shortreal vz,
                      shortreal w, int popid, bool inject=true);
     template <class Func> int particle_pass(Func op, bool relocate=false);
+    template <class Func> int particle_push(Func op);
+    template <class Func> void particle_batch_pass(Func op);
     int particle_pass(bool (*op)(TLinkedParticle& p, ParticlePassArgs a), bool relocate=false);
     template <class Func> void cellPass(Func op);
+    void sort_particles();
+    void partition_base_cells();
+    //! (MPI) Keep only the particles in the base cells of this rank in addparticle (particle injection)
+    void set_owned_injection(bool owned) {
+        owned_injection = owned;
+    }
+    void migrate_particles();
+    int balance_load(real cellWeight, real& imbalanceBefore, real& imbalanceAfter, real& nmovedParticles);
     /** \brief Call operator for all particles in the grid
      *
      * If op returns false, delete the particle afterwards,
@@ -615,6 +793,11 @@ public:
     int forbid_split_and_join(ForbidSplitAndJoinProfile forb);
     void begin_average();
     bool end_average();
+    int average_windows() const {
+        return ave_windows.size();
+    }
+    bool select_average(int w);
+    real average_time_constant(int w) const;
     void prepare_PDF(ScalarField* pdffunc, TPDF_ID& pdfid, real& cumsumvalue);
     void generate_random_point(const TPDF_ID& pdfid, gridreal r[3]);
     void boundary_faces(TFaceDataSelect cs);
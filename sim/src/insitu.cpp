@@ -0,0 +1,349 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <sstream>
+#include "insitu.h"
+#include "params.h"
+#include "magneticfield.h"
+#include "output.h"
+#include "logger.h"
+
+using namespace std;
+
+extern Logger errorlog;
+extern Params simuConfig;
+
+const char *InSituCuts::variableNames[InSituCuts::NVARIABLES] = {"n","rhoq","B","Ue","E","J","Ji"};
+const int InSituCuts::variableComponents[InSituCuts::NVARIABLES] = {1,1,3,3,3,3,3};
+const char *InSituCuts::variableUnits[InSituCuts::NVARIABLES] = {
+    "ion number density deposited for the field solver [m^-3]",
+    "ion charge density deposited for the field solver [C/m^3]",
+    "magnetic field B1+B0 [T]",
+    "electron velocity [m/s]",
+    "electric field [V/m]",
+    "current density [A/m^2]",
+    "ion current density [A/m^2]"
+};
+
+//! Constructor
+InSituCuts::InSituCuts() { }
+
+/** \brief Read the planes and lines of insituFUNC and the variables of insituVariables
+ *
+ * Returns false if the config is not valid or a point is outside the mesh.
+ */
+bool InSituCuts::initialize(Tgrid& g)
+{
+    cuts.clear();
+    vector<string> names;
+    vector< vector<real> > args;
+    if (simuConfig.getFunctionNamesAndArgs("insituFUNC",names,args) == false) {
+        return true;
+    }
+    if (parseVariables(Params::insituVariables) == false) {
+        return false;
+    }
+    for (unsigned int i = 0; i < names.size(); ++i) {
+        Cut cut;
+        ostringstream def;
+        def << names[i];
+        for (unsigned int j = 0; j < args[i].size(); ++j) {
+            def << " " << args[i][j];
+        }
+        cut.definition = def.str();
+        bool ok = false;
+        if (names[i] == "insituPlane") {
+            ok = addPlane(args[i],cut);
+        } else if (names[i] == "insituLine") {
+            ok = addLine(args[i],cut);
+        } else if (names[i] == "insituPolyline") {
+            ok = addPolyline(args[i],cut);
+        } else {
+            ERRORMSG2("unknown in-situ cut function",names[i]);
+            return false;
+        }
+        if (ok == false) {
+            ERRORMSG2("bad in-situ cut arguments",cut.definition);
+            return false;
+        }
+        // All points must be inside the mesh
+        for (unsigned int p = 0; p < cut.r.size(); p += 3) {
+            if (g.findcell(&cut.r[p],cut.cursor) == 0) {
+                ERRORMSG2("in-situ cut point outside the simulation box",cut.definition);
+                return false;
+            }
+        }
+        cuts.push_back(cut);
+    }
+    return true;
+}
+
+//! Whether planes or lines were given
+bool InSituCuts::isDefined() const
+{
+    return cuts.size() > 0;
+}
+
+//! Plane: axis position amin amax bmin bmax na nb
+bool InSituCuts::addPlane(const vector<real>& args, Cut& cut)
+{
+    if (args.size() != 8) {
+        return false;
+    }
+    const int axis = int(args[0]);
+    const int na = int(args[6]);
+    const int nb = int(args[7]);
+    if (axis < 0 || axis > 2 || na < 1 || nb < 1 || args[2] >= args[3] || args[4] >= args[5]) {
+        return false;
+    }
+    const int a = (axis == 0) ? 1 : 0;
+    const int b = (axis == 2) ? 1 : 2;
+    const real da = (args[3] - args[2])/na;
+    const real db = (args[5] - args[4])/nb;
+    cut.type = "plane";
+    cut.n1 = na;
+    cut.n2 = nb;
+    cut.r.resize(3*na*nb);
+    for (int j = 0; j < nb; ++j) {
+        for (int i = 0; i < na; ++i) {
+            shortreal *r = &cut.r[3*(j*na + i)];
+            r[axis] = args[1];
+            r[a] = args[2] + (i + 0.5)*da;
+            r[b] = args[4] + (j + 0.5)*db;
+        }
+    }
+    return true;
+}
+
+//! Line: x1 y1 z1 x2 y2 z2 n
+bool InSituCuts::addLine(const vector<real>& args, Cut& cut)
+{
+    if (args.size() != 7) {
+        return false;
+    }
+    vector<real> polyline(1,args[6]);
+    polyline.insert(polyline.end(),args.begin(),args.begin()+6);
+    return addPolyline(polyline,cut);
+}
+
+//! Polyline: n x1 y1 z1 x2 y2 z2 ...
+bool InSituCuts::addPolyline(const vector<real>& args, Cut& cut)
+{
+    if (args.size() < 7 || (args.size() - 1) % 3 != 0) {
+        return false;
+    }
+    const int n = int(args[0]);
+    const int nvertices = (args.size() - 1)/3;
+    if (n < 2) {
+        return false;
+    }
+    // Distance from the first vertex to each vertex along the polyline
+    vector<real> s(nvertices,0.0);
+    for (int v = 1; v < nvertices; ++v) {
+        const real *r0 = &args[1 + 3*(v-1)];
+        const real *r1 = &args[1 + 3*v];
+        s[v] = s[v-1] + sqrt(sqr(r1[0]-r0[0]) + sqr(r1[1]-r0[1]) + sqr(r1[2]-r0[2]));
+    }
+    if (s[nvertices-1] <= 0) {
+        return false;
+    }
+    cut.type = "line";
+    cut.n1 = n;
+    cut.n2 = 1;
+    cut.r.resize(3*n);
+    int v = 1;
+    for (int i = 0; i < n; ++i) {
+        const real si = s[nvertices-1]*i/(n-1);
+        while (v < nvertices-1 && s[v] < si) {
+            v++;
+        }
+        const real *r0 = &args[1 + 3*(v-1)];
+        const real *r1 = &args[1 + 3*v];
+        const real t = (s[v] > s[v-1]) ? (si - s[v-1])/(s[v] - s[v-1]) : 0.0;
+        for (int d = 0; d < 3; ++d) {
+            cut.r[3*i + d] = r0[d] + t*(r1[d] - r0[d]);
+        }
+    }
+    return true;
+}
+
+//! Comma separated variable names, e.g. "n,B,E"
+bool InSituCuts::parseVariables(const string& names)
+{
+    static const char *componentNames[3] = {"x","y","z"};
+    variables.clear();
+    columns.clear();
+    columns.push_back("x");
+    columns.push_back("y");
+    columns.push_back("z");
+    string::size_type begin = 0;
+    while (begin <= names.size()) {
+        string::size_type end = names.find(',',begin);
+        if (end == string::npos) {
+            end = names.size();
+        }
+        const string name = names.substr(begin,end-begin);
+        int v = 0;
+        while (v < NVARIABLES && name != variableNames[v]) {
+            v++;
+        }
+        if (v == NVARIABLES) {
+            ERRORMSG2("unknown in-situ variable",name);
+            return false;
+        }
+        variables.push_back(TVariable(v));
+        if (variableComponents[v] == 1) {
+            columns.push_back(name);
+        } else {
+            for (int c = 0; c < variableComponents[v]; ++c) {
+                columns.push_back(name + componentNames[c]);
+            }
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+//! Save a file of each plane and line
+bool InSituCuts::save(Tgrid& g, const string& timeStr)
+{
+    bool ok = true;
+    vector<shortreal> data;
+    for (unsigned int i = 0; i < cuts.size(); ++i) {
+        // The cells of the previous save may have been recoarsened
+        cuts[i].cursor.reset();
+        sample(g,cuts[i],data);
+        if (write(cuts[i],i,timeStr,data) == false) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+//! Sample the variables at the points of the cut (columns of data)
+void InSituCuts::sample(Tgrid& g, Cut& cut, vector<shortreal>& data)
+{
+    const int npoints = cut.r.size()/3;
+    data.resize(columns.size()*npoints);
+    for (int p = 0; p < npoints; ++p) {
+        const shortreal *r = &cut.r[3*p];
+        real B[3],Ue[3],vec[3],n,rho_q;
+        // Cell lookup by faceintpol, the cell data from the same cell
+        g.faceintpol(r, Tgrid::FACEDATA_B, B, cut.cursor);
+        addConstantMagneticField(r, B);
+        g.cellintpol(Tgrid::CELLDATA_UE, Ue, cut.cursor);
+        g.cellintpol_density(n, rho_q, cut.cursor);
+        for (int d = 0; d < 3; ++d) {
+            data[d*npoints + p] = r[d];
+        }
+        int col = 3;
+        for (unsigned int v = 0; v < variables.size(); ++v) {
+            switch (variables[v]) {
+            case VAR_N:
+                vec[0] = n;
+                break;
+            case VAR_RHOQ:
+                vec[0] = rho_q;
+                break;
+            case VAR_B:
+                vec[0] = B[0];
+                vec[1] = B[1];
+                vec[2] = B[2];
+                break;
+            case VAR_UE:
+                vec[0] = Ue[0];
+                vec[1] = Ue[1];
+                vec[2] = Ue[2];
+                break;
+            case VAR_E:
+                // The electric field of the particle push: E = -Ue x B (+ polarization field)
+                if (Params::electronPressure == true) {
+                    g.cellintpol(Tgrid::CELLDATA_TEMP2, vec, cut.cursor);
+                } else {
+                    vec[0] = vec[1] = vec[2] = 0.0;
+                }
+                vec[0] += B[1]*Ue[2] - B[2]*Ue[1];
+                vec[1] += B[2]*Ue[0] - B[0]*Ue[2];
+                vec[2] += B[0]*Ue[1] - B[1]*Ue[0];
+                break;
+            case VAR_J:
+                g.cellintpol(Tgrid::CELLDATA_J, vec, cut.cursor);
+                break;
+            case VAR_JI:
+                g.cellintpol(Tgrid::CELLDATA_Ji, vec, cut.cursor);
+                break;
+            }
+            for (int c = 0; c < variableComponents[variables[v]]; ++c) {
+                data[(col++)*npoints + p] = vec[c];
+            }
+        }
+    }
+}
+
+//! Write the header and the columns of a cut
+bool InSituCuts::write(const Cut& cut, int index, const string& timeStr, vector<shortreal>& data) const
+{
+    const int npoints = cut.r.size()/3;
+    ostringstream name;
+    name << "insitu_" << cut.type << index << "_" << timeStr << ".dat";
+    const string fileName = name.str();
+    OutputFile f(fileName);
+    f.precision(16);
+    f << "# " << Params::codeVersion << "\n";
+    f << "# filename: " << fileName << "\n";
+    f << "# t = " << Params::t << "\n";
+    f << "# IN-SITU CUT FILE CONTENTS\n";
+    f << "#  x, y, z = position [m]\n";
+    for (unsigned int v = 0; v < variables.size(); ++v) {
+        f << "#  " << variableNames[variables[v]] << " = " << variableUnits[variables[v]] << "\n";
+    }
+    f << "# cut = " << cut.definition << "\n";
+    f << "type = " << cut.type << "\n";
+    f << "realformat = float\n";
+    f << "columns = \"";
+    for (unsigned int c = 0; c < columns.size(); ++c) {
+        f << (c > 0 ? " " : "") << columns[c];
+    }
+    f << "\"\n";
+    f << "ncolumns = " << columns.size() << "\n";
+    f << "npoints = " << npoints << "\n";
+    f << "n1 = " << cut.n1 << "\n";
+    f << "n2 = " << cut.n2 << "\n";
+    f << "t = " << Params::t << "\n";
+    f << "eoh\n";
+    if (data.size() > 0) {
+        ByteConversion(sizeof(shortreal), reinterpret_cast<unsigned char*>(&data[0]), data.size());
+        f.write(reinterpret_cast<const char*>(&data[0]), data.size()*sizeof(shortreal));
+    }
+    if (f.close() == false) {
+        ERRORMSG2("could not write in-situ cut file", fileName);
+        return false;
+    }
+    return true;
+}
+
+//! Planes and lines for the simulation log
+string InSituCuts::toString() const
+{
+    ostringstream s;
+    for (unsigned int i = 0; i < cuts.size(); ++i) {
+        s << "| " << cuts[i].type << i << ": " << cuts[i].definition << " (" << cuts[i].r.size()/3 << " points)\n";
+    }
+    return s.str();
+}
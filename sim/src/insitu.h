@@ -0,0 +1,81 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INSITU_H
+#define INSITU_H
+
+#include <string>
+#include <vector>
+#include "definitions.h"
+#include "grid.h"
+
+/** \brief In-situ slices and line cuts of the simulation mesh
+ *
+ * The planes and lines are given in the config file function insituFUNC,
+ * one per line:
+ *
+ * insituPlane axis position amin amax bmin bmax na nb\n
+ * insituLine x1 y1 z1 x2 y2 z2 n\n
+ * insituPolyline n x1 y1 z1 x2 y2 z2 ...
+ *
+ * A plane is normal to the axis (0=x, 1=y, 2=z) and its points are the
+ * centres of na x nb pixels, where a and b are the other two axes in
+ * increasing order (a changes fastest). A line has n points from the
+ * first end point to the second one and a polyline n points evenly along
+ * its length.
+ *
+ * The variables of the config file parameter insituVariables are sampled
+ * at the points with the same interpolations as the particle push
+ * (faceintpol for the magnetic field, cellintpol for the cell data) and
+ * saved in small binary files like the particle snapshots.
+ */
+class InSituCuts
+{
+public:
+    InSituCuts();
+    bool initialize(Tgrid& g);
+    bool isDefined() const;
+    bool save(Tgrid& g, const std::string& timeStr);
+    std::string toString() const;
+private:
+    //! Sampled variables
+    enum TVariable {VAR_N=0, VAR_RHOQ=1, VAR_B=2, VAR_UE=3, VAR_E=4, VAR_J=5, VAR_JI=6};
+    enum {NVARIABLES=7};
+    static const char *variableNames[NVARIABLES];
+    static const int variableComponents[NVARIABLES];
+    static const char *variableUnits[NVARIABLES];
+    //! One plane or line
+    struct Cut {
+        std::string type;        //!< "plane" or "line"
+        std::string definition;  //!< Function name and arguments in the config file
+        int n1, n2;              //!< Points in each direction (n2 = 1 for lines)
+        std::vector<shortreal> r; //!< Coordinates of the points (x,y,z for each point)
+        Tgrid::CellCursor cursor;
+    };
+    std::vector<Cut> cuts;
+    std::vector<TVariable> variables;
+    std::vector<std::string> columns;
+    bool addPlane(const std::vector<real>& args, Cut& cut);
+    bool addLine(const std::vector<real>& args, Cut& cut);
+    bool addPolyline(const std::vector<real>& args, Cut& cut);
+    bool parseVariables(const std::string& names);
+    void sample(Tgrid& g, Cut& cut, std::vector<shortreal>& data);
+    bool write(const Cut& cut, int index, const std::string& timeStr, std::vector<shortreal>& data) const;
+};
+
+#endif
@@ -23,6 +23,7 @@
 #include <cmath>
 #include "logger.h"
 #include "params.h"
+#include "decomposition.h"
 
 using namespace std;
 
@@ -51,9 +52,16 @@ Logger::~Logger()
     delete logfile;
 }
 
-//! Initialize logger
-void Logger::init()
+/** \brief Initialize logger
+ *
+ * With several MPI ranks only the root rank writes the log, or if
+ * everyRank is true each rank writes its own log (name_rankNNN.ext).
+ */
+void Logger::init(const bool everyRank)
 {
+    rankLogName = everyRank ? Decomposition::rankFileName(logName) : Decomposition::rootFileName(logName);
+    logName = rankLogName.c_str();
+    delete logfile;
     logfile = new std::fstream(logName,std::fstream::out);
     if (headerAndLineNumbering == true) {
         writeInit(logName);
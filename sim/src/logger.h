@@ -28,6 +28,7 @@ private:
     static unsigned long int totalLogLines; //!< Number of total counted log lines
     static int lineHeaderChars; //!< Number of header chars in each line
     const char* logName; //!< Log file name
+    std::string rankLogName; //!< Log file name of this rank (USE_MPI)
     std::fstream* logfile; //!< Log file stream
     unsigned long int logLines;
     unsigned long int maxLogLines;
@@ -55,7 +56,7 @@ private:
 public:
     Logger(const char* filename = "logfile.log", const unsigned long int maxLines = 100000, const bool headerAndLineNumberingg = true);
     ~Logger();
-    void init();
+    void init(const bool everyRank = false);
     char fill () const;
     char fill (char fillch);
     std::ios_base::fmtflags flags() const;
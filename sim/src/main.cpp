@@ -18,6 +18,7 @@
 
 #include "simulation.h"
 #include "params.h"
+#include "decomposition.h"
 
 using namespace std;
 
@@ -31,13 +32,15 @@ void showUsage()
     cout << "-f: start a simulation run with a given config file\n\n";
     cout << "-cont: continue a simulation run from a breakpoint\n\n";
     cout << "-paradyn: produce a complete parameter log without actually running a simulation\n\n";
-    cout << "-justinit: initialize a simulation run and exit\n\n";
+    cout << "-justinit: initialize a simulation run and exit (e.g. to benchmark the grid startup logged in mainlog)\n\n";
     cout << "-dump: dump default config file variables (incomplete)\n\n";
 }
 
 //! Main program
 int main(int argc, char *argv[])
 {
+    // Initialize MPI (finalized when main returns)
+    Decomposition decomposition(&argc,&argv);
     // Check command line arguments
     if (argc < 3) {
         showUsage();
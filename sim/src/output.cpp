@@ -0,0 +1,332 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include "output.h"
+#include "params.h"
+#include "definitions.h"
+#include "logger.h"
+
+using namespace std;
+
+extern Logger mainlog;
+extern Logger errorlog;
+
+//! Global output writer
+OutputWriter outputWriter;
+
+/** \brief Write a file with POSIX calls and fsync it
+ *
+ * Returns false if the file cannot be written completely.
+ */
+bool writeOutputFile(const string& fileName, bool atomic, const vector<char>& data)
+{
+    const string name = atomic ? fileName + ".tmp" : fileName;
+    const int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    size_t pos = 0;
+    while (ok == true && pos < data.size()) {
+        const ssize_t n = write(fd, &data[pos], data.size() - pos);
+        if (n < 0) {
+            if (errno != EINTR) {
+                ok = false;
+            }
+        } else {
+            pos += n;
+        }
+    }
+    if (ok == true && fsync(fd) != 0) {
+        ok = false;
+    }
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    if (ok == true && atomic == true && rename(name.c_str(), fileName.c_str()) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+// -------------------------------------------------- OutputBuffer --------------------------------------------------
+
+OutputBuffer::OutputBuffer() : std::streambuf() { }
+
+//! Move the written content to v and empty the buffer
+void OutputBuffer::release(vector<char>& v)
+{
+    data.resize(pptr() - pbase());
+    v.swap(data);
+    vector<char>().swap(data);
+    setp(0, 0);
+}
+
+//! Make room for at least n more characters, keeping the written content
+void OutputBuffer::reserve(size_t n)
+{
+    const size_t used = pptr() - pbase();
+    size_t newSize = data.size() < 65536 ? 65536 : 2*data.size();
+    if (newSize < used + n) {
+        newSize = used + n;
+    }
+    data.resize(newSize);
+    setp(&data[0], &data[0] + data.size());
+    // pbump takes an int
+    size_t left = used;
+    while (left > 0) {
+        const int step = left > size_t(INT_MAX) ? INT_MAX : int(left);
+        pbump(step);
+        left -= step;
+    }
+}
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type c)
+{
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    reserve(1);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize OutputBuffer::xsputn(const char *s, std::streamsize n)
+{
+    if (epptr() - pptr() < n) {
+        reserve(n);
+    }
+    memcpy(pptr(), s, n);
+    size_t left = n;
+    while (left > 0) {
+        const int step = left > size_t(INT_MAX) ? INT_MAX : int(left);
+        pbump(step);
+        left -= step;
+    }
+    return n;
+}
+
+// -------------------------------------------------- OutputFile --------------------------------------------------
+
+OutputFile::OutputFile(const string& fileName, bool atomic)
+    : std::ostream(0), fileName(fileName), atomic(atomic), async(outputWriter.enabled()), closed(false)
+{
+    if (async == true) {
+        rdbuf(&buffer);
+    } else {
+        const string name = atomic ? fileName + ".tmp" : fileName;
+        rdbuf(&file);
+        if (file.open(name.c_str(), ios::out | ios::binary) == 0) {
+            setstate(ios::failbit);
+        }
+    }
+}
+
+OutputFile::~OutputFile()
+{
+    close();
+}
+
+/** \brief Finish the file
+ *
+ * In the asynchronous mode the file is submitted to the output writer, and
+ * a failure to write it is reported later in the error log.
+ */
+bool OutputFile::close()
+{
+    if (closed == true) {
+        return !fail();
+    }
+    closed = true;
+    if (async == true) {
+        if (!fail()) {
+            vector<char> data;
+            buffer.release(data);
+            outputWriter.submit(fileName, atomic, data);
+        }
+    } else {
+        if (file.close() == 0) {
+            setstate(ios::failbit);
+        }
+        if (!fail() && atomic == true && rename((fileName + ".tmp").c_str(), fileName.c_str()) != 0) {
+            setstate(ios::failbit);
+        }
+    }
+    return !fail();
+}
+
+// -------------------------------------------------- OutputWriter --------------------------------------------------
+
+OutputWriter::OutputWriter() : bytesWritten(0.0), filesWritten(0), secsWaited(0.0)
+{
+#ifdef USE_ASYNC_OUTPUT
+    running = false;
+    stopping = false;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&jobQueued, NULL);
+    pthread_cond_init(&jobDone, NULL);
+#endif
+}
+
+OutputWriter::~OutputWriter()
+{
+#ifdef USE_ASYNC_OUTPUT
+    // finish() should have been called before this, so that errors can still be logged
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&jobQueued);
+    pthread_mutex_unlock(&mutex);
+    if (running == true) {
+        pthread_join(thread, NULL);
+    }
+    pthread_cond_destroy(&jobDone);
+    pthread_cond_destroy(&jobQueued);
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+//! Whether output files are written in the background
+bool OutputWriter::enabled() const
+{
+#ifdef USE_ASYNC_OUTPUT
+    return Params::maxOutputsInFlight > 0;
+#else
+    return false;
+#endif
+}
+
+/** \brief Queue a file to be written
+ *
+ * The content of data is taken over. Blocks while maxOutputsInFlight files
+ * are already queued or being written.
+ */
+void OutputWriter::submit(const string& fileName, bool atomic, vector<char>& data)
+{
+#ifdef USE_ASYNC_OUTPUT
+    Job *job = new Job;
+    job->fileName = fileName;
+    job->atomic = atomic;
+    job->data.swap(data);
+    pthread_mutex_lock(&mutex);
+    if (running == false) {
+        if (pthread_create(&thread, NULL, threadMain, this) != 0) {
+            pthread_mutex_unlock(&mutex);
+            ERRORMSG("cannot start the output writer thread");
+            doabort();
+        }
+        running = true;
+    }
+    if (static_cast<int>(jobs.size()) >= Params::maxOutputsInFlight) {
+        const double t0 = getWallSecs();
+        while (static_cast<int>(jobs.size()) >= Params::maxOutputsInFlight) {
+            pthread_cond_wait(&jobDone, &mutex);
+        }
+        secsWaited += getWallSecs() - t0;
+    }
+    jobs.push_back(job);
+    pthread_cond_signal(&jobQueued);
+    pthread_mutex_unlock(&mutex);
+#else
+    if (writeOutputFile(fileName, atomic, data) == true) {
+        bytesWritten += data.size();
+        filesWritten++;
+    } else {
+        failedFiles.push_back(fileName);
+    }
+#endif
+    reportErrors();
+}
+
+//! Wait until all submitted files are written and log a summary
+void OutputWriter::finish()
+{
+#ifdef USE_ASYNC_OUTPUT
+    const double t0 = getWallSecs();
+    pthread_mutex_lock(&mutex);
+    while (jobs.empty() == false) {
+        pthread_cond_wait(&jobDone, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    secsWaited += getWallSecs() - t0;
+#endif
+    reportErrors();
+    if (filesWritten > 0) {
+        mainlog << "| Output writer: " << filesWritten << " files (" << bytesWritten/1e6 << " MB) written in background, "
+                << secsWaited << " s spent waiting for the writer\n";
+    }
+}
+
+//! Log the files which could not be written (main thread only)
+void OutputWriter::reportErrors()
+{
+    vector<string> failed;
+#ifdef USE_ASYNC_OUTPUT
+    pthread_mutex_lock(&mutex);
+    failed.swap(failedFiles);
+    pthread_mutex_unlock(&mutex);
+#else
+    failed.swap(failedFiles);
+#endif
+    for (unsigned int i = 0; i < failed.size(); ++i) {
+        ERRORMSG2("could not write output file completely - disk full?", failed[i]);
+    }
+}
+
+#ifdef USE_ASYNC_OUTPUT
+void *OutputWriter::threadMain(void *writer)
+{
+    static_cast<OutputWriter*>(writer)->run();
+    return NULL;
+}
+
+//! Writer thread main loop. Jobs are removed from the queue only after they are written.
+void OutputWriter::run()
+{
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        while (jobs.empty() == true && stopping == false) {
+            pthread_cond_wait(&jobQueued, &mutex);
+        }
+        if (jobs.empty() == true) {
+            break;
+        }
+        Job *job = jobs.front();
+        pthread_mutex_unlock(&mutex);
+        const bool ok = writeOutputFile(job->fileName, job->atomic, job->data);
+        pthread_mutex_lock(&mutex);
+        if (ok == true) {
+            bytesWritten += job->data.size();
+            filesWritten++;
+        } else {
+            failedFiles.push_back(job->fileName);
+        }
+        jobs.pop_front();
+        delete job;
+        pthread_cond_broadcast(&jobDone);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+#endif
+
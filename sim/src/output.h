@@ -0,0 +1,110 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <ostream>
+#include <fstream>
+#ifdef USE_ASYNC_OUTPUT
+#include <pthread.h>
+#endif
+
+//! Growing in-memory stream buffer, which holds the content of one output file
+class OutputBuffer : public std::streambuf
+{
+public:
+    OutputBuffer();
+    void release(std::vector<char>& v);
+protected:
+    int_type overflow(int_type c);
+    std::streamsize xsputn(const char *s, std::streamsize n);
+private:
+    std::vector<char> data;
+    void reserve(size_t n);
+};
+
+/** \brief Output file stream used by all HC, VTK and breakpoint writers
+ *
+ * If the asynchronous output is enabled (USE_ASYNC_OUTPUT and
+ * maxOutputsInFlight > 0), the content is formatted into memory and handed
+ * over to the output writer thread in close(), which writes and fsyncs the
+ * file while the simulation continues. Otherwise the file is written
+ * directly as with std::ofstream.
+ *
+ * An atomic file is first written as fileName.tmp and then renamed, so that
+ * an interrupted write does not destroy a previous file of the same name.
+ */
+class OutputFile : public std::ostream
+{
+public:
+    OutputFile(const std::string& fileName, bool atomic = false);
+    ~OutputFile();
+    bool close();
+private:
+    std::string fileName;  //!< Final name of the file
+    bool atomic;           //!< Write through a temporary file and rename
+    bool async;            //!< Content is collected to buffer
+    bool closed;           //!< close() already called
+    std::filebuf file;     //!< Direct file output (synchronous mode)
+    OutputBuffer buffer;   //!< In-memory file content (asynchronous mode)
+};
+
+//! Background thread which writes the submitted output files to disk
+class OutputWriter
+{
+public:
+    OutputWriter();
+    ~OutputWriter();
+    bool enabled() const;
+    void submit(const std::string& fileName, bool atomic, std::vector<char>& data);
+    void finish();
+private:
+    //! One submitted output file
+    struct Job {
+        std::string fileName;
+        bool atomic;
+        std::vector<char> data;
+    };
+    std::vector<std::string> failedFiles; //!< Files the writer thread failed to write
+    double bytesWritten;                  //!< Total size of written files
+    int filesWritten;                     //!< Total number of written files
+    double secsWaited;                    //!< Wall time the main thread has waited for free slots
+    void reportErrors();
+#ifdef USE_ASYNC_OUTPUT
+    std::deque<Job*> jobs;     //!< Queued and currently written jobs (front is written)
+    bool running;              //!< Writer thread started
+    bool stopping;             //!< Writer thread asked to exit
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t jobQueued;  //!< Signalled when a job is submitted or stopping is set
+    pthread_cond_t jobDone;    //!< Signalled when a job is completed
+    static void *threadMain(void *writer);
+    void run();
+#endif
+};
+
+bool writeOutputFile(const std::string& fileName, bool atomic, const std::vector<char>& data);
+
+extern OutputWriter outputWriter;
+
+#endif
+
@@ -567,6 +567,9 @@ real Params::R_zeroPolarizationField = 0;
 //! Field propagation timestep - should be mostly same as dt
 real Params::dtField = 0;
 
+//! Field propagation substeps per timestep, B is advanced by dtField in fieldSubsteps substeps [#]
+int Params::fieldSubsteps = 1;
+
 //! Field propagation on/off
 bool Params::propagateField = true;
 
@@ -623,12 +626,15 @@ real Params::saveInterval = 0;
 //! Whether to save HC files (0 = no, 1 = binary, 2 = ascii) [-]
 int Params::saveHC = 0;
 
-//! Whether to save VTK files (0 = no, 1 = binary, 2 = ascii) [-]
+//! Whether to save VTK files (0 = no, 1 = binary, 2 = ascii, 3 = XML binary, 4 = compressed XML binary, 5 = XML AMR) [-]
 int Params::saveVTK = 0;
 
 //! "Whether to save (1) or not (0) temporally averaged parameters [-]"
 bool Params::averaging = 0;
 
+//! Time constants of running (exponential) averages saved in addition to the interval average, 0 = not used [s]
+real Params::averageTimeConstants[3] = {0,0,0};
+
 //! Whether to save (1) or not (0) plasma hc-file [-]
 bool Params::plasma_hcfile = 0;
 
@@ -644,6 +650,27 @@ bool Params::saveExtraHcFiles = 0;
 //! Breakpointing intervals (first = cyclic, second = unique file names) - PRODUCES LARGE FILES! [s]
 real Params::wsDumpInterval[2] = {0,0};
 
+//! Maximum number of output files queued to the background writer, 0 = write synchronously [#]
+int Params::maxOutputsInFlight = 0;
+
+//! Particle snapshot interval, 0 = no snapshots [s]
+real Params::particleSnapshotInterval = 0;
+
+//! Fraction of particles saved in particle snapshots [-]
+real Params::particleSnapshotFraction = 1;
+
+//! Region of particles saved in particle snapshots (xmin xmax ymin ymax zmin zmax), xmin >= xmax = all particles [m]
+real Params::particleSnapshotRegion[6] = {0,0,0,0,0,0};
+
+//! In-situ slice and line cut interval, 0 = no in-situ cuts [s]
+real Params::insituInterval = 0;
+
+//! Variables sampled in in-situ cuts (comma separated: n,rhoq,B,Ue,E,J,Ji)
+string Params::insituVariables = "n,B,Ue,E";
+
+//! In-situ slices and line cuts
+string Params::insituFUNC = "{ }";
+
 //! Input parameter update interval [s]
 real Params::inputInterval = 0;
 
@@ -749,6 +776,21 @@ int Params::maxGridRefinementLevel = 0;
 //! Current grid refinement level (calculated by the Tgrid::Refine) [-]
 int Params::currentGridRefinementLevel = 0;
 
+//! Interval of adaptive grid refinement and recoarsening, 0 = no adaptive refinement [timesteps]
+int Params::adaptiveRefinementInterval = 0;
+
+//! Adaptive refinement threshold of the relative jump of B between neighbour cells, 0 = not used [-]
+real Params::adaptiveRefineGradB = 0;
+
+//! Adaptive refinement threshold of the relative jump of density between neighbour cells, 0 = not used [-]
+real Params::adaptiveRefineDensityJump = 0;
+
+//! Adaptive refinement threshold of the current density, 0 = not used [A/m^2]
+real Params::adaptiveRefineJ = 0;
+
+//! Adaptively refined cells are recoarsened below this fraction of the thresholds [-]
+real Params::adaptiveRecoarsenFraction = 0.5;
+
 //! Grid Refinement function in Refine_resis.cpp/h
 string Params::gridRefinementFUNC = "{ }";
 
@@ -784,6 +826,18 @@ int Params::nz;
 //! Average amount of macroparticles per cell [#]
 int Params::macroParticlesPerCell = 0;
 
+//! Interval of re-sorting particles in memory in Morton order of cells, 0 = no sorting [timesteps]
+int Params::particleSortInterval = 0;
+
+//! Interval of MPI load balancing, 0 = no load balancing [timesteps]
+int Params::loadBalanceInterval = 0;
+
+//! MPI load balancing: repartition when the most loaded rank exceeds the average load by this factor [-]
+real Params::loadBalanceTolerance = 1.1;
+
+//! MPI load balancing: cost of a cell in macroparticle pushes [-]
+real Params::loadBalanceCellWeight = 1.0;
+
 //! Macro particle splitting [-]
 bool Params::useMacroParticleSplitting = true;
 
@@ -999,6 +1053,10 @@ void Params::updateDependantParameters()
     } else {
         propagateField = true;
     }
+    if (fieldSubsteps < 1) {
+        WARNINGMSG2("fieldSubsteps must be at least 1, setting fieldSubsteps = 1",fieldSubsteps);
+        fieldSubsteps = 1;
+    }
 #ifdef SAVE_PARTICLE_CELL_SPECTRA
     // set spectra energy bins
     if(spectraNbins > 0 && spectraEmax_eV > 0 && spectraEmin_eV >=0  && spectraEmax_eV > spectraEmin_eV) {
@@ -1317,20 +1375,31 @@ void Params::initVariables()
     ADD_REAL(dx, "Base grid cell size [m]");
     makeInitConstant("dx");
     ADD_REAL(dtField, "Field propagation timestep - should be mostly same as dt [s]");
+    ADD_INT(fieldSubsteps, "Field propagation substeps per timestep, B is advanced by dtField in fieldSubsteps substeps [#]");
     ADD_REAL(vi_max, "Constraint: maximum ion velocity [m/s]");
     ADD_REAL(Ue_max, "Constraint: maximum electron velocity [m/s]");
     ADD_REAL(rho_q_min, "Constraint: minimum charge density in a cell, rho_q = max(rho_q, rho_q_min) [C/m^3]");
     ADD_REAL(t_max, "Duration of simulation run [s]");
     ADD_REAL(saveInterval, "Save interval for output files [s]");
-    ADD_INT(saveHC, "Whether to save HC files (0 = no, 1 = binary, 2 = ascii) [-]");
-    ADD_INT(saveVTK, "Whether to save VTK files (0 = no, 1 = binary, 2 = ascii) [-]");
+    ADD_INT(saveHC, "Whether to save HC files (0 = no, 1 = binary, 2 = ascii, 3 = compressed binary) [-]");
+    ADD_INT(saveVTK, "Whether to save VTK files (0 = no, 1 = binary, 2 = ascii, 3 = XML binary, 4 = compressed XML binary, 5 = XML AMR) [-]");
     ADD_BOOL(averaging, "Whether to save (1) or not (0) temporally averaged parameters [-]");
+    ADD_REAL_TBL(averageTimeConstants, "Time constants of running (exponential) averages saved in addition to the interval average, 0 = not used [s]",3);
     ADD_BOOL(plasma_hcfile, "Whether to save (1) or not (0) plasma hc-file [-]");
     ADD_BOOL(dbug_hcfile, "Whether to save (1) or not (0) dbug hc-file [-]");
     ADD_BOOL(bg_in_avehcfile, "Include bg charge density (1) or not (0) in average hc-file [-]");
     ADD_BOOL(saveExtraHcFiles, "Save extra hc-files [-]");
     makeInitConstant("saveExtraHcFiles");
     ADD_REAL_TBL(wsDumpInterval, "Breakpointing intervals (first = cyclic, second = unique file names) - PRODUCES LARGE FILES! [s]",2);
+    ADD_INT(maxOutputsInFlight, "Maximum number of output files written in background (requires USE_ASYNC_OUTPUT), 0 = write synchronously [#]");
+    ADD_REAL(particleSnapshotInterval, "Particle snapshot interval (binary files pdump_*.dat), 0 = no snapshots [s]");
+    ADD_REAL(particleSnapshotFraction, "Fraction of particles saved in particle snapshots (0...1] [-]");
+    ADD_REAL_TBL(particleSnapshotRegion, "Region of particles saved in particle snapshots (xmin xmax ymin ymax zmin zmax), xmin >= xmax = all particles [m]",6);
+    ADD_REAL(insituInterval, "In-situ slice and line cut interval (binary files insitu_*.dat), 0 = no in-situ cuts [s]");
+    ADD_STRING(insituVariables, "Variables sampled in in-situ cuts, comma separated (n,rhoq,B,Ue,E,J,Ji) [-]");
+    makeInitConstant("insituVariables");
+    ADD_FUNCTION(insituFUNC, "In-situ slices and line cuts [-]");
+    makeInitConstant("insituFUNC");
     ADD_REAL(inputInterval, "Input parameter dynamics interval [s]");
     ADD_REAL(logInterval, "Logging interval [s]");
 #ifdef SAVE_PARTICLES_ALONG_ORBIT
@@ -1350,12 +1419,21 @@ void Params::initVariables()
     makeInitConstant("gridRefinementFUNC");
     ADD_INT(maxGridRefinementLevel, "Maximum allowed grid refinement level []");
     makeInitConstant("maxGridRefinementLevel");
+    ADD_INT(adaptiveRefinementInterval, "Interval of adaptive grid refinement and recoarsening, 0 = no adaptive refinement [timesteps]");
+    ADD_REAL(adaptiveRefineGradB, "Adaptive refinement threshold of the relative jump of B between neighbour cells, 0 = not used [-]");
+    ADD_REAL(adaptiveRefineDensityJump, "Adaptive refinement threshold of the relative jump of density between neighbour cells, 0 = not used [-]");
+    ADD_REAL(adaptiveRefineJ, "Adaptive refinement threshold of the current density, 0 = not used [A/m^2]");
+    ADD_REAL(adaptiveRecoarsenFraction, "Adaptively refined cells are recoarsened below this fraction of the thresholds [-]");
     ADD_INT(densitySmoothingNumber, "Number of density variable smoothing []");
     ADD_INT(electricFieldSmoothingNumber, "Number of electric field smoothing []");
     ADD_FUNCTION(forbidSplitAndJoinFUNC, "Forbid split and join (spatial) function [-]");
     ADD_FUNCTION(bgChargeDensityFUNC, "Background charge density [-]");
     makeInitConstant("bgChargeDensityFUNC");
     ADD_INT(macroParticlesPerCell, "Average amount of macroparticles per cell [#]");
+    ADD_INT(particleSortInterval, "Particle re-sorting interval in Morton order of cells, 0 = no sorting [timesteps]");
+    ADD_INT(loadBalanceInterval, "Interval of MPI load balancing, 0 = no load balancing [timesteps]");
+    ADD_REAL(loadBalanceTolerance, "MPI load balancing: repartition when the most loaded rank exceeds the average load by this factor [-]");
+    ADD_REAL(loadBalanceCellWeight, "MPI load balancing: cost of a cell in macroparticle pushes [-]");
     ADD_BOOL(useMacroParticleSplitting, "Macro particle splitting [-]");
     ADD_BOOL(useMacroParticleJoining, " Macro particle joining [-]");
     ADD_REAL_TBL(splitJoinDeviation, "Deviation allowed in splitting and joining, and probability method (0=old,1=new)",2);
@@ -249,6 +249,7 @@ public:
     static real R_zeroFields2;
     static real R_zeroPolarizationField;
     static real dtField;
+    static int fieldSubsteps;
     static bool propagateField;
     static int nx;
     static int ny;
@@ -305,11 +306,19 @@ public:
     static int saveHC;
     static int saveVTK;
     static bool averaging;
+    static real averageTimeConstants[3];
     static bool plasma_hcfile;
     static bool dbug_hcfile;
     static bool bg_in_avehcfile;
     static bool saveExtraHcFiles;
     static real wsDumpInterval[2];
+    static int maxOutputsInFlight;
+    static real particleSnapshotInterval;
+    static real particleSnapshotFraction;
+    static real particleSnapshotRegion[6];
+    static real insituInterval;
+    static std::string insituVariables;
+    static std::string insituFUNC;
     static real inputInterval;
     static real logInterval;
 #ifdef SAVE_PARTICLES_ALONG_ORBIT
@@ -335,6 +344,10 @@ public:
     static bool useGravitationalAcceleration;
     static real GMdt;
     static int macroParticlesPerCell;
+    static int particleSortInterval;
+    static int loadBalanceInterval;
+    static real loadBalanceTolerance;
+    static real loadBalanceCellWeight;
     static bool useMacroParticleSplitting;
     static bool useMacroParticleJoining;
     static Split splittingFunction;
@@ -344,6 +357,11 @@ public:
     static std::string gridRefinementFUNC;
     static int maxGridRefinementLevel;
     static int currentGridRefinementLevel;
+    static int adaptiveRefinementInterval;
+    static real adaptiveRefineGradB;
+    static real adaptiveRefineDensityJump;
+    static real adaptiveRefineJ;
+    static real adaptiveRecoarsenFraction;
     static std::string forbidSplitAndJoinFUNC;
     static std::string bgChargeDensityFUNC;
     static real splitJoinDeviation[2];
@@ -16,8 +16,10 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include "particle.h"
 #include "random.h"
@@ -28,10 +30,113 @@ using namespace std;
 
 extern Tgrid g;
 
+TParticleArena particleArena;
+
+//! Constructor
+TParticleArena::TParticleArena() { }
+
+//! Destructor
+TParticleArena::~TParticleArena()
+{
+    for (unsigned int i = 0; i < slabs.size(); ++i) {
+        delete [] slabs[i];
+    }
+    slabs.clear();
+}
+
+//! Allocate a new slab into the free list of the population
+void TParticleArena::grow(int popid)
+{
+    if (popid < 0) {
+        ERRORMSG2("bad population id",popid);
+        doabort();
+    }
+    if (popid >= static_cast<int>(freeList.size())) {
+        freeList.resize(popid+1,0);
+        nLive.resize(popid+1,0);
+        nFree.resize(popid+1,0);
+        nPeak.resize(popid+1,0);
+    }
+    TLinkedParticle *const slab = new TLinkedParticle[SLAB_PARTICLES];
+    slabs.push_back(slab);
+    slabPopid.push_back(popid);
+    // Link in address order so that consecutive allocations are contiguous
+    for (int i = 0; i < SLAB_PARTICLES-1; ++i) {
+        slab[i].popid = popid;
+        slab[i].next = &slab[i+1];
+    }
+    slab[SLAB_PARTICLES-1].popid = popid;
+    slab[SLAB_PARTICLES-1].next = freeList[popid];
+    freeList[popid] = slab;
+    nFree[popid] += SLAB_PARTICLES;
+}
+
+//! Number of particles in use in the population
+long TParticleArena::getLive(int popid) const
+{
+    if (popid < 0 || popid >= static_cast<int>(nLive.size())) {
+        return 0;
+    }
+    return nLive[popid];
+}
+
+//! Number of allocated but unused particles in the population
+long TParticleArena::getFree(int popid) const
+{
+    if (popid < 0 || popid >= static_cast<int>(nFree.size())) {
+        return 0;
+    }
+    return nFree[popid];
+}
+
+//! Peak number of particles in use in the population
+long TParticleArena::getPeak(int popid) const
+{
+    if (popid < 0 || popid >= static_cast<int>(nPeak.size())) {
+        return 0;
+    }
+    return nPeak[popid];
+}
+
+/** \brief Relink all slabs into the free lists in address order
+ *
+ * Can be called only when no particles are in use. Subsequent allocations
+ * of each population are then contiguous in memory, slab by slab.
+ */
+void TParticleArena::reset()
+{
+    for (unsigned int i = 0; i < nLive.size(); ++i) {
+        if (nLive[i] != 0) {
+            ERRORMSG2("particles in use, population",static_cast<int>(i));
+            doabort();
+        }
+    }
+    vector<pair<TLinkedParticle*,int> > order(slabs.size());
+    for (unsigned int s = 0; s < slabs.size(); ++s) {
+        order[s] = make_pair(slabs[s],slabPopid[s]);
+    }
+    sort(order.begin(),order.end());
+    for (unsigned int i = 0; i < freeList.size(); ++i) {
+        freeList[i] = 0;
+    }
+    // Link backwards so that the lowest address ends up first
+    for (int s = static_cast<int>(order.size())-1; s >= 0; --s) {
+        TLinkedParticle *const slab = order[s].first;
+        const int popid = order[s].second;
+        for (int i = 0; i < SLAB_PARTICLES-1; ++i) {
+            slab[i].next = &slab[i+1];
+        }
+        slab[SLAB_PARTICLES-1].next = freeList[popid];
+        freeList[popid] = slab;
+    }
+}
+
+#ifndef USE_PARTICLE_ARRAYS
+
 //! Add one new particle with given parameters.
 void TParticleList::add(shortreal x, shortreal y, shortreal z, shortreal vx, shortreal vy, shortreal vz, shortreal w, int popid)
 {
-    TLinkedParticle *const p = new TLinkedParticle;
+    TLinkedParticle *const p = particleArena.alloc(popid);
     p->x = x;
     p->y = y;
     p->z = z;
@@ -70,7 +175,7 @@ int TParticleList::pass(bool (*op)(TLinkedParticle& part,ParticlePassArgs a), Pa
                 first = p->next;
             }
             p = p->next;
-            delete q;
+            particleArena.release(q);
             ndel++;
             n_part--;
         }
@@ -104,7 +209,7 @@ int TParticleList::pass_with_relocate(bool (*op)(TLinkedParticle& p,ParticlePass
                 if (prev) prev->next = p->next;
                 else first = p->next;
                 p = p->next;
-                delete q;
+                particleArena.release(q);
                 ndel++;
                 n_part--;
             } else {
@@ -116,7 +221,7 @@ int TParticleList::pass_with_relocate(bool (*op)(TLinkedParticle& p,ParticlePass
             if (prev) prev->next = p->next;
             else first = p->next;
             p = p->next;
-            delete q;
+            particleArena.release(q);
             ndel++;
             n_part--;
         }
@@ -124,6 +229,199 @@ int TParticleList::pass_with_relocate(bool (*op)(TLinkedParticle& p,ParticlePass
     return ndel;
 }
 
+#else
+
+//! Add one new particle with given parameters.
+void TParticleList::add(shortreal x, shortreal y, shortreal z, shortreal vx, shortreal vy, shortreal vz, shortreal w, int popid)
+{
+    if (n_used >= n_alloc) {
+        reserve(n_used+1);
+    }
+    const int i = n_used++;
+    this->x[i] = x;
+    this->y[i] = y;
+    this->z[i] = z;
+    this->vx[i] = vx;
+    this->vy[i] = vy;
+    this->vz[i] = vz;
+    this->w[i] = w;
+    this->popid[i] = popid;
+    n_part++;
+#ifdef USE_PARTICLE_SUBCYCLING
+    dtlevel[i] = 0;
+    accumed[i] = 1;
+#endif
+}
+
+//! Grow the streams to hold at least n particles
+void TParticleList::reserve(int n)
+{
+    if (n <= n_alloc) {
+        return;
+    }
+    int nnew = (n_alloc > 0) ? 2*n_alloc : 8;
+    while (nnew < n) {
+        nnew *= 2;
+    }
+    reallocate(nnew);
+}
+
+//! Move the streams into a new memory block with capacity nnew (nnew >= n_used)
+void TParticleList::reallocate(int nnew)
+{
+    // Streams in decreasing order of alignment
+#ifdef USE_PARTICLE_SUBCYCLING
+    const size_t streamBytes = nnew*(sizeof(real) + 7*sizeof(shortreal) + sizeof(int) + sizeof(uint8_t));
+#else
+    const size_t streamBytes = nnew*(7*sizeof(shortreal) + sizeof(int));
+#endif
+    char *const newbuf = new char[streamBytes];
+    char *q = newbuf;
+#ifdef USE_PARTICLE_SUBCYCLING
+    real *const new_accumed = reinterpret_cast<real*>(q);
+    q += nnew*sizeof(real);
+#endif
+    shortreal *newstreams[7];
+    for (int s = 0; s < 7; ++s) {
+        newstreams[s] = reinterpret_cast<shortreal*>(q);
+        q += nnew*sizeof(shortreal);
+    }
+    int *const new_popid = reinterpret_cast<int*>(q);
+    q += nnew*sizeof(int);
+#ifdef USE_PARTICLE_SUBCYCLING
+    uint8_t *const new_dtlevel = reinterpret_cast<uint8_t*>(q);
+#endif
+    if (n_used > 0) {
+        shortreal *const oldstreams[7] = {x,y,z,vx,vy,vz,w};
+        for (int s = 0; s < 7; ++s) {
+            memcpy(newstreams[s],oldstreams[s],n_used*sizeof(shortreal));
+        }
+        memcpy(new_popid,popid,n_used*sizeof(int));
+#ifdef USE_PARTICLE_SUBCYCLING
+        memcpy(new_accumed,accumed,n_used*sizeof(real));
+        memcpy(new_dtlevel,dtlevel,n_used*sizeof(uint8_t));
+#endif
+    }
+    delete [] buf;
+    buf = newbuf;
+    n_alloc = nnew;
+    x = newstreams[0];
+    y = newstreams[1];
+    z = newstreams[2];
+    vx = newstreams[3];
+    vy = newstreams[4];
+    vz = newstreams[5];
+    w = newstreams[6];
+    popid = new_popid;
+#ifdef USE_PARTICLE_SUBCYCLING
+    accumed = new_accumed;
+    dtlevel = new_dtlevel;
+#endif
+}
+
+//! Reallocate the streams with a small headroom, or free them if the list is empty
+void TParticleList::shrink()
+{
+    if (n_used <= 0) {
+        delete [] buf;
+        buf = 0;
+        n_alloc = 0;
+        return;
+    }
+    reallocate(max(n_used + n_used/4, 8));
+}
+
+//! Scratch storage of the linked view (only one view can exist at a time)
+static vector<TLinkedParticle> linkedView;
+
+/** \brief Make a temporary linked list of the particles
+ *
+ * Split and Join select and modify particles through TLinkedParticle
+ * pointers. The view is a linked copy of the list in linkedView.
+ * Particles may be unlinked from the view and added into the list
+ * (with add) while the view exists. endLinkedView writes the view
+ * back to the streams.
+ */
+void TParticleList::beginLinkedView()
+{
+    linkedView.resize(n_used);
+    for (int i = 0; i < n_used; ++i) {
+        get(i,linkedView[i]);
+        linkedView[i].next = (i+1 < n_used) ? &linkedView[i+1] : 0;
+    }
+    first = (n_used > 0) ? &linkedView[0] : 0;
+}
+
+//! Write the linked view back to the streams
+void TParticleList::endLinkedView()
+{
+    const int nview = linkedView.size();
+    int m = 0;
+    for (TLinkedParticle *p=first; p; p=p->next) {
+        set(m++,*p);
+    }
+    // Particles added while the view existed follow the view
+    TLinkedParticle p;
+    for (int i = nview; i < n_used; ++i) {
+        get(i,p);
+        set(m+i-nview,p);
+    }
+    n_used = m + (n_used - nview);
+    n_part = n_used;
+    first = 0;
+}
+
+/** \brief Call op for all particles
+ *
+ * If op returns false, delete the particle afterwards. Returns
+ * number of deletions.
+ */
+int TParticleList::pass(bool (*op)(TLinkedParticle& part,ParticlePassArgs a), ParticlePassArgs a)
+{
+    TLinkedParticle p;
+    const int n0 = n_used;
+    int i,nkeep;
+    for (i=0,nkeep=0; i<n0; i++) {
+        get(i,p);
+        if ((*op)(p,a)) {
+            set(nkeep++,p);
+        }
+    }
+    compact(n0,nkeep);
+    return n0 - nkeep;
+}
+
+//! Pass thru the particles in the list with relocation
+int TParticleList::pass_with_relocate(bool (*op)(TLinkedParticle& p,ParticlePassArgs a), ParticlePassArgs a)
+{
+    TLinkedParticle p;
+    const int n0 = n_used;
+    int i,nkeep,ndel = 0;
+    for (i=0,nkeep=0; i<n0; i++) {
+        get(i,p);
+        if ((*op)(p,a)) {
+            TParticleList *newplist = g.find_plist(p);
+            if (newplist != NULL && newplist != this) {
+                // particle p needs to be moved from *this to *newplist
+                newplist->push(p);
+            }
+            // Remove the particle if no particle list found (=out of box)
+            else if(newplist == NULL) {
+                ERRORMSG("no particle list found, removing particle");
+                ndel++;
+            } else {
+                set(nkeep++,p);
+            }
+        } else {
+            ndel++;
+        }
+    }
+    compact(n0,nkeep);
+    return ndel;
+}
+
+#endif
+
 //! Check if the particle belongs into any of the populations in popId. If popId.size() <= 0, return true.
 bool TParticleList::particleInPop(const TLinkedParticle& P, const vector<int> popId) const
 {
@@ -140,6 +438,8 @@ bool TParticleList::particleInPop(const TLinkedParticle& P, const vector<int> po
     }
 }
 
+#ifndef USE_PARTICLE_ARRAYS
+
 //! Calculate sum(w) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
 real TParticleList::calc_weight(vector<int> popId) const
 {
@@ -262,6 +562,15 @@ real TParticleList::calc_avemv2(real vx0, real vy0, real vz0, vector<int> popId)
     return mv2/denom;
 }
 
+//! Calculate the moments of all populations in one pass, m[popid] for popid = 0..npops-1
+void TParticleList::calc_moments(TParticleMoments *m, int npops) const
+{
+    memset(m, 0, npops*sizeof(TParticleMoments));
+    for (TLinkedParticle *p=first; p; p=p->next) {
+        m[p->popid].add(p->vx, p->vy, p->vz, p->w);
+    }
+}
+
 //! Stream operator
 ostream& operator<<(ostream& o, const TParticleList& pl)
 {
@@ -290,14 +599,264 @@ string TParticleList::toString() const
     return ss.str();
 }
 
+//! Copy the particles to the end of out and release them, return the number of particles moved
+int TParticleList::extract(vector<TLinkedParticle>& out)
+{
+    const int n = n_part;
+    TLinkedParticle *p=first,*q;
+    while (p) {
+        q = p->next;
+        out.push_back(*p);
+        particleArena.release(p);
+        p = q;
+    }
+    first = 0;
+    n_part = 0;
+    return n;
+}
+
+//! Prepend n particles from src, keeping their order
+void TParticleList::insert(const TLinkedParticle* src, int n)
+{
+    if (n <= 0) {
+        return;
+    }
+    first = particleArena.alloc(src,n,first);
+    n_part+= n;
+}
+
+/** \brief Move the particles to the lists of the octants of point c (grid refinement)
+ *
+ * The octant of a particle is octants[4*(x>=c[0]) + 2*(y>=c[1]) + (z>=c[2])],
+ * the order of the children of a cell. The particles are relinked as is.
+ */
+void TParticleList::move_to_octants(const gridreal c[3], TParticleList *octants[8])
+{
+    TLinkedParticle *p=first,*q;
+    while (p) {
+        q = p->next;
+        TParticleList *const dst = octants[4*(p->x >= c[0]) + 2*(p->y >= c[1]) + (p->z >= c[2])];
+        p->next = dst->first;
+        dst->first = p;
+        dst->n_part++;
+        p = q;
+    }
+    first = 0;
+    n_part = 0;
+}
+
 //! Destructor
 TParticleList::~TParticleList()
 {
     TLinkedParticle *p=first,*q;
     while (p) {
         q = p->next;
-        delete p;
+        particleArena.release(p);
         p = q;
     }
 }
 
+#else
+
+//! Check if pid is any of the populations in popId. If popId.size() <= 0, return true.
+bool TParticleList::popidInPop(int pid, const vector<int>& popId) const
+{
+    const unsigned int popsN = popId.size();
+    if (popsN <= 0) {
+        return true;
+    }
+    for(unsigned int i = 0; i < popsN; i++) {
+        if (pid == popId[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//! Calculate sum(w) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
+real TParticleList::calc_weight(vector<int> popId) const
+{
+    real result = 0;
+    for (int i = 0; i < n_used; ++i) {
+        if (popidInPop(popid[i], popId) == true) {
+            result += static_cast<real>(w[i]);
+        }
+    }
+    return result;
+}
+
+//! Calculate sum(w*m) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
+real TParticleList::calc_mass(vector<int> popId) const
+{
+    real result = 0;
+    for (int i = 0; i < n_used; ++i) {
+        if (popidInPop(popid[i], popId) == true) {
+            result += static_cast<real>(w[i])*real(Params::pops[popid[i]]->m);
+        }
+    }
+    return result;
+}
+
+//! Calculate sum(w*m) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
+real TParticleList::calc_charge(vector<int> popId) const
+{
+    real result = 0;
+    for (int i = 0; i < n_used; ++i) {
+        if (popidInPop(popid[i], popId) == true) {
+            result += static_cast<real>(w[i])*real(Params::pops[popid[i]]->q);
+        }
+    }
+    return result;
+}
+
+//! Calculate sum(w*v)/sum(w) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
+void TParticleList::calc_avev(real& vx0, real& vy0, real& vz0, vector<int> popId) const
+{
+    vx0 = vy0 = vz0 = 0;
+    real wsum = 0;
+    for (int i = 0; i < n_used; ++i) {
+        if (popidInPop(popid[i], popId) == true) {
+            vx0 += static_cast<real>(w[i])*real(vx[i]);
+            vy0 += static_cast<real>(w[i])*real(vy[i]);
+            vz0 += static_cast<real>(w[i])*real(vz[i]);
+            wsum += static_cast<real>(w[i]);
+        }
+    }
+    if (wsum == 0) {
+        return;
+    }
+    const real invwsum = 1.0/wsum;
+    vx0 *= invwsum;
+    vy0 *= invwsum;
+    vz0 *= invwsum;
+}
+
+//! Calculate U = sum(m*w*v)/sum(m*w) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
+void TParticleList::calc_U(real& Ux0, real& Uy0, real& Uz0, vector<int> popId) const
+{
+    Ux0 = Uy0 = Uz0 = 0;
+    real wsum = 0;
+    for (int i = 0; i < n_used; ++i) {
+        if (popidInPop(popid[i], popId) == true) {
+            const real wfac = static_cast<real>(w[i]) * static_cast<real>(Params::pops[popid[i]]->m);
+            Ux0 += wfac*static_cast<real>(vx[i]);
+            Uy0 += wfac*static_cast<real>(vy[i]);
+            Uz0 += wfac*static_cast<real>(vz[i]);
+            wsum += wfac;
+        }
+    }
+    if (wsum == 0) {
+        return;
+    }
+    const real invwsum = 1.0/wsum;
+    Ux0 *= invwsum;
+    Uy0 *= invwsum;
+    Uz0 *= invwsum;
+}
+
+//! Calculate sum(w*m*(v-v0)^2)/sum(w) over pops listed in popId. If popId.size() <= 0, calculate over all populations.
+real TParticleList::calc_avemv2(real vx0, real vy0, real vz0, vector<int> popId) const
+{
+    real mv2 = 0, denom = 0;
+    for (int i = 0; i < n_used; ++i) {
+        if (popidInPop(popid[i], popId) == true) {
+            mv2 += real(w[i])*static_cast<real>(Params::pops[popid[i]]->m)
+                   * (sqr(vx[i]-vx0) + sqr(vy[i]-vy0) + sqr(vz[i]-vz0));
+            denom += w[i];
+        }
+    }
+    if (denom == 0) {
+        return 0;
+    }
+    return mv2/denom;
+}
+
+//! Calculate the moments of all populations in one pass, m[popid] for popid = 0..npops-1
+void TParticleList::calc_moments(TParticleMoments *m, int npops) const
+{
+    memset(m, 0, npops*sizeof(TParticleMoments));
+    for (int i = 0; i < n_used; ++i) {
+        m[popid[i]].add(vx[i], vy[i], vz[i], w[i]);
+    }
+}
+
+//! Stream operator
+ostream& operator<<(ostream& o, const TParticleList& pl)
+{
+    o << '(';
+    for (int i = 0; i < pl.n_used; ++i) {
+        o << "x=" << pl.x[i] << ",y=" << pl.y[i] << ",z=" << pl.z[i]
+          << ",vx=" << pl.vx[i] << ",vy=" << pl.vy[i] << ",vz=" << pl.vz[i] << "; ";
+    }
+    o << ')';
+    o << ": mv2=" << pl.calc_avemv2(0, 0, 0) << ",npart=" << pl.n_part;
+    return o;
+}
+
+//! Particle list to string
+string TParticleList::toString() const
+{
+    stringstream ss;
+    ss << *this;
+    return ss.str();
+}
+
+/** \brief Move the particles to the lists of the octants of point c (grid refinement)
+ *
+ * The octant of a particle is octants[4*(x>=c[0]) + 2*(y>=c[1]) + (z>=c[2])],
+ * the order of the children of a cell. The streams of the list are freed.
+ */
+void TParticleList::move_to_octants(const gridreal c[3], TParticleList *octants[8])
+{
+    TLinkedParticle p;
+    for (int i = 0; i < n_used; ++i) {
+        get(i,p);
+        octants[4*(p.x >= c[0]) + 2*(p.y >= c[1]) + (p.z >= c[2])]->push(p);
+    }
+    n_used = 0;
+    n_part = 0;
+    shrink();
+}
+
+//! Copy the particles to the end of out and empty the list (the streams are kept), return the number of particles moved
+int TParticleList::extract(vector<TLinkedParticle>& out)
+{
+    const int n = n_used;
+    const size_t n0 = out.size();
+    out.resize(n0 + n);
+    for (int i = 0; i < n; ++i) {
+        get(i,out[n0+i]);
+    }
+    n_used = 0;
+    n_part = 0;
+    return n;
+}
+
+//! Append n particles from src, keeping their order
+void TParticleList::insert(const TLinkedParticle* src, int n)
+{
+    if (n <= 0) {
+        return;
+    }
+    reserve(n_used+n);
+    for (int i = 0; i < n; ++i) {
+        push(src[i]);
+    }
+}
+
+//! Destructor
+TParticleList::~TParticleList()
+{
+    delete [] buf;
+}
+
+#endif
+
+//! Move all particles to the list dst (grid recoarsening)
+void TParticleList::move_to(TParticleList& dst)
+{
+    static const gridreal c[3] = {0,0,0};
+    TParticleList *octants[8] = {&dst,&dst,&dst,&dst,&dst,&dst,&dst,&dst};
+    move_to_octants(c,octants);
+}
+
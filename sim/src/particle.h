@@ -36,18 +36,223 @@ struct TLinkedParticle {
 #endif
 };
 
+/** \brief Slab allocator for linked macroparticles
+ *
+ * Particles are carved from large slabs and recycled through a free
+ * list of their own population, so that particles of one population
+ * stay close to each other in memory and injection, splitting, joining
+ * and removal do not go through the general-purpose heap. Slabs are
+ * never returned to the heap during a run.
+ */
+class TParticleArena
+{
+public:
+    enum {SLAB_PARTICLES=4096}; //!< Number of particles allocated in one slab
+    TParticleArena();
+    ~TParticleArena();
+    TLinkedParticle* alloc(int popid);
+    TLinkedParticle* alloc(const TLinkedParticle* src, int n, TLinkedParticle* next);
+    void release(TLinkedParticle* p);
+    long getLive(int popid) const;
+    long getFree(int popid) const;
+    long getPeak(int popid) const;
+    long getSlabs() const {
+        return slabs.size();
+    }
+    void reset();
+private:
+    void grow(int popid);
+    std::vector<TLinkedParticle*> slabs;    //!< All allocated slabs
+    std::vector<int> slabPopid;             //!< Population of each slab
+    std::vector<TLinkedParticle*> freeList; //!< First free particle of each population
+    std::vector<long> nLive; //!< Number of particles in use in each population
+    std::vector<long> nFree; //!< Number of particles in the free list of each population
+    std::vector<long> nPeak; //!< Maximum of nLive since the beginning of the run
+};
+
+extern TParticleArena particleArena;
+
+//! Take a particle from the free list of the population
+inline TLinkedParticle* TParticleArena::alloc(int popid)
+{
+    TLinkedParticle *p;
+#ifdef USE_OPENMP
+#pragma omp critical(particleArena)
+#endif
+    {
+        if (popid >= static_cast<int>(freeList.size()) || freeList[popid] == 0) {
+            grow(popid);
+        }
+        p = freeList[popid];
+        freeList[popid] = p->next;
+        nFree[popid]--;
+        if (++nLive[popid] > nPeak[popid]) {
+            nPeak[popid] = nLive[popid];
+        }
+    }
+    return p;
+}
+
+/** \brief Take particles for copies of src[0..n-1] from the free lists
+ *
+ * The particles are taken in one critical section, copied from src and
+ * linked in the order of src, the last one to next. Returns the first.
+ */
+inline TLinkedParticle* TParticleArena::alloc(const TLinkedParticle* src, int n, TLinkedParticle* next)
+{
+    if (n <= 0) {
+        return next;
+    }
+    TLinkedParticle *head;
+#ifdef USE_OPENMP
+#pragma omp critical(particleArena)
+#endif
+    {
+        TLinkedParticle **link = &head;
+        for (int i = 0; i < n; ++i) {
+            const int popid = src[i].popid;
+            if (popid >= static_cast<int>(freeList.size()) || freeList[popid] == 0) {
+                grow(popid);
+            }
+            TLinkedParticle *const p = freeList[popid];
+            freeList[popid] = p->next;
+            nFree[popid]--;
+            if (++nLive[popid] > nPeak[popid]) {
+                nPeak[popid] = nLive[popid];
+            }
+            *link = p;
+            link = &p->next;
+        }
+    }
+    // Copy outside the critical section
+    TLinkedParticle *p = head;
+    for (int i = 0; i < n; ++i) {
+        TLinkedParticle *const q = p->next;
+        *p = src[i];
+        p->next = (i < n-1) ? q : next;
+        p = q;
+    }
+    return head;
+}
+
+//! Return a particle into the free list of its population
+inline void TParticleArena::release(TLinkedParticle* p)
+{
+    const int popid = p->popid;
+#ifdef USE_OPENMP
+#pragma omp critical(particleArena)
+#endif
+    {
+        p->next = freeList[popid];
+        freeList[popid] = p;
+        nLive[popid]--;
+        nFree[popid]++;
+    }
+}
+
+/** \brief Velocity moments of one population in a particle list
+ *
+ * Accumulated in one pass with the weighted (West) update of the mean
+ * and the central second moments, which avoids the cancellation of
+ * sum(w*v^2) - sum(w)*<v>^2 for cold drifting populations.
+ */
+struct TParticleMoments {
+    real w;    //!< sum(w)
+    real v[3]; //!< Average velocity sum(w*v)/sum(w)
+    real c[6]; //!< Central second moments sum(w*(v-<v>)_i*(v-<v>)_j) in order xx,yy,zz,xy,xz,yz
+    void add(real vx, real vy, real vz, real wp) {
+        if (wp <= 0) {
+            return;
+        }
+        w += wp;
+        const real r = wp/w;
+        const real dx = vx - v[0];
+        const real dy = vy - v[1];
+        const real dz = vz - v[2];
+        const real f = wp*(1 - r);
+        v[0] += r*dx;
+        v[1] += r*dy;
+        v[2] += r*dz;
+        c[0] += f*dx*dx;
+        c[1] += f*dy*dy;
+        c[2] += f*dz*dz;
+        c[3] += f*dx*dy;
+        c[4] += f*dx*dz;
+        c[5] += f*dy*dz;
+    }
+    //! Combine with the moments of another set of particles (pairwise update of Chan et al.)
+    void merge(const TParticleMoments& o) {
+        if (o.w <= 0) {
+            return;
+        }
+        if (w <= 0) {
+            *this = o;
+            return;
+        }
+        const real wsum = w + o.w;
+        const real r = o.w/wsum;
+        const real d[3] = {o.v[0] - v[0], o.v[1] - v[1], o.v[2] - v[2]};
+        const real f = w*r;
+        for (int i = 0; i < 3; ++i) {
+            v[i] += r*d[i];
+            c[i] += o.c[i] + f*d[i]*d[i];
+        }
+        c[3] += o.c[3] + f*d[0]*d[1];
+        c[4] += o.c[4] + f*d[0]*d[2];
+        c[5] += o.c[5] + f*d[1]*d[2];
+        w = wsum;
+    }
+    //! Trace of the central second moments, sum(w*(v-<v>)^2)
+    real trace() const {
+        return c[0] + c[1] + c[2];
+    }
+};
+
 //! Arguments from the grid to the particle pass function
 struct ParticlePassArgs {
     datareal rho_q;
     gridreal size;
 };
 
+#ifndef USE_PARTICLE_ARRAYS
 //! Linked particle list (unidirectional), for storing to grid cells. For all functions having popID[], pops: take only particles in the specified populations.
+#else
+/** \brief Particle list stored as structure of arrays, for storing to grid cells.
+ *
+ * Each particle variable is kept in its own contiguous stream. The
+ * streams of a list share one memory block, which grows by doubling
+ * and is not shrunk during a run. Particle functions still receive a
+ * TLinkedParticle, which is gathered from and scattered back to the
+ * streams. Split and Join work on a temporary linked view of the list
+ * (see beginLinkedView). For all functions having popID[], pops: take
+ * only particles in the specified populations.
+ */
+#endif
 class TParticleList
 {
 private:
     TLinkedParticle *first;
     int n_part;
+#ifdef USE_PARTICLE_ARRAYS
+    int n_used;  //!< Number of used slots in the streams (differs from n_part only in a linked view)
+    int n_alloc; //!< Capacity of the streams
+    char *buf;   //!< Memory block of all streams
+    shortreal *x,*y,*z,*vx,*vy,*vz,*w; //!< Position, velocity and weight streams
+    int *popid; //!< Population ID stream
+#ifdef USE_PARTICLE_SUBCYCLING
+    real *accumed;
+    uint8_t *dtlevel;
+#endif
+    void reserve(int n);
+    void reallocate(int nnew);
+    void get(int i, TLinkedParticle& p) const;
+    void set(int i, const TLinkedParticle& p);
+    void push(const TLinkedParticle& p);
+    void compact(int n0, int nkeep);
+    void beginLinkedView();
+    void endLinkedView();
+    bool popidInPop(int pid, const std::vector<int>& popId) const;
+#endif
     bool particleInPop(const TLinkedParticle& P, const std::vector<int> popId) const;
     friend class Split;
     friend class Join;
@@ -56,6 +261,11 @@ public:
     void init() {
         first = 0;
         n_part=0;
+#ifdef USE_PARTICLE_ARRAYS
+        n_used = 0;
+        n_alloc = 0;
+        buf = 0;
+#endif
     }
     TParticleList() {
         init();
@@ -73,8 +283,16 @@ public:
     void calc_avev(real& vx0, real& vy0, real& vz0, std::vector<int> popId = std::vector<int>()) const;
     void calc_U(real& Ux0, real& Uy0, real& Uz0, std::vector<int> popId = std::vector<int>()) const;
     real calc_avemv2(real vx0, real vy0, real vz0, std::vector<int> popId = std::vector<int>()) const;
+    void calc_moments(TParticleMoments *m, int npops) const;
     friend std::ostream& operator<<(std::ostream& o, const TParticleList& pl);
     std::string toString() const;
+    void move_to_octants(const gridreal c[3], TParticleList *octants[8]);
+    void move_to(TParticleList& dst);
+    int extract(std::vector<TLinkedParticle>& out);
+    void insert(const TLinkedParticle* src, int n);
+#ifdef USE_PARTICLE_ARRAYS
+    void shrink();
+#endif
     ~TParticleList();
 };
 
@@ -84,5 +302,71 @@ inline int TParticleList::Nparticles() const
     return n_part;
 }
 
+#ifdef USE_PARTICLE_ARRAYS
+
+//! Gather particle i from the streams
+inline void TParticleList::get(int i, TLinkedParticle& p) const
+{
+    p.x = x[i];
+    p.y = y[i];
+    p.z = z[i];
+    p.vx = vx[i];
+    p.vy = vy[i];
+    p.vz = vz[i];
+    p.w = w[i];
+    p.popid = popid[i];
+    p.next = 0;
+#ifdef USE_PARTICLE_SUBCYCLING
+    p.dtlevel = dtlevel[i];
+    p.accumed = accumed[i];
+#endif
+}
+
+//! Scatter particle p into slot i of the streams
+inline void TParticleList::set(int i, const TLinkedParticle& p)
+{
+    x[i] = p.x;
+    y[i] = p.y;
+    z[i] = p.z;
+    vx[i] = p.vx;
+    vy[i] = p.vy;
+    vz[i] = p.vz;
+    w[i] = p.w;
+    popid[i] = p.popid;
+#ifdef USE_PARTICLE_SUBCYCLING
+    dtlevel[i] = p.dtlevel;
+    accumed[i] = p.accumed;
+#endif
+}
+
+//! Append particle p at the end of the streams
+inline void TParticleList::push(const TLinkedParticle& p)
+{
+    if (n_used >= n_alloc) {
+        reserve(n_used+1);
+    }
+    set(n_used++,p);
+    n_part++;
+}
+
+/** \brief Remove holes left by a pass
+ *
+ * Slots [0,nkeep) hold the particles kept by a pass over the first n0
+ * slots. Particles added during the pass (slots n0...) are moved
+ * right after them.
+ */
+inline void TParticleList::compact(int n0, int nkeep)
+{
+    TLinkedParticle p;
+    for (int i = n0; i < n_used; ++i) {
+        get(i,p);
+        set(nkeep+i-n0,p);
+    }
+    n_part -= n0 - nkeep;
+    n_used -= n0 - nkeep;
+}
+
+#endif
+
 #endif
 
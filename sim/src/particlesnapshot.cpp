@@ -0,0 +1,209 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include "particlesnapshot.h"
+#include "params.h"
+#include "population.h"
+#include "logger.h"
+#include "templates.h"
+#include "decomposition.h"
+
+using namespace std;
+
+extern Logger errorlog;
+
+/** \brief Constructor
+ *
+ * Saves a share fraction (0...1] of the particles inside region (xmin xmax
+ * ymin ymax zmin zmax). If xmin >= xmax, all particles are inside the region.
+ */
+ParticleSnapshot::ParticleSnapshot(real fraction, const real region[6]) : fraction(fraction)
+{
+    for (int i = 0; i < 6; ++i) {
+        this->region[i] = region[i];
+    }
+    useRegion = (region[0] < region[1]);
+}
+
+ParticleSnapshot::~ParticleSnapshot()
+{
+    closeFiles();
+}
+
+/** \brief Save the particles of all populations
+ *
+ * Returns false if some file could not be written completely.
+ */
+bool ParticleSnapshot::save(Tgrid& g, const string& timeStr)
+{
+    const unsigned int npops = Params::pops.size();
+    Pass pass;
+    pass.snapshot = this;
+    // Count the saved particles of each population
+    counts.assign(npops, 0);
+    shares.assign(npops, 0.0);
+    pass.counting = true;
+    g.particle_pass(pass);
+    bool ok = true;
+    files.assign(npops, PopulationFile());
+    for (unsigned int i = 0; i < npops; ++i) {
+        if (openFile(i, timeStr) == false) {
+            ok = false;
+        }
+    }
+    // Write the same particles
+    if (ok == true) {
+        shares.assign(npops, 0.0);
+        pass.counting = false;
+        g.particle_pass(pass);
+        for (unsigned int i = 0; i < npops; ++i) {
+            flush(files[i]);
+        }
+    }
+    for (unsigned int i = 0; i < npops; ++i) {
+        if (files[i].nWritten != files[i].nParticles) {
+            files[i].ok = false;
+        }
+    }
+    closeFiles();
+    for (unsigned int i = 0; i < npops; ++i) {
+        if (files[i].ok == false) {
+            ERRORMSG2("could not write particle snapshot file completely", files[i].fileName);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+//! Whether particle p is saved (counts the subsampling share of its population)
+bool ParticleSnapshot::select(const TLinkedParticle& p)
+{
+    if (useRegion == true && (p.x < region[0] || p.x >= region[1] ||
+                              p.y < region[2] || p.y >= region[3] ||
+                              p.z < region[4] || p.z >= region[5])) {
+        return false;
+    }
+    shares[p.popid] += fraction;
+    if (shares[p.popid] < 1.0) {
+        return false;
+    }
+    shares[p.popid] -= 1.0;
+    return true;
+}
+
+//! Add particle p into the buffer of its population
+void ParticleSnapshot::add(const TLinkedParticle& p)
+{
+    PopulationFile& f = files[p.popid];
+    shortreal *b = &f.buffer[f.nBuffered];
+    b[0] = p.x;
+    b[CHUNK_PARTICLES] = p.y;
+    b[2*CHUNK_PARTICLES] = p.z;
+    b[3*CHUNK_PARTICLES] = p.vx;
+    b[4*CHUNK_PARTICLES] = p.vy;
+    b[5*CHUNK_PARTICLES] = p.vz;
+    b[6*CHUNK_PARTICLES] = p.w;
+    if (++f.nBuffered == CHUNK_PARTICLES) {
+        flush(f);
+    }
+}
+
+//! Write the buffered particles at the end of the written part of each column
+void ParticleSnapshot::flush(PopulationFile& f)
+{
+    if (f.nBuffered == 0 || f.ok == false) {
+        f.nBuffered = 0;
+        return;
+    }
+    for (int c = 0; c < NCOLUMNS; ++c) {
+        shortreal *column = &f.buffer[c*CHUNK_PARTICLES];
+        ByteConversion(sizeof(shortreal), reinterpret_cast<unsigned char*>(column), f.nBuffered);
+        const long pos = f.dataStart + long((c*f.nParticles + f.nWritten)*sizeof(shortreal));
+        if (fseek(f.fp, pos, SEEK_SET) != 0 ||
+            fwrite(column, sizeof(shortreal), f.nBuffered, f.fp) != size_t(f.nBuffered)) {
+            f.ok = false;
+        }
+    }
+    f.nWritten += f.nBuffered;
+    f.nBuffered = 0;
+}
+
+//! Create the file of population popid and write its header
+bool ParticleSnapshot::openFile(unsigned int popid, const string& timeStr)
+{
+    PopulationFile& f = files[popid];
+    Population *pop = Params::pops[popid];
+    f.fileName = Decomposition::rankFileName("pdump_" + pop->getIdStr() + "_" + timeStr + ".dat");
+    f.nParticles = counts[popid];
+    f.fp = fopen(f.fileName.c_str(), "wb");
+    f.ok = (f.fp != NULL);
+    if (f.ok == false) {
+        return false;
+    }
+    f.buffer.resize(NCOLUMNS*CHUNK_PARTICLES);
+    ostringstream o;
+    o.precision(16);
+    o << "# " << Params::codeVersion << "\n";
+    o << "# filename: " << f.fileName << "\n";
+    o << "# t = " << Params::t << "\n";
+    o << "# PARTICLE SNAPSHOT FILE CONTENTS\n";
+    o << "#  x, y, z = position [m]\n";
+    o << "#  vx, vy, vz = velocity [m/s]\n";
+    o << "#  w = statistical weight (not scaled by the fraction)\n";
+    o << "# population = " << pop->getIdStr() << "\n";
+    o << "# m = " << pop->m << "\n";
+    o << "# q = " << pop->q << "\n";
+    o << "# fraction = " << fraction << "\n";
+    if (useRegion == true) {
+        o << "# region = " << region[0] << " " << region[1] << " " << region[2] << " "
+          << region[3] << " " << region[4] << " " << region[5] << "\n";
+    } else {
+        o << "# region = all\n";
+    }
+    o << "type = particles\n";
+    o << "realformat = float\n";
+    o << "columns = \"x y z vx vy vz w\"\n";
+    o << "ncolumns = " << NCOLUMNS << "\n";
+    o << "nparticles = " << f.nParticles << "\n";
+    o << "popid = " << popid << "\n";
+    o << "t = " << Params::t << "\n";
+    o << "eoh\n";
+    const string header = o.str();
+    if (fwrite(header.data(), 1, header.size(), f.fp) != header.size()) {
+        f.ok = false;
+        return false;
+    }
+    f.dataStart = header.size();
+    return true;
+}
+
+//! Close the open files and release the buffers
+void ParticleSnapshot::closeFiles()
+{
+    for (unsigned int i = 0; i < files.size(); ++i) {
+        if (files[i].fp != NULL) {
+            if (fclose(files[i].fp) != 0) {
+                files[i].ok = false;
+            }
+            files[i].fp = NULL;
+        }
+        vector<shortreal>().swap(files[i].buffer);
+    }
+}
+
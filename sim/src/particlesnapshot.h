@@ -0,0 +1,103 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARTICLESNAPSHOT_H
+#define PARTICLESNAPSHOT_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "definitions.h"
+#include "particle.h"
+#include "grid.h"
+
+/** \brief Binary columnar particle snapshot files
+ *
+ * The particles of each population are saved in their own file
+ * (pdump_<population>_<time>.dat), which has a text header like the
+ * hc-files followed by the columns x, y, z, vx, vy, vz and w, each with
+ * the values of all saved particles as floats in the byte order of the
+ * binary hc-files.
+ *
+ * The particles are passed twice: first to count the saved particles of
+ * each population and then to write them. The second pass collects the
+ * particles of each population in a buffer of CHUNK_PARTICLES particles,
+ * which is written into the columns of the file when it is full, so the
+ * memory needed does not depend on the number of particles.
+ *
+ * Particles can be selected by a region and subsampled by a fraction. The
+ * subsampling takes every particle whose share of the fraction reaches a
+ * whole particle, so it does not use random numbers and both passes
+ * select the same particles.
+ */
+class ParticleSnapshot
+{
+public:
+    ParticleSnapshot(real fraction, const real region[6]);
+    ~ParticleSnapshot();
+    bool save(Tgrid& g, const std::string& timeStr);
+private:
+    //! Particle pass function object
+    struct Pass;
+    friend struct Pass;
+    struct Pass {
+        ParticleSnapshot *snapshot;
+        bool counting;
+        bool operator()(TLinkedParticle& p) {
+            if (snapshot->select(p) == true) {
+                if (counting == true) {
+                    snapshot->counts[p.popid]++;
+                } else {
+                    snapshot->add(p);
+                }
+            }
+            return true;
+        }
+    };
+    //! Particles per buffered chunk of a population
+    static const int CHUNK_PARTICLES = 65536;
+    //! Number of columns (x, y, z, vx, vy, vz, w)
+    static const int NCOLUMNS = 7;
+    //! Output file of one population
+    struct PopulationFile {
+        std::string fileName;
+        FILE *fp;
+        long dataStart;           //!< File position of the first column
+        uint64_t nParticles;      //!< Length of the columns
+        uint64_t nWritten;        //!< Particles written into the columns
+        int nBuffered;            //!< Particles in the buffer
+        std::vector<shortreal> buffer;  //!< NCOLUMNS columns of CHUNK_PARTICLES values
+        bool ok;
+        PopulationFile() : fp(NULL), dataStart(0), nParticles(0), nWritten(0), nBuffered(0), ok(false) { }
+    };
+    real fraction;
+    real region[6];
+    bool useRegion;
+    std::vector<double> shares;
+    std::vector<uint64_t> counts;
+    std::vector<PopulationFile> files;
+    bool select(const TLinkedParticle& p);
+    void add(const TLinkedParticle& p);
+    void flush(PopulationFile& f);
+    bool openFile(unsigned int popid, const std::string& timeStr);
+    void closeFiles();
+};
+
+#endif
+
@@ -30,6 +30,15 @@
 using namespace std;
 
 Tportrand portrand;
+TGaussCache gausscache = {0.0, false};
+Tportrand *threadrand = &portrand;
+TGaussCache *threadgauss = &gausscache;
+//! Random stream of the calling thread (begin_rnd_stream), allocated at the first use
+static Tportrand *streamrand = 0;
+static TGaussCache streamgauss = {0.0, false};
+#ifdef USE_OPENMP
+#pragma omp threadprivate(threadrand,threadgauss,streamrand,streamgauss)
+#endif
 
 const long int m1 = 2147483563, a1 = 40014, q1 = 53668, r1 = 12211;
 const long int m2 = 2147483399, a2 = 40692, q2 = 52774, r2 = 3791;
@@ -155,6 +164,30 @@ bool Tportrand::load(const char *fn)
     return is.good();
 }
 
+/** \brief Draw the random numbers of the calling thread from a stream of its own
+ *
+ * The stream depends only on seed, so the random numbers drawn by the
+ * work of one parallel task (e.g. a particle push block) do not depend on
+ * which thread runs it or on the order of the tasks. End with end_rnd_stream().
+ */
+void begin_rnd_stream(unsigned long int seed)
+{
+    if (streamrand == 0) {
+        streamrand = new Tportrand;
+    }
+    streamrand->init(seed);
+    streamgauss.is_saved = false;
+    threadrand = streamrand;
+    threadgauss = &streamgauss;
+}
+
+//! Draw the random numbers of the calling thread from portrand again
+void end_rnd_stream()
+{
+    threadrand = &portrand;
+    threadgauss = &gausscache;
+}
+
 /** \brief Gaussian randomness
  *
  *  Generate a Gaussian deviate with zero mean and unit
@@ -167,12 +200,10 @@ bool Tportrand::load(const char *fn)
  */
 fastreal gaussrnd()
 {
-    static fastreal saved;
-    static bool is_saved = false;
     fastreal x,y,r2,fac,result;
-    if (is_saved) {
-        result = saved;
-        is_saved = false;
+    if (threadgauss->is_saved) {
+        result = threadgauss->saved;
+        threadgauss->is_saved = false;
     } else {
         do {
             x = 2*uniformrnd() - 1;
@@ -182,8 +213,8 @@ fastreal gaussrnd()
         // On average, this do loop is executed 4/pi = 1.27324 times
         fac = sqrt(-2.0*log(r2)/r2);
         result = x*fac;
-        saved = y*fac;
-        is_saved = true;
+        threadgauss->saved = y*fac;
+        threadgauss->is_saved = true;
     }
     return result;
 }
@@ -60,8 +60,25 @@ public:
     bool load(const char *fn);
 };
 
+//! Second deviate of the last pair generated by gaussrnd, returned by the next call
+typedef struct {
+    fastreal saved;
+    bool is_saved;
+}
+TGaussCache;
+
 extern Tportrand portrand;
-#define uniformrnd() portrand.next()
+extern TGaussCache gausscache;
+//! Generator and Gaussian cache of the calling thread (portrand and gausscache outside random streams)
+extern Tportrand *threadrand;
+extern TGaussCache *threadgauss;
+#ifdef USE_OPENMP
+#pragma omp threadprivate(threadrand,threadgauss)
+#endif
+#define uniformrnd() threadrand->next()
+
+extern void begin_rnd_stream(unsigned long int seed);
+extern void end_rnd_stream();
 extern fastreal gaussrnd();
 extern fastreal derivgaussrnd(fastreal x0);
 
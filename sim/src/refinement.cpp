@@ -250,6 +250,11 @@ void initializeGridRefinement()
             g.hcwrite_EXTRA(fileName,&Params::gridRefinementFunction,hcHeader);
         }
     }
+    // Refine the grid also as in the breakpoint of a previous state
+    if (Params::wsFileGiven) {
+        ifstream is(Params::wsFileName.c_str(), ios::in | ios::binary);
+        g.readStateRefinement(is);
+    }
     MSGFUNCTIONEND("initializeGridRefinement");
 }
 
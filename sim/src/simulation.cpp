@@ -16,14 +16,19 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <numeric>
 #include <iostream>
 #include <iomanip>
 #include <cstdio>
 #include <cmath>
 #include <ctime>
 #include <cstdlib>
+#include <cstring>
 #include <csignal>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 #include "simulation.h"
 #include "random.h"
 #include "magneticfield.h"
@@ -38,6 +43,9 @@
 #include "vis/vis_db_factory.h"
 #include "templates.h"
 #include "chemistry.h"
+#include "output.h"
+#include "particlesnapshot.h"
+#include "decomposition.h"
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
 #include "transformations.h"
 #endif
@@ -59,15 +67,12 @@ Tgrid g;
 //! Simulation parameters
 Params simuConfig;
 
-//! Output file pointer
-FILE *outputfp;
-
 //! Constructor
 Simulation::Simulation()
 {
     timepool("Init");
     mainlog.init();
-    errorlog.init();
+    errorlog.init(true);
     paramslog.init();
     // Start program execution time counter
     getExecutionSecs();
@@ -85,6 +90,21 @@ Simulation::Simulation()
 #ifdef RECONNECTION_GEOMETRY
 #error RECONNECTION_GEOMETRY does not work with USE_SPHERICAL_COORDINATE_SYSTEM.
 #endif
+#endif
+#ifdef USE_MPI
+#ifdef USE_SPHERICAL_COORDINATE_SYSTEM
+#error USE_MPI does not work with USE_SPHERICAL_COORDINATE_SYSTEM.
+#endif
+#ifdef SAVE_POPULATION_AVERAGES
+#error USE_MPI does not work with SAVE_POPULATION_AVERAGES.
+#endif
+#ifdef SAVE_PARTICLE_CELL_SPECTRA
+#error USE_MPI does not work with SAVE_PARTICLE_CELL_SPECTRA.
+#endif
+#ifdef SAVE_PARTICLES_ALONG_ORBIT
+#error USE_MPI does not work with SAVE_PARTICLES_ALONG_ORBIT.
+#endif
+    mainlog << "MPI RANKS = " << Decomposition::getNranks() << "\n";
 #endif
     mainlog << "\n";
     static bool onlyOneSimulationObject = false;
@@ -143,6 +163,8 @@ Simulation::Simulation()
             << "|----------------------------------------------|\n";
 
 #endif
+    startupWall = getWallSecs();
+    startupCPU = timepool.cputime();
 #ifndef USE_SPHERICAL_COORDINATE_SYSTEM
     g.init(Params::nx, Params::ny, Params::nz, Params::box_xmin, Params::box_ymin, Params::box_zmin, Params::dx);
 #else
@@ -178,44 +200,85 @@ bool Simulation::AlwaysTrue(TLinkedParticle&)
     return true;
 }
 
-//! Particle dumping
-bool Simulation::output(TLinkedParticle& part)
-{
-    fprintf(outputfp,"%g %g %g %g %g %g %g %d\n",
-            double(part.x),double(part.y),double(part.z),
-            double(part.vx),double(part.vy),double(part.vz),
-            double(part.w),int(part.popid));
-    return true;
-}
-
 //! Initialize the simulation
 void Simulation::initializeSimulation()
 {
     MSGFUNCTIONCALL("Simulation::initializeSimulation");
     macroParticlePropagations = 0.0;
+    pushCPU = 0.0;
+    pushRate = 0.0;
+    pushRateAfterSort = false;
+    balanceCPU = 0.0;
+    subcycleStep = -1;
     // Initialize our portable random number generator with some
-    // seed (always the same ==> repeatable)
-    portrand.init(1024);
+    // seed (always the same ==> repeatable, each MPI rank has its own)
+    portrand.init(1024 + Decomposition::getRank());
     initializeGridRefinement();
+    g.partition_base_cells();
+    // Grid startup (init and refinement) against the number of cells
+    const double wallSecs = getWallSecs() - startupWall;
+    const double cpuSecs = timepool.cputime() - startupCPU;
+    const int ncells = g.Ncells_with_ghosts();
+    mainlog << "|------------------ GRID STARTUP ------------------|\n"
+            << "| Cells (with ghosts) : " << ncells << "\n"
+            << "| Wall time           : " << wallSecs << " s\n"
+            << "| CPU time            : " << cpuSecs << " s\n"
+            << "| Rate                : " << (wallSecs > 0 ? ncells/wallSecs : 0.0) << " cells/s\n"
+            << "|--------------------------------------------------|\n";
     initializeForbidSplitJoin();
     initializeResistivity();
     initializeBackgroundChargeDensity();
     initializeMagneticField();
     initializeSplitJoin();
+#ifndef USE_ASYNC_OUTPUT
+    if (Params::maxOutputsInFlight > 0) {
+        WARNINGMSG("maxOutputsInFlight > 0 requires USE_ASYNC_OUTPUT, writing output files synchronously");
+    }
+#endif
+#ifndef USE_COMPRESSED_HC
+    if (Params::saveHC == 3) {
+        WARNINGMSG("saveHC = 3 requires USE_COMPRESSED_HC, saving uncompressed binary HC files");
+    }
+    if (Params::saveVTK == 4) {
+        WARNINGMSG("saveVTK = 4 requires USE_COMPRESSED_HC, saving uncompressed XML VTK files");
+    }
+#endif
+#ifndef USE_MPI
+    if (Params::loadBalanceInterval > 0) {
+        WARNINGMSG("loadBalanceInterval > 0 requires USE_MPI, the load is not balanced");
+    }
+#endif
+#ifdef USE_SPHERICAL_COORDINATE_SYSTEM
+    if (Params::adaptiveRefinementInterval > 0) {
+        WARNINGMSG("adaptiveRefinementInterval > 0 requires Cartesian coordinates, the grid is not adapted");
+    }
+    if (Params::saveVTK == 5) {
+        WARNINGMSG("saveVTK = 5 requires Cartesian coordinates, saving XML VTK unstructured grid files");
+    }
+    if (Params::fieldSubsteps > 1) {
+        WARNINGMSG("fieldSubsteps > 1 requires Cartesian coordinates, the field is propagated in one step");
+    }
+#endif
     mainlog << "|---------------- GENERAL SIMULATION INFORMATION ----------------|\n"
             << "| R_P = " << Params::R_P/1e3 << " km\n"
             << "| R_zeroFields (inner boundary) = " << Params::R_zeroFields/1e3 << " km = " << Params::R_zeroFields/Params::R_P << " R_P = " << (Params::R_zeroFields-Params::R_P)/1e3 << " km + R_P\n"
             << "| dt = " << Params::dt << " s\n"
+            << "| field substeps per timestep = " << Params::fieldSubsteps << "\n"
             << "| t_max = " << Params::t_max << " s\n"
             << "| save interval = " << Params::saveInterval << " s\n"
             << "| input interval = " << Params::inputInterval << " s\n"
             << "| log interval = " << Params::logInterval << " s\n"
             << "| breakpoint interval (cyclic) = " << Params::wsDumpInterval[0] << " s\n"
             << "| breakpoint interval (keep) = " << Params::wsDumpInterval[1] << " s\n"
+            << "| particle snapshot interval = " << Params::particleSnapshotInterval << " s\n"
+            << "| in-situ cut interval = " << Params::insituInterval << " s\n"
+            << "| Output files in flight (0 = synchronous) = " << (outputWriter.enabled() ? Params::maxOutputsInFlight : 0) << "\n"
             << "| Average output files = " << (Params::averaging ? "yes" : "no") << "\n"
+            << "| Running average time constants = " << Params::averageTimeConstants[0] << " " << Params::averageTimeConstants[1] << " " << Params::averageTimeConstants[2] << " s\n"
             << "| MacroParticlesPerCell = "  << Params::macroParticlesPerCell << "\n"
             << "| Maximun number of grid refinement levels = " << Params::maxGridRefinementLevel << "\n"
             << "| Current number of grid refinement levels = " << Params::currentGridRefinementLevel << "\n"
+            << "| Adaptive refinement interval (0 = off) = " << Params::adaptiveRefinementInterval << " timesteps\n"
             << "| min_dx = " << Params::dx/real(1 << Params::currentGridRefinementLevel)*1e-3 << " km = " << Params::dx/(Params::R_P*real(1 << Params::currentGridRefinementLevel)) << " R_P\n"
             << "| max_dx = " << Params::dx*1e-3 << " km = " << Params::dx/Params::R_P << " R_P\n"
             << "| vi_max = " << Params::vi_max/1e3 << " km/s\n"
@@ -260,6 +323,18 @@ void Simulation::initializeSimulation()
         ERRORMSG("wsDumpInterval < dt");
         doabort();
     }
+    if(Params::particleSnapshotInterval > 0 && Params::particleSnapshotInterval < Params::dt) {
+        ERRORMSG("particleSnapshotInterval < dt");
+        doabort();
+    }
+    if(Params::particleSnapshotFraction <= 0 || Params::particleSnapshotFraction > 1) {
+        ERRORMSG("particleSnapshotFraction must be in (0,1]");
+        doabort();
+    }
+    if(Params::insituInterval > 0 && Params::insituInterval < Params::dt) {
+        ERRORMSG("insituInterval < dt");
+        doabort();
+    }
     mainlog
             << "|-------------------- IMF --------------------|\n"
             << "|   B  = [" << Params::SW_Bx/1e-9 << ", " << Params::SW_By/1e-9 << ", " << Params::SW_Bz/1e-9 << "] nT\n"
@@ -331,7 +406,36 @@ void Simulation::initializeSimulation()
         visWriters.push_back(&(VisDBFactory::getVisDB(VTK_LEGACY_BINARY, *visDataSourceImpl)));
     } else if(Params::saveVTK == 2) {
         visWriters.push_back(&(VisDBFactory::getVisDB(VTK_LEGACY_ASCII, *visDataSourceImpl)));
+    } else if(Params::saveVTK == 3) {
+        visWriters.push_back(&(VisDBFactory::getVisDB(VTK_XML_BINARY, *visDataSourceImpl)));
+    } else if(Params::saveVTK == 4) {
+#ifdef USE_COMPRESSED_HC
+        visWriters.push_back(&(VisDBFactory::getVisDB(VTK_XML_COMPRESSED, *visDataSourceImpl)));
+#else
+        visWriters.push_back(&(VisDBFactory::getVisDB(VTK_XML_BINARY, *visDataSourceImpl)));
+#endif
+    } else if(Params::saveVTK == 5) {
+#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
+        visWriters.push_back(&(VisDBFactory::getVisDB(VTK_XML_AMR, *visDataSourceImpl)));
+#else
+        visWriters.push_back(&(VisDBFactory::getVisDB(VTK_XML_BINARY, *visDataSourceImpl)));
+#endif
+    }
+    // Initialize in-situ slices and line cuts
+#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
+    if (insitu.initialize(g) == false) {
+        doabort();
     }
+    if (insitu.isDefined() == true) {
+        mainlog << "|---------------- IN-SITU CUTS ----------------|\n"
+                << insitu.toString()
+                << "|-----------------------------------------------|\n\n";
+    }
+#else
+    if (Params::insituInterval > 0) {
+        WARNINGMSG("in-situ cuts require Cartesian coordinates, no in-situ cuts saved");
+    }
+#endif
     MSGFUNCTIONEND("Simulation::initializeSimulation");
 }
 
@@ -342,7 +446,7 @@ void Simulation::run()
     // Read previous state, if it was given
     if (Params::wsFileGiven) {
         timepool("LoadBreakpoint");
-        readState( Params::wsFileName.c_str() );
+        readState( Decomposition::rankFileName(Params::wsFileName).c_str() );
         finalizeTimestep(false);
     }
     mainlog << "TIMELOOP START\n";
@@ -376,31 +480,36 @@ void Simulation::runOnlyParameterDynamics()
 //! Forward simulation one timestep
 void Simulation::stepForward()
 {
+    adaptGrid();
+    balanceLoad();
+    sortParticles();
     timepool("Newparticle");
+    // Every rank keeps the new particles in its own base cells
+    g.set_owned_injection(true);
     for (unsigned int i = 0; i < Params::pops.size(); ++i) {
         Params::pops[i]->createParticles();
     }
+    g.set_owned_injection(false);
     timepool("Field");
     if(Params::propagateField == true) {
         g.zero_rhoq_nc_Vq();
     }
     timepool("Xpropag");
 #ifndef USE_PARTICLE_SUBCYCLING
-    g.particle_pass(&PropagateX);
+    g.particle_push(PushX());
 #else
     g.particle_pass(&PropagatePart1);
 #endif
     g.particle_pass_with_relocation(&AlwaysTrue);
+    if (Decomposition::getNranks() > 1) {
+        timepool("Migrate");
+        g.migrate_particles();
+    }
     timepool("Field");
     if(Params::propagateField == true) {
         g.finalize_accum();
         g.smoothing();//smooth the particle related variables before propagating the field.
-        if (Params::fieldPredCor == false) {
-            fieldpropagate(Tgrid::FACEDATA_B, Tgrid::FACEDATA_B, Tgrid::FACEDATA_B,Params::dtField,true);
-        } else {
-            fieldpropagate(Tgrid::FACEDATA_BSTAR, Tgrid::FACEDATA_B, Tgrid::FACEDATA_B,Params::dtField/2,false);
-            fieldpropagate(Tgrid::FACEDATA_B, Tgrid::FACEDATA_B, Tgrid::FACEDATA_BSTAR,Params::dtField,true);
-        }
+        fieldSubcycle();
         if(Params::electronPressure==true) {
             g.FC(Tgrid::FACEDATA_B,Tgrid::CELLDATA_B);//update cell-data B to calculate E for particle acceleration.
             // g.Neumann_rhoq();//set up the boundary condition of rho_q for Cell-to-node interpolation. This is redundant because it is already taken care of in finalize_accum().
@@ -412,7 +521,11 @@ void Simulation::stepForward()
     }
     timepool("Vpropag");
 #ifndef USE_PARTICLE_SUBCYCLING
-    g.particle_pass(&PropagateV);
+#ifdef USE_BATCHED_PUSH
+    g.particle_batch_pass(PushVBatch());
+#else
+    g.particle_push(PushV());
+#endif
 #else
     g.particle_pass(&PropagatePart2);
 #endif
@@ -438,27 +551,168 @@ void Simulation::stepForward()
 #endif
     // Count particle propagations
     macroParticlePropagations += g.Nparticles();
-    // particle dumping
-    static const int Ndumps = 4;
-    static real particle_dump_start[Ndumps] = {1e20,1e20,1e20,1e20};
-    static bool particle_dump_done[Ndumps] = {0};
-    for(int i=0; i<Ndumps; ++i) {
-        if ((Params::cnt_dt % int(particle_dump_start[i]/Params::dt+0.5) == 0) && (particle_dump_done[i] == false)  && (Params::cnt_dt > 0)) {
-            string fn = "pdump_" + Params::getSimuTimeStr() + ".dat";
-            outputfp = fopen(fn.c_str(),"w");
-            //fprintf(outputfp,"D=2r %d %d\n",g.Nparticles(),8);
-            fprintf(outputfp,"# x y z vx vy vz w popid\n");
-            g.particle_pass(&output);
-            fclose(outputfp);
-            particle_dump_done[i] = true;
-            mainlog << "Dumped particles in \"" << fn << "\" at t=" << Params::t << "\n";
+    measurePushRate(g.Nparticles());
+}
+
+/** \brief Propagate B by dtField in fieldSubsteps substeps
+ *
+ * The whistler waves limit the explicit field propagation to a timestep
+ * proportional to dx^2 and density/B, which the particles do not need.
+ * With fieldSubsteps = N the field is propagated N times by dtField/N
+ * between the particle pushes. The ion moments of the timestep are taken
+ * to be at the middle of the timestep and are interpolated from (and
+ * extrapolated along) the change since the previous timestep
+ * (Tgrid::set_subcycle_moments). After the substeps U_e is calculated
+ * with the moments of the timestep for the velocity push. The substeps
+ * and the stability margin (whistler limit / substep) are logged every
+ * logInterval.
+ */
+void Simulation::fieldSubcycle()
+{
+    const int nsub = Params::fieldSubsteps;
+    const real dts = Params::dtField/nsub;
+    if (nsub > 1) {
+        g.begin_moment_subcycling(subcycleStep == Params::cnt_dt-1);
+        subcycleStep = Params::cnt_dt;
+    }
+    for (int s = 0; s < nsub; ++s) {
+        if (nsub > 1) {
+            g.set_subcycle_moments((s+0.5)/nsub - 0.5);
         }
+        if (Params::fieldPredCor == false) {
+            fieldpropagate(Tgrid::FACEDATA_B, Tgrid::FACEDATA_B, Tgrid::FACEDATA_B,dts,true);
+        } else {
+            fieldpropagate(Tgrid::FACEDATA_BSTAR, Tgrid::FACEDATA_B, Tgrid::FACEDATA_B,dts/2,false);
+            fieldpropagate(Tgrid::FACEDATA_B, Tgrid::FACEDATA_B, Tgrid::FACEDATA_BSTAR,dts,true);
+        }
+    }
+    if (nsub > 1) {
+        g.end_moment_subcycling();
+        g.calc_ue();
+        g.Neumann(Tgrid::CELLDATA_UE);
+    }
+    if (Params::logInterval > 0 && (Params::cnt_dt % int(Params::logInterval/Params::dt+0.5) == 0)) {
+        const real dtw = g.whistler_timestep();
+        mainlog << "Field at t=" << Params::t << ": " << nsub << " substeps of " << dts << " s, whistler limit "
+                << dtw << " s, stability margin " << ((dts > 0.0) ? dtw/dts : 0.0) << "\n";
+    }
+}
+
+/** \brief Adapt the grid refinement every adaptiveRefinementInterval timesteps
+ *
+ * Cells are refined and recoarsened by the solution of the previous
+ * timestep (Tgrid::adapt_refinement) and the static profiles are set in
+ * the new cells.
+ */
+void Simulation::adaptGrid()
+{
+    if (Params::adaptiveRefinementInterval <= 0 || Params::cnt_dt <= 0 || Params::cnt_dt % Params::adaptiveRefinementInterval != 0) {
+        return;
+    }
+#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
+    timepool("Adapt");
+    const double wall0 = getWallSecs();
+    int nrefined, nrecoarsened;
+    g.adapt_refinement(nrefined,nrecoarsened);
+    if (nrefined + nrecoarsened > 0) {
+        if (Params::resistivityFunction.isDefined() == true) {
+            g.set_resistivity(Params::resistivityFunction);
+        }
+        if (Params::bgChargeDensityFunction.isDefined() == true) {
+            g.set_bgRhoQ(Params::bgChargeDensityFunction);
+        }
+        if (Params::forbidSplitAndJoinFunction.isDefined() == true) {
+            g.forbid_split_and_join(Params::forbidSplitAndJoinFunction);
+        }
+        visDataSourceImpl->gridChanged();
+    }
+    mainlog << "Adapted the grid at t=" << Params::t << ": refined " << nrefined << " and recoarsened "
+            << nrecoarsened << " cells in " << getWallSecs()-wall0 << " s, " << g.Ncells_with_ghosts() << " cells\n";
+#endif
+}
+
+/** \brief (MPI) Balance the load of the ranks every loadBalanceInterval timesteps
+ *
+ * The CPU time each rank spent on its particles since the previous call
+ * is compared between the ranks. If the most loaded rank exceeds the
+ * average by more than loadBalanceTolerance, the base cells are divided
+ * again by their particles and cells (Tgrid::balance_load). The CPU time
+ * excludes the waits in the MPI exchanges.
+ */
+void Simulation::balanceLoad()
+{
+    const int nranks = Decomposition::getNranks();
+    if (nranks <= 1 || Params::loadBalanceInterval <= 0 || Params::cnt_dt <= 0 || Params::cnt_dt % Params::loadBalanceInterval != 0) {
+        return;
+    }
+    timepool("Balance");
+    const double wall0 = getWallSecs();
+    const double cpu = timepool.gettime("Newparticle") + timepool.gettime("Xpropag") + timepool.gettime("Vpropag")
+                       + timepool.gettime("splitjoin") + timepool.gettime("ParticleProcesses");
+    const int rank = Decomposition::getRank();
+    vector<real> work(2*nranks,0.0);
+    work[rank] = cpu - balanceCPU;
+    work[nranks+rank] = g.Nparticles();
+    balanceCPU = cpu;
+    Decomposition::sum(&work[0],2*nranks);
+    const real cpuMax = *max_element(work.begin(),work.begin()+nranks);
+    const real cpuSum = accumulate(work.begin(),work.begin()+nranks,0.0);
+    const real cpuImbalance = (cpuSum > 0.0) ? cpuMax*nranks/cpuSum : 1.0;
+    mainlog << "Load balance at t=" << Params::t << ": CPU time imbalance " << cpuImbalance << ", "
+            << *min_element(work.begin()+nranks,work.end()) << "..." << *max_element(work.begin()+nranks,work.end())
+            << " macroparticles per rank\n";
+    if (cpuImbalance <= Params::loadBalanceTolerance) {
+        return;
+    }
+    real imbalanceBefore, imbalanceAfter;
+    real nmovedParticles;
+    const int nmoved = g.balance_load(Params::loadBalanceCellWeight,imbalanceBefore,imbalanceAfter,nmovedParticles);
+    mainlog << "Balanced the load at t=" << Params::t << ": cost imbalance " << imbalanceBefore << " -> " << imbalanceAfter
+            << ", moved " << nmoved << " base cells and " << nmovedParticles << " macroparticles in "
+            << getWallSecs()-wall0 << " s\n";
+}
+
+/** \brief Re-sort particles in memory every particleSortInterval timesteps
+ *
+ * Particles become scattered in memory as they move between cells, which
+ * slows down particle propagation. The propagation rate of the timestep
+ * before sorting is logged here and the rate of the timestep after sorting
+ * in measurePushRate.
+ */
+void Simulation::sortParticles()
+{
+    if (Params::particleSortInterval <= 0 || Params::cnt_dt <= 0 || Params::cnt_dt % Params::particleSortInterval != 0) {
+        return;
+    }
+    timepool("Sort");
+    const double cpu0 = timepool.cputime();
+    g.sort_particles();
+    timepool.count("Sort",g.Nparticles());
+    mainlog << "Sorted particles at t=" << Params::t << " in " << timepool.cputime()-cpu0
+            << " s, " << pushRate << " macros/second before sorting\n";
+    pushRateAfterSort = true;
+}
+
+//! Measure the particle propagation rate of the ongoing timestep
+void Simulation::measurePushRate(real npropagated)
+{
+    const double cpu = timepool.gettime("Xpropag") + timepool.gettime("Vpropag");
+    pushRate = (cpu > pushCPU) ? npropagated/(cpu - pushCPU) : 0.0;
+    pushCPU = cpu;
+    // Macroparticles/s of Xpropag and Vpropag in the timepool breakdown
+    timepool.count("Xpropag",npropagated);
+    timepool.count("Vpropag",npropagated);
+    if (pushRateAfterSort == true) {
+        mainlog << "Sorted particles at t=" << Params::t << ": " << pushRate << " macros/second after sorting\n";
+        pushRateAfterSort = false;
     }
 }
 
 //! Finalize time step
 bool Simulation::finalizeTimestep(bool doBreakpointing)
 {
+    // All MPI ranks stop at the same timestep
+    Params::stoppingPhase = Decomposition::any(Params::stoppingPhase);
     // Save step for hc-files
     if (Params::saveInterval > 0 && (Params::cnt_dt % int(Params::saveInterval/Params::dt+0.5) == 0)) {
         timepool("SaveStep");
@@ -468,14 +722,28 @@ bool Simulation::finalizeTimestep(bool doBreakpointing)
     if (doBreakpointing == true && Params::wsDumpInterval[0] > 0 && (Params::cnt_dt % int(Params::wsDumpInterval[0]/Params::dt+0.5) == 0) && Params::cnt_dt >0) {
         timepool("SaveBreakpoint");
         // single file name, older file overwritten
-        dumpState("breakpoint.dat");
+        dumpState(Decomposition::rankFileName("breakpoint.dat").c_str());
     }
     if (doBreakpointing == true && Params::wsDumpInterval[1] > 0 && (Params::cnt_dt % int(Params::wsDumpInterval[1]/Params::dt+0.5) == 0) && Params::cnt_dt > 0) {
         timepool("SaveBreakpoint");
         // unique file name, older file not overwritten
-        string fn = "breakpoint_" + Params::getSimuTimeStr() + ".dat";
+        string fn = Decomposition::rankFileName("breakpoint_" + Params::getSimuTimeStr() + ".dat");
         dumpState(fn.c_str());
     }
+    // Particle snapshots
+    if (Params::particleSnapshotInterval > 0 && (Params::cnt_dt % int(Params::particleSnapshotInterval/Params::dt+0.5) == 0) && Params::cnt_dt > 0) {
+        timepool("SaveParticles");
+        ParticleSnapshot snapshot(Params::particleSnapshotFraction, Params::particleSnapshotRegion);
+        const string timeStr = Params::getSimuTimeStr();
+        if (snapshot.save(g, timeStr) == true) {
+            mainlog << "Saved particle snapshot files pdump_*_" << timeStr << ".dat at t=" << Params::t << "\n";
+        }
+    }
+    // In-situ slices and line cuts
+    if (Params::insituInterval > 0 && insitu.isDefined() == true && Decomposition::isRoot() == true && (Params::cnt_dt % int(Params::insituInterval/Params::dt+0.5) == 0)) {
+        timepool("SaveInsitu");
+        insitu.save(g, Params::getSimuTimeStr());
+    }
     timepool("Misc");
 #ifndef NO_DIAGNOSTICS
     // Logging
@@ -533,7 +801,12 @@ void Simulation::saveVisualizationFiles()
     if (Params::averaging == true) {
         averageOk = g.end_average();
     }
-    if(Params::saveHC > 0) {
+    // Particle moments of all populations for all files in one particle pass
+    if (Params::saveHC > 0 || Params::saveVTK > 0) {
+        g.compute_moments();
+    }
+    // With several MPI ranks the moments are on every rank but only the root rank writes
+    if(Params::saveHC > 0 && Decomposition::isRoot() == true) {
         // Get hc-file configurations
         vector<string> hcFilePrefix;
         vector< vector<int> > popId;
@@ -544,6 +817,12 @@ void Simulation::saveVisualizationFiles()
             hcFileFormat = "binary";
         } else if(Params::saveHC == 2) {
             hcFileFormat = "ascii";
+        } else if(Params::saveHC == 3) {
+#ifdef USE_COMPRESSED_HC
+            hcFileFormat = "compressed";
+#else
+            hcFileFormat = "binary";
+#endif
         } else {
             hcFileFormat = "binary";
         }
@@ -556,9 +835,13 @@ void Simulation::saveVisualizationFiles()
             string fn = hcFilePrefix[i] + "_hybstate_" + Params::getSimuTimeStr() + ".hc";
             g.hcwrite_MHD(fn.c_str(),hcFileFormat,"populations",popId[i]);
         }
-        // Save temporally averaged hc-file
-        if (averageOk == true) {
-            string fn = "average_hybstate_" + Params::getSimuTimeStr() + ".hc";
+        // Save temporally averaged hc-files: the interval average and the running averages (_run1, _run2...)
+        for (int w = 0; averageOk == true && w < g.average_windows(); w++) {
+            if (g.select_average(w) == false) {
+                continue;
+            }
+            const string run = (w == 0) ? "" : "_run" + int2string(w,1);
+            string fn = "average" + run + "_hybstate_" + Params::getSimuTimeStr() + ".hc";
             g.hcwrite_MHD(fn.c_str(),hcFileFormat,"average",vector<int>());
 #ifdef SAVE_POPULATION_AVERAGES
             for (unsigned int i = 0; i < hcFilePrefix.size(); i++) {
@@ -566,7 +849,7 @@ void Simulation::saveVisualizationFiles()
                 if (hcFilePrefix[i].compare("-") == 0) {
                     continue;
                 }
-                string fn = hcFilePrefix[i] + "_ave_hybstate_" + Params::getSimuTimeStr() + ".hc";
+                string fn = hcFilePrefix[i] + "_ave" + run + "_hybstate_" + Params::getSimuTimeStr() + ".hc";
                 g.hcwrite_MHD(fn.c_str(),hcFileFormat,"populations_ave",popId[i]);
             }
 #endif
@@ -575,7 +858,7 @@ void Simulation::saveVisualizationFiles()
                 if (hcFilePrefix[i].compare("-") == 0) {
                     continue;
                 }
-                string fn = hcFilePrefix[i] + "_spectra_" + Params::getSimuTimeStr() + ".hc";
+                string fn = hcFilePrefix[i] + "_spectra" + run + "_" + Params::getSimuTimeStr() + ".hc";
                 g.hcwrite_SPECTRA(fn.c_str(),hcFileFormat,popId[i]);
             }
 #endif
@@ -591,13 +874,18 @@ void Simulation::saveVisualizationFiles()
             g.hcwrite_DBUG(fn.c_str());
         }
     } // if(saveHC)
-    if(Params::saveVTK > 0) {
+    if(Params::saveVTK > 0 && Decomposition::isRoot() == true) {
+        // The average VTK variables are from the interval average
+        if (averageOk == true) {
+            g.select_average(0);
+        }
         string fn = "hybstate_" + Params::getSimuTimeStr();
         for (std::vector<VisDB*>::iterator visDB = visWriters.begin(); visDB != visWriters.end(); ++visDB) {
             //(*visDB)->writeVisValues(fn.c_str(),std::vector<DB::Particles>(1, DB::Particles()));
             (*visDB)->writeVisValues(fn.c_str());
         }
     }
+    g.free_moments();
     if (Params::averaging == true) {
         g.begin_average();
     }
@@ -606,6 +894,9 @@ void Simulation::saveVisualizationFiles()
 //! Save extra hc-files
 void Simulation::saveExtraHcFiles()
 {
+    if (Decomposition::isRoot() == false) {
+        return;
+    }
     for(unsigned int i=0; i < Params::pops.size(); ++i) {
         Params::pops[i]->writeExtraHcFile();
     }
@@ -616,9 +907,12 @@ void Simulation::dumpState(const char *fileName)
 {
     MSGFUNCTIONCALL("Simulation::dumpState");
     mainlog << "Creating a break point: " << fileName << "\n";
-    ofstream dumpFile(fileName, ios::out);
+    // Write to a temporary file first so that an interrupted write does not destroy the previous breakpoint
+    OutputFile dumpFile(fileName, true);
     g.dumpState(dumpFile);
-    dumpFile.close();
+    if (dumpFile.close() == false) {
+        ERRORMSG2("failed to write a break point", fileName);
+    }
     MSGFUNCTIONEND("Simulation::dumpState");
 }
 
@@ -627,8 +921,19 @@ void Simulation::readState(const char *fileName)
 {
     MSGFUNCTIONCALL("Simulation::readState");
     mainlog << "Loading a break point: " << fileName << "\n";
-    ifstream is(fileName);
-    g.readState(is);
+    ifstream is(fileName, ios::in | ios::binary);
+    if (!is.good()) {
+        ERRORMSG2("cannot open break point file", fileName);
+        doabort();
+    }
+    // Second handle for reading the particle blocks in parallel
+    const int fd = open(fileName, O_RDONLY);
+    g.readState(is, fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    // The particles of the breakpoint are in the base cells of the rank that wrote it
+    g.migrate_particles();
     MSGFUNCTIONEND("Simulation::readState");
 }
 
@@ -642,6 +947,7 @@ int Simulation::finalize()
             << "| " << macroParticlePropagations/cpu << " macros/second\n"
             << "|-------------------------------------------\n";
     //portrand.save("portrand.state");
+    outputWriter.finish();
     MSGFUNCTIONEND("Simulation::finalize");
     return 0;
 }
@@ -788,11 +1094,17 @@ bool Simulation::PropagatePart2(TLinkedParticle& part)
 
 //! Move particle (r = v*dt)
 bool Simulation::PropagateX(TLinkedParticle& part)
+{
+    Tgrid::CellCursor cur;
+    return PropagateX(part,cur);
+}
+
+//! Move particle (r = v*dt), cur is the cell lookup state of the caller
+bool Simulation::PropagateX(TLinkedParticle& part, Tgrid::CellCursor& cur)
 {
 #ifndef USE_PARTICLE_SUBCYCLING
-    static real pdt, pw;
-    pdt = Params::dt;
-    pw = 1;
+    const real pdt = Params::dt;
+    const real pw = 1;
 #else
     real pdt, pw;
     pdt = Params::dt_psub[part.dtlevel];
@@ -803,19 +1115,19 @@ bool Simulation::PropagateX(TLinkedParticle& part)
     r_new[0] = part.x + part.vx*pdt;
     r_new[1] = part.y + part.vy*pdt;
     r_new[2] = part.z + part.vz*pdt;
-    // Check particle detectors
+    // Check particle detectors (they lock only when a particle hits a detector)
     for(unsigned int i=0; i < Params::detectors.size(); ++i) {
         Params::detectors[i]->runPartDetects(&part,r_new);
     }
     part.x = r_new[0];
     part.y = r_new[1];
     part.z = r_new[2];
-    // Check boundary conditions
+    // Check boundary conditions (they lock only when a particle is removed or injected)
     const bool part_kept = Params::pops[part.popid]->checkBoundaries(part,rave);
     if (part_kept) {
         const fastreal v[3] = {part.vx, part.vy, part.vz};
         if(Params::propagateField == true) {
-            g.accumulate_PIC(rave, v, part.w*pw, part.popid);
+            g.accumulate_PIC(rave, v, part.w*pw, part.popid, cur);
         }
     }
     return part_kept;
@@ -824,13 +1136,19 @@ bool Simulation::PropagateX(TLinkedParticle& part)
 
 //! Accelerate particle (Lorentz force)
 bool Simulation::PropagateV(TLinkedParticle& part)
+{
+    Tgrid::CellCursor cur;
+    return PropagateV(part,cur);
+}
+
+//! Accelerate particle (Lorentz force), cur is the cell lookup state of the caller
+bool Simulation::PropagateV(TLinkedParticle& part, Tgrid::CellCursor& cur)
 {
     if(Params::pops[part.popid]->getPropagateV() == false) {
         return true;
     }
 #ifndef USE_PARTICLE_SUBCYCLING
-    static real pdt;
-    pdt = Params::dt;
+    const real pdt = Params::dt;
 #else
     real pdt;
     pdt = Params::dt_psub[part.dtlevel];
@@ -840,16 +1158,16 @@ bool Simulation::PropagateV(TLinkedParticle& part)
     fastreal v[3] = {part.vx, part.vy, part.vz};
     real B[3],Ue[3];
     // Self-consistent B1 field from cell faces + constant B0 field => B(r) = B1(r) + B0(r)
-    g.faceintpol(r, Tgrid::FACEDATA_B, B);
+    g.faceintpol(r, Tgrid::FACEDATA_B, B, cur);
     addConstantMagneticField(r, B);
     // Velocity field of the electron fluid from cells
-    // Do not pass r => uses saved_cellptr and avoids findcell call
-    g.cellintpol(Tgrid::CELLDATA_UE,Ue);
+    // Do not pass r => uses the cell of faceintpol and avoids findcell call
+    g.cellintpol(Tgrid::CELLDATA_UE,Ue,cur);
     if(Params::electronPressure==true) {
         real Efield[3],tx,ty,tz,sx,sy,sz,dvx,dvy,dvz,vmx,vmy,vmz,v0x,v0y,v0z,vpx,vpy,vpz,qmideltT2,t2,b2;
         // get the NGP electric field
-        // Do not pass r => uses saved_cellptr and avoids findcell call
-        g.cellintpol(Tgrid::CELLDATA_TEMP2,Efield);
+        // Do not pass r => uses the cell of faceintpol and avoids findcell call
+        g.cellintpol(Tgrid::CELLDATA_TEMP2,Efield,cur);
         Efield[0] += B[1]*Ue[2] - B[2]*Ue[1];
         Efield[1] += B[2]*Ue[0] - B[0]*Ue[2];
         Efield[2] += B[0]*Ue[1] - B[1]*Ue[0];
@@ -899,7 +1217,8 @@ bool Simulation::PropagateV(TLinkedParticle& part)
     }
     // Gravity correction
     if(Params::useGravitationalAcceleration == true) {
-        real rLength = sqrt( sqr(part.x) + sqr(part.y) + sqr(part.z) );
+        // Sum in double: -ffast-math may add float squares in any order
+        real rLength = sqrt( sqr(real(part.x)) + sqr(real(part.y)) + sqr(real(part.z)) );
 #ifndef USE_PARTICLE_SUBCYCLING
         real s = -Params::GMdt/cube(rLength);
 #else
@@ -918,6 +1237,9 @@ bool Simulation::PropagateV(TLinkedParticle& part)
         v[2] *= norm;
 #ifndef NO_DIAGNOSTICS
         // Increase particle speed cutting rate counter
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
         Params::diag.pCounter[part.popid]->cutRateV += 1.0;
 #endif
     }
@@ -927,6 +1249,314 @@ bool Simulation::PropagateV(TLinkedParticle& part)
     return true;
 }
 
+#ifdef USE_BATCHED_PUSH
+
+//! Initialize the population constants of the batched velocity push
+Simulation::PushVBatch::PushVBatch() : storing(false), n(0)
+{
+    const int npops = Params::pops.size();
+    halfAlpha.resize(npops);
+    propagate.resize(npops);
+    for (int p=0; p<npops; p++) {
+        // Constant: alpha/2 = q*dt/(2*m)
+        halfAlpha[p] = 0.5*Params::pops[p]->q*Params::dt/Params::pops[p]->m;
+        propagate[p] = Params::pops[p]->getPropagateV();
+    }
+}
+
+//! Start gathering a batch of nparticles particles
+void Simulation::PushVBatch::begin(int nparticles)
+{
+    if (static_cast<int>(qm.size()) < nparticles) {
+        for (int d=0; d<3; d++) {
+            r[d].resize(nparticles);
+            v[d].resize(nparticles);
+            B[d].resize(nparticles);
+            Ue[d].resize(nparticles);
+            E[d].resize(nparticles);
+        }
+        qm.resize(nparticles);
+        popid.resize(nparticles);
+        cut.resize(nparticles);
+    }
+    storing = false;
+    n = 0;
+}
+
+//! Gather the fields at a particle, or store its new velocity after push()
+bool Simulation::PushVBatch::operator()(TLinkedParticle& part)
+{
+    if (!propagate[part.popid]) {
+        return true;
+    }
+    if (storing) {
+        part.vx = v[0][n];
+        part.vy = v[1][n];
+        part.vz = v[2][n];
+        n++;
+        return true;
+    }
+    const shortreal rp[3] = {part.x, part.y, part.z};
+    real Bp[3],Uep[3],Ep[3];
+    // Same field lookups as in PropagateV
+    g.faceintpol(rp, Tgrid::FACEDATA_B, Bp, cursor);
+    addConstantMagneticField(rp, Bp);
+    g.cellintpol(Tgrid::CELLDATA_UE,Uep,cursor);
+    if(Params::electronPressure==true) {
+        g.cellintpol(Tgrid::CELLDATA_TEMP2,Ep,cursor);
+    }
+    r[0][n] = part.x;
+    r[1][n] = part.y;
+    r[2][n] = part.z;
+    v[0][n] = part.vx;
+    v[1][n] = part.vy;
+    v[2][n] = part.vz;
+    for (int d=0; d<3; d++) {
+        B[d][n] = Bp[d];
+        Ue[d][n] = Uep[d];
+        E[d][n] = (Params::electronPressure==true) ? Ep[d] : 0.0;
+    }
+    qm[n] = halfAlpha[part.popid];
+    popid[n] = part.popid;
+    n++;
+    return true;
+}
+
+/** \brief Accelerate the gathered particles (Lorentz force)
+ *
+ * The arithmetic is that of PropagateV, written as loops over the batch
+ * without branches that depend on the particle. Starts the storing pass.
+ */
+void Simulation::PushVBatch::push()
+{
+    const int nb = n;
+    shortreal *const x = &r[0][0], *const y = &r[1][0], *const z = &r[2][0];
+    fastreal *const vx = &v[0][0], *const vy = &v[1][0], *const vz = &v[2][0];
+    const real *const Bx = &B[0][0], *const By = &B[1][0], *const Bz = &B[2][0];
+    const real *const Uex = &Ue[0][0], *const Uey = &Ue[1][0], *const Uez = &Ue[2][0];
+    const real *const Ex = &E[0][0], *const Ey = &E[1][0], *const Ez = &E[2][0];
+    const real *const half_alpha = &qm[0];
+    char *const vcut = &cut[0];
+    if(Params::electronPressure==true) {
+#pragma omp simd
+        for (int i=0; i<nb; i++) {
+            const real Efield0 = Ex[i] + (By[i]*Uez[i] - Bz[i]*Uey[i]);
+            const real Efield1 = Ey[i] + (Bz[i]*Uex[i] - Bx[i]*Uez[i]);
+            const real Efield2 = Ez[i] + (Bx[i]*Uey[i] - By[i]*Uex[i]);
+            const real qmideltT2 = half_alpha[i];
+            const real dvx=qmideltT2*Efield0;
+            const real dvy=qmideltT2*Efield1;
+            const real dvz=qmideltT2*Efield2;
+            const real tx=qmideltT2*Bx[i];
+            const real ty=qmideltT2*By[i];
+            const real tz=qmideltT2*Bz[i];
+            const real t2=tx*tx+ty*ty+tz*tz;
+            const real b2=2./(1.+t2);
+            const real sx=b2*tx;
+            const real sy=b2*ty;
+            const real sz=b2*tz;
+            const real vmx=vx[i]+dvx;
+            const real vmy=vy[i]+dvy;
+            const real vmz=vz[i]+dvz;
+            const real v0x=vmx+vmy*tz-vmz*ty;
+            const real v0y=vmy+vmz*tx-vmx*tz;
+            const real v0z=vmz+vmx*ty-vmy*tx;
+            const real vpx=vmx+v0y*sz-v0z*sy;
+            const real vpy=vmy+v0z*sx-v0x*sz;
+            const real vpz=vmz+v0x*sy-v0y*sx;
+            vx[i]=vpx+dvx;
+            vy[i]=vpy+dvy;
+            vz[i]=vpz+dvz;
+        }
+    } else {
+#pragma omp simd
+        for (int i=0; i<nb; i++) {
+            // Vector: dU = v_i - U_e
+            const real dU0 = vx[i]-Uex[i];
+            const real dU1 = vy[i]-Uey[i];
+            const real dU2 = vz[i]-Uez[i];
+            // Vector: W = q*dt*B/(2*m)
+            const real b0 = half_alpha[i]*Bx[i];
+            const real b1 = half_alpha[i]*By[i];
+            const real b2 = half_alpha[i]*Bz[i];
+            // Constant: beta = 2/(1+|b|^2)
+            const real beta = 2.0/(1.0 + (sqr(b0) + sqr(b1) + sqr(b2)));
+            // Cross products dU x b and (dU x b) x b
+            const real dUxb0 = dU1*b2 - dU2*b1;
+            const real dUxb1 = dU2*b0 - dU0*b2;
+            const real dUxb2 = dU0*b1 - dU1*b0;
+            const real dUxbxb0 = dUxb1*b2 - dUxb2*b1;
+            const real dUxbxb1 = dUxb2*b0 - dUxb0*b2;
+            const real dUxbxb2 = dUxb0*b1 - dUxb1*b0;
+            // Add velocity components
+            vx[i] += beta*( dUxb0 + dUxbxb0 );
+            vy[i] += beta*( dUxb1 + dUxbxb1 );
+            vz[i] += beta*( dUxb2 + dUxbxb2 );
+        }
+    }
+    // Gravity correction
+    if(Params::useGravitationalAcceleration == true) {
+#pragma omp simd
+        for (int i=0; i<nb; i++) {
+            const real rLength = sqrt( sqr(real(x[i])) + sqr(real(y[i])) + sqr(real(z[i])) );
+            const real s = -Params::GMdt/cube(rLength);
+            vx[i] += s*x[i];
+            vy[i] += s*y[i];
+            vz[i] += s*z[i];
+        }
+    }
+    // Check particle maximum speed (CONSTRAINT)
+#pragma omp simd
+    for (int i=0; i<nb; i++) {
+        const real v2 = sqr(vx[i]) + sqr(vy[i]) + sqr(vz[i]);
+        vcut[i] = (v2 > Params::vi_max2);
+        const real norm = vcut[i] ? Params::vi_max/sqrt(v2) : 1.0;
+        vx[i] *= norm;
+        vy[i] *= norm;
+        vz[i] *= norm;
+    }
+#ifndef NO_DIAGNOSTICS
+    for (int i=0; i<nb; i++) {
+        if (vcut[i]) {
+            // Increase particle speed cutting rate counter
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+            Params::diag.pCounter[popid[i]]->cutRateV += 1.0;
+        }
+    }
+#endif
+    storing = true;
+    n = 0;
+}
+
+namespace
+{
+
+//! (TEST) Velocities of the particles before and after PropagateV, in the order of Tgrid::particle_batch_pass
+struct PushVReference {
+    PushVReference(std::vector<shortreal>& v0, std::vector<shortreal>& v1) : before(v0), after(v1), storing(false) { }
+    void begin(int) {
+        storing = false;
+    }
+    bool operator()(TLinkedParticle& part) {
+        if (storing || Params::pops[part.popid]->getPropagateV() == false) {
+            return true;
+        }
+        TLinkedParticle copy = part;
+        Simulation::PropagateV(copy,cursor);
+        const shortreal v0[3] = {part.vx, part.vy, part.vz};
+        const shortreal v1[3] = {copy.vx, copy.vy, copy.vz};
+        before.insert(before.end(),v0,v0+3);
+        after.insert(after.end(),v1,v1+3);
+        return true;
+    }
+    void push() {
+        storing = true;
+    }
+private:
+    Tgrid::CellCursor cursor;
+    std::vector<shortreal>& before;
+    std::vector<shortreal>& after;
+    bool storing;
+};
+
+//! (TEST) Compare the velocities with the reference and restore the velocities before the push
+struct PushVCompare {
+    PushVCompare(const std::vector<shortreal>& v0, const std::vector<shortreal>& v1, int& maxulp, long& nmax)
+        : before(v0), after(v1), maxUlp(maxulp), nMax(nmax), n(0), storing(false) { }
+    void begin(int) {
+        storing = false;
+    }
+    bool operator()(TLinkedParticle& part) {
+        if (storing || Params::pops[part.popid]->getPropagateV() == false) {
+            return true;
+        }
+        shortreal *const v[3] = {&part.vx, &part.vy, &part.vz};
+        for (int d=0; d<3; d++, n++) {
+            const int u = ulpDistance(*v[d],after[n]);
+            if (u > maxUlp) {
+                maxUlp = u;
+                nMax = n/3;
+            }
+            *v[d] = before[n];
+        }
+        return true;
+    }
+    void push() {
+        storing = true;
+    }
+private:
+    //! Number of representable floats between a and b
+    static int ulpDistance(shortreal a, shortreal b) {
+        int32_t ia, ib;
+        memcpy(&ia,&a,sizeof(ia));
+        memcpy(&ib,&b,sizeof(ib));
+        // Sign and magnitude to a number line on which the floats are consecutive
+        const double ka = (ia < 0) ? -double(ia & 0x7fffffff) : double(ia);
+        const double kb = (ib < 0) ? -double(ib & 0x7fffffff) : double(ib);
+        const double d = fabs(ka - kb);
+        return (d > 1e9) ? 1000000000 : int(d);
+    }
+    const std::vector<shortreal>& before;
+    const std::vector<shortreal>& after;
+    int& maxUlp;
+    long& nMax;
+    size_t n;
+    bool storing;
+};
+
+}
+
+/** \brief (TEST) Compare the batched velocity push with PropagateV
+ *
+ * Pushes every particle with PropagateV (on a copy) and with PushVBatch in
+ * the electronPressure and the dU x b branches, without and with the
+ * gravitational acceleration, and restores the velocities afterwards. The
+ * stored velocities must be bit-identical, with gravity within one unit in
+ * the last place (-ffast-math may reorder the double sum of |r|^2). Returns
+ * the number of failed cases. Run serially (make test_pushv).
+ */
+int Simulation::testBatchedPush()
+{
+    const bool electronPressure = Params::electronPressure;
+    const bool gravity = Params::useGravitationalAcceleration;
+    const real GMdt = Params::GMdt;
+    if (Params::GMdt == 0) {
+        // Mass of Venus if the run has no planet mass
+        Params::GMdt = 6.674e-11*4.867e24*Params::dt;
+    }
+    int nfailed = 0;
+    for (int c=0; c<4; c++) {
+        Params::electronPressure = (c%2 == 1);
+        Params::useGravitationalAcceleration = (c/2 == 1);
+        const int bound = Params::useGravitationalAcceleration ? 1 : 0;
+        std::vector<shortreal> before, after;
+        g.particle_batch_pass(PushVReference(before,after));
+        g.particle_batch_pass(PushVBatch());
+        int maxUlp = 0;
+        long nMax = -1;
+        g.particle_batch_pass(PushVCompare(before,after,maxUlp,nMax));
+        const bool ok = (maxUlp <= bound) && before.empty() == false;
+        cout << (ok ? "PASS" : "FAIL") << " batched push, electronPressure=" << Params::electronPressure
+             << " gravity=" << Params::useGravitationalAcceleration << ": " << before.size()/3
+             << " particles, max " << maxUlp << " ulp (bound " << bound << ")";
+        if (maxUlp > 0) {
+            cout << " at particle " << nMax;
+        }
+        cout << "\n";
+        if (!ok) {
+            nfailed++;
+        }
+    }
+    Params::electronPressure = electronPressure;
+    Params::useGravitationalAcceleration = gravity;
+    Params::GMdt = GMdt;
+    return nfailed;
+}
+
+#endif
+
 //! Propagate magnetic field (Faraday's law)
 void Simulation::fieldpropagate(Tgrid::TFaceDataSelect fsBnew,
                                 Tgrid::TFaceDataSelect fsBold, Tgrid::TFaceDataSelect fsBrhs,
@@ -1005,6 +1635,7 @@ void Simulation::fieldpropagate(Tgrid::TFaceDataSelect fsBnew,
 //! (SPHERICAL) Spherical version of "stepForward"
 void Simulation::sph_stepForward()
 {
+    sortParticles();
     timepool("Newparticle");
     for(unsigned int i = 0; i < Params::pops.size(); ++i) {
         Params::pops[i]->createParticles();
@@ -1072,17 +1703,7 @@ void Simulation::sph_stepForward()
     }
     // Count particle propagations
     macroParticlePropagations += g.Nparticles();
-    /*int particle_dump_start[1] = {30000};
-    if ((Params::cnt_dt % int(particle_dump_start[0]/Params::dt+0.5) == 0) && particle_dump1_done == 0 && Params::cnt_dt > 0) {
-    	string fn = "pdump_" + Params::getSimuTimeStr() + ".dat";
-    	outputfp = fopen(fn.c_str(),"w");
-    	fprintf(outputfp,"D=2r %d %d\n",g.Nparticles(),8);
-    	fprintf(outputfp,"# x y z vx vy vz w m\n");
-    	g.particle_pass(&output);
-    	fclose(outputfp);
-    	particle_dump1_done = 1;
-    	mainlog << "Dumped particles in \"" << fn << "\" at t=" << Params::t << "\n";
-    }*/
+    measurePushRate(g.Nparticles());
 }
 
 //! (SPHERICAL) Toroidal boundary conditions
@@ -1180,7 +1801,7 @@ bool Simulation::sph_PropagateV(TLinkedParticle& part)
     //!g.sph_faceintpol(r, Tgrid::FACEDATA_B, B);
     addConstantMagneticField(r, B);
     // Velocity field of the electron fluid from cells
-    // Do not pass r => uses saved_cellptr and avoids findcell call
+    // Do not pass r => uses the cell of faceintpol and avoids findcell call
     //!g.cellintpol(Tgrid::CELLDATA_UE,Ue);
     g.faceintpol(r, Tgrid::FACEDATA_UE, Ue);
     //g.sph_faceintpol(r, Tgrid::FACEDATA_UE, Ue); // Here we use first order of approximation of Ue insread of zero order
@@ -1219,7 +1840,7 @@ bool Simulation::sph_PropagateV(TLinkedParticle& part)
         // Old BB algorithm version
         /*real Efield[3],tx,ty,tz,sx,sy,sz,dvx,dvy,dvz,vmx,vmy,vmz,v0x,v0y,v0z,vpx,vpy,vpz,qmideltT2,t2,b2;
         // get the NGP electric field
-        // Do not pass r => uses saved_cellptr and avoids findcell call
+        // Do not pass r => uses the cell of faceintpol and avoids findcell call
         g.cellintpol(Tgrid::CELLDATA_TEMP2,Efield);
         sph_transf_S2C_A(r,Efield); // Tranformation from spherical coordinates to Cartesian
         Efield[0] += B[1]*Ue[2] - B[2]*Ue[1];
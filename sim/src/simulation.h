@@ -26,6 +26,7 @@
 #include "vis/vis_db.h"
 #include "vis/vis_data_source_simulation.h"
 #include "diagnostics.h"
+#include "insitu.h"
 
 extern Logger mainlog, errorlog, paramslog;
 
@@ -40,6 +41,10 @@ public:
     void updateParams();
     int finalize();
     static bool PropagateV(TLinkedParticle& part);
+    static bool PropagateV(TLinkedParticle& part, Tgrid::CellCursor& cur);
+#ifdef USE_BATCHED_PUSH
+    int testBatchedPush();
+#endif
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
     static bool sph_PropagateV(TLinkedParticle& part);
 #endif
@@ -47,20 +52,71 @@ private:
     Ttimepool timepool;
     GridRefinementProfile refineFunc;
     real macroParticlePropagations;
+    double pushCPU; //!< CPU time spent in particle propagation up to the previous timestep
+    real pushRate; //!< Particle propagation rate during the previous timestep [macros/s]
+    bool pushRateAfterSort; //!< Log pushRate of the ongoing timestep (first one after particle sorting)
+    double balanceCPU; //!< (MPI) CPU time spent on the particles up to the previous load balancing
+    int subcycleStep; //!< Timestep of the previous field subcycling (cnt_dt), -1 = none
     SimulationVisDataSourceImpl* visDataSourceImpl;
     std::vector<VisDB*> visWriters;
+    InSituCuts insitu; //!< In-situ slices and line cuts
+    double startupWall; //!< Wall clock time at the start of the grid initialization [s]
+    double startupCPU; //!< CPU time at the start of the grid initialization [s]
     void initializeSimulation();
     void stepForward();
+    void fieldSubcycle();
+    void adaptGrid();
+    void balanceLoad();
+    void sortParticles();
+    void measurePushRate(real npropagated);
     bool finalizeTimestep(bool doBreakpointing = true);
     void saveStep();
     void dumpState(const char *fileName);
     void readState(const char *fileName);
     void saveVisualizationFiles();
     void saveExtraHcFiles();
-    static bool output(TLinkedParticle&);
     static bool AlwaysTrue(TLinkedParticle&);
     static void BoundaryB(datareal celldata[Tgrid::NCELLDATA][3], int dim);
     static bool PropagateX(TLinkedParticle& part);
+    static bool PropagateX(TLinkedParticle& part, Tgrid::CellCursor& cur);
+    //! Particle position push with its own cell lookup state
+    struct PushX {
+        Tgrid::CellCursor cursor;
+        bool operator()(TLinkedParticle& part) {
+            return PropagateX(part,cursor);
+        }
+    };
+    //! Particle velocity push with its own cell lookup state
+    struct PushV {
+        Tgrid::CellCursor cursor;
+        bool operator()(TLinkedParticle& part) {
+            return PropagateV(part,cursor);
+        }
+    };
+#ifdef USE_BATCHED_PUSH
+    /** \brief Particle velocity push in batches (see Tgrid::particle_batch_pass)
+     *
+     * Gathers the fields at the particles of a leaf cell like PropagateV
+     * and runs the velocity update of the whole batch in vectorized loops.
+     */
+    struct PushVBatch {
+        PushVBatch();
+        void begin(int nparticles);
+        bool operator()(TLinkedParticle& part);
+        void push();
+    private:
+        Tgrid::CellCursor cursor;
+        std::vector<real> halfAlpha; //!< q*dt/(2*m) of each population
+        std::vector<char> propagate; //!< Propagate velocities of each population
+        bool storing; //!< False in the gathering pass, true in the pass which stores the results
+        int n; //!< Number of particles in the batch
+        std::vector<shortreal> r[3];
+        std::vector<fastreal> v[3];
+        std::vector<real> B[3], Ue[3], E[3], qm;
+        std::vector<int> popid;
+        std::vector<char> cut; //!< Speed of the particle was cut to vi_max
+    };
+#endif
     void fieldpropagate(Tgrid::TFaceDataSelect fsBnew, Tgrid::TFaceDataSelect fsBold,
                         Tgrid::TFaceDataSelect fsBrhs,
                         real fp_dt, bool do_upwinding);
@@ -0,0 +1,108 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include "spectrabins.h"
+
+using namespace std;
+
+//! Constructor
+SpectraBins::SpectraBins() : mode(BIN_SEARCH), nbins(0), x0(0), invdx(0) { }
+
+//! Whether the values x are evenly spaced
+static bool isUniform(const vector<real>& x)
+{
+    const real dx = (x.back() - x.front())/(x.size() - 1);
+    if (dx <= 0) {
+        return false;
+    }
+    for (unsigned int i = 1; i < x.size(); ++i) {
+        if (fabs(x[i] - x[i-1] - dx) > 1e-6*dx) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! Set the bin edges (v^2, increasing)
+void SpectraBins::initialize(const vector<real>& v2edges)
+{
+    edges = v2edges;
+    nbins = edges.size() - 1;
+    mode = BIN_SEARCH;
+    if (nbins < 1) {
+        return;
+    }
+    if (edges[0] > 0) {
+        vector<real> logEdges(edges.size());
+        for (unsigned int i = 0; i < edges.size(); ++i) {
+            logEdges[i] = log(edges[i]);
+        }
+        if (isUniform(logEdges)) {
+            mode = BIN_LOG;
+            x0 = logEdges[0];
+            invdx = nbins/(logEdges[nbins] - logEdges[0]);
+            return;
+        }
+    }
+    if (isUniform(edges)) {
+        mode = BIN_LINEAR;
+        x0 = edges[0];
+        invdx = nbins/(edges[nbins] - edges[0]);
+    }
+}
+
+/** \brief Bin of v^2, -1 if none
+ *
+ * v^2 below the first edge goes to the first bin if lowAll and v^2 above
+ * the last edge to the last bin if highAll.
+ */
+int SpectraBins::find(real v2, bool lowAll, bool highAll) const
+{
+    if (nbins < 1) {
+        return -1;
+    }
+    if (v2 < edges[0]) {
+        return lowAll ? 0 : -1;
+    }
+    if (v2 >= edges[nbins]) {
+        return highAll ? nbins-1 : -1;
+    }
+    int i;
+    if (mode == BIN_LOG) {
+        i = int((log(v2) - x0)*invdx);
+    } else if (mode == BIN_LINEAR) {
+        i = int((v2 - x0)*invdx);
+    } else {
+        i = upper_bound(edges.begin(),edges.end(),v2) - edges.begin() - 1;
+    }
+    // Rounding errors of the constant time estimate
+    if (i < 0) {
+        i = 0;
+    } else if (i >= nbins) {
+        i = nbins-1;
+    }
+    while (v2 < edges[i]) {
+        i--;
+    }
+    while (v2 >= edges[i+1]) {
+        i++;
+    }
+    return i;
+}
@@ -0,0 +1,51 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPECTRABINS_H
+#define SPECTRABINS_H
+
+#include <vector>
+#include "definitions.h"
+
+//! Energy bin of a macroparticle in the particle cell spectra
+struct TSpectraBin {
+    int bin;    //!< Bin index, -1 = not in the spectra
+    real speed; //!< Speed of the particle, the spectra are weighted by it [m/s]
+};
+
+/** \brief Energy bins of the particle cell spectra of one population
+ *
+ * The bin edges are given as v^2 (Params::spectraV2BinsPerPop). Edges that
+ * are uniform in log(v^2) (spectraLogBins = 1) or in v^2 (linear energy
+ * bins) are binned in constant time, other edges by a binary search.
+ */
+class SpectraBins
+{
+public:
+    SpectraBins();
+    void initialize(const std::vector<real>& v2edges);
+    int find(real v2, bool lowAll, bool highAll) const;
+private:
+    enum TMode {BIN_LOG=0, BIN_LINEAR=1, BIN_SEARCH=2};
+    TMode mode;
+    int nbins;
+    std::vector<real> edges; //!< nbins+1 edges of v^2 [m^2/s^2]
+    real x0, invdx; //!< First edge and 1/bin width in log(v^2) or v^2
+};
+
+#endif
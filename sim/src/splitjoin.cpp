@@ -66,7 +66,14 @@ Split::~Split() { }
 //! Split macroparticles in a given particle list
 int Split::doSplitting(const gridreal boxmin[3], const gridreal boxmax[3], TParticleList& tplist)
 {
+#ifndef USE_PARTICLE_ARRAYS
     return (this->*ptr)(boxmin,boxmax,tplist);
+#else
+    tplist.beginLinkedView();
+    const int result = (this->*ptr)(boxmin,boxmax,tplist);
+    tplist.endLinkedView();
+    return result;
+#endif
 }
 
 //! Default function, which aborts the program if called
@@ -289,7 +296,14 @@ Join::~Join() { }
 //! Join macroparticles
 int Join::doJoining(const gridreal boxmin[3], const gridreal boxmax[3], TParticleList& tplist, int fast)
 {
+#ifndef USE_PARTICLE_ARRAYS
     return (this->*ptr)(boxmin,boxmax,tplist,fast);
+#else
+    tplist.beginLinkedView();
+    const int result = (this->*ptr)(boxmin,boxmax,tplist,fast);
+    tplist.endLinkedView();
+    return result;
+#endif
 }
 
 //! Default function, which aborts the program if called
@@ -611,7 +625,9 @@ int Join::joinDefault(const gridreal boxmin[3], const gridreal boxmax[3], TParti
         for (pred=tplist.first; pred->next!=q; pred=pred->next);
         pred->next = pp[2]->next;
     }
-    delete q;
+#ifndef USE_PARTICLE_ARRAYS
+    particleArena.release(q);
+#endif
 #ifndef NO_DIAGNOSTICS
     // Increase counter
     Params::diag.pCounter[PA.popid]->joiningRate += 1;
@@ -709,15 +725,16 @@ int Join::joinOriginal(const gridreal minbox[3], const gridreal maxbox[3], TPart
     if (p3 == tplist.first) {
         q = p3;
         tplist.first = p3->next;
-        delete q;
     } else {
         q = p3;
         // find predecessor
         TLinkedParticle *pred;
         for (pred=tplist.first; pred->next!=q; pred=pred->next);
         pred->next = p3->next;
-        delete q;
     }
+#ifndef USE_PARTICLE_ARRAYS
+    particleArena.release(q);
+#endif
 #ifndef NO_DIAGNOSTICS
     // Increase counter
     Params::diag.pCounter[PA.popid]->joiningRate += 1;
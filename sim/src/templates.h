@@ -43,20 +43,103 @@ int Tgrid::Tcell::particle_pass_recursive(Func& op, bool relocate)
     return ndel;
 }
 
-//! Pass all particles in the list to the function op
+//! Pass all particles in the list to the function op (base cells in Morton order)
 template <class Func>
 int Tgrid::particle_pass(Func op, bool relocate)
 {
-    int i,j,k,ndel=0;
-    TCellPtr c;
-    ForAll(i,j,k) {
-        c = cells[flatindex(i,j,k)];
-        ndel+= c->particle_pass_recursive(op,relocate);
+    int ndel=0;
+    const int ncells = morton_order.size();
+    for (int m=0; m<ncells; m++) {
+        ndel+= cells[morton_order[m]]->particle_pass_recursive(op,relocate);
     }
     n_particles-= ndel;
     return ndel;
 }
 
+/** \brief Pass all particles to op, in parallel with USE_OPENMP
+ *
+ * The base grid is divided into blocks of PUSH_BLOCK_SIZE^3 cells coloured
+ * by the parity of their block indices. Blocks of one colour are pushed in
+ * parallel: their accumulate_PIC stencils do not overlap, and deposits that
+ * could reach beyond the block are deferred and applied afterwards in block
+ * order. Random numbers drawn by op come from a stream of the block. The
+ * accumulated quantities thus do not depend on the number of threads. Particles are not relocated, use particle_pass_with_relocation
+ * afterwards for the particles which crossed a cell boundary.
+ */
+template <class Func>
+int Tgrid::particle_push(Func op)
+{
+#ifndef USE_OPENMP
+    return particle_pass(op);
+#else
+    int ndel=0;
+    begin_push_pass();
+    for (int colour=0; colour<8; colour++) {
+        const int nb = push_phases[colour].size();
+#pragma omp parallel for schedule(dynamic) reduction(+:ndel)
+        for (int n=0; n<nb; n++) {
+            const int b = push_phases[colour][n];
+            // Each block has its own copy of op (e.g. its own CellCursor)
+            Func blockOp(op);
+            begin_push_block(b);
+            for (int m=push_blocks[b].first; m<push_blocks[b].last; m++) {
+                ndel+= cells[morton_order[m]]->particle_pass_recursive(blockOp,false);
+            }
+            end_push_block();
+        }
+    }
+    flush_push_deposits();
+    n_particles-= ndel;
+    return ndel;
+#endif
+}
+
+/** \brief Pass the particles of a leaf cell to op as one batch (recursive)
+ *
+ * Calls op.begin(n) and passes the particles to op for gathering, then
+ * calls op.push() and passes the particles again in the same order so that
+ * op can store the results. op must keep all particles.
+ */
+template <class Func>
+void Tgrid::Tcell::particle_batch_recursive(Func& op)
+{
+    if (haschildren) {
+        int ch;
+        for (ch=0; ch<8; ch++) child[0][0][ch]->particle_batch_recursive(op);
+    } else if (plist.Nparticles() > 0) {
+        op.begin(plist.Nparticles());
+        plist.pass(op);
+        op.push();
+        plist.pass(op);
+    }
+}
+
+/** \brief Pass the particles to op in batches of one leaf cell
+ *
+ * See Tcell::particle_batch_recursive. The particles are not relocated or
+ * accumulated, so with USE_OPENMP the base cells are passed in parallel.
+ */
+template <class Func>
+void Tgrid::particle_batch_pass(Func op)
+{
+    const int ncells = morton_order.size();
+#ifdef USE_OPENMP
+#pragma omp parallel
+    {
+        // Each thread has its own copy of op (e.g. its own CellCursor and buffers)
+        Func threadOp(op);
+#pragma omp for schedule(dynamic)
+        for (int m=0; m<ncells; m++) {
+            cells[morton_order[m]]->particle_batch_recursive(threadOp);
+        }
+    }
+#else
+    for (int m=0; m<ncells; m++) {
+        cells[morton_order[m]]->particle_batch_recursive(op);
+    }
+#endif
+}
+
 //! Pass cells (recursive)
 template <class Func>
 void Tgrid::Tcell::cellPassRecursive(Func& op)
@@ -79,6 +162,8 @@ void Tgrid::cellPass(Func op)
     cells[flatindex(i, j, k)]->cellPassRecursive(op);
 }
 
+#ifndef USE_PARTICLE_ARRAYS
+
 /** \brief Call op for all particles
  *
  * If op returns false, delete the particle afterwards. Returns
@@ -101,7 +186,7 @@ int TParticleList::pass(Func& op)
                 first = p->next;
             }
             p = p->next;
-            delete q;
+            particleArena.release(q);
             ndel++;
             n_part--;
         }
@@ -148,7 +233,7 @@ int TParticleList::pass_with_relocate(Func& op)
                 if (prev) prev->next = p->next;
                 else first = p->next;
                 p = p->next;
-                delete q;
+                particleArena.release(q);
                 ndel++;
                 n_part--;
             } else {
@@ -160,7 +245,7 @@ int TParticleList::pass_with_relocate(Func& op)
             if (prev) prev->next = p->next;
             else first = p->next;
             p = p->next;
-            delete q;
+            particleArena.release(q);
             ndel++;
             n_part--;
         }
@@ -168,5 +253,74 @@ int TParticleList::pass_with_relocate(Func& op)
     return ndel;
 }
 
+#else
+
+/** \brief Call op for all particles
+ *
+ * If op returns false, delete the particle afterwards. Returns
+ * number of deletions.
+ */
+template <class Func>
+int TParticleList::pass(Func& op)
+{
+    TLinkedParticle p;
+    const int n0 = n_used;
+    int i,nkeep;
+    for (i=0,nkeep=0; i<n0; i++) {
+        get(i,p);
+        if (op(p)) {
+            set(nkeep++,p);
+        }
+    }
+    compact(n0,nkeep);
+    return n0 - nkeep;
+}
+
+/** \brief Call op for all particles
+ *
+ * Const pass. Like pass, but doesn't change anything.
+ */
+template <class Func>
+void TParticleList::pass(Func& op) const
+{
+    TLinkedParticle p;
+    for (int i=0; i<n_used; i++) {
+        get(i,p);
+        op(p);
+    }
+}
+
+//! Pass thru the particles in the list with relocation
+template <class Func>
+int TParticleList::pass_with_relocate(Func& op)
+{
+    TLinkedParticle p;
+    const int n0 = n_used;
+    int i,nkeep,ndel = 0;
+    for (i=0,nkeep=0; i<n0; i++) {
+        get(i,p);
+        if (op(p)) {
+            TParticleList *newplist = g.find_plist(p);
+            if (newplist != NULL && newplist != this) {
+                // particle p needs to be moved from *this to *newplist
+                newplist->push(p);
+            }
+            // Remove the particle if no particle list found (=out of box)
+            else if(newplist == NULL) {
+                ERRORMSG("no particle list found, removing particle");
+                ndel++;
+            } else {
+                set(nkeep++,p);
+            }
+        } else {
+            ndel++;
+        }
+    }
+    compact(n0,nkeep);
+    return ndel;
+}
+
+#endif
+
 #endif
 
@@ -0,0 +1,48 @@
+/** This file is part of the HYB simulation platform.
+ *
+ *  Copyright 2014- Finnish Meteorological Institute
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <iostream>
+#include "../simulation.h"
+#include "../params.h"
+#include "../decomposition.h"
+
+using namespace std;
+
+/** \brief Batched velocity push test (make test_pushv)
+ *
+ * Runs the simulation of the config file given with -f to its t_max and
+ * compares the batched velocity push (USE_BATCHED_PUSH) with PropagateV
+ * for the particles at the end (Simulation::testBatchedPush). Returns
+ * nonzero if any case fails.
+ */
+int main(int argc, char *argv[])
+{
+    Decomposition decomposition(&argc,&argv);
+    if (argc < 3 || strcmp(argv[1], "-f") != 0) {
+        cout << "Usage: test_pushv -f hybrid.cfg\n";
+        return -1;
+    }
+    Params::configFileName = argv[2];
+    Simulation simu;
+    simu.run();
+    const int nfailed = simu.testBatchedPush();
+    simu.finalize();
+    cout << (nfailed == 0 ? "test_pushv passed\n" : "test_pushv FAILED\n");
+    return (nfailed == 0) ? 0 : 1;
+}
@@ -62,12 +62,31 @@ Ttimepool::Ttimepool() : n(0), attached_index(-1)
 {
     for (int i=0; i<MAX_TIMEPOOLS; i++) {
         t[i] = 0.0;
+        cnt[i] = 0.0;
         str[i] = 0;
     }
     cputime0 = GetCPUSeconds();
     cputimeLast = cputime0;
 }
 
+//! Get the CPU time accumulated in a timepool, zero if the timepool has not been used
+double Ttimepool::gettime(const char *s) const
+{
+    for (int j=0; j<n; j++) if (!strcmp(s,str[j])) {
+            return t[j];
+        }
+    return 0.0;
+}
+
+//! Add work count to a timepool, ignored if the timepool has not been used
+void Ttimepool::count(const char *s, double c)
+{
+    for (int j=0; j<n; j++) if (!strcmp(s,str[j])) {
+            cnt[j]+= c;
+            return;
+        }
+}
+
 //! Attach a timepool
 void Ttimepool::attach(const char *s)
 {
@@ -123,6 +142,13 @@ Ttimepool::~Ttimepool()
         mainlog.width(10);
         mainlog << t[i] << " s (" << 100.0*t[i]/ttot << " %) ";
         mainlog.unsetf(ios::right);
+        if (cnt[i] > 0 && t[i] > 0) {
+            mainlog.flags(ios::scientific);
+            mainlog.precision(3);
+            mainlog << cnt[i]/t[i] << " /s ";
+            mainlog.precision(1);
+            mainlog.flags(ios::fixed | ios::showpoint);
+        }
         mainlog	<< "\n";
     }
     const double cpu = GetCPUSeconds()-cputime0;
@@ -26,6 +26,7 @@ public:
     enum {MAX_TIMEPOOLS=30};  //!< Increase this if necessary (but probably 30 different time pools is quite enough)
 private:
     double t[MAX_TIMEPOOLS];  //!< accumulated CPU time in each timepool
+    double cnt[MAX_TIMEPOOLS]; //!< accumulated work count in each timepool (for the rate in the breakdown)
     char *str[MAX_TIMEPOOLS]; //!< name of each timepool
     int n;                    //!< number of timepools
     int attached_index;       //!< the index of currently attached timepool
@@ -34,7 +35,9 @@ private:
 public:
     Ttimepool();
     double cputime() const;
+    double gettime(const char *s) const; //!< Accumulated CPU time of a timepool (excluding the currently attached one)
     void attach(const char *s); //!< Call this with any string tag to start spending time in a new timepool
+    void count(const char *s, double c); //!< Add work done in a timepool, the breakdown shows its rate (count/s)
     void operator()(const char *s) {
         attach(s); //!< you can just say timepool("mytag") instead of timepool.attach("mytag")
     }
@@ -21,7 +21,6 @@
 
 #include <string>
 #include <vector>
-#include <map>
 #include "cpp_utils.h"
 #include "container.h"
 #include "../definitions.h"
@@ -198,39 +197,5 @@ Interval<nDims> getNodeIntervalFromPatch
     return i;
 }
 
-/** \brief Returns node coordinates from given data source without duplicates.
- *
- * If coordinates of data source are traversed, there are duplicate node
- * coordinates at adjacent sides of different patches.
- * This function returns all node coordinates of data source without
- * these duplicates.
- *
- * Coordinates are returned in std::map where keys are coordinates
- * and values are set to zero (caller can set this values for its
- * own purposes.
- *
- * Template argument nDims means dimensions of data source data.
- */
-template <Dimension nDims>
-SharedPtr<std::map<Coordinates<nDims>, std::size_t> >
-getCoordinatesWithoutDuplicates(const CommonDataSourceData& data)
-{
-    SharedPtr<std::map<Coordinates<nDims>, std::size_t> > coordIndexes
-    (new std::map<Coordinates<nDims>, std::size_t>);
-    for (ConstSequenceHandle<CommonDataSourceData::Patch>::const_iterator patch
-         = data.patches.begin(); patch != data.patches.end(); ++patch) {
-        const unsigned int maxRefRatio
-            = data.patches[data.patches.size() - 1].refinementRatio;
-        const unsigned int coordRatio = maxRefRatio / patch->refinementRatio;
-        Interval<nDims> patchInterval
-            = getNodeIntervalFromPatch<nDims>(*patch);
-        for (typename Interval<nDims>::const_iterator coords
-             = patchInterval.begin(); coords != patchInterval.end(); ++coords) {
-            (*coordIndexes)[(*coords) * coordRatio] = 0;
-        }
-    }
-    return coordIndexes;
-}
-
 #endif
 
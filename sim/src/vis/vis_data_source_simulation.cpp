@@ -138,7 +138,7 @@ struct CellFormulas {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
             vector<real> results(3);
-            cell.plist.calc_avev(results[0], results[1],
+            cell.moment_avev(results[0], results[1],
                                  results[2], popId);
             return results;
         }
@@ -146,13 +146,13 @@ struct CellFormulas {
     struct nFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            return vector<real> (1, cell.plist.calc_weight(popId)/(cell.size*cell.size*cell.size));
+            return vector<real> (1, cell.moment_weight(popId)/(cell.size*cell.size*cell.size));
         }
     };
     struct nTotAveFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            return vector<real> (1, cell.ave_nc);
+            return vector<real> (1, cell.ave_n());
         }
     };
 #ifdef SAVE_POPULATION_AVERAGES
@@ -160,35 +160,16 @@ struct CellFormulas {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
             vector<real> results(3);
-            real n=0,vx=0,vy=0,vz=0;
-            for(unsigned int i=0; i< popId.size(); i++) {
-                int j = popId[i];
-                n += cell.pop_ave_n[j];
-                vx += cell.pop_ave_n[j]*cell.pop_ave_vx[j];
-                vy += cell.pop_ave_n[j]*cell.pop_ave_vy[j];
-                vz += cell.pop_ave_n[j]*cell.pop_ave_vz[j];
-            }
-            real inv_n=0;
-            if(n>0) {
-                inv_n = 1.0/n;
-            }
-            vx *= inv_n;
-            vy *= inv_n;
-            vz *= inv_n;
-            results[0] = vx;
-            results[1] = vy;
-            results[2] = vz;
+            real n;
+            cell.ave_population(popId, n, results[0], results[1], results[2]);
             return results;
         }
     };
     struct nAveFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            real n=0;
-            for(unsigned int i=0; i< popId.size(); i++) {
-                int j = popId[i];
-                n += cell.pop_ave_n[j];
-            }
+            real n,vx,vy,vz;
+            cell.ave_population(popId, n, vx, vy, vz);
             return vector<real> (1,n);
         }
     };
@@ -196,7 +177,7 @@ struct CellFormulas {
     struct rhoFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            return vector<real> (1, cell.plist.calc_mass(popId) /
+            return vector<real> (1, cell.moment_mass(popId) /
                                  (cell.size*cell.size*cell.size));
         }
     };
@@ -204,9 +185,9 @@ struct CellFormulas {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
             real vx0=0,vy0=0,vz0=0;
-            cell.plist.calc_avev(vx0,vy0,vz0,popId);
+            cell.moment_avev(vx0,vy0,vz0,popId);
 
-            return vector<real> (1, 2*cell.plist.calc_avemv2(vx0,vy0,vz0,popId)/(3*Params::k_B));
+            return vector<real> (1, 2*cell.moment_avemv2(vx0,vy0,vz0,popId)/(3*Params::k_B));
         }
     };
     struct EConvectiveFormula {
@@ -392,7 +373,7 @@ struct CellFormulas {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
             vector<real> results(3);
-            cell.plist.calc_avev(results[0], results[1], results[2], popId);
+            cell.moment_avev(results[0], results[1], results[2], popId);
             return results;
         }
     };
@@ -400,7 +381,7 @@ struct CellFormulas {
     struct sph_nFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            return vector<real> (1, cell.plist.calc_weight(popId)/(cell.sph_dV));
+            return vector<real> (1, cell.moment_weight(popId)/(cell.sph_dV));
             //return vector<real> (1, cell.nc);
         }
     };
@@ -408,14 +389,14 @@ struct CellFormulas {
     struct sph_rhoFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            return vector<real> (1, cell.plist.calc_mass(popId)/(cell.sph_dV));
+            return vector<real> (1, cell.moment_mass(popId)/(cell.sph_dV));
         }
     };
     // rho_q calculation.
     struct sph_rhoqFormula {
         vector<real> operator()(const GridPriv::Tcell& cell,
                                 const vector<int>& popId) {
-            return vector<real> (1, cell.plist.calc_charge(popId)/(cell.sph_dV));
+            return vector<real> (1, cell.moment_charge(popId)/(cell.sph_dV));
             //return vector<real> (1, cell.rho_q);
         }
     };
@@ -1385,7 +1366,12 @@ struct ParticleMapper {
     ParticleMapper(const ParticleData& pData,
                    Func f)
         : m_pData(new ParticleData(pData)), m_func(f), prevIdx(0),
-          currentCell(m_pData->cells.begin()) {
+          currentCell(m_pData->cells.begin()),
+#ifndef USE_PARTICLE_ARRAYS
+          prevParticle(0) {
+#else
+          prevSlot(-1), prevParticle() {
+#endif
         findFirstParticleFromCurrentCell();
     }
     Ret operator()(std::size_t particleIdx) const {
@@ -1396,7 +1382,12 @@ struct ParticleMapper {
         }
         while(prevIdx != particleIdx)
             gotoNextParticle();
+#ifndef USE_PARTICLE_ARRAYS
         return m_func(*prevParticle);
+#else
+        currentCell->plist.get(prevSlot, prevParticle);
+        return m_func(prevParticle);
+#endif
     }
     struct ParticleData {
         const GridCells cells;
@@ -1406,6 +1397,7 @@ private:
     Func m_func;
     mutable std::size_t prevIdx;
     mutable GridCells::const_iterator currentCell;
+#ifndef USE_PARTICLE_ARRAYS
     mutable const TLinkedParticle* prevParticle;
     void gotoNextParticle() const {
         prevParticle = prevParticle->next;
@@ -1422,6 +1414,24 @@ private:
             prevParticle = currentCell->plist.first;
         }
     }
+#else
+    mutable int prevSlot; //!< Index of the particle in the list of currentCell
+    mutable TLinkedParticle prevParticle; //!< Copy of the particle gathered from the list
+    void gotoNextParticle() const {
+        ++prevSlot;
+        while (prevSlot >= currentCell->plist.Nparticles()) {
+            ++currentCell;
+            prevSlot = 0;
+        }
+        ++ prevIdx;
+    }
+    void findFirstParticleFromCurrentCell() const {
+        prevSlot = 0;
+        while (prevSlot >= currentCell->plist.Nparticles()) {
+            ++currentCell;
+        }
+    }
+#endif
 };
 
 //! "Pimpl" implementation class of SimulationVisDataSourceImpl
@@ -1676,3 +1686,9 @@ VisData SimulationVisDataSourceImpl::getVisData() const
     return pimpl->getVisData();
 }
 
+//! Find the AMR patches again after the grid was refined or recoarsened
+void SimulationVisDataSourceImpl::gridChanged()
+{
+    pimpl->m_patches = findAMRPatches(pimpl->m_cells);
+}
+
@@ -38,6 +38,7 @@ public:
     SimulationVisDataSourceImpl(const Params& p, const Tgrid& g);
     virtual ~SimulationVisDataSourceImpl() { }
     virtual VisData getVisData() const;
+    void gridChanged();
 private:
     //! SimulationVisDataSourceImpl uses "pimpl" idiom. This is pointer to actual implementation.
     SCopyPtr<SimulationVisDataSourceImplPrivate> pimpl;
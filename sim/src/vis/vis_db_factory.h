@@ -25,7 +25,7 @@
 #include "vis_db.h"
 #include "vis_db_vtk.h"
 
-enum VisFormat { VTK_LEGACY_ASCII = 0, VTK_LEGACY_BINARY = 1 };
+enum VisFormat { VTK_LEGACY_ASCII = 0, VTK_LEGACY_BINARY = 1, VTK_XML_BINARY = 2, VTK_XML_COMPRESSED = 3, VTK_XML_AMR = 4 };
 
 //! Visualization database factory
 class VisDBFactory
@@ -42,6 +42,15 @@ public:
         case VTK_LEGACY_BINARY:
             return *new VTKVisDB(dataSource, VTKVisDB::LEGACY_BINARY,
                                  VTKVisDB::CALCULATE_ONCE);
+        case VTK_XML_BINARY:
+            return *new VTKVisDB(dataSource, VTKVisDB::XML_BINARY,
+                                 VTKVisDB::CALCULATE_ONCE);
+        case VTK_XML_COMPRESSED:
+            return *new VTKVisDB(dataSource, VTKVisDB::XML_COMPRESSED,
+                                 VTKVisDB::CALCULATE_ONCE);
+        case VTK_XML_AMR:
+            return *new VTKVisDB(dataSource, VTKVisDB::XML_AMR,
+                                 VTKVisDB::DONT_REMOVE);
         }
         throw std::invalid_argument("Unrecognized file format");
     }
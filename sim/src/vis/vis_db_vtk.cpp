@@ -21,16 +21,27 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
 #include "cpp_utils.h"
 #include "container.h"
 #include "vis_db_vtk.h"
 #include "../definitions.h"
+#include "../logger.h"
+#include "../output.h"
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
 #include "../transformations.h"
 #endif
+#ifdef USE_COMPRESSED_HC
+#include <zlib.h>
+#endif
 
 using namespace std;
 
+extern Logger errorlog;
+
 namespace
 {
 
@@ -244,7 +255,7 @@ void writeCellsAsStructuredPoints(VisData& data, ostream& os,
  */
 void writeCellsAsUnstructuredGrid
 (VisData& data, ostream& os, VTKVisDB::FileFormat format,
- SharedPtr<std::map<Coordinates<3>, std::size_t> > coordIndexes,
+ SharedPtr<NodeIndexes> coordIndexes,
  DB::FloatingPrecision binFloatingPrec)
 {
     DataWriter::WriteMode dataWriteMode;
@@ -283,7 +294,7 @@ void writeCellsAsUnstructuredGrid
                        data.refRatio1CellSize[2] / maxRefRatio
                      };
     if (coordIndexes                 // don't remove duplicate coordinates
-        == SharedPtr<std::map<Coordinates<3>, std::size_t> >(0)) {
+        == SharedPtr<NodeIndexes>(0)) {
         for (ConstSequenceHandle<VisData::Patch>::const_iterator patch
              = data.patches.begin(); patch != data.patches.end(); ++patch) {
             vector<std::size_t> dims = getPatchDimensions(*patch);
@@ -329,15 +340,14 @@ void writeCellsAsUnstructuredGrid
     } else {           // remove duplicate coordinates
         nPoints = coordIndexes->size();
         os << "POINTS " << nPoints << " " << dataTypeString << "\n";
-        std::size_t idx = 0;
-        for (std::map<Coordinates<3>, std::size_t>::iterator coords
-             = coordIndexes->begin(); coords != coordIndexes->end(); ++coords) {
-            coords->second = idx;
+        for (std::size_t idx = 0; idx < nPoints; ++idx) {
+            std::size_t coords[3];
+            coordIndexes->coordinates(idx, coords);
             // Spherical coordinates test for VisIt
             /*
-            double xx = coords->first[0] * spacing[0] + data.startCoordinates[0];
-            double yy = coords->first[1] * spacing[1] + data.startCoordinates[1];
-            double zz = coords->first[2] * spacing[2] + data.startCoordinates[2];
+            double xx = coords[0] * spacing[0] + data.startCoordinates[0];
+            double yy = coords[1] * spacing[1] + data.startCoordinates[1];
+            double zz = coords[2] * spacing[2] + data.startCoordinates[2];
             double r = -1*xx + Params::box_xmax;
             double theta = M_PI*(yy - Params::box_ymin)/Params::box_Y;
             double phi = 2*M_PI*(zz - Params::box_zmin)/Params::box_Z;
@@ -347,7 +357,7 @@ void writeCellsAsUnstructuredGrid
             */
             gridreal crd[3];
             for(int i=0; i<3; ++i) {
-                crd[i] = coords->first[i] * spacing[i] + data.startCoordinates[i];
+                crd[i] = coords[i] * spacing[i] + data.startCoordinates[i];
             }
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
             sph_transf_H2S_VTK(crd);
@@ -355,7 +365,6 @@ void writeCellsAsUnstructuredGrid
             writer.write(crd[0]);
             writer.write(crd[1]);
             writer.write(crd[2]);
-            ++idx;
         }
     }
     os << "\n";
@@ -363,7 +372,7 @@ void writeCellsAsUnstructuredGrid
     os << "CELLS " << nCells << " " << nCells * 9 << "\n";
     writer.setRowLength(9);
     if (coordIndexes            // duplicate coordinates aren't removed
-        == SharedPtr<std::map<Coordinates<3>, std::size_t> >(0)) {
+        == SharedPtr<NodeIndexes>(0)) {
         unsigned int firstPatchPointIdx = 0;
         for (ConstSequenceHandle<VisData::Patch>::const_iterator patch
              = data.patches.begin(); patch != data.patches.end(); ++patch) {
@@ -416,41 +425,24 @@ void writeCellsAsUnstructuredGrid
 // the original in comments
 #ifdef USE_SPHERICAL_COORDINATE_SYSTEM
                 writer.write<int>(int(8))
-                .write<int>((*coordIndexes)
-                            [co])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, 0, 0)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, coordRatio, 0)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(0, coordRatio, 0)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(0, 0, coordRatio)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, 0, coordRatio)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, coordRatio, coordRatio)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(0, coordRatio, coordRatio)]);
+                .write<int>(coordIndexes->find(co[0], co[1], co[2]))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1], co[2]))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1] + coordRatio, co[2]))
+                .write<int>(coordIndexes->find(co[0], co[1] + coordRatio, co[2]))
+                .write<int>(coordIndexes->find(co[0], co[1], co[2] + coordRatio))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1], co[2] + coordRatio))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1] + coordRatio, co[2] + coordRatio))
+                .write<int>(coordIndexes->find(co[0], co[1] + coordRatio, co[2] + coordRatio));
 #else
                 writer.write<int>(int(8))
-                .write<int>((*coordIndexes)
-                            [co])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, 0, 0)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(0, coordRatio, 0)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, coordRatio, 0)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(0, 0, coordRatio)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, 0, coordRatio)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(0, coordRatio, coordRatio)])
-                .write<int>((*coordIndexes)
-                            [co + Coordinates<3>(coordRatio, coordRatio,
-                                                 coordRatio)]);
+                .write<int>(coordIndexes->find(co[0], co[1], co[2]))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1], co[2]))
+                .write<int>(coordIndexes->find(co[0], co[1] + coordRatio, co[2]))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1] + coordRatio, co[2]))
+                .write<int>(coordIndexes->find(co[0], co[1], co[2] + coordRatio))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1], co[2] + coordRatio))
+                .write<int>(coordIndexes->find(co[0], co[1] + coordRatio, co[2] + coordRatio))
+                .write<int>(coordIndexes->find(co[0] + coordRatio, co[1] + coordRatio, co[2] + coordRatio));
 #endif
             }
         }
@@ -558,6 +550,776 @@ void writeParticlesAsUnstructuredGrid(VisData& data, ostream& os,
     }
 }
 
+
+//! Multiplier of the Fibonacci hashing of NodeIndexes (2^64 / golden ratio)
+const uint64_t hashMultiplier = (uint64_t(0x9E3779B9) << 32) | uint64_t(0x7F4A7C15);
+
+//! Uncompressed size of the blocks of compressed VTK XML data arrays
+const std::size_t XML_BLOCK_SIZE = 65536;
+
+//! Name of the byte order of this machine in VTK XML files
+const char *hostByteOrder()
+{
+    const int one = 1;
+    return *reinterpret_cast<const char*>(&one) ? "LittleEndian" : "BigEndian";
+}
+
+//! VTK XML type name of T
+template <class T> const char *xmlType();
+template <> const char *xmlType<float>()
+{
+    return "Float32";
+}
+template <> const char *xmlType<double>()
+{
+    return "Float64";
+}
+template <> const char *xmlType<int>()
+{
+    return "Int32";
+}
+template <> const char *xmlType<unsigned char>()
+{
+    return "UInt8";
+}
+
+/** \brief Data array in the appended data section of a VTK XML file
+ *
+ * The content is kept as it is written: a 64-bit byte count followed by
+ * the raw values, or the VTK zlib header followed by the compressed blocks.
+ */
+struct AppendedArray {
+    std::string type;          //!< VTK XML type name
+    std::string name;          //!< Array name (empty for the points)
+    unsigned int nComponents;  //!< Number of components per tuple
+    std::vector<char> bytes;   //!< Encoded content
+};
+
+//! Append a 64-bit integer in the byte order of the machine
+void putUint64(vector<char>& out, uint64_t x)
+{
+    const char *p = reinterpret_cast<const char*>(&x);
+    out.insert(out.end(), p, p + sizeof(uint64_t));
+}
+
+/** \brief Encode the values of an array for the appended data section
+ *
+ * Compressed arrays are split into blocks of XML_BLOCK_SIZE bytes, which
+ * are compressed in parallel. Returns false if zlib fails.
+ */
+template <class T>
+bool encodeArray(const vector<T>& values, bool compress, AppendedArray& a)
+{
+    const std::size_t n = values.size()*sizeof(T);
+    const char *raw = values.empty() ? 0 : reinterpret_cast<const char*>(&values[0]);
+    a.type = xmlType<T>();
+    a.bytes.clear();
+    if (compress == false) {
+        a.bytes.reserve(sizeof(uint64_t) + n);
+        putUint64(a.bytes, n);
+        a.bytes.insert(a.bytes.end(), raw, raw + n);
+        return true;
+    }
+#ifdef USE_COMPRESSED_HC
+    const long nBlocks = (n + XML_BLOCK_SIZE - 1)/XML_BLOCK_SIZE;
+    vector< vector<Bytef> > blocks(nBlocks);
+    int nFailed = 0;
+#ifdef USE_OPENMP
+    #pragma omp parallel for schedule(dynamic) reduction(+:nFailed)
+#endif
+    for (long b = 0; b < nBlocks; ++b) {
+        const std::size_t len = min(XML_BLOCK_SIZE, n - b*XML_BLOCK_SIZE);
+        uLongf cLen = compressBound(len);
+        blocks[b].resize(cLen);
+        if (compress2(&blocks[b][0], &cLen, reinterpret_cast<const Bytef*>(raw + b*XML_BLOCK_SIZE), len, Z_BEST_SPEED) != Z_OK) {
+            nFailed++;
+        }
+        blocks[b].resize(cLen);
+    }
+    if (nFailed > 0) {
+        return false;
+    }
+    putUint64(a.bytes, nBlocks);
+    putUint64(a.bytes, XML_BLOCK_SIZE);
+    putUint64(a.bytes, nBlocks > 0 ? n - (nBlocks - 1)*XML_BLOCK_SIZE : 0);
+    for (long b = 0; b < nBlocks; ++b) {
+        putUint64(a.bytes, blocks[b].size());
+    }
+    for (long b = 0; b < nBlocks; ++b) {
+        a.bytes.insert(a.bytes.end(), blocks[b].begin(), blocks[b].end());
+    }
+    return true;
+#else
+    // VTKVisDB does not use XML_COMPRESSED without zlib
+    return false;
+#endif
+}
+
+//! Cells of one patch in the integer coordinates of the finest patch level
+struct PatchBox {
+    std::size_t start[3];    //!< First cell (on the patch level)
+    std::size_t dims[3];     //!< Number of cells
+    std::size_t ratio;       //!< Cell size on the finest patch level
+    std::size_t firstCell;   //!< Index of the first cell of the patch in the file
+    std::size_t firstPoint;  //!< Index of the first node of the patch if duplicates are not removed
+};
+
+/** \brief Corners of a cell in the order of the VTK cell type
+ *
+ * VTK_VOXEL (11) in Cartesian and VTK_HEXAHEDRON (12) in spherical runs,
+ * as in writeCellsAsUnstructuredGrid.
+ */
+#ifdef USE_SPHERICAL_COORDINATE_SYSTEM
+const int xmlCellType = 12;
+const int cellCorners[8][3] = {{0,0,0},{1,0,0},{1,1,0},{0,1,0},{0,0,1},{1,0,1},{1,1,1},{0,1,1}};
+#else
+const int xmlCellType = 11;
+const int cellCorners[8][3] = {{0,0,0},{1,0,0},{0,1,0},{1,1,0},{0,0,1},{1,0,1},{0,1,1},{1,1,1}};
+#endif
+
+//! Fill the node coordinates (three per node)
+template <class T>
+void fillPoints(const vector<PatchBox>& boxes, const NodeIndexes *nodes, std::size_t nPoints,
+                const real start[3], const real spacing[3], vector<T>& points)
+{
+    points.resize(3*nPoints);
+    if (nodes != 0) {
+        const long n = nPoints;
+#ifdef USE_OPENMP
+        #pragma omp parallel for schedule(static)
+#endif
+        for (long idx = 0; idx < n; ++idx) {
+            std::size_t c[3];
+            nodes->coordinates(idx, c);
+            gridreal crd[3];
+            for (int i = 0; i < 3; ++i) {
+                crd[i] = c[i]*spacing[i] + start[i];
+            }
+#ifdef USE_SPHERICAL_COORDINATE_SYSTEM
+            sph_transf_H2S_VTK(crd);
+#endif
+            for (int i = 0; i < 3; ++i) {
+                points[3*idx + i] = crd[i];
+            }
+        }
+        return;
+    }
+    for (unsigned int p = 0; p < boxes.size(); ++p) {
+        const PatchBox& b = boxes[p];
+        const std::size_t nx = b.dims[0] + 1, ny = b.dims[1] + 1;
+        const long n = nx*ny*(b.dims[2] + 1);
+#ifdef USE_OPENMP
+        #pragma omp parallel for schedule(static)
+#endif
+        for (long i = 0; i < n; ++i) {
+            const std::size_t c[3] = { (b.start[0] + i % nx)*b.ratio,
+                                       (b.start[1] + (i / nx) % ny)*b.ratio,
+                                       (b.start[2] + i / (nx*ny))*b.ratio
+                                     };
+            gridreal crd[3];
+            for (int k = 0; k < 3; ++k) {
+                crd[k] = c[k]*spacing[k] + start[k];
+            }
+#ifdef USE_SPHERICAL_COORDINATE_SYSTEM
+            sph_transf_H2S_VTK(crd);
+#endif
+            for (int k = 0; k < 3; ++k) {
+                points[3*(b.firstPoint + i) + k] = crd[k];
+            }
+        }
+    }
+}
+
+//! Fill the cell connectivity (eight node indexes per cell)
+void fillConnectivity(const vector<PatchBox>& boxes, const NodeIndexes *nodes,
+                      std::size_t nCells, vector<int>& connectivity)
+{
+    connectivity.resize(8*nCells);
+    for (unsigned int p = 0; p < boxes.size(); ++p) {
+        const PatchBox& b = boxes[p];
+        const std::size_t nx = b.dims[0], ny = b.dims[1];
+        const long n = nx*ny*b.dims[2];
+#ifdef USE_OPENMP
+        #pragma omp parallel for schedule(static)
+#endif
+        for (long i = 0; i < n; ++i) {
+            const std::size_t x = i % nx, y = (i / nx) % ny, z = i / (nx*ny);
+            int *const corners = &connectivity[8*(b.firstCell + i)];
+            for (int k = 0; k < 8; ++k) {
+                const int *const o = cellCorners[k];
+                if (nodes != 0) {
+                    corners[k] = nodes->find((b.start[0] + x + o[0])*b.ratio,
+                                             (b.start[1] + y + o[1])*b.ratio,
+                                             (b.start[2] + z + o[2])*b.ratio);
+                } else {
+                    corners[k] = b.firstPoint + (x + o[0]) + (nx + 1)*((y + o[1]) + (ny + 1)*(z + o[2]));
+                }
+            }
+        }
+    }
+}
+
+//! Fill the values of a cell vector variable (components of a cell together)
+template <class T>
+void fillCellValues(const VisData::VectorVariable& var, const vector<PatchBox>& boxes,
+                    std::size_t nCells, vector<T>& values)
+{
+    const unsigned int nComps = var.components.size();
+    values.resize(nComps*nCells);
+    for (unsigned int p = 0; p < boxes.size(); ++p) {
+        vector<const real*> comps(nComps);
+        for (unsigned int c = 0; c < nComps; ++c) {
+            comps[c] = var.components[c].values[p];
+        }
+        const PatchBox& b = boxes[p];
+        const long n = b.dims[0]*b.dims[1]*b.dims[2];
+#ifdef USE_OPENMP
+        #pragma omp parallel for schedule(static)
+#endif
+        for (long i = 0; i < n; ++i) {
+            for (unsigned int c = 0; c < nComps; ++c) {
+                values[nComps*(b.firstCell + i) + c] = comps[c][i];
+            }
+        }
+    }
+}
+
+/** \brief Fill and encode the points and cell variables of the XML file
+ *
+ * T is the floating point type of the written values.
+ */
+template <class T>
+bool encodeXMLValueArrays(VisData& data, const vector<PatchBox>& boxes, const NodeIndexes *nodes,
+                          std::size_t nPoints, std::size_t nCells, const real spacing[3],
+                          bool compress, vector<AppendedArray>& arrays)
+{
+    const real start[3] = { data.startCoordinates[0], data.startCoordinates[1], data.startCoordinates[2] };
+    {
+        vector<T> points;
+        fillPoints(boxes, nodes, nPoints, start, spacing, points);
+        arrays.push_back(AppendedArray());
+        arrays.back().nComponents = 3;
+        if (encodeArray(points, compress, arrays.back()) == false) {
+            return false;
+        }
+    }
+    for (ConstSequenceHandle<VisData::VectorVariable>::const_iterator var
+         = data.cellVectorVariables.begin();
+         var != data.cellVectorVariables.end(); ++var) {
+        vector<T> values;
+        fillCellValues(*var, boxes, nCells, values);
+        arrays.push_back(AppendedArray());
+        arrays.back().name = var->name;
+        arrays.back().nComponents = var->components.size();
+        if (encodeArray(values, compress, arrays.back()) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//! Write the XML element of an appended data array
+void writeDataArrayElement(ostream& os, const AppendedArray& a, uint64_t offset)
+{
+    os << "        <DataArray type=\"" << a.type << "\"";
+    if (a.name.empty() == false) {
+        os << " Name=\"" << a.name << "\"";
+    }
+    os << " NumberOfComponents=\"" << a.nComponents << "\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+}
+
+//! Offsets of the arrays in the appended data section
+vector<uint64_t> appendedOffsets(const vector<AppendedArray>& arrays)
+{
+    vector<uint64_t> offsets(arrays.size());
+    uint64_t offset = 0;
+    for (unsigned int i = 0; i < arrays.size(); ++i) {
+        offsets[i] = offset;
+        offset += arrays[i].bytes.size();
+    }
+    return offsets;
+}
+
+//! Write the XML declaration and the VTKFile start tag
+void writeXMLFileStart(ostream& os, const char *type, bool compress)
+{
+    os << "<?xml version=\"1.0\"?>\n";
+    os << "<VTKFile type=\"" << type << "\" version=\"1.0\" byte_order=\"" << hostByteOrder()
+       << "\" header_type=\"UInt64\"";
+    if (compress == true) {
+        os << " compressor=\"vtkZLibDataCompressor\"";
+    }
+    os << ">\n";
+}
+
+//! Write the appended data section and the VTKFile end tag (frees the array contents)
+void writeAppendedData(ostream& os, vector<AppendedArray>& arrays)
+{
+    os << "  <AppendedData encoding=\"raw\">\n";
+    os << "_";
+    for (unsigned int i = 0; i < arrays.size(); ++i) {
+        if (arrays[i].bytes.empty() == false) {
+            os.write(&arrays[i].bytes[0], arrays[i].bytes.size());
+        }
+        vector<char>().swap(arrays[i].bytes);
+    }
+    os << "\n  </AppendedData>\n";
+    os << "</VTKFile>\n";
+}
+
+/** \brief Writes cells as unstructured grid in VTK XML format (.vtu)
+ *
+ * Can be used with AMR mesh. All data arrays are filled in parallel into
+ * contiguous buffers and written after the XML header as raw appended data,
+ * each array with one write call.
+ */
+void writeCellsAsXMLUnstructuredGrid(VisData& data, ostream& os, VTKVisDB::FileFormat format,
+                                     SharedPtr<NodeIndexes> coordIndexes,
+                                     DB::FloatingPrecision binFloatingPrec)
+{
+    const bool compress = (format == VTKVisDB::XML_COMPRESSED);
+    const NodeIndexes *const nodes
+        = (coordIndexes == SharedPtr<NodeIndexes>(0)) ? 0 : &(*coordIndexes);
+    const unsigned int maxRefRatio
+        = data.patches[data.patches.size() - 1].refinementRatio;
+    const real spacing[] = { data.refRatio1CellSize[0] / maxRefRatio,
+                             data.refRatio1CellSize[1] / maxRefRatio,
+                             data.refRatio1CellSize[2] / maxRefRatio
+                           };
+    vector<PatchBox> boxes(data.patches.size());
+    std::size_t nCells = 0, nPoints = 0;
+    for (unsigned int p = 0; p < boxes.size(); ++p) {
+        const VisData::Patch& patch = data.patches[p];
+        vector<std::size_t> dims = getPatchDimensions(patch);
+        for (int i = 0; i < 3; ++i) {
+            boxes[p].start[i] = patch.startCoordinates[i];
+            boxes[p].dims[i] = dims[i];
+        }
+        boxes[p].ratio = maxRefRatio / patch.refinementRatio;
+        boxes[p].firstCell = nCells;
+        boxes[p].firstPoint = nPoints;
+        nCells += dims[0] * dims[1] * dims[2];
+        nPoints += (dims[0] + 1) * (dims[1] + 1) * (dims[2] + 1);
+    }
+    if (nodes != 0) {
+        nPoints = nodes->size();
+    }
+    // Points and cell variables
+    vector<AppendedArray> arrays;
+    bool ok;
+    if (binFloatingPrec == DB::FLOAT) {
+        ok = encodeXMLValueArrays<float>(data, boxes, nodes, nPoints, nCells, spacing, compress, arrays);
+    } else {
+        ok = encodeXMLValueArrays<double>(data, boxes, nodes, nPoints, nCells, spacing, compress, arrays);
+    }
+    // Cells
+    const std::size_t firstCellArray = arrays.size();
+    arrays.resize(firstCellArray + 3);
+    {
+        vector<int> connectivity;
+        fillConnectivity(boxes, nodes, nCells, connectivity);
+        arrays[firstCellArray].name = "connectivity";
+        ok = ok && encodeArray(connectivity, compress, arrays[firstCellArray]);
+    }
+    {
+        vector<int> offsets(nCells);
+        for (std::size_t i = 0; i < nCells; ++i) {
+            offsets[i] = 8*(i + 1);
+        }
+        arrays[firstCellArray + 1].name = "offsets";
+        ok = ok && encodeArray(offsets, compress, arrays[firstCellArray + 1]);
+    }
+    {
+        vector<unsigned char> types(nCells, xmlCellType);
+        arrays[firstCellArray + 2].name = "types";
+        ok = ok && encodeArray(types, compress, arrays[firstCellArray + 2]);
+    }
+    for (unsigned int i = firstCellArray; i < arrays.size(); ++i) {
+        arrays[i].nComponents = 1;
+    }
+    if (ok == false) {
+        ERRORMSG("zlib compression failed");
+        os.setstate(ios::failbit);
+        return;
+    }
+    const vector<uint64_t> offsets = appendedOffsets(arrays);
+    writeXMLFileStart(os, "UnstructuredGrid", compress);
+    os << "  <UnstructuredGrid>\n";
+    os << "    <Piece NumberOfPoints=\"" << nPoints << "\" NumberOfCells=\"" << nCells << "\">\n";
+    os << "      <Points>\n";
+    writeDataArrayElement(os, arrays[0], offsets[0]);
+    os << "      </Points>\n";
+    os << "      <Cells>\n";
+    for (unsigned int i = firstCellArray; i < arrays.size(); ++i) {
+        writeDataArrayElement(os, arrays[i], offsets[i]);
+    }
+    os << "      </Cells>\n";
+    os << "      <CellData>\n";
+    for (unsigned int i = 1; i < firstCellArray; ++i) {
+        writeDataArrayElement(os, arrays[i], offsets[i]);
+    }
+    os << "      </CellData>\n";
+    os << "    </Piece>\n";
+    os << "  </UnstructuredGrid>\n";
+    writeAppendedData(os, arrays);
+}
+
+//! Number of cells along an edge of the blocks of VTK overlapping AMR files
+const std::size_t AMR_BLOCK_SIZE = 8;
+
+/** \brief Blocks of one level of a VTK overlapping AMR data set
+ *
+ * Level n has refinement ratio 2^n and is divided into blocks of
+ * AMR_BLOCK_SIZE^3 cells aligned with the origin of the mesh.
+ */
+struct AMRLevel {
+    std::size_t dims[3];              //!< Number of cells of the level in the mesh
+    std::size_t nBlocks[3];           //!< Number of blocks of the level in the mesh
+    std::vector<long> blockIds;       //!< Index of each block in blocks, or -1 if it is not used
+    std::vector<std::size_t> blocks;  //!< Used blocks (block coordinates x + nBlocks[0]*(y + nBlocks[1]*z))
+    //! Cells of used block b (hi inclusive)
+    void box(std::size_t b, std::size_t lo[3], std::size_t hi[3]) const {
+        const std::size_t c[3] = { blocks[b] % nBlocks[0], (blocks[b] / nBlocks[0]) % nBlocks[1],
+                                   blocks[b] / (nBlocks[0]*nBlocks[1])
+                                 };
+        for (int i = 0; i < 3; ++i) {
+            lo[i] = c[i]*AMR_BLOCK_SIZE;
+            hi[i] = min(lo[i] + AMR_BLOCK_SIZE, dims[i]) - 1;
+        }
+    }
+    //! Index of used block containing cell (x,y,z) and index of the cell in it
+    long find(std::size_t x, std::size_t y, std::size_t z, std::size_t& cellIdx) const {
+        const long b = blockIds[x/AMR_BLOCK_SIZE + nBlocks[0]*(y/AMR_BLOCK_SIZE + nBlocks[1]*(z/AMR_BLOCK_SIZE))];
+        if (b >= 0) {
+            std::size_t lo[3], hi[3];
+            box(b, lo, hi);
+            cellIdx = (x - lo[0]) + (hi[0] - lo[0] + 1)*((y - lo[1]) + (hi[1] - lo[1] + 1)*(z - lo[2]));
+        }
+        return b;
+    }
+};
+
+//! Level of refinement ratio r (r = 2^level)
+unsigned int amrLevel(unsigned int r)
+{
+    unsigned int level = 0;
+    while ((1u << level) < r) {
+        ++level;
+    }
+    return level;
+}
+
+/** \brief Find the blocks of the levels of a VTK overlapping AMR data set
+ *
+ * All blocks of level 0 are used. A block of level n > 0 is used if it
+ * contains cells refined at least n times, so the used blocks of level n+1
+ * are inside the used blocks of level n.
+ */
+void findAMRBlocks(VisData& data, vector<AMRLevel>& levels)
+{
+    const unsigned int maxRefRatio
+        = data.patches[data.patches.size() - 1].refinementRatio;
+    levels.resize(amrLevel(maxRefRatio) + 1);
+    std::size_t dims0[3] = { 0, 0, 0 };
+    for (unsigned int p = 0; p < data.patches.size(); ++p) {
+        const VisData::Patch& patch = data.patches[p];
+        for (int i = 0; i < 3; ++i) {
+            dims0[i] = max(dims0[i], (patch.endCoordinates[i] + 1) / patch.refinementRatio);
+        }
+    }
+    for (unsigned int level = 0; level < levels.size(); ++level) {
+        AMRLevel& l = levels[level];
+        for (int i = 0; i < 3; ++i) {
+            l.dims[i] = dims0[i] << level;
+            l.nBlocks[i] = (l.dims[i] + AMR_BLOCK_SIZE - 1) / AMR_BLOCK_SIZE;
+        }
+        l.blockIds.assign(l.nBlocks[0]*l.nBlocks[1]*l.nBlocks[2], level == 0 ? 0 : -1);
+        for (unsigned int p = 0; p < data.patches.size(); ++p) {
+            const VisData::Patch& patch = data.patches[p];
+            const unsigned int patchLevel = amrLevel(patch.refinementRatio);
+            if (level == 0 || patchLevel < level) {
+                continue;
+            }
+            const unsigned int shift = patchLevel - level;
+            for (std::size_t z = (patch.startCoordinates[2] >> shift) / AMR_BLOCK_SIZE;
+                 z <= (patch.endCoordinates[2] >> shift) / AMR_BLOCK_SIZE; ++z)
+                for (std::size_t y = (patch.startCoordinates[1] >> shift) / AMR_BLOCK_SIZE;
+                     y <= (patch.endCoordinates[1] >> shift) / AMR_BLOCK_SIZE; ++y)
+                    for (std::size_t x = (patch.startCoordinates[0] >> shift) / AMR_BLOCK_SIZE;
+                         x <= (patch.endCoordinates[0] >> shift) / AMR_BLOCK_SIZE; ++x) {
+                        l.blockIds[x + l.nBlocks[0]*(y + l.nBlocks[1]*z)] = 0;
+                    }
+        }
+        for (std::size_t b = 0; b < l.blockIds.size(); ++b) {
+            if (l.blockIds[b] == 0) {
+                l.blockIds[b] = l.blocks.size();
+                l.blocks.push_back(b);
+            }
+        }
+    }
+}
+
+/** \brief Fill the values of a cell vector variable in the blocks of all levels
+ *
+ * A cell refined in the mesh gets the average of its children on the next
+ * level, and the other cells get the value of the mesh cell containing them.
+ */
+void fillAMRValues(VisData& data, const VisData::VectorVariable& var, const vector<AMRLevel>& levels,
+                   vector< vector< vector<real> > >& values)
+{
+    const unsigned int nComps = var.components.size();
+    values.resize(levels.size());
+    for (int level = levels.size() - 1; level >= 0; --level) {
+        const AMRLevel& l = levels[level];
+        values[level].resize(l.blocks.size());
+        for (std::size_t b = 0; b < l.blocks.size(); ++b) {
+            std::size_t lo[3], hi[3];
+            l.box(b, lo, hi);
+            values[level][b].assign(nComps*(hi[0] - lo[0] + 1)*(hi[1] - lo[1] + 1)*(hi[2] - lo[2] + 1), 0.0);
+        }
+        // Average of the children on the next level
+        if (level + 1 < static_cast<int>(levels.size())) {
+            const AMRLevel& fine = levels[level + 1];
+            for (std::size_t b = 0; b < fine.blocks.size(); ++b) {
+                std::size_t lo[3], hi[3];
+                fine.box(b, lo, hi);
+                const real *child = &values[level + 1][b][0];
+                for (std::size_t z = lo[2]; z <= hi[2]; ++z)
+                    for (std::size_t y = lo[1]; y <= hi[1]; ++y)
+                        for (std::size_t x = lo[0]; x <= hi[0]; ++x, child += nComps) {
+                            std::size_t cellIdx = 0;
+                            const long pb = l.find(x/2, y/2, z/2, cellIdx);
+                            real *parent = &values[level][pb][nComps*cellIdx];
+                            for (unsigned int c = 0; c < nComps; ++c) {
+                                parent[c] += child[c] / 8;
+                            }
+                        }
+            }
+        }
+        // Values of the mesh cells of this or coarser levels
+        for (unsigned int p = 0; p < data.patches.size(); ++p) {
+            const VisData::Patch& patch = data.patches[p];
+            const int patchLevel = amrLevel(patch.refinementRatio);
+            if (patchLevel > level) {
+                continue;
+            }
+            const unsigned int shift = level - patchLevel;
+            const vector<std::size_t> dims = getPatchDimensions(patch);
+            std::size_t pLo[3], pHi[3];
+            for (int i = 0; i < 3; ++i) {
+                pLo[i] = patch.startCoordinates[i] << shift;
+                pHi[i] = ((patch.endCoordinates[i] + 1) << shift) - 1;
+            }
+            vector<const real*> comps(nComps);
+            for (unsigned int c = 0; c < nComps; ++c) {
+                comps[c] = var.components[c].values[p];
+            }
+            for (std::size_t bz = pLo[2] / AMR_BLOCK_SIZE; bz <= pHi[2] / AMR_BLOCK_SIZE; ++bz)
+                for (std::size_t by = pLo[1] / AMR_BLOCK_SIZE; by <= pHi[1] / AMR_BLOCK_SIZE; ++by)
+                    for (std::size_t bx = pLo[0] / AMR_BLOCK_SIZE; bx <= pHi[0] / AMR_BLOCK_SIZE; ++bx) {
+                        const long b = l.blockIds[bx + l.nBlocks[0]*(by + l.nBlocks[1]*bz)];
+                        if (b < 0) {
+                            continue;
+                        }
+                        std::size_t lo[3], hi[3];
+                        l.box(b, lo, hi);
+                        for (int i = 0; i < 3; ++i) {
+                            lo[i] = max(lo[i], pLo[i]);
+                            hi[i] = min(hi[i], pHi[i]);
+                        }
+                        for (std::size_t z = lo[2]; z <= hi[2]; ++z)
+                            for (std::size_t y = lo[1]; y <= hi[1]; ++y)
+                                for (std::size_t x = lo[0]; x <= hi[0]; ++x) {
+                                    std::size_t cellIdx = 0;
+                                    l.find(x, y, z, cellIdx);
+                                    const std::size_t patchIdx = ((x >> shift) - patch.startCoordinates[0])
+                                                                 + dims[0]*(((y >> shift) - patch.startCoordinates[1])
+                                                                         + dims[1]*((z >> shift) - patch.startCoordinates[2]));
+                                    for (unsigned int c = 0; c < nComps; ++c) {
+                                        values[level][b][nComps*cellIdx + c] = comps[c][patchIdx];
+                                    }
+                                }
+                    }
+        }
+    }
+}
+
+/** \brief Fill and encode the cell variables of all blocks
+ *
+ * The variables are the outer loop, because their values are evaluated
+ * whenever the sequence of variables is dereferenced.
+ */
+template <class T>
+void encodeAMRValueArrays(VisData& data, const vector<AMRLevel>& levels,
+                          vector< vector< vector<AppendedArray> > >& blockArrays)
+{
+    blockArrays.resize(levels.size());
+    for (unsigned int level = 0; level < levels.size(); ++level) {
+        blockArrays[level].resize(levels[level].blocks.size());
+    }
+    for (ConstSequenceHandle<VisData::VectorVariable>::const_iterator var
+         = data.cellVectorVariables.begin();
+         var != data.cellVectorVariables.end(); ++var) {
+        const VisData::VectorVariable& v = *var;
+        vector< vector< vector<real> > > values;
+        fillAMRValues(data, v, levels, values);
+        for (unsigned int level = 0; level < levels.size(); ++level) {
+            for (std::size_t b = 0; b < levels[level].blocks.size(); ++b) {
+                const vector<T> blockValues(values[level][b].begin(), values[level][b].end());
+                vector<real>().swap(values[level][b]);
+                blockArrays[level][b].push_back(AppendedArray());
+                AppendedArray& a = blockArrays[level][b].back();
+                a.name = v.name;
+                a.nComponents = v.components.size();
+                encodeArray(blockValues, false, a);
+            }
+        }
+    }
+}
+
+//! Write cells lo..hi of a level as VTK XML image data (.vti)
+void writeBlockAsXMLImageData(VisData& data, const std::size_t lo[3], const std::size_t hi[3],
+                              const real spacing[3], ostream& os, vector<AppendedArray>& arrays)
+{
+    const vector<uint64_t> offsets = appendedOffsets(arrays);
+    ostringstream extent;
+    extent << "0 " << hi[0] - lo[0] + 1 << " 0 " << hi[1] - lo[1] + 1 << " 0 " << hi[2] - lo[2] + 1;
+    os.precision(15);
+    writeXMLFileStart(os, "ImageData", false);
+    os << "  <ImageData WholeExtent=\"" << extent.str() << "\" Origin=\""
+       << data.startCoordinates[0] + lo[0]*spacing[0] << " "
+       << data.startCoordinates[1] + lo[1]*spacing[1] << " "
+       << data.startCoordinates[2] + lo[2]*spacing[2] << "\" Spacing=\""
+       << spacing[0] << " " << spacing[1] << " " << spacing[2] << "\">\n";
+    os << "    <Piece Extent=\"" << extent.str() << "\">\n";
+    os << "      <CellData>\n";
+    for (unsigned int i = 0; i < arrays.size(); ++i) {
+        writeDataArrayElement(os, arrays[i], offsets[i]);
+    }
+    os << "      </CellData>\n";
+    os << "    </Piece>\n";
+    os << "  </ImageData>\n";
+    writeAppendedData(os, arrays);
+}
+
+/** \brief Writes cells as VTK overlapping AMR data set (.vthb + .vti)
+ *
+ * The blocks of findAMRBlocks are written as image data into the folder
+ * fileName, and fileName.vthb lists them by level with their boxes in the
+ * cell indexes of the level. Readers hide the cells covered by blocks of
+ * finer levels.
+ */
+void writeCellsAsOverlappingAMR(VisData& data, const string& fileName,
+                                DB::FloatingPrecision binFloatingPrec)
+{
+    if (mkdir(fileName.c_str(), 0755) != 0 && errno != EEXIST) {
+        ERRORMSG2("cannot create folder for VTK AMR blocks", fileName);
+        return;
+    }
+    // File names in the .vthb file are relative to its folder
+    const string::size_type slash = fileName.rfind('/');
+    const string baseName = (slash == string::npos) ? fileName : fileName.substr(slash + 1);
+    vector<AMRLevel> levels;
+    findAMRBlocks(data, levels);
+    vector< vector< vector<AppendedArray> > > blockArrays;
+    if (binFloatingPrec == DB::FLOAT) {
+        encodeAMRValueArrays<float>(data, levels, blockArrays);
+    } else {
+        encodeAMRValueArrays<double>(data, levels, blockArrays);
+    }
+    OutputFile of(fileName + ".vthb");
+    of.precision(15);
+    of << "<?xml version=\"1.0\"?>\n";
+    of << "<VTKFile type=\"vtkOverlappingAMR\" version=\"1.1\" byte_order=\"" << hostByteOrder()
+       << "\" header_type=\"UInt64\">\n";
+    of << "  <vtkOverlappingAMR origin=\"" << data.startCoordinates[0] << " "
+       << data.startCoordinates[1] << " " << data.startCoordinates[2] << "\" grid_description=\"XYZ\">\n";
+    for (unsigned int level = 0; level < levels.size(); ++level) {
+        const real spacing[] = { data.refRatio1CellSize[0] / (1 << level),
+                                 data.refRatio1CellSize[1] / (1 << level),
+                                 data.refRatio1CellSize[2] / (1 << level)
+                               };
+        of << "    <Block level=\"" << level << "\" spacing=\""
+           << spacing[0] << " " << spacing[1] << " " << spacing[2] << "\">\n";
+        for (std::size_t b = 0; b < levels[level].blocks.size(); ++b) {
+            std::size_t lo[3], hi[3];
+            levels[level].box(b, lo, hi);
+            ostringstream blockName;
+            blockName << baseName << "_" << level << "_" << b << ".vti";
+            of << "      <DataSet index=\"" << b << "\" amr_box=\""
+               << lo[0] << " " << hi[0] << " " << lo[1] << " " << hi[1] << " " << lo[2] << " " << hi[2]
+               << "\" file=\"" << baseName << "/" << blockName.str() << "\"/>\n";
+            OutputFile block(fileName + "/" + blockName.str());
+            writeBlockAsXMLImageData(data, lo, hi, spacing, block, blockArrays[level][b]);
+            block.close();
+        }
+        of << "    </Block>\n";
+    }
+    of << "  </vtkOverlappingAMR>\n";
+    of << "</VTKFile>\n";
+    of.close();
+}
+
+}
+
+NodeIndexes::NodeIndexes(const CommonDataSourceData& data)
+{
+    const unsigned int maxRefRatio
+        = data.patches[data.patches.size() - 1].refinementRatio;
+    std::size_t maxNodes = 0;
+    for (ConstSequenceHandle<CommonDataSourceData::Patch>::const_iterator patch
+         = data.patches.begin(); patch != data.patches.end(); ++patch) {
+        vector<std::size_t> dims = getPatchDimensions(*patch);
+        maxNodes += (dims[0] + 1) * (dims[1] + 1) * (dims[2] + 1);
+    }
+    // At most half of the slots are used
+    std::size_t nSlots = 2;
+    m_shift = 63;
+    while (nSlots < 2*maxNodes) {
+        nSlots *= 2;
+        --m_shift;
+    }
+    m_slotKeys.assign(nSlots, 0);
+    m_slotIndexes.assign(nSlots, 0);
+    for (ConstSequenceHandle<CommonDataSourceData::Patch>::const_iterator patch
+         = data.patches.begin(); patch != data.patches.end(); ++patch) {
+        const std::size_t coordRatio = maxRefRatio / patch->refinementRatio;
+        for (std::size_t z = patch->startCoordinates[2] * coordRatio;
+             z <= (patch->endCoordinates[2] + 1) * coordRatio; z += coordRatio)
+            for (std::size_t y = patch->startCoordinates[1] * coordRatio;
+                 y <= (patch->endCoordinates[1] + 1) * coordRatio; y += coordRatio)
+                for (std::size_t x = patch->startCoordinates[0] * coordRatio;
+                     x <= (patch->endCoordinates[0] + 1) * coordRatio; x += coordRatio) {
+                    const uint64_t key = makeKey(x, y, z);
+                    const std::size_t s = slot(key);
+                    if (m_slotKeys[s] == 0) {
+                        m_slotKeys[s] = key + 1;
+                        m_keys.push_back(key);
+                    }
+                }
+    }
+    // Sorting the packed keys gives the z, y, x order
+    sort(m_keys.begin(), m_keys.end());
+    for (std::size_t idx = 0; idx < m_keys.size(); ++idx) {
+        m_slotIndexes[slot(m_keys[idx])] = idx;
+    }
+}
+
+//! Slot of the hash table holding key, or the empty slot where key belongs
+std::size_t NodeIndexes::slot(uint64_t key) const
+{
+    const std::size_t mask = m_slotKeys.size() - 1;
+    std::size_t s = static_cast<std::size_t>((key * hashMultiplier) >> m_shift);
+    while (m_slotKeys[s] != 0 && m_slotKeys[s] != key + 1) {
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+//! Index of the node at integer coordinates (x,y,z), which must be a node of the patches
+std::size_t NodeIndexes::find(std::size_t x, std::size_t y, std::size_t z) const
+{
+    return m_slotIndexes[slot(makeKey(x, y, z))];
 }
 
 VTKVisDB::VTKVisDB(const VisDataSource& dataSource, FileFormat format,
@@ -573,29 +1335,39 @@ void VTKVisDB::writeVisValues(const std::string& filename,
     // Remove duplicate coordinates, if requested
     switch(m_duplMode) {
     case DONT_REMOVE:
-        m_coordIndexes = SharedPtr<std::map<Coordinates<3>, std::size_t> >(0);
+        m_coordIndexes = SharedPtr<NodeIndexes>(0);
         break;
     case CALCULATE_ONCE:
-        if (m_coordIndexes == SharedPtr<std::map<Coordinates<3>, std::size_t> >(0))
-            m_coordIndexes = getCoordinatesWithoutDuplicates<3>(data);
+        if (m_coordIndexes == SharedPtr<NodeIndexes>(0))
+            m_coordIndexes = SharedPtr<NodeIndexes>(new NodeIndexes(data));
         break;
     case CALCULATE_ALWAYS:
-        m_coordIndexes = getCoordinatesWithoutDuplicates<3>(data);
+        m_coordIndexes = SharedPtr<NodeIndexes>(new NodeIndexes(data));
         break;
     }
-    string fName = filename + ".vtk";
-    ofstream of(fName.c_str());
-    // If data has only one AMR patch, write as structured points
-#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
-    if (data.patches.size() == 1) {
-        writeCellsAsStructuredPoints(data, of, m_format, binFloatingPrec);
+    if (m_format == XML_AMR) {
+        writeCellsAsOverlappingAMR(data, filename, binFloatingPrec);
     } else {
-        writeCellsAsUnstructuredGrid(data, of, m_format, m_coordIndexes, binFloatingPrec);
-    }
+        const bool xml = (m_format == XML_BINARY || m_format == XML_COMPRESSED);
+        string fName = filename + (xml ? ".vtu" : ".vtk");
+        OutputFile of(fName);
+        if (xml) {
+            writeCellsAsXMLUnstructuredGrid(data, of, m_format, m_coordIndexes, binFloatingPrec);
+        }
+        // If data has only one AMR patch, write as structured points
+#ifndef USE_SPHERICAL_COORDINATE_SYSTEM
+        else if (data.patches.size() == 1) {
+            writeCellsAsStructuredPoints(data, of, m_format, binFloatingPrec);
+        } else {
+            writeCellsAsUnstructuredGrid(data, of, m_format, m_coordIndexes, binFloatingPrec);
+        }
 #else
-    writeCellsAsUnstructuredGrid(data, of, m_format, m_coordIndexes, binFloatingPrec);
+        else {
+            writeCellsAsUnstructuredGrid(data, of, m_format, m_coordIndexes, binFloatingPrec);
+        }
 #endif
-    of.close();
+        of.close();
+    }
     // write particles
     for (vector<Particles>::const_iterator particles = writeParticles.begin();
          particles != writeParticles.end(); ++particles) {
@@ -613,12 +1385,12 @@ void VTKVisDB::writeVisValues(const std::string& filename,
             pFilename << particles->startParticleIdx << "-"
                       << particles->endParticleIdx;
         pFilename << ".vtk";
-        ofstream pof(pFilename.str().c_str());
+        OutputFile pof(pFilename.str());
         writeParticlesAsUnstructuredGrid(data, pof, *particles);
         pof.close();
         // save memory by removing unneeded reference
         if (m_duplMode == CALCULATE_ALWAYS)
-            m_coordIndexes = SharedPtr<std::map<Coordinates<3>, std::size_t> >(0);
+            m_coordIndexes = SharedPtr<NodeIndexes>(0);
     }
 }
 
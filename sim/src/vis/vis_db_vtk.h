@@ -20,15 +20,61 @@
 #define VIS_DB_VTK_H
 
 #include <string>
+#include <vector>
+#include <stdint.h>
 #include "cpp_utils.h"
 #include "vis_db.h"
 #include "vis_data_source.h"
 
+/** \brief Indexes of the cell nodes of all patches without duplicates
+ *
+ * Nodes are identified by their integer coordinates on the finest patch
+ * level, which round the node positions to unique integer triples like
+ * Tgrid::intcoords, and are found through an open addressing hash table.
+ * The nodes are indexed in the order of increasing z, y and x coordinate.
+ */
+class NodeIndexes
+{
+public:
+    explicit NodeIndexes(const CommonDataSourceData& data);
+    //! Number of nodes
+    std::size_t size() const {
+        return m_keys.size();
+    }
+    //! Integer coordinates of node idx
+    void coordinates(std::size_t idx, std::size_t c[3]) const {
+        const uint64_t key = m_keys[idx];
+        c[0] = static_cast<std::size_t>(key & COORD_MASK);
+        c[1] = static_cast<std::size_t>((key >> COORD_BITS) & COORD_MASK);
+        c[2] = static_cast<std::size_t>(key >> 2*COORD_BITS);
+    }
+    std::size_t find(std::size_t x, std::size_t y, std::size_t z) const;
+private:
+    enum {COORD_BITS = 21, COORD_MASK = (1 << COORD_BITS) - 1};
+    static uint64_t makeKey(std::size_t x, std::size_t y, std::size_t z) {
+        return (uint64_t(z) << 2*COORD_BITS) | (uint64_t(y) << COORD_BITS) | uint64_t(x);
+    }
+    std::size_t slot(uint64_t key) const;
+    std::vector<uint64_t> m_keys;       //!< Coordinates of nodes in index order
+    std::vector<uint64_t> m_slotKeys;   //!< Hash table keys + 1 (0 = empty slot)
+    std::vector<uint32_t> m_slotIndexes;//!< Hash table node indexes
+    unsigned int m_shift;               //!< 64 - log2(number of slots)
+};
+
 //! VTK visualization database
 class VTKVisDB : public VisDB
 {
 public:
-    enum FileFormat {LEGACY_ASCII, LEGACY_BINARY};
+    /** \brief File format
+     *
+     * LEGACY_ASCII, LEGACY_BINARY: legacy VTK format (.vtk)
+     * XML_BINARY: XML unstructured grid with raw appended data (.vtu)
+     * XML_COMPRESSED: as XML_BINARY, but the data arrays are compressed
+     * with zlib (requires USE_COMPRESSED_HC)
+     * XML_AMR: overlapping AMR data set (.vthb) with one image data
+     * file (.vti) per patch, Cartesian coordinates only
+     */
+    enum FileFormat {LEGACY_ASCII, LEGACY_BINARY, XML_BINARY, XML_COMPRESSED, XML_AMR};
     /** \brief How to remove duplicate coordinates
      *
      * DONT_REMOVE: don't remove duplicate coordinates.
@@ -49,7 +95,7 @@ private:
     FileFormat m_format;
     RemoveDuplicatesMode m_duplMode;
     const VisDataSource& m_dataSource;
-    SharedPtr<std::map<Coordinates<3>, std::size_t> > m_coordIndexes;
+    SharedPtr<NodeIndexes> m_coordIndexes;
 };
 
 /*class VTKDumpDB : public DumpDB {
@@ -19,7 +19,13 @@
 #include "pyhc.h"
 #include "metagrid.H"
 #include "variables.H"
+#include "fileheader.H"
+#include "byteconv.H"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <cstring>
 
 using namespace std;
 
@@ -91,3 +97,68 @@ double PGrid::xmax2()
     g->getbox(xmin,xmax);
     return xmax[2];
 }
+
+void PParticles::open(const char *fn)
+{
+	ok = false;
+	n = 0;
+	columns.clear();
+	data.clear();
+	ifstream f(fn, ios::in | ios::binary);
+	if (!f) {
+		cerr << "*** PParticles::open: cannot open " << fn << "\n";
+		return;
+	}
+	Theader h;
+	f >> h;
+	if (!h.good() || !h.exists("type") || strcmp(h.getstr("type"),"particles")
+		|| !h.exists("realformat") || strcmp(h.getstr("realformat"),"float")) {
+		cerr << "*** PParticles::open: " << fn << " is not a particle snapshot file\n";
+		return;
+	}
+	n = h.getint("nparticles");
+	popid = h.exists("popid") ? h.getint("popid") : -1;
+	t = h.getreal("t");
+	istringstream names(h.getstr("columns"));
+	string name;
+	while (names >> name) columns.push_back(name);
+	if ((long)columns.size() != h.getint("ncolumns")) {
+		cerr << "*** PParticles::open: bad column names in " << fn << "\n";
+		return;
+	}
+	offset = f.tellg();
+	data.resize(columns.size()*n);
+	if (n > 0) {
+		f.read((char *)&data[0], sizeof(float)*data.size());
+		if (f.gcount() != (streamsize)(sizeof(float)*data.size())) {
+			cerr << "*** PParticles::open: " << fn << " is truncated\n";
+			data.clear();
+			return;
+		}
+		ByteConversion(sizeof(float),(unsigned char *)&data[0],data.size());
+	}
+	ok = true;
+}
+
+int PParticles::column(const char *name)
+{
+	string s(name);
+	for (unsigned int i=0; i<s.size(); i++) s[i] = tolower(s[i]);
+	for (unsigned int c=0; c<columns.size(); c++)
+		if (columns[c] == s) return c;
+	return -1;
+}
+
+double PParticles::get(int col, long i)
+{
+	if (!ok || col < 0 || col >= (int)columns.size() || i < 0 || i >= n) {
+		cerr << "*** PParticles::get: index out of range\n";
+		return 0;
+	}
+	return data[col*n + i];
+}
+
+double PParticles::get(const char *name, long i)
+{
+	return get(column(name),i);
+}
@@ -20,6 +20,8 @@
 #include "metagrid.H"
 //#include "GridOpener.h"
 #include "gridcache.H"
+#include <vector>
+#include <string>
 
 
 class PGrid   
@@ -51,5 +53,34 @@ class PGrid
     double zintpol(double x, double y, double z, const char *vnam);
 };
 
+// Particle snapshot file (pdump_*.dat) written by the simulation.
+// The columns (x y z vx vy vz w) of all particles are read in memory.
+// For large files, read the columns directly with numpy.memmap starting
+// from dataoffset() (see README).
+
+class PParticles
+{
+	std::vector<std::string> columns;
+	std::vector<float> data;
+	long n, popid, offset;
+	double t;
+	bool ok;
+
+	public:
+
+	PParticles() {n = 0; popid = -1; offset = 0; t = 0; ok = false;}
+
+	void open(const char *fn);
+	bool isok() {return ok;}
+	long size() {return n;}
+	long ncolumns() {return columns.size();}
+	long population() {return popid;}
+	double time() {return t;}
+	long dataoffset() {return offset;}
+	int column(const char *name);
+	double get(int col, long i);
+	double get(const char *name, long i);
+};
+
 #define PYHC_H
 #endif